@@ -55,11 +55,13 @@
  * than the segment size.
  */
 #define	LFS_MINSEGSIZE		(64 * 1024)
+#define	LFS_MAXSEGSIZE		(64 * 1024 * 1024)
 #define	DFL_LFSSEG		(1024 * 1024)
 #define	DFL_LFSSEG_SHIFT	20
 #define	DFL_LFSSEG_MASK		0xFFFFF
 
 #define	LFS_MINBLOCKSIZE	512
+#define	LFS_MAXBLOCKSIZE	65536
 #define	DFL_LFSBLOCK		8192
 #define	DFL_LFSBLOCK_SHIFT	13
 #define	DFL_LFSBLOCK_MASK	0x1FFF
@@ -74,3 +76,7 @@
 #define SMALL_LFSSEG		32768
 #define SMALL_LFSBLOCK		1024
 #define SMALL_LFSFRAG		512
+#define SMALL_LFSBLOCK_SHIFT	10
+
+#define LARGE_LFSBLOCK		65536
+#define LARGE_LFSBLOCK_SHIFT	16
@@ -1,7 +1,16 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/falloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,14 +18,456 @@
 #include <sys/types.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
 
 #include "config.h"
 #include "lfs.h"
+#include "lfsz.h"
+#include "nbd.h"
+#include "verity.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
 
 static int next_inum = 4;
+static int append;
+static int stable;
+static int iblocks_first;	/* --iblocks-first, see write_file() */
+
+/*
+ * The manifest of an image (--manifest) lists, for each regular file, what
+ * we know about its source (size, mtime and a hash of its content) and where
+ * it ended up in the image (inode and data block runs), one per line:
+ *
+ *   <hash> <size> <mtime sec>.<nsec> <inode> <nruns> <daddr>+<len>... <path>
+ *
+ * With --reuse, files with the same path, size and mtime as in the manifest
+ * of the old image are copied from its blocks instead of read from the tree,
+ * and keep their hash.
+ */
+#define MANIFEST_MAGIC	"genlfs-manifest 1"
+
+struct manifest_entry {
+	char		*path;		/* relative to the top, from "/" */
+	uint64_t	hash;
+	uint64_t	size;
+	struct timespec	mtime;
+	uint64_t	inum;
+	struct lfs_extent *ext;
+	uint64_t	next;
+};
+
+struct manifest {
+	struct manifest_entry *entries;	/* sorted by path */
+	uint64_t	n;
+	uint32_t	bsize;		/* of the image it describes */
+};
+
+static struct manifest reuse;
+static int reuse_fd = -1;
+static FILE *manifest;
+static uint64_t reused_files, reused_bytes;
+
+/* Path of the current directory, relative to the top of the tree */
+static char cwd_path[PATH_MAX];
+
+/* FNV-1a */
+static uint64_t hash_data(const char *data, uint64_t size) {
+	uint64_t h = 0xcbf29ce484222325ULL, i;
+
+	for (i = 0; i < size; i++)
+		h = (h ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+/* FNV-1a a word at a time (then the bytes left), for file contents */
+static uint64_t hash_content(const char *data, uint64_t size) {
+	uint64_t h = 0xcbf29ce484222325ULL, i, w;
+
+	for (i = 0; i + sizeof(w) <= size; i += sizeof(w)) {
+		memcpy(&w, data + i, sizeof(w));
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	return h ^ hash_data(data + i, size - i);
+}
+
+/*
+ * With --stable, inode numbers come from a hash of the path, so adding or
+ * removing a file doesn't renumber the ones after it (and change their
+ * directories and inodes). A number taken already goes to the next free
+ * one. There are at least twice as many numbers as files and directories.
+ */
+static uint8_t *stable_inums;	/* bitmap of the numbers given out */
+static uint64_t stable_ninums;	/* a power of 2 */
+static uint64_t stable_anchor;	/* see is_anchor() */
+
+/* FNV-1a of a path, with its bits mixed (as in MurmurHash3's fmix64) */
+static uint64_t hash_path(const char *path) {
+	uint64_t h = hash_data(path, strlen(path));
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int stable_inum(const char *path) {
+	uint64_t i = hash_path(path) & (stable_ninums - 1);
+
+	while (stable_inums[i / 8] & (1 << i % 8))
+		i = (i + 1) & (stable_ninums - 1);
+	stable_inums[i / 8] |= 1 << i % 8;
+	return next_inum + 1 + i;
+}
+
+/*
+ * With --profile, the files read at boot are written first, in the order
+ * they are read, each right after the directories on its way that are not
+ * written yet. The profile has one file on each line, from the top of the
+ * tree, after the part of it that is read if not all of it:
+ *
+ *   [<offset>+<length> ]<path>
+ *
+ * A directory written early gives out the inode numbers of its entries
+ * then, walk() uses them later and leaves out what is written already.
+ */
+struct profile_entry {
+	char		*path;		/* from "/" */
+	uint64_t	off;
+	uint64_t	len;		/* 0 for all of it */
+};
+
+/* Paths given an inode number early, by --profile or --locality */
+struct placed {
+	char		*path;		/* NULL in a free slot */
+	int		inum;
+	int		type;
+	int		written;
+};
+
+static struct profile_entry *profile;
+static uint64_t nprofile;
+static struct placed *placed;		/* hash table, by path */
+static int dry_run;			/* see layout_dry_run() */
+static uint64_t nplaced, placed_cap;	/* a power of 2 */
+
+static struct placed *placed_find(const char *path) {
+	uint64_t i;
+
+	if (placed_cap == 0)
+		return NULL;
+	for (i = hash_path(path) & (placed_cap - 1); placed[i].path != NULL;
+	     i = (i + 1) & (placed_cap - 1))
+		if (strcmp(placed[i].path, path) == 0)
+			return &placed[i];
+	return NULL;
+}
+
+static struct placed *placed_add(const char *path, int inum, int type) {
+	uint64_t i;
+
+	if (2 * (nplaced + 1) > placed_cap) {
+		struct placed *old = placed;
+		uint64_t old_cap = placed_cap;
+
+		placed_cap = placed_cap ? placed_cap * 2 : 1024;
+		placed = calloc(placed_cap, sizeof(*placed));
+		assert(placed);
+		for (i = 0; i < old_cap; i++) {
+			uint64_t j;
+
+			if (old[i].path == NULL)
+				continue;
+			for (j = hash_path(old[i].path) & (placed_cap - 1);
+			     placed[j].path != NULL;
+			     j = (j + 1) & (placed_cap - 1))
+				;
+			placed[j] = old[i];
+		}
+		free(old);
+	}
+	for (i = hash_path(path) & (placed_cap - 1); placed[i].path != NULL;
+	     i = (i + 1) & (placed_cap - 1))
+		;
+	placed[i] = (struct placed){.inum = inum, .type = type};
+	placed[i].path = strdup(path);
+	assert(placed[i].path);
+	nplaced++;
+	return &placed[i];
+}
+
+/* Once walk() is done, as --watch adds and removes files after that */
+static void placed_clear(void) {
+	uint64_t i;
+
+	for (i = 0; i < placed_cap; i++)
+		free(placed[i].path);
+	free(placed);
+	placed = NULL;
+	nplaced = placed_cap = 0;
+}
+
+static int profile_written(const char *path) {
+	struct placed *p = placed_find(path);
+
+	return p != NULL && p->written;
+}
+
+/* With --append, new inode numbers come off the image's free list */
+int get_next_inum(struct fs *fs, const char *path) {
+	struct placed *p = placed_find(path);
+
+	if (p != NULL)
+		return p->inum;
+	if (append)
+		return alloc_inode(fs);
+	if (stable)
+		return stable_inum(path);
+	return ++next_inum;
+}
+
+static int entry_cmp(const void *a, const void *b) {
+	return strcmp(((const struct manifest_entry *)a)->path,
+		      ((const struct manifest_entry *)b)->path);
+}
+
+/* Loads the manifest of the image at (image), if there is one. */
+static void load_manifest(const char *image, struct manifest *m) {
+	char file[PATH_MAX], *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	uint64_t i, cap_entries = 0;
+	FILE *f;
+
+	snprintf(file, sizeof(file), "%s.manifest", image);
+	f = fopen(file, "r");
+	if (f == NULL) {
+		warn("No manifest for %s, nothing will be reused", image);
+		return;
+	}
+	if (getline(&line, &cap, f) <= 0 ||
+	    sscanf(line, MANIFEST_MAGIC " %u", &m->bsize) != 1)
+		errx(1, "Not a genlfs manifest: %s", file);
+
+	while ((len = getline(&line, &cap, f)) > 0) {
+		struct manifest_entry e;
+		char *p = line;
+		int n;
+
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (sscanf(p, "%lx %lu %ld.%ld %lu %lu%n", &e.hash, &e.size,
+			   &e.mtime.tv_sec, &e.mtime.tv_nsec, &e.inum, &e.next,
+			   &n) != 6)
+			errx(1, "Bad manifest line: %s", line);
+		p += n;
+		e.ext = calloc(e.next ? e.next : 1, sizeof(struct lfs_extent));
+		assert(e.ext);
+		for (i = 0; i < e.next; i++) {
+			if (sscanf(p, " %ld+%lu%n", &e.ext[i].daddr,
+				   &e.ext[i].len, &n) != 2)
+				errx(1, "Bad manifest line: %s", line);
+			p += n;
+		}
+		if (*p++ != ' ')
+			errx(1, "Bad manifest line: %s", line);
+		e.path = strdup(p);
+		assert(e.path);
+
+		if (m->n == cap_entries) {
+			cap_entries = cap_entries ? cap_entries * 2 : 1024;
+			m->entries = realloc(m->entries, cap_entries *
+						 sizeof(struct manifest_entry));
+			assert(m->entries);
+		}
+		m->entries[m->n++] = e;
+	}
+	free(line);
+	fclose(f);
+	qsort(m->entries, m->n, sizeof(struct manifest_entry), entry_cmp);
+}
+
+/*
+ * Returns the content of (path), file (name) in the current directory, from
+ * the old image, if the manifest says it is the same file (same size and
+ * mtime). NULL otherwise, or if it is empty. The match is trusted, but for
+ * the first word of each run of blocks, checked against the file in case
+ * the old image was written over since.
+ */
+static char *reuse_file(const char *name, const char *path,
+			const struct stat *sb, uint64_t *hash) {
+	struct manifest_entry key = {.path = (char *)path}, *e;
+	uint64_t off = 0, i, word;
+	char *data;
+	int fd;
+
+	e = bsearch(&key, reuse.entries, reuse.n, sizeof(*e), entry_cmp);
+	if (e == NULL || e->size != (uint64_t)sb->st_size || e->size == 0 ||
+	    e->mtime.tv_sec != sb->st_mtim.tv_sec ||
+	    e->mtime.tv_nsec != sb->st_mtim.tv_nsec)
+		return NULL;
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	data = malloc(e->size);
+	assert(data);
+	for (i = 0; i < e->next && off < e->size; i++) {
+		uint64_t len = e->ext[i].len * reuse.bsize, n;
+
+		if (len > e->size - off)
+			len = e->size - off;
+		n = MIN(len, sizeof(word));
+
+		if (e->ext[i].daddr == LFS_UNUSED_DADDR)
+			memset(data + off, 0, len);
+		else if (pread(reuse_fd, data + off, len,
+			       (off_t)e->ext[i].daddr * reuse.bsize) !=
+			 (ssize_t)len)
+			break;
+		if (pread(fd, &word, n, off) != (ssize_t)n ||
+		    memcmp(&word, data + off, n) != 0)
+			break;
+		off += len;
+	}
+	close(fd);
+	if (off != e->size) {
+		free(data);
+		return NULL;
+	}
+	*hash = e->hash;
+	return data;
+}
+
+/* Adds file (inum) at (path) to the manifest of the image being built. */
+static void manifest_add(struct fs *fs, const char *path, const struct stat *sb,
+			 uint64_t hash, uint64_t inum) {
+	struct lfs_extent *ext;
+	uint64_t next, i;
+
+	/* One line per file, names with a newline are just not reused */
+	if (strchr(path, '\n') != NULL)
+		return;
+	if (file_extents(fs, inum, &ext, &next) != 0)
+		errx(1, "Failed to map: %s", path);
+	fprintf(manifest, "%lx %lu %ld.%09ld %lu %lu", hash,
+		(uint64_t)sb->st_size, sb->st_mtim.tv_sec, sb->st_mtim.tv_nsec,
+		inum, next);
+	for (i = 0; i < next; i++)
+		fprintf(manifest, " %ld+%lu", ext[i].daddr, ext[i].len);
+	fprintf(manifest, " %s\n", path);
+	free(ext);
+}
+
+/*
+ * With --watch, the paths changed since the last checkpoint (relative to the
+ * top, from "/"), sorted. Only those, and the directories they are in, are
+ * written again. (all) is set when we lost track of what changed.
+ */
+struct path_set {
+	char		**paths;
+	uint64_t	n;
+	uint64_t	cap;
+	int		all;
+};
+
+static struct path_set changes;
+static int syncing;
+
+static int path_cmp(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void path_set_add(struct path_set *set, const char *path) {
+	if (set->n == set->cap) {
+		set->cap = set->cap ? set->cap * 2 : 64;
+		set->paths = realloc(set->paths, set->cap * sizeof(char *));
+		assert(set->paths);
+	}
+	set->paths[set->n] = strdup(path);
+	assert(set->paths[set->n]);
+	set->n++;
+}
+
+static void path_set_clear(struct path_set *set) {
+	uint64_t i;
+
+	for (i = 0; i < set->n; i++)
+		free(set->paths[i]);
+	set->n = 0;
+	set->all = 0;
+}
+
+/* Whether (path) changed, or something under it if (below) */
+static int path_changed(const char *path, int below) {
+	char prefix[PATH_MAX + 1];
+	uint64_t lo = 0, hi = changes.n;
+	size_t len;
+
+	if (changes.all)
+		return 1;
+	if (bsearch(&path, changes.paths, changes.n, sizeof(char *), path_cmp))
+		return 1;
+	if (!below)
+		return 0;
+
+	/* The first path after "path/" has to start with it */
+	len = snprintf(prefix, sizeof(prefix), "%s/", path);
+	while (lo < hi) {
+		uint64_t mid = (lo + hi) / 2;
+		if (strcmp(changes.paths[mid], prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < changes.n && strncmp(changes.paths[lo], prefix, len) == 0;
+}
+
+/* Deletes file or directory (inum) from the image, and all under it. */
+static void delete_tree(struct fs *fs, uint64_t inum, int type) {
+	char name[LFS_MAXNAMLEN + 1];
+	struct directory *dir;
+	uint64_t child;
+	int off = 0, child_type;
+
+	if (type == LFS_DT_DIR) {
+		dir = malloc(sizeof(struct directory));
+		assert(dir);
+		if (read_dir(fs, inum, dir) != 0)
+			errx(1, "Failed to read directory %lu", inum);
+		while (dir_entry(dir, &off, name, &child, &child_type) == 0)
+			delete_tree(fs, child, child_type);
+		free(dir);
+	}
+	if (delete_file(fs, inum) != 0)
+		errx(1, "Failed to delete inode %lu", inum);
+}
+
+/*
+ * Drops the entries of (dir) that are not in the current directory anymore.
+ * Returns whether there was any.
+ */
+static int delete_missing(struct fs *fs, struct directory *dir) {
+	char name[LFS_MAXNAMLEN + 1];
+	uint64_t inum;
+	int off = 0, type, deleted = 0;
+	struct stat sb;
 
-int get_next_inum(void) { return ++next_inum; }
+	while (dir_entry(dir, &off, name, &inum, &type) == 0) {
+		if (lstat(name, &sb) == 0)
+			continue;
+		printf("deleted (%lu): %s\n", inum, name);
+		delete_tree(fs, inum, type);
+		assert(dir_remove_entry(dir, name) == 0);
+		off = 0;
+		deleted = 1;
+	}
+	return deleted;
+}
 
 /*
    DT_BLK      This is a block device.
@@ -29,22 +480,427 @@ int get_next_inum(void) { return ++next_inum; }
    DT_UNKNOWN  The file type is unknown.
    */
 
-void walk(struct fs *fs, int parent_inum, int inum) {
-	DIR *d;
-	struct dirent *dirent;
+static int name_cmp(const struct dirent **a, const struct dirent **b) {
+	return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+/*
+ * The entries of the current directory, in readdir() order, or sorted by
+ * name with --stable. Returns -1 if it can't be read.
+ */
+static int list_dir(struct dirent ***names) {
+	return scandir(".", names, NULL, stable ? name_cmp : NULL);
+}
+
+/*
+ * Blocks of (bsize) the files under directory (name) take, with their
+ * inode blocks (but not the indirect ones).
+ */
+static uint64_t subtree_blocks(const char *name, uint64_t bsize) {
+	struct dirent **names;
+	uint64_t nblocks = 1;
+	struct stat sb;
+	int n, i;
+
+	if (chdir(name) != 0)
+		return 0;
+	n = list_dir(&names);
+	for (i = 0; i < n; free(names[i++])) {
+		if (lstat(names[i]->d_name, &sb) != 0)
+			continue;
+		if (S_ISREG(sb.st_mode))
+			nblocks += (sb.st_size + bsize - 1) / bsize + 1;
+		else if (S_ISDIR(sb.st_mode) && strcmp(names[i]->d_name, ".") &&
+			 strcmp(names[i]->d_name, ".."))
+			nblocks += subtree_blocks(names[i]->d_name, bsize);
+	}
+	if (n >= 0)
+		free(names);
+	if (chdir("..") != 0)
+		errx(1, "Failed to chdir: ..");
+	return nblocks;
+}
+
+/*
+ * With --stable, files and directories that take at least a segment are
+ * written in a group of segments of their own, and the log skips some
+ * slack after it (up to 1/8 of the segments it used, and at least the rest
+ * of its last one): as long as a group still fits, what comes after it
+ * stays where it was. The groups in a directory go first, so where they
+ * start doesn't depend on the smaller files next to them.
+ *
+ * Moves the entries that get a group to the front of (names), in the same
+ * order, and returns how many there are.
+ */
+static int groups_first(struct fs *fs, struct dirent **names, int n) {
+	uint64_t bsize = fs->lfs.dlfs_bsize;
+	struct dirent **rest = malloc((n ? n : 1) * sizeof(*rest));
+	int ngroups = 0, nrest = 0, i;
+	struct stat sb;
+
+	assert(rest);
+	for (i = 0; i < n; i++) {
+		const char *name = names[i]->d_name;
+		uint64_t nblocks = 0;
+
+		/* Removed since scandir(), walk() leaves it out too */
+		if (lstat(name, &sb) != 0) {
+			rest[nrest++] = names[i];
+			continue;
+		}
+		if (S_ISREG(sb.st_mode))
+			nblocks = (sb.st_size + bsize - 1) / bsize + 1;
+		else if (S_ISDIR(sb.st_mode) && strcmp(name, ".") &&
+			 strcmp(name, ".."))
+			nblocks = subtree_blocks(name, bsize);
+		if (nblocks >= fs->lfs.dlfs_fsbpseg)
+			names[ngroups++] = names[i];
+		else
+			rest[nrest++] = names[i];
+	}
+	memcpy(names + ngroups, rest, nrest * sizeof(*rest));
+	free(rest);
+	return ngroups;
+}
+
+/*
+ * The smaller files and directories are packed, but one in about (mask + 1)
+ * of them, picked by the hash of its path, starts a group of the ones that
+ * follow: a file added or removed only moves those in its own group. The
+ * mask is set for groups of about 8 segments.
+ */
+static int is_anchor(const char *path) {
+	return ((hash_path(path) >> 32) & stable_anchor) == 0;
+}
+
+static uint64_t start_group(struct fs *fs) {
+	if (skip_to_segment(fs, fs->seg.seg_number) != 0)
+		errx(1, "No room left for a stable layout, try a larger --size");
+	return fs->seg.seg_number;
+}
+
+static void end_group(struct fs *fs, uint64_t start) {
+	uint64_t used = fs->seg.seg_number - start + 1, gran = 1;
+
+	while (gran * 8 < used)
+		gran *= 2;
+	if (skip_to_segment(fs, start + (used / gran + 1) * gran) != 0)
+		errx(1, "No room left for a stable layout, try a larger --size");
+}
+
+/* Directories that are not in the image, not even empty */
+static int skipped_dir(const char *name) {
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+	       strcmp(name, "dev") == 0 || strcmp(name, "sys") == 0 ||
+	       strcmp(name, "proc") == 0;
+}
+
+/*
+ * --hot and --hot-age pick the files expected to be written at run time
+ * (logs, caches, state): the ones at a path matching a pattern, and the ones
+ * modified less than (hot_age) seconds before (build_time). They are written
+ * after the rest of the tree, in segments of their own, so that writing over
+ * them leaves the segments of the rest full. The su_lastmod of a segment is
+ * then the newest mtime of the files in it, or (build_time) for hot ones,
+ * for the cleaner to tell the old segments from the ones still changing.
+ */
+static char **hot_patterns;
+static int nhot_patterns;
+static int64_t hot_age = -1;
+static time_t build_time;
+
+struct hot_file {
+	char	*path;
+	int	inum;
+};
+static struct hot_file *hot_files;
+static uint64_t nhot_files, hot_cap;
+
+static int hot_placing(void) {
+	return nhot_patterns > 0 || hot_age >= 0;
+}
+
+static int is_hot(const char *path, const struct stat *sb) {
+	int i;
+
+	for (i = 0; i < nhot_patterns; i++)
+		if (fnmatch(hot_patterns[i],
+			    hot_patterns[i][0] == '/' ? path : path + 1,
+			    0) == 0)
+			return 1;
+	return hot_age >= 0 && sb->st_mtime > build_time - hot_age;
+}
+
+static void hot_add(const char *path, int inum) {
+	if (nhot_files == hot_cap) {
+		hot_cap = hot_cap ? hot_cap * 2 : 64;
+		hot_files = realloc(hot_files, hot_cap * sizeof(*hot_files));
+		assert(hot_files);
+	}
+	hot_files[nhot_files].path = strdup(path);
+	assert(hot_files[nhot_files].path);
+	hot_files[nhot_files++].inum = inum;
+}
+
+/*
+ * Writes regular file (name) in the current directory, at (path) from the
+ * top, as inode (inum), in place of (old_inum) if not 0, and in a group of
+ * its own with --stable if (group).
+ */
+static int write_regular(struct fs *fs, const char *name, const char *path,
+			 const struct stat *sb, int inum, int old_inum,
+			 int group) {
+	int lazy = fs->out != NULL && fs->out->lazy;
+	uint64_t hash = 0;
+	char *copy = reuse.n && !lazy ? reuse_file(name, path, sb, &hash) :
+					NULL;
+	int fd = -1, ret;
+	void *addr = copy;
+	if (lazy && sb->st_size > 0) {
+		/* Read when a client reads it, from the top */
+		char rel[strlen(path) + 2];
+		snprintf(rel, sizeof(rel), ".%s", path);
+		addr = lazy_map(fs->out, rel, sb->st_size);
+	} else if (copy == NULL && sb->st_size > 0) {
+		fd = openat(AT_FDCWD, name, O_RDONLY);
+		assert(fd > 0);
+		addr = mmap(NULL, sb->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		assert(addr != MAP_FAILED);
+		if (manifest)
+			hash = hash_content(addr, sb->st_size);
+	} else if (copy == NULL && manifest) {
+		hash = hash_content("", 0);
+	}
+	printf("regular file (%d): %s%s\n", inum, name,
+	       copy ? " (reused)" : "");
+	if (hot_placing()) {
+		time_t t = is_hot(path, sb) ? build_time : sb->st_mtime;
+
+		/* Not later than the image, and never 0 */
+		fs->lastmod = t > build_time ? build_time : t > 0 ? t : 1;
+	}
+	if (old_inum != 0 && remove_file(fs, old_inum) != 0)
+		errx(1, "Failed to replace: %s", name);
+	uint64_t start = group ? start_group(fs) : 0;
+	ret = write_file(fs, (char *)addr, sb->st_size, inum, LFS_IFREG | 0777,
+			 1, 0);
+	if (ret == EFBIG && (uint64_t)sb->st_size >
+				fs->lfs.dlfs_maxfilesize - fs->lfs.dlfs_bsize)
+		errx(1, "Failed to write %s: file too large for this block "
+		     "size", name);
+	if (ret != 0)
+		return ret;
+	if (group)
+		end_group(fs, start);
+	if (manifest)
+		manifest_add(fs, path, sb, hash, inum);
+	if (copy) {
+		reused_files++;
+		reused_bytes += sb->st_size;
+		free(copy);
+	} else if (lazy && sb->st_size > 0) {
+		lazy_unmap(fs->out);
+	} else if (fd >= 0) {
+		munmap(addr, sb->st_size);
+		close(fd);
+	}
+	return 0;
+}
+
+/*
+ * Writes the files walk() put aside as hot, from the top of the tree, in
+ * segments the rest of the tree is not in. What is written after them (the
+ * ifile) is written again at every checkpoint, and is hot too.
+ */
+static void write_hot(struct fs *fs) {
+	uint64_t i, first, nbytes = 0;
+	struct stat sb;
+	int ret;
+
+	if (!hot_placing())
+		return;
+	if (nhot_files > 0 && skip_to_segment(fs, fs->seg.seg_number) != 0)
+		errx(1, "No room left for the hot files, try a larger --size");
+	first = fs->seg.seg_number;
+	for (i = 0; i < nhot_files; i++) {
+		char *path = hot_files[i].path;
+
+		if (lstat(path + 1, &sb) != 0)
+			err(1, "Failed to stat %s", path + 1);
+		ret = write_regular(fs, path + 1, path, &sb, hot_files[i].inum,
+				    0, 0);
+		if (ret != 0)
+			errx(1, "Failed to write %s: %s", path + 1,
+			     strerror(ret));
+		nbytes += sb.st_size;
+		free(path);
+	}
+	if (nhot_files > 0)
+		printf("hot: %lu files (%lu bytes) in segments %lu to %u\n",
+		       nhot_files, nbytes, first, fs->seg.seg_number);
+	free(hot_files);
+	hot_files = NULL;
+	nhot_files = hot_cap = 0;
+	fs->lastmod = build_time;
+}
+
+/*
+ * Writes (dir), the entries of directory (inum) but for "." and "..", in
+ * place of the one in the image if (existing).
+ */
+static int write_dir(struct fs *fs, struct directory *dir, int inum,
+		     int parent_inum, int existing) {
+	dir_add_entry(dir, ".", inum, LFS_DT_DIR);
+	dir_add_entry(dir, "..", parent_inum, LFS_DT_DIR);
+	dir_done(dir);
+
+	/* TODO: nlinks should be 2 for root. What about others (does
+	 * ..  count)? */
+	if (existing && remove_file(fs, inum) != 0)
+		errx(1, "Failed to replace directory %d", inum);
+	return write_file(fs, dir->data, dir->curr, inum, LFS_IFDIR | 0755, 1,
+			  0);
+}
+
+/*
+ * With --locality, the regular files of a directory are written first, with
+ * their inodes kept until the last one is written (see write_inodes()), and
+ * then the directory, before its subdirectories (which get their inode
+ * numbers then): its entries, and the inodes of the files in it, are in a
+ * row, for readdir() and stat().
+ */
+static int locality;
+
+/* Moves the regular files to the front of (names), returns how many. */
+static int files_first(struct dirent **names, int n) {
+	struct dirent **rest = malloc((n ? n : 1) * sizeof(*rest));
+	int nfiles = 0, nrest = 0, i;
+	struct stat sb;
+
+	assert(rest);
+	for (i = 0; i < n; i++) {
+		if (lstat(names[i]->d_name, &sb) == 0 && S_ISREG(sb.st_mode))
+			names[nfiles++] = names[i];
+		else
+			rest[nrest++] = names[i];
+	}
+	memcpy(names + nfiles, rest, nrest * sizeof(*rest));
+	free(rest);
+	return nfiles;
+}
+
+static int flush_inodes(struct fs *fs) {
+	fs->defer_inodes = 0;
+	return write_inodes(fs);
+}
+
+/*
+ * With --locality, writes the current directory (inum) once its regular
+ * files are, with (subdirs), the entries left, that are not written yet.
+ */
+static int write_dir_first(struct fs *fs, struct directory *dir,
+			   struct dirent **subdirs, int n, int inum,
+			   int parent_inum) {
+	struct stat sb;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		char *name = subdirs[i]->d_name;
+		char path[sizeof(cwd_path) + sizeof(subdirs[i]->d_name) + 1];
+		struct placed *p;
+
+		if (lstat(name, &sb) != 0 || !S_ISDIR(sb.st_mode) ||
+		    skipped_dir(name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", cwd_path, name);
+		p = placed_find(path);
+		if (p == NULL)
+			p = placed_add(path, get_next_inum(fs, path),
+				       LFS_DT_DIR);
+		assert(dir_add_entry(dir, name, p->inum, LFS_DT_DIR) == 0);
+	}
+	return write_dir(fs, dir, inum, parent_inum, 0);
+}
+
+/*
+ * Writes the current directory as inode (inum). If it (and so inum) is
+ * already in the image, its entries are kept, files with the same name are
+ * replaced, and the directory is only written again if it has new entries.
+ * Returns the error of write_file() if a file can't be written (ENOSPC when
+ * the image is full).
+ */
+int walk(struct fs *fs, int parent_inum, int inum, int existing) {
+	struct dirent **names, *dirent;
 	struct directory *dir = calloc(1, sizeof(struct directory));
+	int changed = !existing, n, i, ngroups = 0, chunk = 0;
+	int nfiles = -1, dir_written = 0, ret = 0;
+	uint64_t chunk_start = 0;
 	assert(dir);
+	dir->is64 = fs->is64;
 
-	d = opendir(".");
+	n = list_dir(&names);
 
-	if (d == NULL) {
-		return;
+	if (n < 0) {
+		free(dir);
+		return 0;
+	}
+	if (stable && !append)
+		ngroups = groups_first(fs, names, n);
+	if (locality && !existing) {
+		nfiles = files_first(names, n);
+		fs->defer_inodes = 1;
 	}
 
-	while ((dirent = readdir(d)) != NULL) {
+	if (existing && read_dir(fs, inum, dir) != 0)
+		errx(1, "Failed to read directory %d", inum);
+	if (existing && syncing && delete_missing(fs, dir))
+		changed = 1;
+
+	for (i = 0; i < n && ret == 0; free(names[i++])) {
+		char path[sizeof(cwd_path) + sizeof(names[i]->d_name) + 1];
 		struct stat sb;
+		int old_inum = 0, old_type = 0;
 
-		lstat(dirent->d_name, &sb);
+		dirent = names[i];
+
+		if (i == nfiles)
+			ret = flush_inodes(fs);
+		if (i == nfiles && ret == 0 && !profile_written(cwd_path))
+			ret = write_dir_first(fs, dir, names + i, n - i, inum,
+					      parent_inum);
+		if (i == nfiles)
+			dir_written = 1;
+		if (ret != 0)
+			continue;
+
+		/* Removed since scandir() */
+		if (lstat(dirent->d_name, &sb) != 0)
+			continue;
+		if (existing)
+			old_inum = dir_lookup(dir, dirent->d_name, &old_type);
+
+		/* Keeping in sync: only what changed, or changed under it */
+		snprintf(path, sizeof(path), "%s/%s", cwd_path, dirent->d_name);
+		if (old_inum != 0 && syncing &&
+		    !path_changed(path, S_ISDIR(sb.st_mode)))
+			continue;
+		if (stable && !append && i >= ngroups && is_anchor(path) &&
+		    (S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode)) &&
+		    strcmp(dirent->d_name, ".") && strcmp(dirent->d_name, "..")) {
+			if (chunk)
+				end_group(fs, chunk_start);
+			chunk_start = start_group(fs);
+			chunk = 1;
+		}
+		if (old_inum != 0 && syncing &&
+		    (S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode)) &&
+		    old_type != (S_ISDIR(sb.st_mode) ? LFS_DT_DIR : LFS_DT_REG)) {
+			printf("deleted (%d): %s\n", old_inum, dirent->d_name);
+			delete_tree(fs, old_inum, old_type);
+			assert(dir_remove_entry(dir, dirent->d_name) == 0);
+			old_inum = 0;
+			changed = 1;
+		}
 
 		switch (sb.st_mode & S_IFMT) {
 		case S_IFBLK:
@@ -54,23 +910,30 @@ void walk(struct fs *fs, int parent_inum, int inum) {
 			printf("character device\n");
 			break;
 		case S_IFDIR:
-			if (strcmp(dirent->d_name, ".") == 0)
-				break;
-			if (strcmp(dirent->d_name, "..") == 0)
-				break;
-			if (strcmp(dirent->d_name, "dev") == 0)
-				break;
-			if (strcmp(dirent->d_name, "sys") == 0)
+			if (skipped_dir(dirent->d_name))
 				break;
-			if (strcmp(dirent->d_name, "proc") == 0)
-				break;
-			int next_inum = get_next_inum();
-			assert(dir_add_entry(dir, dirent->d_name, next_inum,
-				      LFS_DT_DIR) == 0);
+			if (old_inum != 0 && old_type != LFS_DT_DIR)
+				errx(1, "Not a directory in the image: %s",
+				     dirent->d_name);
+			int next_inum = old_inum ? old_inum :
+						   get_next_inum(fs, path);
+			if (old_inum == 0 && !dir_written) {
+				assert(dir_add_entry(dir, dirent->d_name,
+					      next_inum, LFS_DT_DIR) == 0);
+				changed = 1;
+			}
 			printf("directory (%d): %s\n", next_inum, dirent->d_name);
+			int group = i < ngroups;
+			uint64_t start = group ? start_group(fs) : 0;
 			if (chdir(dirent->d_name) != 0)
 				errx(1, "Failed to chdir: %s", dirent->d_name);
-			walk(fs, inum, next_inum);
+			size_t cwd_len = strlen(cwd_path);
+			snprintf(cwd_path + cwd_len, sizeof(cwd_path) - cwd_len,
+				 "/%s", dirent->d_name);
+			ret = walk(fs, inum, next_inum, old_inum != 0);
+			if (group && ret == 0)
+				end_group(fs, start);
+			cwd_path[cwd_len] = '\0';
 			if (chdir("..") != 0)
 				errx(1, "Failed to chdir: ..");
 			break;
@@ -81,22 +944,24 @@ void walk(struct fs *fs, int parent_inum, int inum) {
 			printf("symlink\n");
 			break;
 		case S_IFREG: {
-			int fd = openat(AT_FDCWD, dirent->d_name, O_RDONLY);
-			assert(fd > 0);
-			void *addr = NULL;
-			if (sb.st_size > 0) {
-				addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-				assert(addr != MAP_FAILED);
+			if (old_inum != 0 && old_type != LFS_DT_REG)
+				errx(1, "Not a regular file in the image: %s",
+				     dirent->d_name);
+			int next_inum = old_inum ? old_inum :
+						   get_next_inum(fs, path);
+			if (!profile_written(path) && !append &&
+			    is_hot(path, &sb))
+				hot_add(path, next_inum);
+			else if (!profile_written(path))
+				ret = write_regular(fs, dirent->d_name, path,
+						    &sb, next_inum, old_inum,
+						    i < ngroups);
+
+			if (old_inum == 0) {
+				assert(dir_add_entry(dir, dirent->d_name,
+					      next_inum, LFS_DT_REG) == 0);
+				changed = 1;
 			}
-			int next_inum = get_next_inum();
-			printf("regular file (%d): %s\n", next_inum, dirent->d_name);
-			write_file(fs, (char *)addr, sb.st_size, next_inum,
-					   LFS_IFREG | 0777, 1, 0);
-			munmap(addr, sb.st_size);
-			close(fd);
-
-			assert(dir_add_entry(dir, dirent->d_name, next_inum,
-				      LFS_DT_REG) == 0);
 			break;
 		}
 		case S_IFSOCK:
@@ -108,38 +973,1898 @@ void walk(struct fs *fs, int parent_inum, int inum) {
 		}
 	}
 
+	/* What is left after a failure */
+	for (; i < n; i++)
+		free(names[i]);
+	if (ret == 0 && fs->defer_inodes)
+		ret = flush_inodes(fs);
+	if (ret == 0 && changed && !dir_written && !profile_written(cwd_path))
+		ret = write_dir(fs, dir, inum, parent_inum, existing);
+	if (ret == 0 && chunk)
+		end_group(fs, chunk_start);
+	free(dir);
+	free(names);
+	return ret;
+}
+
+/*
+ * With --readahead <name>, a file of that name at the top of the image lists
+ * the parts of the image the profile reads, in its order, for the host to
+ * read them ahead of the guest, one range of bytes on each line:
+ *
+ *   <offset> <length> <path>
+ *
+ * For each file, its inode block, its indirect blocks, and the runs of its
+ * data blocks (in the part of it that is read). It is written once the rest
+ * of the tree is, write_profile_dir() gives it an entry at the top.
+ */
+static char *readahead_name;
+static int readahead_inum;
+
+/* Loads the profile at (file), see struct profile_entry. */
+static void load_profile(const char *file) {
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	uint64_t cap_entries = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		err(1, "Failed to open %s", file);
+	while ((len = getline(&line, &cap, f)) > 0) {
+		struct profile_entry e = {0};
+		char *p = line;
+		int n;
+
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (sscanf(p, "%lu+%lu %n", &e.off, &e.len, &n) == 2) {
+			if (e.len == 0)
+				errx(1, "Bad profile line: %s", line);
+			p += n;
+		}
+		while (p[0] == '.' && p[1] == '/')
+			p += 2;
+		while (*p == '/')
+			p++;
+		while (len > 0 && line[len - 1] == '/')
+			line[--len] = '\0';
+		if (*p == '\0' || *p == '#')
+			continue;
+		e.path = malloc(strlen(p) + 2);
+		assert(e.path);
+		sprintf(e.path, "/%s", p);
+
+		if (nprofile == cap_entries) {
+			cap_entries = cap_entries ? cap_entries * 2 : 64;
+			profile = realloc(profile,
+					  cap_entries * sizeof(*profile));
+			assert(profile);
+		}
+		profile[nprofile++] = e;
+	}
+	free(line);
+	fclose(f);
+}
+
+/*
+ * Writes directory (path), from the top (the current directory), as inode
+ * (inum), giving out the inode numbers of its entries.
+ */
+static void write_profile_dir(struct fs *fs, const char *path, int inum,
+			      int parent_inum) {
+	struct directory *dir = calloc(1, sizeof(struct directory));
+	int top = open(".", O_RDONLY | O_DIRECTORY), n, i;
+	char rel[PATH_MAX];
+	struct dirent **names;
+
+	assert(dir && top >= 0);
+	dir->is64 = fs->is64;
+	snprintf(rel, sizeof(rel), ".%s", path);
+	if (chdir(rel) != 0)
+		errx(1, "Failed to chdir: %s", rel);
+	n = list_dir(&names);
+	for (i = 0; i < n; free(names[i++])) {
+		char *name = names[i]->d_name, child[PATH_MAX];
+		struct placed *p;
+		struct stat sb;
+		int type;
+
+		if (lstat(name, &sb) != 0)
+			continue;
+		if (S_ISREG(sb.st_mode))
+			type = LFS_DT_REG;
+		else if (S_ISDIR(sb.st_mode) && !skipped_dir(name))
+			type = LFS_DT_DIR;
+		else
+			continue;
+		snprintf(child, sizeof(child), "%s/%s", path, name);
+		p = placed_find(child);
+		if (p == NULL)
+			p = placed_add(child, get_next_inum(fs, child), type);
+		assert(dir_add_entry(dir, name, p->inum, type) == 0);
+	}
+	if (n >= 0)
+		free(names);
+	if (path[0] == '\0' && readahead_name != NULL) {
+		char top_path[strlen(readahead_name) + 2];
+
+		snprintf(top_path, sizeof(top_path), "/%s", readahead_name);
+		readahead_inum = get_next_inum(fs, top_path);
+		assert(dir_add_entry(dir, readahead_name, readahead_inum,
+				     LFS_DT_REG) == 0);
+	}
 	dir_add_entry(dir, ".", inum, LFS_DT_DIR);
 	dir_add_entry(dir, "..", parent_inum, LFS_DT_DIR);
 	dir_done(dir);
 
-	/* TODO: nlinks should be 2 for root. What about others (does ..
-	 * count)? */
-	write_file(fs, dir->data, dir->curr, inum, LFS_IFDIR | 0755, 1, 0);
+	printf("directory (%d): %s\n", inum, rel);
+	if (write_file(fs, dir->data, dir->curr, inum, LFS_IFDIR | 0755, 1,
+		       0) != 0)
+		errx(1, "Failed to write directory %d", inum);
+	/* Not before: placed_add() moves the entries */
+	placed_find(path)->written = 1;
+	if (fchdir(top) != 0)
+		err(1, "Failed to chdir back to the top");
+	close(top);
 	free(dir);
+}
 
-	closedir(d);
+/* Writes the files of the profile, before walk() writes the rest. */
+static void write_profile(struct fs *fs) {
+	uint64_t i;
+	int ret;
+
+	placed_add("", ULFS_ROOTINO, LFS_DT_DIR);
+	for (i = 0; i < nprofile; i++) {
+		char *path = profile[i].path, *slash, rel[PATH_MAX];
+		int parent_inum = ULFS_ROOTINO;
+		struct placed *p = NULL;
+		struct stat sb;
+
+		/* The directories on its way, from the top down */
+		for (slash = path; slash != NULL;
+		     slash = strchr(slash + 1, '/')) {
+			*slash = '\0';
+			p = placed_find(path);
+			if (p != NULL && p->type == LFS_DT_DIR && !p->written) {
+				write_profile_dir(fs, path, p->inum,
+						  parent_inum);
+				p = placed_find(path);
+			}
+			*slash = '/';
+			if (p == NULL || p->type != LFS_DT_DIR)
+				break;
+			parent_inum = p->inum;
+		}
+		p = slash == NULL ? placed_find(path) : NULL;
+		if (p == NULL) {
+			if (!dry_run)
+				warnx("Not in the image, left out of the "
+				      "profile: %s", path);
+			continue;
+		}
+		if (p->written)
+			continue;
+		if (p->type == LFS_DT_DIR) {
+			write_profile_dir(fs, path, p->inum, parent_inum);
+			continue;
+		}
+		snprintf(rel, sizeof(rel), ".%s", path);
+		if (lstat(rel, &sb) != 0)
+			err(1, "Failed to stat %s", rel);
+		ret = write_regular(fs, rel, path, &sb, p->inum, 0, 0);
+		if (ret != 0)
+			errx(1, "Failed to write %s: %s", rel, strerror(ret));
+		p->written = 1;
+	}
 }
 
-int main(int argc, char **argv) {
-	struct fs fs;
-	uint64_t nbytes = 1024 * 1024 * 1024 * 4ULL;
+struct readahead_list {
+	FILE		*f;
+	uint64_t	nranges;
+	uint64_t	nbytes;
+};
+
+static void readahead_add(struct fs *fs, struct readahead_list *l,
+			  int64_t daddr, uint64_t nblocks, const char *path) {
+	uint64_t nbytes = nblocks * fs->lfs.dlfs_bsize;
+
+	if (daddr == LFS_UNUSED_DADDR)
+		return;
+	fprintf(l->f, "%lu %lu %s\n", daddr * fs->lfs.dlfs_bsize, nbytes,
+		path);
+	l->nranges++;
+	l->nbytes += nbytes;
+}
 
-	if (argc != 3) {
-		errx(1, "Usage: %s <directory> <image>", argv[0]);
+/* Writes the --readahead file, once the files of the profile are. */
+static void write_readahead(struct fs *fs) {
+	uint64_t i, j, next, lbn;
+	uint32_t bsize = fs->lfs.dlfs_bsize;
+	struct readahead_list l = {0};
+	struct lfs_file_info info;
+	struct lfs_extent *ext;
+	char *buf = NULL;
+	size_t len = 0;
+
+	if (readahead_name == NULL || readahead_inum == 0)
+		return;
+	l.f = open_memstream(&buf, &len);
+	assert(l.f);
+	for (i = 0; i < nprofile; i++) {
+		struct profile_entry *e = &profile[i];
+		struct placed *p = placed_find(e->path);
+		uint64_t first = e->off / bsize;
+		uint64_t last = e->len ? (e->off + e->len + bsize - 1) / bsize :
+					 -1ULL;
+
+		/* One line per range, names with a newline are left out */
+		if (p == NULL || !p->written || strchr(e->path, '\n') != NULL)
+			continue;
+		if (stat_file(fs, p->inum, &info) != 0)
+			errx(1, "Failed to read inode %d", p->inum);
+		readahead_add(fs, &l, info.daddr, 1, e->path);
+		if (file_iblocks(fs, p->inum, &ext, &next) != 0)
+			errx(1, "Failed to map: %s", e->path);
+		for (j = 0; j < next; j++)
+			readahead_add(fs, &l, ext[j].daddr, ext[j].len, e->path);
+		free(ext);
+		if (file_extents(fs, p->inum, &ext, &next) != 0)
+			errx(1, "Failed to map: %s", e->path);
+		for (j = 0, lbn = 0; j < next; lbn += ext[j++].len) {
+			uint64_t from = lbn > first ? lbn : first;
+			uint64_t to = lbn + ext[j].len < last ? lbn + ext[j].len :
+								 last;
+
+			if (from < to && ext[j].daddr != LFS_UNUSED_DADDR)
+				readahead_add(fs, &l, ext[j].daddr + from - lbn,
+					      to - from, e->path);
+		}
+		free(ext);
 	}
+	if (fclose(l.f) != 0)
+		errx(1, "Failed to make the --readahead list");
 
-	fs.fd = open(argv[2], O_CREAT | O_RDWR, DEFFILEMODE);
-	assert(fs.fd != 0);
+	printf("regular file (%d): %s\n", readahead_inum, readahead_name);
+	if (write_file(fs, buf, len, readahead_inum, LFS_IFREG | 0777, 1,
+		       0) != 0)
+		errx(1, "Failed to write: %s", readahead_name);
+	printf("readahead: %lu ranges (%lu bytes) in /%s\n", l.nranges,
+	       l.nbytes, readahead_name);
+	free(buf);
+}
 
-	init_lfs(&fs, nbytes);
+/*
+ * With --extent-map <file>, where each file and directory ended up in the
+ * image, for tools on the host to read ahead what a workload reads, or to
+ * tell which file a read in a trace is in. One per line, from the top, each
+ * directory before what is in it:
+ *
+ *   <inode> <d|f> <size> <inode daddr> <nruns> <daddr>+<len>...
+ *       <niruns> <daddr>+<len>... <path>
+ *
+ * (on one line): the runs of its data blocks by logical block (0 for a
+ * hole), then the runs of its indirect blocks. Addresses and lengths are in
+ * blocks of the size on the first line.
+ */
+#define EXTENT_MAP_MAGIC	"genlfs-extents 1"
 
-	if (chdir(argv[1]) != 0)
-		return 1;
+static void map_runs(FILE *f, struct lfs_extent *ext, uint64_t next) {
+	uint64_t i;
+
+	fprintf(f, " %lu", next);
+	for (i = 0; i < next; i++)
+		fprintf(f, " %ld+%lu", ext[i].daddr, ext[i].len);
+	free(ext);
+}
+
+/* Adds (inum) at (path), and all under it if a directory, to the map. */
+static void map_tree(struct fs *fs, FILE *f, uint64_t inum, int type,
+		     char *path, size_t len) {
+	char name[LFS_MAXNAMLEN + 1];
+	struct lfs_file_info info;
+	struct directory *dir;
+	struct lfs_extent *ext;
+	uint64_t child, next;
+	int off = 0, child_type;
+
+	if (stat_file(fs, inum, &info) != 0)
+		errx(1, "Failed to read inode %lu", inum);
+	fprintf(f, "%lu %c %lu %ld", inum, type == LFS_DT_DIR ? 'd' : 'f',
+		info.size, info.daddr);
+	if (file_extents(fs, inum, &ext, &next) != 0)
+		errx(1, "Failed to map inode %lu", inum);
+	map_runs(f, ext, next);
+	if (file_iblocks(fs, inum, &ext, &next) != 0)
+		errx(1, "Failed to map inode %lu", inum);
+	map_runs(f, ext, next);
+	fprintf(f, " %s\n", len ? path : "/");
+	if (type != LFS_DT_DIR)
+		return;
+
+	dir = calloc(1, sizeof(struct directory));
+	assert(dir);
+	dir->is64 = fs->is64;
+	if (read_dir(fs, inum, dir) != 0)
+		errx(1, "Failed to read directory %lu", inum);
+	while (dir_entry(dir, &off, name, &child, &child_type) == 0) {
+		/* One line per path, names with a newline are left out */
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
+		    strchr(name, '\n') != NULL)
+			continue;
+		snprintf(path + len, PATH_MAX - len, "/%s", name);
+		map_tree(fs, f, child, child_type, path,
+			 len + strlen(path + len));
+		path[len] = '\0';
+	}
+	free(dir);
+}
+
+static void write_extent_map(struct fs *fs, FILE *f, const char *file) {
+	char path[PATH_MAX] = "";
+
+	fprintf(f, EXTENT_MAP_MAGIC " %u\n", fs->lfs.dlfs_bsize);
+	map_tree(fs, f, ULFS_ROOTINO, LFS_DT_DIR, path, 0);
+	if (fclose(f) != 0)
+		err(1, "Failed to write %s", file);
+}
+
+struct seeks {
+	int64_t		seg;		/* the last read ended in */
+	uint64_t	n;
+};
+
+/*
+ * A read in the segment the last one ended in, or in the next one, is not a
+ * seek: a segment is read at once, and the one after it ahead.
+ */
+static void seek_read(struct fs *fs, struct seeks *s, int64_t daddr,
+		      uint64_t nblocks) {
+	int64_t seg = daddr / fs->lfs.dlfs_fsbpseg;
 
-	walk(&fs, ULFS_ROOTINO, ULFS_ROOTINO);
+	if (seg != s->seg && seg != s->seg + 1)
+		s->n++;
+	s->seg = (daddr + nblocks - 1) / fs->lfs.dlfs_fsbpseg;
+}
+
+/* Reads blocks [first, last) of file (inum), or the ones it has. */
+static void read_blocks(struct fs *fs, struct seeks *s, uint64_t inum,
+			uint64_t first, uint64_t last) {
+	struct lfs_extent *ext;
+	uint64_t next, i, lbn = 0;
+
+	if (file_extents(fs, inum, &ext, &next) != 0)
+		errx(1, "Failed to map inode %lu", inum);
+	for (i = 0; i < next; lbn += ext[i++].len) {
+		uint64_t from = lbn > first ? lbn : first;
+		uint64_t to = lbn + ext[i].len < last ? lbn + ext[i].len : last;
+
+		if (from < to && ext[i].daddr != LFS_UNUSED_DADDR)
+			seek_read(fs, s, ext[i].daddr + (from - lbn),
+				  to - from);
+	}
+	free(ext);
+}
+
+/* Reads the inode of (inum), and all of it if a directory, the first time. */
+static void read_node(struct fs *fs, struct seeks *s, uint8_t **seen,
+		      uint64_t *nseen, uint64_t inum, int type) {
+	struct lfs_file_info info;
+
+	if (inum >= *nseen * 8) {
+		uint64_t n = *nseen;
+
+		while (inum >= *nseen * 8)
+			*nseen = *nseen ? *nseen * 2 : 1024;
+		*seen = realloc(*seen, *nseen);
+		assert(*seen);
+		memset(*seen + n, 0, *nseen - n);
+	}
+	if ((*seen)[inum / 8] & (1 << inum % 8))
+		return;
+	(*seen)[inum / 8] |= 1 << inum % 8;
+	if (stat_file(fs, inum, &info) != 0)
+		errx(1, "Failed to read inode %lu", inum);
+	seek_read(fs, s, info.daddr, 1);
+	if (type == LFS_DT_DIR)
+		read_blocks(fs, s, inum, 0, UINT64_MAX);
+}
+
+/*
+ * The seeks to read the profile from (fs), the way a kernel would: the
+ * inode and the blocks of each directory on the way to a file (once, they
+ * stay cached), its inode, and then the part of it read.
+ */
+static uint64_t profile_seeks(struct fs *fs) {
+	struct directory *dir = malloc(sizeof(struct directory));
+	struct seeks s = {.seg = -2};
+	uint64_t i, bsize = fs->lfs.dlfs_bsize, nseen = 0;
+	uint8_t *seen = NULL;
+
+	assert(dir);
+	dir->is64 = fs->is64;
+	for (i = 0; i < nprofile; i++) {
+		struct profile_entry *e = &profile[i];
+		char path[PATH_MAX], *name, *save;
+		uint64_t inum = ULFS_ROOTINO;
+		int type = LFS_DT_DIR;
+
+		snprintf(path, sizeof(path), "%s", e->path);
+		read_node(fs, &s, &seen, &nseen, inum, type);
+		for (name = strtok_r(path, "/", &save); name != NULL && inum;
+		     name = strtok_r(NULL, "/", &save)) {
+			if (type != LFS_DT_DIR || read_dir(fs, inum, dir) != 0)
+				inum = 0;
+			else
+				inum = dir_lookup(dir, name, &type);
+			if (inum != 0)
+				read_node(fs, &s, &seen, &nseen, inum, type);
+		}
+		if (inum != 0 && type == LFS_DT_REG)
+			read_blocks(fs, &s, inum, e->off / bsize,
+				    e->len ? (e->off + e->len - 1) / bsize + 1 :
+					     UINT64_MAX);
+	}
+	free(seen);
+	free(dir);
+	return s.n;
+}
+
+/* What the layout report measures in an image */
+struct layout_report {
+	uint64_t	profile_seeks;	/* see profile_seeks() */
+	uint64_t	ndirs;
+	uint64_t	ls_blocks;	/* see ls_blocks() */
+	uint64_t	ls_segs;
+};
+
+struct daddr_list {
+	int64_t		*daddrs;
+	uint64_t	n;
+	uint64_t	cap;
+};
+
+static void daddr_add(struct daddr_list *l, int64_t daddr) {
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		l->daddrs = realloc(l->daddrs, l->cap * sizeof(*l->daddrs));
+		assert(l->daddrs);
+	}
+	l->daddrs[l->n++] = daddr;
+}
+
+static int daddr_cmp(const void *a, const void *b) {
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * The blocks ls -l of each directory reads (its inode and blocks, and the
+ * inode of each entry), and the segments they are in, added up.
+ */
+static void ls_blocks(struct fs *fs, struct layout_report *r) {
+	struct directory *dir = malloc(sizeof(struct directory));
+	struct daddr_list dirs = {0}, l = {0};
+	uint64_t i, j, k;
+
+	assert(dir);
+	dir->is64 = fs->is64;
+	daddr_add(&dirs, ULFS_ROOTINO);
+	for (i = 0; i < dirs.n; i++) {
+		char name[LFS_MAXNAMLEN + 1];
+		struct lfs_file_info info;
+		struct lfs_extent *ext;
+		uint64_t inum, next;
+		int off = 0, type;
+
+		if (stat_file(fs, dirs.daddrs[i], &info) != 0 ||
+		    file_extents(fs, dirs.daddrs[i], &ext, &next) != 0 ||
+		    read_dir(fs, dirs.daddrs[i], dir) != 0)
+			errx(1, "Failed to read directory %ld", dirs.daddrs[i]);
+		l.n = 0;
+		daddr_add(&l, info.daddr);
+		for (j = 0; j < next; j++)
+			for (k = 0; ext[j].daddr != LFS_UNUSED_DADDR &&
+				    k < ext[j].len; k++)
+				daddr_add(&l, ext[j].daddr + k);
+		free(ext);
+		while (dir_entry(dir, &off, name, &inum, &type) == 0) {
+			if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+				continue;
+			if (stat_file(fs, inum, &info) != 0)
+				errx(1, "Failed to read inode %lu", inum);
+			daddr_add(&l, info.daddr);
+			if (type == LFS_DT_DIR)
+				daddr_add(&dirs, inum);
+		}
+
+		qsort(l.daddrs, l.n, sizeof(*l.daddrs), daddr_cmp);
+		for (j = 0; j < l.n; j++) {
+			if (j > 0 && l.daddrs[j] == l.daddrs[j - 1])
+				continue;
+			r->ls_blocks++;
+			if (j == 0 || l.daddrs[j] / fs->lfs.dlfs_fsbpseg !=
+					  l.daddrs[j - 1] / fs->lfs.dlfs_fsbpseg)
+				r->ls_segs++;
+		}
+	}
+	r->ndirs = dirs.n;
+	free(dirs.daddrs);
+	free(l.daddrs);
+	free(dir);
+}
+
+/*
+ * Lays out the tree in the current directory in memory, with the profile
+ * first and --locality if (asked), or as genlfs does without them, and
+ * measures it. In a child process, so that the layout written later starts
+ * from scratch.
+ */
+static void layout_dry_run(uint64_t nbytes, const struct lfs_params *params,
+			   int asked, struct layout_report *r) {
+	int fds[2], status;
+	pid_t pid;
+
+	if (pipe(fds) != 0)
+		err(1, "Failed to lay out the tree");
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0)
+		err(1, "Failed to lay out the tree");
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		struct fs fs;
+
+		if (null < 0 || dup2(null, STDOUT_FILENO) < 0)
+			_exit(1);
+		manifest = NULL;
+		dry_run = 1;
+		if (!asked)
+			locality = 0;
+		fs.fd = -1;
+		if (init_lfs_params(&fs, nbytes, params) != 0)
+			_exit(1);
+		fs.iblocks_first = iblocks_first;
+		fs.out = lazy_create(&fs, nbytes);
+		if (asked && nprofile)
+			write_profile(&fs);
+		if (walk(&fs, ULFS_ROOTINO, ULFS_ROOTINO, 0) != 0)
+			_exit(1);
+		write_hot(&fs);
+		write_readahead(&fs);
+		if (finish_lfs(&fs) != 0)
+			_exit(1);
+		memset(r, 0, sizeof(*r));
+		r->profile_seeks = profile_seeks(&fs);
+		ls_blocks(&fs, r);
+		_exit(write(fds[1], r, sizeof(*r)) != sizeof(*r));
+	}
+	close(fds[1]);
+	if (read(fds[0], r, sizeof(*r)) != sizeof(*r) ||
+	    waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+	    WEXITSTATUS(status) != 0)
+		errx(1, "Failed to lay out the tree");
+	close(fds[0]);
+}
+
+/* What we know about the input tree before writing anything. */
+struct tree_stats {
+	uint64_t	nfiles;
+	uint64_t	ndirs;
+	uint64_t	nbytes;
+	uint64_t	max_fanout;
+	uint64_t	hist[64];	/* regular files by log2 of their size */
+	uint64_t	*sizes;		/* in the order walk() writes them */
+	uint64_t	nsizes;
+	uint64_t	cap;
+	int		is64;		/* directory entry format */
+};
+
+static void stats_add(struct tree_stats *st, uint64_t size) {
+	if (st->nsizes == st->cap) {
+		st->cap = st->cap ? st->cap * 2 : 1024;
+		st->sizes = realloc(st->sizes, st->cap * sizeof(uint64_t));
+		assert(st->sizes);
+	}
+	st->sizes[st->nsizes++] = size;
+}
+
+/*
+ * Same traversal as walk(), but only collects sizes. Directories are built
+ * for real so we know their exact size.
+ */
+void scan(struct tree_stats *st) {
+	struct dirent **names, *dirent;
+	struct directory *dir = calloc(1, sizeof(struct directory));
+	uint64_t fanout = 0;
+	int n, i;
+	assert(dir);
+	dir->is64 = st->is64;
+
+	n = list_dir(&names);
+
+	if (n < 0) {
+		free(dir);
+		return;
+	}
+
+	for (i = 0; i < n; free(names[i++])) {
+		struct stat sb;
+
+		dirent = names[i];
+
+		/* Removed since scandir(), see walk() */
+		if (lstat(dirent->d_name, &sb) != 0)
+			continue;
+
+		switch (sb.st_mode & S_IFMT) {
+		case S_IFDIR:
+			if (skipped_dir(dirent->d_name))
+				break;
+			assert(dir_add_entry(dir, dirent->d_name, ULFS_ROOTINO,
+				      LFS_DT_DIR) == 0);
+			fanout++;
+			if (chdir(dirent->d_name) != 0)
+				errx(1, "Failed to chdir: %s", dirent->d_name);
+			scan(st);
+			if (chdir("..") != 0)
+				errx(1, "Failed to chdir: ..");
+			break;
+		case S_IFREG:
+			stats_add(st, sb.st_size);
+			st->nfiles++;
+			st->nbytes += sb.st_size;
+			st->hist[sb.st_size ? 64 - __builtin_clzll(sb.st_size) : 0]++;
+			assert(dir_add_entry(dir, dirent->d_name, ULFS_ROOTINO,
+				      LFS_DT_REG) == 0);
+			fanout++;
+			break;
+		default:
+			break;
+		}
+	}
+
+	dir_add_entry(dir, ".", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(dir, "..", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_done(dir);
+
+	stats_add(st, dir->curr);
+	st->ndirs++;
+	st->nbytes += dir->curr;
+	if (fanout > st->max_fanout)
+		st->max_fanout = fanout;
+	free(dir);
+	free(names);
+}
+
+/*
+ * What a seek costs, in bytes we could have read instead. Used to weigh
+ * the number of reads against the image size when picking a geometry.
+ */
+#define SEEK_COST	(128 * 1024ULL)
+
+/*
+ * Tries every supported block and segment size (or just the ones not set
+ * by the user) and picks the one with the smallest image size plus boot
+ * read cost. Frags are always the block size and there is one inode per
+ * block, as that's all lfs.c writes.
+ */
+static void auto_geometry(uint64_t nbytes, struct lfs_params *params) {
+	struct tree_stats st = {.is64 = params->is64};
+	struct lfs_params best = {0};
+	uint64_t best_cost = UINT64_MAX;
+	uint32_t bsize, ssize;
+	int i;
+
+	scan(&st);
+
+	printf("tree: %lu files, %lu dirs, %lu bytes, max fan-out %lu\n",
+	       st.nfiles, st.ndirs, st.nbytes, st.max_fanout);
+	for (i = 0; i < 64; i++) {
+		if (st.hist[i] == 0)
+			continue;
+		if (i == 0)
+			printf("  empty files: %lu\n", st.hist[i]);
+		else
+			printf("  files < %llu bytes: %lu\n", 1ULL << i,
+			       st.hist[i]);
+	}
+
+	printf("%8s %9s %8s %6s %14s %9s %14s %14s\n", "bsize", "ssize",
+	       "fsize", "inopb", "image", "reads", "read bytes", "cost");
+	for (bsize = LFS_MINBLOCKSIZE; bsize <= LFS_MAXBLOCKSIZE; bsize <<= 1) {
+		if (params->bsize != 0 && params->bsize != bsize)
+			continue;
+		for (ssize = LFS_MINSEGSIZE; ssize <= LFS_MAXSEGSIZE;
+		     ssize <<= 1) {
+			struct lfs_params p = {.bsize = bsize, .ssize = ssize,
+					       .is64 = params->is64};
+			struct lfs_estimate est;
+			uint64_t cost;
+
+			if (params->ssize != 0 && params->ssize != ssize)
+				continue;
+			if (estimate_lfs(nbytes, &p, st.sizes, st.nsizes,
+					 &est) != 0)
+				continue;
+
+			cost = est.nbytes + est.read_bytes +
+			       est.nreads * SEEK_COST;
+			printf("%8u %9u %8u %6u %14lu %9lu %14lu %14lu\n",
+			       bsize, ssize, bsize, 1, est.nbytes, est.nreads,
+			       est.read_bytes, cost);
+			if (cost < best_cost) {
+				best_cost = cost;
+				best = p;
+			}
+		}
+	}
+
+	free(st.sizes);
+	if (best_cost == UINT64_MAX)
+		errx(1, "No geometry can hold this tree");
+
+	printf("chosen: bsize %u, ssize %u, fsize %u, inopb 1\n", best.bsize,
+	       best.ssize, best.bsize);
+	*params = best;
+}
+
+/*
+ * The size of the smallest FS the tree fits in (--trim): as many segments
+ * as the log needs, ifile included. How large the segment usage table is,
+ * and where the superblocks go, depend on the number of segments, so try
+ * again until the estimate fits.
+ */
+static uint64_t trimmed_size(const struct lfs_params *params) {
+	struct tree_stats st = {.is64 = params->is64};
+	struct lfs_params p = *params;
+	uint64_t ssize, nsegs = 1, need;
+	struct lfs_estimate est;
+	int ret;
+
+	if (p.bsize == 0)
+		p.bsize = DFL_LFSBLOCK;
+	if (p.ssize == 0)
+		p.ssize = DFL_LFSSEG;
+	ssize = p.ssize;
+
+	scan(&st);
+	for (;;) {
+		ret = estimate_lfs((nsegs + 1) * ssize, &p, st.sizes, st.nsizes,
+				   &est);
+		if (ret == EINVAL)
+			errx(1, "Unsupported geometry: block size %u, segment "
+			     "size %u", p.bsize, p.ssize);
+		if (ret != 0)
+			errx(1, "No FS can hold this tree with this geometry");
+		need = (est.nbytes + ssize - 1) / ssize;
+		if (need <= nsegs)
+			break;
+		nsegs = need;
+	}
+	free(st.sizes);
+	return (nsegs + 1) * ssize;
+}
+
+/*
+ * Drops what is past the end of the log (and of the last superblock): a
+ * file is truncated, the rest of a device is discarded if it can be.
+ */
+static uint64_t trim_image(struct fs *fs) {
+	uint64_t bsize = fs->lfs.dlfs_bsize;
+	uint64_t end = fs->lfs.dlfs_offset * bsize, sb_end;
+	struct stat sb;
+	off_t devsize;
+	int i;
+
+	for (i = 0; i < LFS_MAXNUMSB; i++) {
+		if (i > 0 && fs->lfs.dlfs_sboffs[i] == 0)
+			break;
+		sb_end = fs->lfs.dlfs_sboffs[i] * bsize + LFS_SBPAD;
+		if (sb_end > end)
+			end = sb_end;
+	}
+	if (fstat(fs->fd, &sb) != 0)
+		err(1, "Failed to stat the image");
+	if (S_ISREG(sb.st_mode)) {
+		if (ftruncate(fs->fd, end) != 0)
+			err(1, "Failed to truncate the image");
+	} else {
+		devsize = lseek(fs->fd, 0, SEEK_END);
+		if (devsize > 0 && (uint64_t)devsize > end &&
+		    fallocate(fs->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      end, devsize - end) != 0)
+			warn("Failed to discard the end of the device");
+	}
+	printf("trimmed to %lu bytes, %lu segments\n", end, fs->nsegs);
+	return end;
+}
+
+/* After a change, wait this long for more before writing a checkpoint */
+#define WATCH_DELAY_MS	50
+
+#define WATCH_EVENTS	(IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY | \
+			 IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | \
+			 IN_DONT_FOLLOW)
+
+static volatile sig_atomic_t stop;
+
+/* Paths of the watched directories (relative to the top), by descriptor */
+static char **watched;
+static int nwatched;
+
+static void on_signal(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+/* Watches directory (path) and all the ones under it, like walk() goes. */
+static void add_watches(int ifd, const char *path) {
+	char dir[sizeof(cwd_path) + 2];
+	struct dirent *dirent;
+	struct stat sb;
+	DIR *d;
+	int wd;
+
+	snprintf(dir, sizeof(dir), ".%s", path);
+	wd = inotify_add_watch(ifd, dir, WATCH_EVENTS);
+	if (wd < 0) {
+		warn("Failed to watch %s", dir);
+		return;
+	}
+	if (wd >= nwatched) {
+		watched = realloc(watched, (wd + 1) * sizeof(char *));
+		assert(watched);
+		memset(&watched[nwatched], 0,
+		       (wd + 1 - nwatched) * sizeof(char *));
+		nwatched = wd + 1;
+	}
+	free(watched[wd]);
+	watched[wd] = strdup(path);
+	assert(watched[wd]);
+
+	d = opendir(dir);
+	if (d == NULL)
+		return;
+	while ((dirent = readdir(d)) != NULL) {
+		char sub[sizeof(cwd_path) + sizeof(dirent->d_name) + 2];
+
+		if (strcmp(dirent->d_name, ".") == 0 ||
+		    strcmp(dirent->d_name, "..") == 0 ||
+		    strcmp(dirent->d_name, "dev") == 0 ||
+		    strcmp(dirent->d_name, "sys") == 0 ||
+		    strcmp(dirent->d_name, "proc") == 0)
+			continue;
+		snprintf(sub, sizeof(sub), "%s/%s", dir, dirent->d_name);
+		if (lstat(sub, &sb) != 0 || !S_ISDIR(sb.st_mode))
+			continue;
+		add_watches(ifd, sub + 1);
+	}
+	closedir(d);
+}
+
+/* Adds the paths of the pending events to the set of changes. */
+static void read_events(int ifd) {
+	char buf[64 * 1024]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len = read(ifd, buf, sizeof(buf));
+	char *p;
+
+	for (p = buf; len > 0 && p < buf + len; p += sizeof(*ev) + ev->len) {
+		char path[sizeof(cwd_path) + NAME_MAX + 2];
+
+		ev = (const struct inotify_event *)p;
+		if (ev->mask & IN_Q_OVERFLOW) {
+			changes.all = 1;
+			continue;
+		}
+		if (ev->wd < 0 || ev->wd >= nwatched || watched[ev->wd] == NULL)
+			continue;
+		if (ev->mask & IN_IGNORED) {
+			free(watched[ev->wd]);
+			watched[ev->wd] = NULL;
+			continue;
+		}
+		if (ev->len == 0)
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", watched[ev->wd],
+			 ev->name);
+		path_set_add(&changes, path);
+		if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+			add_watches(ifd, path);
+	}
+}
+
+/* Writes what changed since the last checkpoint, and a new checkpoint. */
+static void sync_image(struct fs *fs) {
+	struct timespec start, end;
+	uint64_t i, n = 0;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	qsort(changes.paths, changes.n, sizeof(char *), path_cmp);
+	for (i = 0; i < changes.n; i++) {
+		if (n > 0 && strcmp(changes.paths[n - 1], changes.paths[i]) == 0)
+			free(changes.paths[i]);
+		else
+			changes.paths[n++] = changes.paths[i];
+	}
+	changes.n = n;
+
+	free_lfs(fs);
+	ret = load_lfs(fs);
+	if (ret != 0)
+		errx(1, "Failed to load the FS: %s", strerror(ret));
+	append = 1;
+	syncing = 1;
+	/* The image keeps its last checkpoint */
+	ret = walk(fs, ULFS_ROOTINO, ULFS_ROOTINO, 1);
+	if (ret != 0)
+		errx(1, "Failed to write the changes: %s", strerror(ret));
+	syncing = 0;
+	ret = finish_lfs(fs);
+	if (ret != 0)
+		errx(1, "Failed to write the ifile: %s", strerror(ret));
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	printf("checkpoint: %lu changes in %.1f ms\n",
+	       changes.all ? 0 : changes.n,
+	       (end.tv_sec - start.tv_sec) * 1e3 +
+		   (end.tv_nsec - start.tv_nsec) / 1e6);
+	fflush(stdout);
+	path_set_clear(&changes);
+}
+
+/*
+ * Keeps the image in sync with the tree until we are interrupted, with a
+ * new checkpoint after every burst of changes.
+ */
+static void watch(struct fs *fs, int ifd) {
+	struct pollfd pfd = {.fd = ifd, .events = POLLIN};
+	int ret;
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	printf("watching for changes\n");
+	fflush(stdout);
+	while (!stop) {
+		ret = poll(&pfd, 1, changes.n || changes.all ? WATCH_DELAY_MS : -1);
+		if (ret < 0 && errno != EINTR)
+			err(1, "Failed to wait for changes");
+		if (ret > 0)
+			read_events(ifd);
+		else if (ret == 0)
+			sync_image(fs);
+	}
+	if (changes.n || changes.all)
+		sync_image(fs);
+	close(ifd);
+}
+
+/* Parses sizes like "8192", "8k", "1m" or "16t". Returns 0 on error. */
+static uint64_t parse_size(const char *str) {
+	unsigned shift = 0;
+	char *end;
+	uint64_t n;
+
+	errno = 0;
+	n = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'k': case 'K':
+		shift = 10;
+		end++;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		end++;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		end++;
+		break;
+	case 't': case 'T':
+		shift = 40;
+		end++;
+		break;
+	}
+	/* Nor negative, nor past 64 bits, before or after the suffix */
+	if (*end != '\0' || end == str || strchr(str, '-') != NULL ||
+	    errno == ERANGE || n > UINT64_MAX >> shift)
+		return 0;
+	return n << shift;
+}
+
+/*
+ * Writes the dm-verity hash tree fs->out made of the first (nbytes) of the
+ * image, in whole blocks of (bsize): to (fd), or after the image if it is
+ * the image's.
+ */
+static void write_verity(struct fs *fs, uint64_t nbytes, uint32_t bsize,
+			 int compressed, int fd, const char *file) {
+	uint8_t root[SHA256_DIGEST_LEN];
+	uint64_t size = (nbytes + bsize - 1) / bsize * bsize, off = 0, len;
+	char hex[2 * SHA256_DIGEST_LEN + 1];
+	struct stat sb;
+	int i, ret;
+
+	/* The last block is read whole */
+	if (!compressed && fstat(fs->fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    (uint64_t)sb.st_size < size && ftruncate(fs->fd, size) != 0)
+		err(1, "Failed to extend the image");
+	if (fd == fs->fd)
+		off = size;
+	ret = verity_finish(fs->out, nbytes, fd, off, root, &len);
+	fs->out = NULL;
+	if (ret != 0)
+		errx(1, "Failed to write the hash tree: %s", strerror(ret));
+	if (fd != fs->fd && close(fd) != 0)
+		err(1, "Failed to write %s", file);
+	for (i = 0; i < SHA256_DIGEST_LEN; i++)
+		sprintf(hex + 2 * i, "%02x", root[i]);
+	printf("verity: root hash %s, %lu blocks of %u bytes, %lu bytes of "
+	       "tree in %s at %lu\n", hex, size / bsize, bsize, len, file, off);
+}
+
+/*
+ * --verify reads an image back and compares it with the tree it was made
+ * of: the same directories and regular files (what genlfs writes, see
+ * walk()), and the content of each file, read from the image by the block
+ * addresses of its inode. The main thread walks both trees, the files are
+ * compared on a thread for each CPU, as it goes.
+ */
+#define VERIFY_BUF	(1024 * 1024)
+
+struct verify_file {
+	char			*path;		/* from the top, no leading / */
+	uint64_t		inum;
+	struct verify_file	*next;
+};
+
+struct verifier {
+	struct fs		*fs;
+	pthread_mutex_t		lock;
+	pthread_cond_t		more;
+	pthread_cond_t		room;
+	struct verify_file	*queue;
+	struct verify_file	**tail;
+	int			queued;
+	int			max_queued;
+	int			stop;
+	uint64_t		ndirs, nfiles, nbytes, nbad;
+};
+
+static void verify_bad(struct verifier *v, const char *path,
+		       const char *what) {
+	pthread_mutex_lock(&v->lock);
+	printf("mismatch: /%s: %s\n", path, what);
+	v->nbad++;
+	pthread_mutex_unlock(&v->lock);
+}
+
+/* Compares (f) with its inode in the image, with (a) and (b) to read to. */
+static void verify_file(struct verifier *v, struct verify_file *f, char *a,
+			char *b) {
+	struct fs *fs = v->fs;
+	uint32_t bsize = fs->lfs.dlfs_bsize;
+	struct lfs_file_info info;
+	struct lfs_extent *ext = NULL;
+	uint64_t next, i, done, off = 0;
+	char what[64];
+	struct stat sb;
+	int fd;
+
+	fd = open(f->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &sb) != 0) {
+		verify_bad(v, f->path, "can't be read from the tree");
+		goto out;
+	}
+	if (stat_file(fs, f->inum, &info) != 0 ||
+	    (info.mode & LFS_IFMT) != LFS_IFREG ||
+	    file_extents(fs, f->inum, &ext, &next) != 0) {
+		verify_bad(v, f->path, "bad inode in the image");
+		goto out;
+	}
+	if (info.size != (uint64_t)sb.st_size) {
+		snprintf(what, sizeof(what), "%lu bytes in the image, %lu in "
+			 "the tree", info.size, (uint64_t)sb.st_size);
+		verify_bad(v, f->path, what);
+		goto out;
+	}
+	for (i = 0; i < next; i++) {
+		for (done = 0; done < ext[i].len * bsize && off < info.size;) {
+			uint64_t len = MIN(ext[i].len * bsize - done,
+					   MIN(VERIFY_BUF, info.size - off));
+			int64_t daddr = ext[i].daddr;
+			uint64_t j;
+
+			if (daddr == LFS_UNUSED_DADDR)
+				memset(a, 0, len);
+			else if (pread64(fs->fd, a, len, daddr * bsize + done) !=
+				 (ssize_t)len) {
+				verify_bad(v, f->path, "short read in the image");
+				goto out;
+			}
+			if (pread64(fd, b, len, off) != (ssize_t)len) {
+				verify_bad(v, f->path, "short read in the tree");
+				goto out;
+			}
+			if (memcmp(a, b, len) != 0) {
+				for (j = 0; a[j] == b[j]; j++)
+					;
+				snprintf(what, sizeof(what), "differs at byte "
+					 "%lu", off + j);
+				verify_bad(v, f->path, what);
+				goto out;
+			}
+			done += len;
+			off += len;
+		}
+	}
+	pthread_mutex_lock(&v->lock);
+	v->nfiles++;
+	v->nbytes += info.size;
+	pthread_mutex_unlock(&v->lock);
+out:
+	free(ext);
+	if (fd >= 0)
+		close(fd);
+}
+
+static void *verify_thread(void *arg) {
+	struct verifier *v = arg;
+	char *a = malloc(VERIFY_BUF), *b = malloc(VERIFY_BUF);
+	struct verify_file *f;
+
+	assert(a && b);
+	pthread_mutex_lock(&v->lock);
+	for (;;) {
+		while (v->queue == NULL && !v->stop)
+			pthread_cond_wait(&v->more, &v->lock);
+		f = v->queue;
+		if (f == NULL)
+			break;
+		v->queue = f->next;
+		if (v->queue == NULL)
+			v->tail = &v->queue;
+		v->queued--;
+		pthread_cond_signal(&v->room);
+		pthread_mutex_unlock(&v->lock);
+
+		verify_file(v, f, a, b);
+		free(f->path);
+		free(f);
+
+		pthread_mutex_lock(&v->lock);
+	}
+	pthread_mutex_unlock(&v->lock);
+	free(a);
+	free(b);
+	return NULL;
+}
+
+static void verify_queue(struct verifier *v, const char *path, uint64_t inum) {
+	struct verify_file *f = malloc(sizeof(*f));
+
+	assert(f);
+	f->path = strdup(path);
+	assert(f->path);
+	f->inum = inum;
+	f->next = NULL;
+	pthread_mutex_lock(&v->lock);
+	while (v->queued >= v->max_queued)
+		pthread_cond_wait(&v->room, &v->lock);
+	*v->tail = f;
+	v->tail = &f->next;
+	v->queued++;
+	pthread_cond_signal(&v->more);
+	pthread_mutex_unlock(&v->lock);
+}
+
+struct verify_entry {
+	char		name[LFS_MAXNAMLEN + 1];
+	uint64_t	inum;
+	int		type;
+};
+
+static int verify_entry_cmp(const void *a, const void *b) {
+	return strcmp(((const struct verify_entry *)a)->name,
+		      ((const struct verify_entry *)b)->name);
+}
+
+/* What walk() makes of (name) in the tree: LFS_DT_DIR, LFS_DT_REG or 0. */
+static int tree_type(const char *path, const char *name) {
+	struct stat sb;
+
+	if (lstat(path, &sb) != 0)
+		return 0;
+	if (S_ISDIR(sb.st_mode) && !skipped_dir(name))
+		return LFS_DT_DIR;
+	if (S_ISREG(sb.st_mode))
+		return LFS_DT_REG;
+	return 0;
+}
+
+/*
+ * Compares directory (inum) of the image with the one at (path) in the
+ * tree, both sorted by name, and queues the files in both.
+ */
+static void verify_dir(struct verifier *v, uint64_t inum, char *path,
+		       size_t len) {
+	struct directory *dir = calloc(1, sizeof(struct directory));
+	struct verify_entry *entries = NULL;
+	struct dirent **names;
+	uint64_t nentries = 0, cap = 0, i = 0;
+	int n, j = 0, off = 0, cmp, type;
+	struct verify_entry e;
+
+	assert(dir);
+	dir->is64 = v->fs->is64;
+	if (read_dir(v->fs, inum, dir) != 0) {
+		verify_bad(v, path, "bad directory in the image");
+		free(dir);
+		return;
+	}
+	while (dir_entry(dir, &off, e.name, &e.inum, &e.type) == 0) {
+		/* Not in the tree, see write_readahead() */
+		if (len == 0 && readahead_name &&
+		    strcmp(e.name, readahead_name) == 0)
+			continue;
+		if (nentries == cap) {
+			cap = cap ? 2 * cap : 64;
+			entries = realloc(entries, cap * sizeof(*entries));
+			assert(entries);
+		}
+		entries[nentries++] = e;
+	}
+	free(dir);
+	qsort(entries, nentries, sizeof(*entries), verify_entry_cmp);
+	n = scandir(len ? path : ".", &names, NULL, name_cmp);
+	if (n < 0) {
+		verify_bad(v, path, "can't be read from the tree");
+		n = 0;
+		names = NULL;
+	}
+	v->ndirs++;
+
+	while (i < nentries || j < n) {
+		const char *name;
+
+		if (i == nentries)
+			cmp = 1;
+		else if (j == n)
+			cmp = -1;
+		else
+			cmp = strcmp(entries[i].name, names[j]->d_name);
+		name = cmp <= 0 ? entries[i].name : names[j]->d_name;
+		snprintf(path + len, PATH_MAX - len, "%s%s", len ? "/" : "",
+			 name);
+		type = cmp >= 0 ? tree_type(path, name) : 0;
+		if (cmp < 0 || (cmp == 0 && type != entries[i].type)) {
+			verify_bad(v, path, type ? "not of the same type in the "
+						   "tree" : "not in the tree");
+		} else if (cmp > 0) {
+			if (type != 0)
+				verify_bad(v, path, "not in the image");
+		} else if (type == LFS_DT_DIR) {
+			verify_dir(v, entries[i].inum, path, strlen(path));
+		} else {
+			verify_queue(v, path, entries[i].inum);
+		}
+		path[len] = '\0';
+		if (cmp <= 0)
+			i++;
+		if (cmp >= 0)
+			free(names[j++]);
+	}
+	free(names);
+	free(entries);
+}
+
+/*
+ * Compares (image), open in fs->fd, with the tree in the current
+ * directory. Returns 1 if they differ.
+ */
+static int verify_image(struct fs *fs, const char *image) {
+	struct timespec start, end;
+	char path[PATH_MAX] = "";
+	struct verifier v = {0};
+	struct lfsz z;
+	pthread_t *threads;
+	int i, nthreads = sysconf(_SC_NPROCESSORS_ONLN), ret;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (lfsz_open(&z, fs->fd) == 0)
+		errx(1, "%s is compressed, uncompress it with lfsunz first",
+		     image);
+	ret = load_lfs(fs);
+	if (ret != 0)
+		errx(1, "Failed to load the FS: %s", strerror(ret));
+
+	v.fs = fs;
+	v.tail = &v.queue;
+	nthreads = nthreads > 0 ? nthreads : 1;
+	/* Enough for the threads to go on while a directory is read */
+	v.max_queued = 64 * nthreads;
+	pthread_mutex_init(&v.lock, NULL);
+	pthread_cond_init(&v.more, NULL);
+	pthread_cond_init(&v.room, NULL);
+	threads = malloc(nthreads * sizeof(pthread_t));
+	assert(threads);
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, verify_thread, &v))
+			errx(1, "Failed to start a thread");
+
+	verify_dir(&v, ULFS_ROOTINO, path, 0);
+
+	pthread_mutex_lock(&v.lock);
+	v.stop = 1;
+	pthread_cond_broadcast(&v.more);
+	pthread_mutex_unlock(&v.lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&v.lock);
+	pthread_cond_destroy(&v.more);
+	pthread_cond_destroy(&v.room);
+	free_lfs(fs);
+	close(fs->fd);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+	       (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("verify: %lu directories, %lu files, %lu bytes in %.1f s "
+	       "(%.1f MB/s), %lu mismatches\n", v.ndirs, v.nfiles, v.nbytes,
+	       secs, v.nbytes / 1e6 / (secs > 0 ? secs : 1), v.nbad);
+	return v.nbad ? 1 : 0;
+}
+
+static void usage(char *prog) {
+	errx(1, "Usage: %s [--size N] [--block-size N] [--segment-size N] "
+		"[--auto-geometry] [--64bit] [--read-only [--trim]] [--stable] "
+		"[--manifest] [--reuse <old image>] [--watch] [--compress] "
+		"[--profile <file>] [--locality] [--iblocks-first] "
+		"[--hot <pattern>]... [--hot-age <seconds>] "
+		"[--reserve-segments N] [--spare-inodes N] "
+		"[--extent-map <file>] [--readahead <name>] "
+		"[--verity <file> | --verity-append] [--verity-block-size N] "
+		"<directory> <image>\n"
+		"       %s --append <image> <directory>\n"
+		"       %s --verify [--readahead <name>] <directory> <image>\n"
+		"       %s [--size N] [--block-size N] [--segment-size N] "
+		"[--64bit] [--read-only] [--stable] [--profile <file>] "
+		"[--locality] [--iblocks-first] [--hot <pattern>]... "
+		"[--hot-age <seconds>] [--reserve-segments N] "
+		"[--spare-inodes N] [--extent-map <file>] [--readahead <name>] "
+		"--serve-nbd <socket> <directory>", prog,
+		prog, prog, prog);
+}
+
+int main(int argc, char **argv) {
+	struct fs fs;
+	uint64_t nbytes = 1024 * 1024 * 1024 * 4ULL;
+	struct lfs_params params = {0};
+	static struct option long_opts[] = {
+		{"size", required_argument, 0, 'S'},
+		{"block-size", required_argument, 0, 'b'},
+		{"segment-size", required_argument, 0, 's'},
+		{"auto-geometry", no_argument, 0, 'a'},
+		{"64bit", no_argument, 0, '6'},
+		{"append", required_argument, 0, 'A'},
+		{"manifest", no_argument, 0, 'm'},
+		{"reuse", required_argument, 0, 'r'},
+		{"watch", no_argument, 0, 'w'},
+		{"read-only", no_argument, 0, 'R'},
+		{"trim", no_argument, 0, 'T'},
+		{"stable", no_argument, 0, 'L'},
+		{"compress", no_argument, 0, 'z'},
+		{"serve-nbd", required_argument, 0, 'n'},
+		{"profile", required_argument, 0, 'p'},
+		{"locality", no_argument, 0, 'l'},
+		{"iblocks-first", no_argument, 0, 'i'},
+		{"hot", required_argument, 0, 'H'},
+		{"hot-age", required_argument, 0, 'e'},
+		{"reserve-segments", required_argument, 0, 'c'},
+		{"spare-inodes", required_argument, 0, 'I'},
+		{"extent-map", required_argument, 0, 'M'},
+		{"readahead", required_argument, 0, 'P'},
+		{"verity", required_argument, 0, 'V'},
+		{"verity-append", no_argument, 0, 'v'},
+		{"verity-block-size", required_argument, 0, 'B'},
+		{"verify", no_argument, 0, 'Y'},
+		{0, 0, 0, 0}};
+	int opt, ret, autogeo = 0, create_only = 0, save_manifest = 0;
+	int watching = 0, ifd = -1, trim = 0, sized = 0, compress = 0;
+	int nbd_fd = -1, serving = 0, verify = 0;
+	char *image = NULL, *old_image = NULL, *sock = NULL, *prof = NULL;
+	uint64_t reserve_segs = 0, spare_inodes = 0, size;
+	char *extent_map = NULL, *end;
+	FILE *map_file = NULL;
+	char *verity_file = NULL;
+	int verity_append = 0, verity_fd = -1;
+	uint32_t verity_bsize = 4096;
+	struct lfs_output *zout = NULL;
+
+	while ((opt = getopt_long(argc, argv, "6A:ab:B:c:e:H:iI:lLmM:n:p:P:r:Rs:S:TvV:wYz", long_opts, NULL)) != -1) {
+		if (opt != 'A' && opt != 'Y' && opt != 'P')
+			create_only = 1;
+		switch (opt) {
+		case 'S':
+			nbytes = parse_size(optarg);
+			if (nbytes == 0)
+				errx(1, "Invalid image size: %s", optarg);
+			sized = 1;
+			break;
+		case 'b':
+			size = parse_size(optarg);
+			if (size == 0 || size > UINT32_MAX)
+				errx(1, "Invalid block size: %s", optarg);
+			params.bsize = size;
+			break;
+		case 's':
+			size = parse_size(optarg);
+			if (size == 0 || size > UINT32_MAX)
+				errx(1, "Invalid segment size: %s", optarg);
+			params.ssize = size;
+			break;
+		case 'a':
+			autogeo = 1;
+			break;
+		case '6':
+			params.is64 = 1;
+			break;
+		case 'A':
+			append = 1;
+			image = optarg;
+			break;
+		case 'Y':
+			verify = 1;
+			break;
+		case 'm':
+			save_manifest = 1;
+			break;
+		case 'r':
+			old_image = optarg;
+			break;
+		case 'w':
+			watching = 1;
+			break;
+		case 'R':
+			params.readonly = 1;
+			break;
+		case 'T':
+			trim = 1;
+			break;
+		case 'L':
+			stable = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'n':
+			sock = optarg;
+			serving = 1;
+			break;
+		case 'p':
+			prof = optarg;
+			break;
+		case 'l':
+			locality = 1;
+			break;
+		case 'i':
+			iblocks_first = 1;
+			break;
+		case 'H':
+			hot_patterns = realloc(hot_patterns,
+					       (nhot_patterns + 1) *
+						   sizeof(*hot_patterns));
+			assert(hot_patterns);
+			hot_patterns[nhot_patterns++] = optarg;
+			break;
+		case 'e':
+			hot_age = strtoll(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0' || hot_age < 0)
+				errx(1, "Invalid age: %s", optarg);
+			break;
+		case 'c':
+			reserve_segs = strtoull(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0' ||
+			    reserve_segs > UINT32_MAX)
+				errx(1, "Invalid number of segments: %s",
+				     optarg);
+			break;
+		case 'I':
+			spare_inodes = strtoull(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+				errx(1, "Invalid number of inodes: %s", optarg);
+			break;
+		case 'M':
+			extent_map = optarg;
+			break;
+		case 'V':
+			verity_file = optarg;
+			break;
+		case 'v':
+			verity_append = 1;
+			break;
+		case 'B':
+			size = parse_size(optarg);
+			if (size < 512 || size > UINT32_MAX ||
+			    (size & (size - 1)) != 0)
+				errx(1, "Invalid verity block size: %s", optarg);
+			verity_bsize = size;
+			break;
+		case 'P':
+			readahead_name = optarg;
+			if (*optarg == '\0' || strchr(optarg, '/') != NULL ||
+			    strcmp(optarg, ".") == 0 || strcmp(optarg, "..") == 0)
+				errx(1, "Invalid --readahead name: %s", optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (verify) {
+		if (create_only || append || argc - optind != 2)
+			usage(argv[0]);
+		image = argv[optind + 1];
+		fs.fd = open(image, O_RDONLY);
+		if (fs.fd < 0)
+			err(1, "Failed to open %s", image);
+		if (chdir(argv[optind]) != 0)
+			err(1, "Failed to chdir: %s", argv[optind]);
+		return verify_image(&fs, image);
+	}
+
+	if (append) {
+		if (create_only || readahead_name || argc - optind != 1)
+			usage(argv[0]);
+		fs.fd = open(image, O_RDWR);
+		if (fs.fd < 0)
+			err(1, "Failed to open %s", image);
+		ret = load_lfs(&fs);
+		if (ret != 0)
+			errx(1, "Failed to load the FS: %s", strerror(ret));
+		if (chdir(argv[optind]) != 0)
+			err(1, "Failed to chdir: %s", argv[optind]);
+
+		ret = walk(&fs, ULFS_ROOTINO, ULFS_ROOTINO, 1);
+		if (ret != 0)
+			errx(1, "Failed to add the tree: %s", strerror(ret));
+
+		ret = finish_lfs(&fs);
+		if (ret != 0)
+			errx(1, "Failed to write the ifile: %s", strerror(ret));
+		close(fs.fd);
+		return 0;
+	}
+
+	if (argc - optind != (serving ? 1 : 2))
+		usage(argv[0]);
+	if (serving && (save_manifest || old_image || watching || compress ||
+			trim))
+		errx(1, "Nothing is written with --serve-nbd, it can't be "
+			"used with --manifest, --reuse, --watch, --compress or "
+			"--trim");
+	if (watching && save_manifest)
+		errx(1, "The manifest would be stale after the first change, "
+			"--manifest can't be used with --watch");
+	if (verity_file && verity_append)
+		errx(1, "--verity and --verity-append are two places for the "
+			"same tree, pick one");
+	if ((verity_file || verity_append) && (serving || watching))
+		errx(1, "The hash tree is of the image as written, it can't be "
+			"made with --serve-nbd or --watch");
+	if (verity_append && compress)
+		errx(1, "The tree can't be appended to a compressed image, use "
+			"--verity <file>");
+	if (watching && (extent_map || readahead_name))
+		errx(1, "The extent map and the read-ahead list would be stale "
+			"after the first change, --extent-map and --readahead "
+			"can't be used with --watch");
+	if (readahead_name && !prof)
+		errx(1, "--readahead lists what the profile reads, it needs "
+			"--profile");
+	if (readahead_name) {
+		char top_path[PATH_MAX];
+		struct stat sb;
+
+		snprintf(top_path, sizeof(top_path), "%s/%s", argv[optind],
+			 readahead_name);
+		if (lstat(top_path, &sb) == 0)
+			errx(1, "%s is in the tree already, pick another "
+				"--readahead name", top_path);
+	}
+	if (readahead_name && trim)
+		errx(1, "--trim sizes the image for the tree alone, it can't "
+			"be used with --readahead");
+	if (watching && params.readonly)
+		errx(1, "--watch writes the image again, it can't be --read-only");
+	if (trim && !params.readonly)
+		errx(1, "A trimmed image has no room left, --trim needs "
+			"--read-only");
+	if (trim && sized)
+		errx(1, "--trim picks the size of the image, drop --size");
+	if (locality && stable)
+		errx(1, "--stable has a layout of its own, it can't be used "
+			"with --locality");
+	if (hot_placing() && params.readonly)
+		errx(1, "Nothing is written to a --read-only image, --hot and "
+			"--hot-age can't be used with it");
+	if ((reserve_segs || spare_inodes) && params.readonly)
+		errx(1, "Nothing is written to a --read-only image, "
+			"--reserve-segments and --spare-inodes can't be used "
+			"with it");
+	if (trim && stable)
+		errx(1, "--stable leaves room between groups, it can't be "
+			"--trim'med");
+	if (compress && (save_manifest || watching || extent_map ||
+			 readahead_name))
+		errx(1, "A compressed image can't be read back, --compress "
+			"can't be used with --manifest, --watch, --extent-map "
+			"or --readahead");
+	if (compress && trim)
+		errx(1, "A compressed image has no empty segments already, "
+			"drop --trim");
+
+	if (autogeo) {
+		char *cwd = getcwd(NULL, 0);
+		assert(cwd);
+		if (chdir(argv[optind]) != 0)
+			return 1;
+		auto_geometry(nbytes, &params);
+		if (chdir(cwd) != 0)
+			errx(1, "Failed to chdir: %s", cwd);
+		free(cwd);
+	}
+
+	/* The reserved segments on top of the default size */
+	if (reserve_segs && !sized)
+		nbytes += reserve_segs *
+			  (params.ssize ? params.ssize : DFL_LFSSEG);
+
+	if (trim) {
+		char *cwd = getcwd(NULL, 0);
+		assert(cwd);
+		if (chdir(argv[optind]) != 0)
+			err(1, "Failed to chdir: %s", argv[optind]);
+		nbytes = trimmed_size(&params);
+		if (chdir(cwd) != 0)
+			errx(1, "Failed to chdir: %s", cwd);
+		free(cwd);
+	}
+
+	if (stable) {
+		struct tree_stats st = {.is64 = params.is64};
+		char *cwd = getcwd(NULL, 0), *epoch = getenv("SOURCE_DATE_EPOCH");
+		assert(cwd);
+		if (chdir(argv[optind]) != 0)
+			err(1, "Failed to chdir: %s", argv[optind]);
+		scan(&st);
+		free(st.sizes);
+		if (chdir(cwd) != 0)
+			errx(1, "Failed to chdir: %s", cwd);
+		free(cwd);
+
+		for (stable_ninums = 1024;
+		     stable_ninums < 2 * (st.nfiles + st.ndirs);)
+			stable_ninums *= 2;
+		stable_inums = calloc(stable_ninums / 8, 1);
+		assert(stable_inums);
+
+		/* Files and directories in 8 segments, each with its inode */
+		uint64_t bsize = params.bsize ? params.bsize : DFL_LFSBLOCK;
+		uint64_t ssize = params.ssize ? params.ssize : DFL_LFSSEG;
+		uint64_t n = st.nfiles + st.ndirs;
+		uint64_t per_seg = n * ssize / (st.nbytes + 2 * n * bsize);
+		for (stable_anchor = 1; stable_anchor < 8 * per_seg;)
+			stable_anchor *= 2;
+		stable_anchor--;
+
+		/* Every inode and summary has the same time in every build */
+		params.tstamp = epoch ? strtoll(epoch, NULL, 10) : 0;
+		if (params.tstamp == 0)
+			params.tstamp = 1;
+	}
+
+	/* What --hot-age counts from, and the su_lastmod of hot segments */
+	build_time = params.tstamp != 0 ? params.tstamp : time(0);
+
+	if (prof)
+		load_profile(prof);
+	if (prof || locality) {
+		struct layout_report before, after;
+		char *cwd = getcwd(NULL, 0);
+		assert(cwd);
+		if (chdir(argv[optind]) != 0)
+			err(1, "Failed to chdir: %s", argv[optind]);
+		layout_dry_run(nbytes, &params, 0, &before);
+		layout_dry_run(nbytes, &params, 1, &after);
+		if (chdir(cwd) != 0)
+			errx(1, "Failed to chdir: %s", cwd);
+		free(cwd);
+		if (prof)
+			printf("profile: %lu paths, %lu seeks to read them "
+			       "(%lu in the default layout)\n", nprofile,
+			       after.profile_seeks, before.profile_seeks);
+		if (locality)
+			printf("ls -l: %lu directories, %lu blocks in %lu "
+			       "segments (%lu in the default layout)\n",
+			       after.ndirs, after.ls_blocks, after.ls_segs,
+			       before.ls_segs);
+	}
+
+	if (serving) {
+		/* No image, what the log writes is kept by fs.out */
+		fs.fd = -1;
+		nbd_fd = nbd_listen(sock);
+		if (nbd_fd < 0)
+			err(1, "Failed to listen on %s", sock);
+	} else {
+		fs.fd = open(argv[optind + 1], O_CREAT | O_RDWR |
+			     (compress ? O_TRUNC : 0), DEFFILEMODE);
+		assert(fs.fd != 0);
+	}
+
+	/* Nothing from an older image in the holes of a trimmed one */
+	if (trim) {
+		struct stat sb;
+		if (fstat(fs.fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		    ftruncate(fs.fd, 0) != 0)
+			err(1, "Failed to truncate %s", argv[optind + 1]);
+	}
+
+	if (old_image) {
+		struct stat old_sb, sb;
+
+		reuse_fd = open(old_image, O_RDONLY);
+		if (reuse_fd < 0)
+			err(1, "Failed to open %s", old_image);
+		if (fstat(reuse_fd, &old_sb) == 0 && fstat(fs.fd, &sb) == 0 &&
+		    old_sb.st_dev == sb.st_dev && old_sb.st_ino == sb.st_ino)
+			errx(1, "Can't reuse the image being written: %s",
+			     old_image);
+		load_manifest(old_image, &reuse);
+	}
+
+	ret = init_lfs_params(&fs, nbytes, &params);
+	if (ret == EINVAL)
+		errx(1, "Unsupported geometry: block size %u, segment size %u",
+		     params.bsize ? params.bsize : DFL_LFSBLOCK,
+		     params.ssize ? params.ssize : DFL_LFSSEG);
+	if (ret == EFBIG)
+		errx(1, "Image too large for LFS32, try --64bit");
+	if (ret != 0)
+		errx(1, "Failed to initialize the FS: %s", strerror(ret));
+	fs.iblocks_first = iblocks_first;
+	fs.spare_inodes = spare_inodes;
+	if (compress)
+		fs.out = zout = lfsz_create(fs.fd, fs.lfs.dlfs_ssize, nbytes,
+					    sysconf(_SC_NPROCESSORS_ONLN));
+	if (verity_file || verity_append) {
+		if (fs.lfs.dlfs_ssize % verity_bsize != 0)
+			errx(1, "The segment size (%u) is not a multiple of the "
+			     "verity block size (%u)", fs.lfs.dlfs_ssize,
+			     verity_bsize);
+		fs.out = verity_create(fs.out, fs.fd, fs.lfs.dlfs_ssize, nbytes,
+				       verity_bsize,
+				       sysconf(_SC_NPROCESSORS_ONLN));
+	}
+	if (serving)
+		fs.out = lazy_create(&fs, nbytes);
+
+	if (save_manifest) {
+		char file[PATH_MAX];
+
+		snprintf(file, sizeof(file), "%s.manifest", argv[optind + 1]);
+		manifest = fopen(file, "w");
+		if (manifest == NULL)
+			err(1, "Failed to create %s", file);
+		fprintf(manifest, MANIFEST_MAGIC " %u\n", fs.lfs.dlfs_bsize);
+	}
+
+	if (verity_file) {
+		verity_fd = open(verity_file, O_CREAT | O_WRONLY | O_TRUNC,
+				 DEFFILEMODE);
+		if (verity_fd < 0)
+			err(1, "Failed to create %s", verity_file);
+	}
+	if (extent_map) {
+		map_file = fopen(extent_map, "w");
+		if (map_file == NULL)
+			err(1, "Failed to create %s", extent_map);
+	}
+
+	/* The image and the files next to it are relative to it */
+	int cwd_fd = open(".", O_RDONLY | O_DIRECTORY);
+	assert(cwd_fd >= 0);
+	if (chdir(argv[optind]) != 0)
+		return 1;
+
+	/* Changes while we write the image are in the next checkpoint */
+	if (watching) {
+		ifd = inotify_init1(IN_NONBLOCK);
+		if (ifd < 0)
+			err(1, "Failed to watch %s", argv[optind]);
+		add_watches(ifd, "");
+	}
+
+	if (nprofile)
+		write_profile(&fs);
+	ret = walk(&fs, ULFS_ROOTINO, ULFS_ROOTINO, 0);
+	if (ret == ENOSPC)
+		errx(1, "No space left for the tree, try a larger --size");
+	if (ret != 0)
+		errx(1, "Failed to write the tree: %s", strerror(ret));
+	write_hot(&fs);
+	write_readahead(&fs);
+	placed_clear();
+	if (old_image)
+		printf("reused %lu files (%lu bytes) from %s\n", reused_files,
+		       reused_bytes, old_image);
+
+	ret = finish_lfs(&fs);
+	if (ret != 0)
+		errx(1, "Failed to write the ifile: %s", strerror(ret));
+	if (reserve_segs &&
+	    fs.lfs.dlfs_nclean < fs.lfs.dlfs_minfreeseg + reserve_segs) {
+		/* Don't leave an image without the room asked for */
+		struct stat img_sb;
+		char file[PATH_MAX];
+
+		if (fstat(fs.fd, &img_sb) == 0 && S_ISREG(img_sb.st_mode))
+			unlinkat(cwd_fd, argv[optind + 1], 0);
+		if (manifest) {
+			snprintf(file, sizeof(file), "%s.manifest",
+				 argv[optind + 1]);
+			unlinkat(cwd_fd, file, 0);
+		}
+		if (verity_file)
+			unlinkat(cwd_fd, verity_file, 0);
+		errx(1, "%u clean segments left, %lu are needed: try a larger "
+		     "--size", fs.lfs.dlfs_nclean,
+		     fs.lfs.dlfs_minfreeseg + reserve_segs);
+	}
+	if (reserve_segs)
+		printf("clean: %u segments (%lu beyond the cleaner's "
+		       "minimum)\n", fs.lfs.dlfs_nclean,
+		       fs.lfs.dlfs_nclean - (uint64_t)fs.lfs.dlfs_minfreeseg);
+	if (extent_map)
+		write_extent_map(&fs, map_file, extent_map);
+	if (serving) {
+		printf("serving on %s\n", sock);
+		fflush(stdout);
+		ret = nbd_serve(fs.out, nbd_fd);
+		errx(1, "Failed to serve on %s: %s", sock, strerror(ret));
+	}
 
-	finish_lfs(&fs);
+	/* Make an image file as large as the FS (most of it a hole) */
+	struct stat sb;
+	uint64_t image_size = nbytes;
+	if (compress) {
+		ret = lfsz_finish(zout);
+		if (ret != 0)
+			errx(1, "Failed to write the compressed image: %s",
+			     strerror(ret));
+	} else if (trim)
+		image_size = trim_image(&fs);
+	else if (fstat(fs.fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		 (uint64_t)sb.st_size < nbytes && ftruncate(fs.fd, nbytes) != 0)
+		err(1, "Failed to extend %s", argv[optind + 1]);
+	if (verity_file || verity_append)
+		write_verity(&fs, image_size, verity_bsize, compress,
+			     verity_file ? verity_fd : fs.fd,
+			     verity_file ? verity_file : argv[optind + 1]);
+	if (watching)
+		watch(&fs, ifd);
 	close(fs.fd);
+	if (manifest && fclose(manifest) != 0)
+		err(1, "Failed to write the manifest");
 
 	return 0;
 }
@@ -101,36 +101,47 @@ u_int32_t cksum(void *str, size_t len);
 
 /* size args */
 #define NSUPERBLOCKS LFS_MAXNUMSB
-#ifndef IFILE_MAP_SZ
-#define IFILE_MAP_SZ	32
-#endif
 
-#define MAX_INODES (((IFILE_MAP_SZ * DFL_LFSBLOCK) / sizeof(IFILE32)) - IFILE_MAP_SZ + 1)
+/* Inode numbers the inode map can hold without growing it. */
+#define MAX_INODES(_fs) ((_fs)->ifile.nmap * (_fs)->lfs.dlfs_ifpb)
 
 /*
  * calculate the maximum file size allowed with the specified block shift.
  */
-#define NPTR32 ((1 << DFL_LFSBLOCK_SHIFT) / sizeof(int32_t))
-#define MAXFILESIZE32                                                          \
-	((ULFS_NDADDR + NPTR32 + NPTR32 * NPTR32 + NPTR32 * NPTR32 * NPTR32)   \
-	 << DFL_LFSBLOCK_SHIFT)
-
-#define NPTR64 ((1 << DFL_LFSBLOCK_SHIFT) / sizeof(int64_t))
-#define MAXFILESIZE64                                                          \
-	((ULFS_NDADDR + NPTR64 + NPTR64 * NPTR64 + NPTR64 * NPTR64 * NPTR64)   \
-	 << DFL_LFSBLOCK_SHIFT)
+#define _NPTR32(_bshift) ((1ULL << (_bshift)) / sizeof(int32_t))
+#define MAXFILESIZE32(_bshift)                                                 \
+	((ULFS_NDADDR + _NPTR32(_bshift) +                                     \
+	  _NPTR32(_bshift) * _NPTR32(_bshift) +                                \
+	  _NPTR32(_bshift) * _NPTR32(_bshift) * _NPTR32(_bshift))              \
+	 << (_bshift))
+
+#define _NPTR64(_bshift) ((1ULL << (_bshift)) / sizeof(int64_t))
+#define MAXFILESIZE64(_bshift)                                                 \
+	((ULFS_NDADDR + _NPTR64(_bshift) +                                     \
+	  _NPTR64(_bshift) * _NPTR64(_bshift) +                                \
+	  _NPTR64(_bshift) * _NPTR64(_bshift) * _NPTR64(_bshift))              \
+	 << (_bshift))
+
+/* Block pointers per indirect block. */
+#define NPTR(_fs) ((_fs)->lfs.dlfs_nindir)
 
 #define LOG2(X)                                                                \
 	((unsigned)(8 * sizeof(unsigned long long) - __builtin_clzll((X)) - 1))
 
-#define SECTOR_TO_BYTES(_S) (DEV_BSIZE * (_S))
-#define FSBLOCK_TO_BYTES(_S) (DFL_LFSBLOCK * (uint64_t)(_S))
-#define SEGS_TO_FSBLOCKS(_S) (((_S) * (uint64_t)DFL_LFSSEG) / DFL_LFSBLOCK)
-
 #define DIV_UP(_x, _y) (((_x) + (_y)-1) / (_y))
 #define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+#define MAX(_x, _y) (((_x) > (_y)) ? (_x) : (_y))
+
+#define SECTOR_TO_BYTES(_S) (DEV_BSIZE * (_S))
+#define FSBLOCK_TO_BYTES(_fs, _S) ((uint64_t)(_S) << (_fs)->lfs.dlfs_bshift)
+#define SEGS_TO_FSBLOCKS(_fs, _S) ((uint64_t)(_S) * (_fs)->lfs.dlfs_fsbpseg)
+
+/* FS blocks taken by the disk label area, a superblock and a summary. */
+#define LABEL_FSBLOCKS(_fs) DIV_UP(LFS_LABELPAD, (_fs)->lfs.dlfs_bsize)
+#define SB_FSBLOCKS(_fs) DIV_UP(LFS_SBPAD, (_fs)->lfs.dlfs_bsize)
+#define SUM_FSBLOCKS(_fs) ((_fs)->lfs.dlfs_sumsize >> (_fs)->lfs.dlfs_bshift)
 
-static const struct dlfs dlfs32_default = {
+static const struct dlfs64 dlfs_default = {
     .dlfs_magic = LFS_MAGIC,
     .dlfs_version = LFS_VERSION,
     .dlfs_ssize = DFL_LFSSEG,
@@ -142,7 +153,6 @@ static const struct dlfs dlfs32_default = {
     .dlfs_freehd = HIGHEST_USED_INO + 1,
     .dlfs_uinodes = 0,
     .dlfs_idaddr = 0,
-    .dlfs_ifile = LFS_IFILE_INUM,
     .dlfs_offset = 0,
     .dlfs_lastpseg = 0,
     .dlfs_nextseg = 0,
@@ -152,7 +162,7 @@ static const struct dlfs dlfs32_default = {
     /* not very efficient, but makes things easier */
     .dlfs_inopf = 1,
     .dlfs_minfree = MINFREE,
-    .dlfs_maxfilesize = MAXFILESIZE32,
+    .dlfs_maxfilesize = MAXFILESIZE32(DFL_LFSBLOCK_SHIFT),
     .dlfs_fsbpseg = DFL_LFSSEG / DFL_LFSFRAG,
     .dlfs_inopb = 1,
     .dlfs_ifpb = DFL_LFSBLOCK / sizeof(IFILE32),
@@ -160,8 +170,6 @@ static const struct dlfs dlfs32_default = {
     .dlfs_nindir = DFL_LFSBLOCK / sizeof(int32_t),
     .dlfs_nspf = DFL_LFSBLOCK / 512,
     .dlfs_cleansz = 1,
-    .dlfs_segmask = DFL_LFSSEG_MASK,
-    .dlfs_segshift = DFL_LFSSEG_SHIFT,
     .dlfs_bshift = DFL_LFSBLOCK_SHIFT,
     .dlfs_ffshift = DFL_LFS_FFSHIFT,
     .dlfs_fbshift = DFL_LFS_FBSHIFT,
@@ -188,24 +196,138 @@ static const struct dlfs dlfs32_default = {
     .dlfs_pad = {0},
     .dlfs_cksum = 0};
 
-#define SEGUSE_OFF(_sepb, _i)                                                  \
-	(((_i) / _sepb) * DFL_LFSBLOCK +                                       \
-	 sizeof(SEGUSE) * ((_i) - ((((_i) / _sepb) * _sepb))))
+/* Offset of segment (_i) in its segment usage table block. */
+#define SEGUSE_OFF(_fs, _i) (sizeof(SEGUSE) * ((_i) % (_fs)->lfs.dlfs_sepb))
 
-#define SEGUSE_GET(_fs, _i)                                                    \
-	((SEGUSE *)&(_fs->ifile.segusage[SEGUSE_OFF(_fs->lfs.dlfs_sepb, (_i))]))
+#define SEGUSE_GET(_fs, _i) segusage_get((_fs), (_i))
 
-#define IFILE_OFF(_ifpb, _i)                                                   \
-	(((_i) / _ifpb) * DFL_LFSBLOCK +                                       \
-	 sizeof(IFILE32) * ((_i) - ((((_i) / _ifpb) * _ifpb))))
+#define IFILE_OFF(_fs, _i)                                                     \
+	(FSBLOCK_TO_BYTES(_fs, (_i) / (_fs)->lfs.dlfs_ifpb) +                  \
+	 IFILE_SIZE((_fs)->is64) * ((_i) % (_fs)->lfs.dlfs_ifpb))
 
 #define IFILE_GET(_fs, _i)                                                     \
-	((IFILE32 *)&(_fs->ifile.ifiles[IFILE_OFF(_fs->lfs.dlfs_ifpb, (_i))]))
+	((IFILE *)&(_fs->ifile.ifiles[IFILE_OFF(_fs, (_i))]))
+
+/*
+ * The segment usage table is allocated a block at a time, the first time
+ * an entry in the block is used. Most segments are never used by a new
+ * image, so this keeps large images cheap to create. The blocks never used
+ * are written from segusage_empty.
+ */
+static SEGUSE *segusage_get(struct fs *fs, uint64_t segnum) {
+	struct _ifile *ifile = &fs->ifile;
+	uint64_t blk = segnum / fs->lfs.dlfs_sepb;
+
+	assert(segnum < fs->nsegs);
+	if (ifile->segusage[blk] == NULL) {
+		ifile->segusage[blk] = malloc(fs->lfs.dlfs_bsize);
+		assert(ifile->segusage[blk]);
+		memcpy(ifile->segusage[blk], ifile->segusage_empty,
+		       fs->lfs.dlfs_bsize);
+	}
+	return (SEGUSE *)&ifile->segusage[blk][SEGUSE_OFF(fs, segnum)];
+}
+
+/*
+ * The first segment from (segnum) on that is not in use (see fs->inuse), or
+ * nsegs if there is none. Not the segment usage table, as write_ifile()
+ * fills it in ahead of the log.
+ */
+static uint64_t next_clean_segment(struct fs *fs, uint64_t segnum) {
+	if (fs->inuse == NULL)
+		return segnum;
+	while (segnum < fs->nsegs && (fs->inuse[segnum / 8] & (1 << segnum % 8)))
+		segnum++;
+	return segnum;
+}
+
+/*
+ * The segment the log goes to after the one before (segnum): the next clean
+ * one, or once past the last segment, the first clean one from the start,
+ * like NetBSD does. Segment 0 has the label and is never reused. A new FS
+ * is written from the start, and never wraps.
+ */
+static uint64_t next_log_segment(struct fs *fs, uint64_t segnum) {
+	uint64_t next = next_clean_segment(fs, segnum);
+
+	if (next >= fs->nsegs && segnum <= fs->nsegs && fs->inuse != NULL)
+		next = next_clean_segment(fs, 1);
+	return next;
+}
+
+/*
+ * Blocks for data in a FS of (nsegs) segments, without the (minfreeseg)
+ * segments kept free and the superblocks.
+ */
+static int64_t data_fsblocks(struct fs *fs, uint64_t nsegs,
+			     uint64_t minfreeseg) {
+	return ((nsegs - minfreeseg) * fs->lfs.dlfs_ssize -
+		(uint64_t)fs->lfs.dlfs_bsize * NSUPERBLOCKS) /
+	       fs->lfs.dlfs_bsize;
+}
+
+/* Number of segments between superblocks. */
+static uint64_t sb_interval(uint64_t nsegs) {
+	if (nsegs / LFS_MAXNUMSB < LFS_MIN_SBINTERVAL)
+		return LFS_MIN_SBINTERVAL;
+	return nsegs / LFS_MAXNUMSB;
+}
+
+/*
+ * Sets the format, the block and segment sizes, and everything derived from
+ * them. Both sizes have to be powers of two. Frags are always the same size
+ * as blocks.
+ */
+static int set_geometry(struct dlfs64 *lfs, uint32_t bsize, uint32_t ssize,
+			int is64) {
+	if (bsize < LFS_MINBLOCKSIZE || bsize > LFS_MAXBLOCKSIZE ||
+	    (bsize & (bsize - 1)) != 0)
+		return EINVAL;
+	if (ssize < LFS_MINSEGSIZE || ssize > LFS_MAXSEGSIZE ||
+	    (ssize & (ssize - 1)) != 0)
+		return EINVAL;
+	/* Room for a label, a superblock, a summary, and some data. */
+	if (ssize / bsize <= 2 * DIV_UP(LFS_SBPAD, bsize) + 2 + 6)
+		return EINVAL;
+
+	lfs->dlfs_magic = is64 ? LFS64_MAGIC : LFS_MAGIC;
+	lfs->dlfs_maxsymlinklen = is64 ? LFS64_MAXSYMLINKLEN :
+					 LFS32_MAXSYMLINKLEN;
+	lfs->dlfs_ssize = ssize;
+	lfs->dlfs_bsize = bsize;
+	lfs->dlfs_fsize = bsize;
+	lfs->dlfs_frag = 1;
+	lfs->dlfs_maxfilesize = is64 ? MAXFILESIZE64(LOG2(bsize)) :
+				       MAXFILESIZE32(LOG2(bsize));
+	lfs->dlfs_fsbpseg = ssize / bsize;
+	lfs->dlfs_ifpb = bsize / IFILE_SIZE(is64);
+	lfs->dlfs_sepb = bsize / sizeof(SEGUSE);
+	lfs->dlfs_nindir = bsize / DADDR_SIZE(is64);
+	lfs->dlfs_nspf = bsize / DEV_BSIZE;
+	lfs->dlfs_bshift = LOG2(bsize);
+	lfs->dlfs_ffshift = LOG2(bsize);
+	lfs->dlfs_fbshift = 0;
+	lfs->dlfs_bmask = bsize - 1;
+	lfs->dlfs_ffmask = bsize - 1;
+	lfs->dlfs_fbmask = 0;
+	lfs->dlfs_blktodb = LOG2(bsize / DEV_BSIZE);
+	lfs->dlfs_fsbtodb = LOG2(bsize / DEV_BSIZE);
+	lfs->dlfs_sumsize = bsize;
+	lfs->dlfs_ibsize = bsize;
+	return 0;
+}
 
 /* XXX: doesn't advance the log. Maybe it should? */
+/* The time of the inodes and summaries we write. */
+static time_t fs_time(struct fs *fs) {
+	return fs->tstamp != 0 ? fs->tstamp : time(0);
+}
+
 int write_log(struct fs *fs, void *data, uint64_t len, off_t lfs_off, int remap) {
 	int ret;
 
+	if (fs->out != NULL)
+		return fs->out->write(fs->out, data, len, lfs_off);
 	ret = pwrite64(fs->fd, data, len, lfs_off);
 	if (ret == len)
 		return 0;
@@ -215,27 +337,117 @@ int write_log(struct fs *fs, void *data, uint64_t len, off_t lfs_off, int remap)
 		return -1;
 }
 
-/* Add a block into the data checksum */
-void segment_add_datasum(struct segment *seg, char *block, uint32_t size) {
-	uint32_t i;
-	for (i = 0; i < size; i += DFL_LFSBLOCK) {
-		/* The final checksum will be done with a sequence of the first
-		 * byte of every block */
-		assert(seg->cksum_idx < MAX_BLOCKS_PER_SEG);
-		seg->data_for_cksum[seg->cksum_idx++] = block[i];
+/*
+ * Zeroes the rest of the block that (len) bytes were written to at byte
+ * (off). In a new FS the blocks after the log were never written, and are
+ * zero already; a segment used again still has its old data.
+ */
+static int zero_block_tail(struct fs *fs, uint64_t off, uint64_t len) {
+	uint64_t tail = fs->lfs.dlfs_bsize - (len & fs->lfs.dlfs_bmask);
+	static char zeroes[LFS_MAXBLOCKSIZE];
+
+	if (fs->inuse == NULL || (len & fs->lfs.dlfs_bmask) == 0)
+		return 0;
+	return write_log(fs, zeroes, tail, off + len, 0);
+}
+
+/*
+ * Add (size) bytes of blocks into the data checksum of the partial segment.
+ * Like the kernel, the checksum is done over the first 4 bytes of every
+ * block after the summary; the bytes past (size) are zero on disk. A NULL
+ * (block) is data a lazy output didn't read, see struct lfs_output.
+ */
+static inline void segment_add_datasum(struct fs *fs, char *block,
+				       uint64_t size, const unsigned bshift) {
+	struct segment *seg = &fs->seg;
+	uint64_t i;
+	for (i = 0; i < size; i += (1ULL << bshift)) {
+		int32_t word = 0;
+
+		if (block != NULL)
+			memcpy(&word, block + i, MIN(sizeof(word), size - i));
+		assert(seg->cksum_idx < fs->lfs.dlfs_fsbpseg);
+		seg->data_for_cksum[seg->cksum_idx++] = word;
 	}
 }
 
+/* Superblock fields with the same name in struct dlfs and struct dlfs64. */
+#define DLFS_FIELDS(_X)                                                        \
+	_X(magic) _X(version) _X(size) _X(ssize) _X(dsize) _X(bsize)           \
+	_X(fsize) _X(frag) _X(freehd) _X(bfree) _X(nfiles) _X(avail)           \
+	_X(uinodes) _X(idaddr) _X(lastseg) _X(nextseg) _X(curseg) _X(offset)   \
+	_X(lastpseg) _X(inopf) _X(minfree) _X(maxfilesize) _X(fsbpseg)         \
+	_X(inopb) _X(ifpb) _X(sepb) _X(nindir) _X(nseg) _X(nspf) _X(cleansz)   \
+	_X(segtabsz) _X(bshift) _X(ffshift) _X(fbshift) _X(bmask) _X(ffmask)   \
+	_X(fbmask) _X(blktodb) _X(sushift) _X(maxsymlinklen) _X(nclean)        \
+	_X(pflags) _X(dmeta) _X(minfreeseg) _X(sumsize) _X(serial) _X(ibsize)  \
+	_X(s0addr) _X(tstamp) _X(inodefmt) _X(interleave) _X(ident)           \
+	_X(fsbtodb) _X(resvseg)
+
+/* Converts the in-memory superblock into the 32-bit on-disk one. */
+static void dlfs_to_dlfs32(const struct dlfs64 *l, struct dlfs *d) {
+	uint32_t i;
+
+	/* Everything in a 32-bit FS has to be addressable with 32 bits. */
+	assert(l->dlfs_size <= INT32_MAX && l->dlfs_offset <= INT32_MAX);
+
+	memset(d, 0, sizeof(*d));
+#define _X(_f) d->dlfs_##_f = l->dlfs_##_f;
+	DLFS_FIELDS(_X)
+#undef _X
+	d->dlfs_ifile = LFS_IFILE_INUM;
+	d->dlfs_segmask = l->dlfs_ssize - 1;
+	d->dlfs_segshift = LOG2(l->dlfs_ssize);
+	for (i = 0; i < LFS_MAXNUMSB; i++)
+		d->dlfs_sboffs[i] = l->dlfs_sboffs[i];
+	memcpy(d->dlfs_fsmnt, l->dlfs_fsmnt, MNAMELEN);
+}
+
+/* And back, for an existing FS. */
+static void dlfs32_to_dlfs(const struct dlfs *d, struct dlfs64 *l) {
+	uint32_t i;
+
+	memset(l, 0, sizeof(*l));
+#define _X(_f) l->dlfs_##_f = d->dlfs_##_f;
+	DLFS_FIELDS(_X)
+#undef _X
+	for (i = 0; i < LFS_MAXNUMSB; i++)
+		l->dlfs_sboffs[i] = d->dlfs_sboffs[i];
+	memcpy(l->dlfs_fsmnt, d->dlfs_fsmnt, MNAMELEN);
+}
+
 int write_superblock(struct fs *fs) {
+	union {
+		struct dlfs u_32;
+		struct dlfs64 u_64;
+	} sb;
 	uint32_t i;
 	int ret;
 
 	for (i = 0; i < NSUPERBLOCKS; i++) {
-		fs->lfs.dlfs_cksum = lfs_sb_cksum32(&fs->lfs);
-		ret = write_log(fs, &fs->lfs, sizeof(fs->lfs),
-			FSBLOCK_TO_BYTES(fs->lfs.dlfs_sboffs[i]), 0);
+		if (i > 0 && fs->lfs.dlfs_sboffs[i] == 0)
+			break;
+		if (fs->is64)
+			sb.u_64 = fs->lfs;
+		else
+			dlfs_to_dlfs32(&fs->lfs, &sb.u_32);
+		/* The checksum covers the same bytes in both formats */
+		sb.u_32.dlfs_cksum = lfs_sb_cksum32(&sb.u_32);
+		ret = write_log(fs, &sb, sizeof(sb),
+			FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_sboffs[i]), 0);
 		if (ret != 0)
 			return ret;
+		/*
+		 * The primary superblock is always read from LFS_LABELPAD. With
+		 * blocks larger than that, the first one is at the end of block
+		 * 0, so keep a copy at the well-known location too.
+		 */
+		if (i == 0 && FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_sboffs[0]) !=
+				      LFS_LABELPAD) {
+			ret = write_log(fs, &sb, sizeof(sb), LFS_LABELPAD, 0);
+			if (ret != 0)
+				return ret;
+		}
 		fs->lfs.dlfs_serial++;
 	}
 	return 0;
@@ -243,21 +455,66 @@ int write_superblock(struct fs *fs) {
 
 /* Advance the log by nr FS blocks. */
 int _advance_log(struct fs *fs, uint32_t nr) {
-	struct dlfs *lfs = &fs->lfs;
+	struct dlfs64 *lfs = &fs->lfs;
 
-	if (lfs->dlfs_avail <= nr)
+	if (lfs->dlfs_avail <= nr || lfs->dlfs_bfree <= nr)
 		return ENOSPC;
 
 	/* Should not be used to make space for a superblock */
 	lfs->dlfs_offset += nr;
 	lfs->dlfs_lastpseg += nr;
 	lfs->dlfs_avail -= nr;
-	assert(lfs->dlfs_bfree - nr > 0);
 	lfs->dlfs_bfree -= nr;
 
 	return 0;
 }
 
+/*
+ * Starts a partial segment at the current offset: sets an empty summary and
+ * makes a hole for it. Its blocks follow it.
+ */
+static int start_partial_segment(struct fs *fs) {
+	SEGSUM *segsum = fs->seg.segsum;
+	uint32_t serial = U_GET(fs->is64, segsum, ss_serial);
+	int is64 = fs->is64;
+	int ret;
+
+	fs->seg.cksum_idx = 0;
+	fs->seg.sum_bytes_left = fs->lfs.dlfs_sumsize - SEGSUM_HDR_SIZE(is64);
+	fs->seg.disk_bno = fs->lfs.dlfs_offset;
+	fs->seg.fi_nblocks = 0;
+
+	memset(segsum, 0, fs->lfs.dlfs_sumsize);
+	U_SET(is64, segsum, ss_magic, SS_MAGIC);
+	U_SET(is64, segsum, ss_next, fs->lfs.dlfs_nextseg);
+	/* TODO: make this random */
+	U_SET(is64, segsum, ss_ident, 249755386);
+	U_SET(is64, segsum, ss_flags, SS_RFW);
+	U_SET(is64, segsum, ss_serial, serial + 1);
+
+	fs->seg.fip = (FINFO *)((uint64_t)segsum + SEGSUM_HDR_SIZE(is64));
+
+	ret = _advance_log(fs, SUM_FSBLOCKS(fs));
+	if (ret != 0)
+		return ret;
+	assert(fs->seg.disk_bno < fs->lfs.dlfs_offset);
+	fs->lfs.dlfs_dmeta++;
+	return 0;
+}
+
+/*
+ * Sets the number of partial segments of the current segment in its SEGUSE
+ * entry. While the ifile is written, write_ifile() accounted its partial
+ * segments already, and the SEGUSE block can be logged before all of them
+ * are started: never lower that count then.
+ */
+static void set_nsums(struct fs *fs, SEGUSE *segusage) {
+	if (fs->seg.ino == LFS_IFILE_INUM)
+		segusage->su_nsums = MAX(segusage->su_nsums, fs->seg.nsums);
+	else
+		segusage->su_nsums = fs->seg.nsums;
+}
+
 /*
  * This sets an initial version of the segment summary at the start of the
  * segment, and sets a block for a superblock if there is any.  The offset
@@ -265,33 +522,55 @@ int _advance_log(struct fs *fs, uint32_t nr) {
  * would be after the segment summary, and a superblock (if any).
  */
 int start_segment(struct fs *fs, struct _ifile *ifile) {
-	struct segsum32 *segsum = fs->seg.segsum;
+	SEGSUM *segsum = fs->seg.segsum;
+	uint64_t next = fs->seg.seg_number + 1;
 	SEGUSE *segusage;
+	uint64_t segnum;
 	int ret;
 
-	assert(fs->lfs.dlfs_offset == 1 ||
+	assert(fs->lfs.dlfs_offset == LABEL_FSBLOCKS(fs) ||
 		(fs->lfs.dlfs_offset % fs->lfs.dlfs_fsbpseg == 0));
 	assert(segsum != NULL);
 
+	/*
+	 * Nothing goes back to the segment we leave, but a superblock, or
+	 * the ifile inode (written after the ifile, see write_ifile()).
+	 */
+	if (fs->out != NULL && fs->out->done != NULL &&
+	    fs->seg.seg_number != (uint32_t)-1 &&
+	    !(SEGUSE_GET(fs, fs->seg.seg_number)->su_flags &
+	      SEGUSE_SUPERBLOCK) &&
+	    fs->lfs.dlfs_idaddr / fs->lfs.dlfs_fsbpseg != fs->seg.seg_number)
+		fs->out->done(fs->out, fs->seg.seg_number);
+
+	/*
+	 * Segments in use are skipped. In a new FS, every segment past the
+	 * log is clean, but not necessarily in one we add files to.
+	 */
+	segnum = next_log_segment(fs, MAX(next, fs->seg.skip_to));
+	if (segnum >= fs->nsegs)
+		return ENOSPC;
+	if (segnum != next)
+		fs->lfs.dlfs_offset = SEGS_TO_FSBLOCKS(fs, segnum);
+	if (fs->inuse != NULL)
+		fs->inuse[segnum / 8] |= 1 << segnum % 8;
 	fs->lfs.dlfs_nclean--;
-	fs->lfs.dlfs_curseg += DFL_LFSSEG / DFL_LFSBLOCK;
-	fs->lfs.dlfs_nextseg += DFL_LFSSEG / DFL_LFSBLOCK;
-	assert(fs->lfs.dlfs_nextseg > fs->lfs.dlfs_curseg);
-	fs->seg.seg_number++;
+	fs->lfs.dlfs_curseg = SEGS_TO_FSBLOCKS(fs, segnum);
+	fs->lfs.dlfs_nextseg =
+	    SEGS_TO_FSBLOCKS(fs, next_log_segment(fs, segnum + 1));
+	assert(fs->lfs.dlfs_nextseg != fs->lfs.dlfs_curseg);
+	fs->seg.seg_number = segnum;
 
 	if (fs->lfs.dlfs_curseg == 0)
-		assert(fs->lfs.dlfs_offset == 1);
+		assert(fs->lfs.dlfs_offset == LABEL_FSBLOCKS(fs));
 	else
 		assert(fs->lfs.dlfs_offset % fs->lfs.dlfs_fsbpseg == 0);
 
-	fs->seg.cksum_idx = 0;
-
 	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
 	if (segusage->su_flags & SEGUSE_SUPERBLOCK) {
-		/* The first block is for the superblock of the segment (if
-		 * any) */
-		segment_add_datasum(&fs->seg, (char *)&fs->lfs, DFL_LFSBLOCK);
-		ret = _advance_log(fs, 1);
+		/* The first blocks are for the superblock of the segment (if
+		 * any). It's not part of any partial segment. */
+		ret = _advance_log(fs, SB_FSBLOCKS(fs));
 		if (ret != 0)
 			return ret;
 		segusage->su_flags = SEGUSE_SUPERBLOCK;
@@ -302,60 +581,75 @@ int start_segment(struct fs *fs, struct _ifile *ifile) {
 	fs->seg.fs = (struct lfs *)&fs->lfs;
 	fs->seg.ninodes = 0;
 	fs->seg.seg_bytes_left = fs->lfs.dlfs_ssize;
-	fs->seg.sum_bytes_left = fs->lfs.dlfs_sumsize;
-	fs->seg.disk_bno = fs->lfs.dlfs_offset;
 
+	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
+	segusage->su_flags |= SEGUSE_ACTIVE | SEGUSE_DIRTY;
 	/*
-	 * We create one segment summary per segment. In other words,
-	 * one partial segment per segment.
+	 * The segment starts with one partial segment. More are started
+	 * when its summary fills up, see next_partial_segment().
 	 */
-	segsum->ss_magic = SS_MAGIC;
-	segsum->ss_next = fs->lfs.dlfs_nextseg;
-	/* TODO: make this random */
-	segsum->ss_ident = 249755386;
-	segsum->ss_nfinfo = 0;
-	segsum->ss_ninos = 0;
-	segsum->ss_flags = SS_RFW;
-	segsum->ss_reclino = 0;
-	segsum->ss_serial++;
-
-	fs->seg.fip = (FINFO *)((uint64_t)segsum + sizeof(struct segsum32));
+	fs->seg.nsums = 1;
+	set_nsums(fs, segusage);
 
-	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-	segusage->su_flags |= SEGUSE_ACTIVE | SEGUSE_DIRTY;
-	/* One seg. summary per segment. */
-	segusage->su_nsums = 1;
+	/*
+	 * After skip_to_segment(), the serial numbers start over from one
+	 * that only depends on where we are: no segment before has as many
+	 * partial segments as it has blocks for summaries.
+	 */
+	if (fs->seg.skip_to != 0) {
+		U_SET(fs->is64, segsum, ss_serial,
+		      segnum * (fs->lfs.dlfs_fsbpseg / SUM_FSBLOCKS(fs)));
+		fs->seg.skip_to = 0;
+	}
 
-	/* Make a hole for the segment summary. */
-	/* TODO: make sure there is no superblock here. */
-	ret = _advance_log(fs, fs->lfs.dlfs_sumsize / DFL_LFSBLOCK);
+	ret = start_partial_segment(fs);
 	if (ret != 0)
 		return ret;
-	assert(fs->seg.disk_bno < fs->lfs.dlfs_offset);
-	fs->lfs.dlfs_dmeta++;
 
 	assert(fs->lfs.dlfs_offset >= fs->lfs.dlfs_curseg);
 	if (fs->lfs.dlfs_curseg == 0)
-		assert((fs->lfs.dlfs_offset - 3) % fs->lfs.dlfs_fsbpseg == 0);
+		assert(fs->lfs.dlfs_offset == LABEL_FSBLOCKS(fs) +
+			SB_FSBLOCKS(fs) + SUM_FSBLOCKS(fs));
 	else
-		assert(((fs->lfs.dlfs_offset - 1) % fs->lfs.dlfs_fsbpseg == 0) ||
-		       ((fs->lfs.dlfs_offset - 2) % fs->lfs.dlfs_fsbpseg == 0));
+		assert(((fs->lfs.dlfs_offset - SUM_FSBLOCKS(fs)) %
+			fs->lfs.dlfs_fsbpseg == 0) ||
+		       ((fs->lfs.dlfs_offset - SUM_FSBLOCKS(fs) - SB_FSBLOCKS(fs)) %
+			fs->lfs.dlfs_fsbpseg == 0));
 
 	return 0;
 }
 
-int write_segment_summary(struct fs *fs) {
+/*
+ * Sets the data checksum of a summary, from the first words of the blocks
+ * of its partial segment, and then its own checksum.
+ */
+void segsum_set_datasum(struct fs *fs, void *segsum, const int32_t *words,
+			uint64_t nwords) {
 	size_t sumstart = offsetof(SEGSUM32, ss_datasum);
-	struct segsum32 *ssp;
-	ssp = (struct segsum32 *)fs->seg.segsum;
+	SEGSUM *ssp = segsum;
+
+	/* ss_sumsum and ss_datasum are at the same place in SEGSUM64 */
+	U_SET(fs->is64, ssp, ss_datasum,
+	      cksum((void *)words, nwords * sizeof(int32_t)));
+	U_SET(fs->is64, ssp, ss_sumsum,
+	      cksum((char *)segsum + sumstart,
+		    fs->lfs.dlfs_sumsize - sumstart));
+}
+
+int write_segment_summary(struct fs *fs) {
+	SEGSUM *ssp;
+	int ret;
+	ssp = (SEGSUM *)fs->seg.segsum;
 
-	ssp->ss_create = time(0);
-	ssp->ss_datasum = cksum(fs->seg.data_for_cksum,
-					fs->seg.cksum_idx * sizeof(int32_t));
-	ssp->ss_sumsum = cksum((char *)fs->seg.segsum + sumstart,
-			       fs->lfs.dlfs_sumsize - sumstart);
+	U_SET(fs->is64, ssp, ss_create, fs_time(fs));
+	segsum_set_datasum(fs, ssp, fs->seg.data_for_cksum, fs->seg.cksum_idx);
 
-	return write_log(fs, ssp, DFL_LFSBLOCK, FSBLOCK_TO_BYTES(fs->seg.disk_bno), 0);
+	ret = write_log(fs, ssp, fs->lfs.dlfs_sumsize,
+			FSBLOCK_TO_BYTES(fs, fs->seg.disk_bno), 0);
+	if (ret == 0 && fs->out != NULL && fs->out->summary != NULL)
+		fs->out->summary(fs->out, FSBLOCK_TO_BYTES(fs, fs->seg.disk_bno),
+				 fs->seg.cksum_idx);
+	return ret;
 }
 
 /* Advance the log by nr FS blocks. */
@@ -387,24 +681,264 @@ int advance_log_by_one(struct fs *fs, struct _ifile *ifile) {
 /* Advance the log by nr FS blocks. */
 int advance_log(struct fs *fs, struct _ifile *ifile, uint32_t nr) {
 	uint32_t i, prev;
+	SEGUSE *segusage;
 	int ret;
 
 	assert(fs->lfs.dlfs_offset >= fs->lfs.dlfs_curseg);
 	prev = fs->lfs.dlfs_offset;
+	/* The blocks moved past were written in the current segment */
+	if (fs->lastmod != 0) {
+		segusage = SEGUSE_GET(fs, fs->seg.seg_number);
+		segusage->su_lastmod = MAX(segusage->su_lastmod,
+					   (uint64_t)fs->lastmod);
+	}
 	for (i = 0; i < nr; i++) {
 		ret = advance_log_by_one(fs, ifile);
 		if (ret != 0)
 			return ret;
 	}
 	assert(fs->lfs.dlfs_offset >= fs->lfs.dlfs_curseg);
-	assert(fs->lfs.dlfs_offset > prev);
+	assert(fs->lfs.dlfs_offset != prev);
+
+	return 0;
+}
+
+/* Blocks left in the current segment, counting the one at the offset. */
+static inline uint64_t seg_avail(struct fs *fs) {
+	return fs->lfs.dlfs_fsbpseg -
+	       (fs->lfs.dlfs_offset - fs->lfs.dlfs_curseg);
+}
+
+/*
+ * How many of the next (n) blocks of a file can be written in one run: all
+ * in the (avail) blocks left in the segment, and all described by the
+ * (sum_left) bytes left in the summary of the partial segment. The file
+ * needs a new FINFO there unless (has_finfo). 0 means the summary is full.
+ */
+static uint64_t pseg_fit(uint64_t n, uint64_t avail, uint64_t sum_left,
+			 int has_finfo, int is64) {
+	uint64_t need = has_finfo ? 0 : FINFO_SIZE(is64);
+
+	if (sum_left < need + DADDR_SIZE(is64))
+		return 0;
+	return MIN(n, MIN(avail, (sum_left - need) / DADDR_SIZE(is64)));
+}
+
+/* Ends the FINFO of the current file. Its next blocks get a new one. */
+static void finfo_close(struct fs *fs) {
+	struct segment *seg = &fs->seg;
+
+	if (seg->fi_nblocks == 0)
+		return;
+	seg->fip = (FINFO *)((char *)seg->fip + FINFO_SIZE(fs->is64) +
+			     seg->fi_nblocks * DADDR_SIZE(fs->is64));
+	seg->fi_nblocks = 0;
+}
+
+/*
+ * Closes the current partial segment, because its summary is full: writes
+ * the summary, and starts a new partial segment right after the blocks of
+ * this one. If there is no room left in the segment for a summary and a
+ * block, the rest of it is left unused and we move to the next segment.
+ */
+static int next_partial_segment(struct fs *fs, struct _ifile *ifile) {
+	struct segment *seg = &fs->seg;
+	uint32_t curr = seg->seg_number;
+	SEGUSE *segusage;
+	int ret;
+
+	finfo_close(fs);
+	if (seg_avail(fs) <= SUM_FSBLOCKS(fs)) {
+		while (seg->seg_number == curr) {
+			ret = advance_log_by_one(fs, ifile);
+			if (ret != 0)
+				return ret;
+		}
+		return 0;
+	}
+
+	ret = write_segment_summary(fs);
+	if (ret != 0)
+		return ret;
+	ret = start_partial_segment(fs);
+	if (ret != 0)
+		return ret;
+	seg->nsums++;
+	segusage = SEGUSE_GET(fs, seg->seg_number);
+	set_nsums(fs, segusage);
+	return 0;
+}
+
+/*
+ * Moves the log to the start of segment (segnum), or of the next segment if
+ * the log is past that already. The rest of the current segment is left
+ * unused, and the segments in between clean. Nothing moves if nothing was
+ * written in segment (segnum) yet.
+ */
+int skip_to_segment(struct fs *fs, uint64_t segnum) {
+	struct segment *seg = &fs->seg;
+	SEGSUM *segsum = seg->segsum;
+	uint64_t curr = seg->seg_number;
+	int ret;
+
+	if (curr == segnum && seg->nsums == 1 &&
+	    U_GET(fs->is64, segsum, ss_nfinfo) == 0 &&
+	    U_GET(fs->is64, segsum, ss_ninos) == 0)
+		return 0;
+	if (segnum <= curr)
+		segnum = curr + 1;
+	if (segnum >= fs->nsegs)
+		return ENOSPC;
+
+	/* The log goes on there, not in the next segment */
+	finfo_close(fs);
+	seg->skip_to = segnum;
+	fs->lfs.dlfs_nextseg = SEGS_TO_FSBLOCKS(fs, segnum);
+	U_SET(fs->is64, segsum, ss_next, fs->lfs.dlfs_nextseg);
+	while (seg->seg_number == curr) {
+		ret = advance_log_by_one(fs, &fs->ifile);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Returns in (fit) how many of the next (n) blocks of the current file can
+ * be written in one run, at least 1. See pseg_fit().
+ */
+static int reserve_blocks(struct fs *fs, struct _ifile *ifile, uint64_t n,
+			  uint64_t *fit) {
+	struct segment *seg = &fs->seg;
+	int ret;
+
+	assert(n > 0);
+	while ((*fit = pseg_fit(n, seg_avail(fs), seg->sum_bytes_left,
+				seg->fi_nblocks > 0, fs->is64)) == 0) {
+		ret = next_partial_segment(fs, ifile);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Where the next (n) blocks of the current file will go, written one after
+ * the other, in (daddrs). The log doesn't move: this follows what
+ * reserve_blocks(), next_partial_segment() and start_segment() will do,
+ * and has to be kept in step with them. ENOSPC if they don't fit in the FS.
+ */
+static int plan_blocks(struct fs *fs, uint64_t n, int64_t *daddrs) {
+	struct segment *seg = &fs->seg;
+	uint64_t fsbpseg = fs->lfs.dlfs_fsbpseg;
+	uint64_t segnum = seg->seg_number, curseg = fs->lfs.dlfs_curseg;
+	uint64_t off = fs->lfs.dlfs_offset, fit, i;
+	int64_t sum_left = seg->sum_bytes_left;
+	int has_finfo = seg->fi_nblocks > 0;
+
+	while (n > 0) {
+		fit = pseg_fit(n, fsbpseg - (off - curseg), sum_left,
+			       has_finfo, fs->is64);
+		if (fit == 0 && fsbpseg - (off - curseg) > SUM_FSBLOCKS(fs)) {
+			/* A new partial segment in this one */
+			off += SUM_FSBLOCKS(fs);
+			sum_left = fs->lfs.dlfs_sumsize -
+				   SEGSUM_HDR_SIZE(fs->is64);
+			has_finfo = 0;
+			continue;
+		}
+		if (fit > 0) {
+			sum_left -= (has_finfo ? 0 : FINFO_SIZE(fs->is64)) +
+				    fit * DADDR_SIZE(fs->is64);
+			has_finfo = 1;
+			for (i = 0; i < fit; i++)
+				*daddrs++ = off++;
+			n -= fit;
+			if (off - curseg < fsbpseg)
+				continue;
+		}
+		/* The rest of the segment is left, the log goes to the next */
+		segnum = next_log_segment(fs, MAX(segnum + 1, seg->skip_to));
+		if (segnum >= fs->nsegs)
+			return ENOSPC;
+		curseg = off = SEGS_TO_FSBLOCKS(fs, segnum);
+		if (SEGUSE_GET(fs, segnum)->su_flags & SEGUSE_SUPERBLOCK)
+			off += SB_FSBLOCKS(fs);
+		off += SUM_FSBLOCKS(fs);
+		sum_left = fs->lfs.dlfs_sumsize - SEGSUM_HDR_SIZE(fs->is64);
+		has_finfo = 0;
+	}
+	return 0;
+}
+
+/*
+ * Adds (n) blocks of the current file, with logical block numbers starting
+ * at (lbn), to its FINFO in the summary. They have to fit, see
+ * reserve_blocks().
+ */
+static void finfo_add_blocks(struct fs *fs, int64_t lbn, uint64_t n) {
+	struct segment *seg = &fs->seg;
+	char *blocks = (char *)seg->fip + FINFO_SIZE(fs->is64);
+	int is64 = fs->is64;
+	uint64_t i;
+
+	if (seg->fi_nblocks == 0) {
+		U_SET(is64, seg->fip, fi_version,
+		      U_GET(is64, IFILE_GET(fs, seg->ino), if_version));
+		U_SET(is64, seg->fip, fi_ino, seg->ino);
+		U_SET(is64, seg->fip, fi_lastlength, fs->lfs.dlfs_bsize);
+		U_SET(is64, (SEGSUM *)seg->segsum, ss_nfinfo,
+		      U_GET(is64, (SEGSUM *)seg->segsum, ss_nfinfo) + 1);
+		seg->sum_bytes_left -= FINFO_SIZE(is64);
+	}
+	for (i = 0; i < n; i++)
+		DADDR_SET(is64, blocks, seg->fi_nblocks + i, lbn + i);
+	seg->fi_nblocks += n;
+	seg->sum_bytes_left -= n * DADDR_SIZE(is64);
+	U_SET(is64, seg->fip, fi_nblocks, seg->fi_nblocks);
+	assert(seg->sum_bytes_left >= 0);
+}
+
+/*
+ * Makes room in the summary for the address of one more inode block, after
+ * ending the FINFO of the current file.
+ */
+static int reserve_inode(struct fs *fs, struct _ifile *ifile) {
+	int ret;
 
+	finfo_close(fs);
+	while (fs->seg.sum_bytes_left < (int32_t)IINFO_SIZE(fs->is64)) {
+		ret = next_partial_segment(fs, ifile);
+		if (ret != 0)
+			return ret;
+	}
 	return 0;
 }
 
+/*
+ * Adds the inode block at the current offset to the summary. The inode
+ * block addresses grow down from the end of the summary.
+ */
+static void iinfo_add(struct fs *fs) {
+	SEGSUM *segsum = fs->seg.segsum;
+	int is64 = fs->is64;
+	uint64_t ninos = U_GET(is64, segsum, ss_ninos);
+	char *iip = (char *)segsum + fs->lfs.dlfs_sumsize -
+		    (ninos + 1) * IINFO_SIZE(is64);
+
+	assert(fs->seg.sum_bytes_left >= (int32_t)IINFO_SIZE(is64));
+	DADDR_SET(is64, iip, 0, fs->lfs.dlfs_offset);
+	U_SET(is64, segsum, ss_ninos, ninos + 1);
+	fs->seg.sum_bytes_left -= IINFO_SIZE(is64);
+}
+
+#define DIRHDR(_dir, _off) ((LFS_DIRHEADER *)&(_dir)->data[(_off)])
+
 int dir_add_entry(struct directory *dir, char *name, int inumber, int type) {
 	int namlen = strnlen(name, LFS_MAXNAMLEN);
-	int reclen = namlen + sizeof(struct lfs_dirheader32);
+	int hdrlen = DIRHDR_SIZE(dir->is64);
+	int reclen = namlen + hdrlen;
+	LFS_DIRHEADER *prev, d;
 
 	/*
 	 * The record length is always 4-byte aligned:
@@ -431,13 +965,14 @@ int dir_add_entry(struct directory *dir, char *name, int inumber, int type) {
 
 		/* Round the curlen of the previous entry to LFS_DIRBLKSIZ. */
 		if (dir->prev < dir->curr) {
-			struct lfs_dirheader32 *prev =
-			    (struct lfs_dirheader32 *)&dir->data[dir->prev];
-			prev->dh_reclen = LFS_DIRBLKSIZ - (dir->prev % LFS_DIRBLKSIZ);
-
-			assert(prev->dh_reclen <= LFS_DIRBLKSIZ);
-			assert((dir->prev + prev->dh_reclen) % LFS_DIRBLKSIZ == 0);
-			assert((prev->dh_reclen & 0x3) == 0);
+			prev = DIRHDR(dir, dir->prev);
+			U_SET(dir->is64, prev, dh_reclen,
+			      LFS_DIRBLKSIZ - (dir->prev % LFS_DIRBLKSIZ));
+
+			assert(U_GET(dir->is64, prev, dh_reclen) <= LFS_DIRBLKSIZ);
+			assert((dir->prev + U_GET(dir->is64, prev, dh_reclen)) %
+				       LFS_DIRBLKSIZ == 0);
+			assert((U_GET(dir->is64, prev, dh_reclen) & 0x3) == 0);
 		}
 
 		/* Move this entry to the next BLK. */
@@ -449,14 +984,20 @@ int dir_add_entry(struct directory *dir, char *name, int inumber, int type) {
 		return ENFILE;
 
 	dir->prev = dir->curr;
-	struct lfs_dirheader32 d = {.dh_ino = inumber,
-				    .dh_reclen = reclen,
-				    .dh_type = type,
-				    .dh_namlen = namlen};
-	memcpy(&dir->data[dir->curr], &d, sizeof(d));
-	dir->curr += sizeof(d);
+	memset(&d, 0, sizeof(d));
+	if (dir->is64) {
+		d.u_64.dh_inoA = inumber;
+		d.u_64.dh_inoB = 0;
+	} else {
+		d.u_32.dh_ino = inumber;
+	}
+	U_SET(dir->is64, &d, dh_reclen, reclen);
+	U_SET(dir->is64, &d, dh_type, type);
+	U_SET(dir->is64, &d, dh_namlen, namlen);
+	memcpy(&dir->data[dir->curr], &d, hdrlen);
+	dir->curr += hdrlen;
 	strcpy(&dir->data[dir->curr], name);
-	dir->curr += reclen - sizeof(d);
+	dir->curr += reclen - hdrlen;
 
 	assert(dir->curr >= 0);
 	if (dir->curr >= DIRSIZE)
@@ -470,15 +1011,16 @@ void dir_done(struct directory *dir) {
 	assert(dir->curr > 0);
 	assert(dir->curr < DIRSIZE);
 	
-	struct lfs_dirheader32 *prev =
-		    (struct lfs_dirheader32 *)&dir->data[dir->prev];
-	prev->dh_reclen = LFS_DIRBLKSIZ - (dir->prev % LFS_DIRBLKSIZ);
-	dir->curr = dir->prev + prev->dh_reclen;
+	LFS_DIRHEADER *prev = DIRHDR(dir, dir->prev);
+	uint16_t reclen = LFS_DIRBLKSIZ - (dir->prev % LFS_DIRBLKSIZ);
 
-	assert(prev->dh_reclen <= LFS_DIRBLKSIZ);
+	U_SET(dir->is64, prev, dh_reclen, reclen);
+	dir->curr = dir->prev + reclen;
+
+	assert(reclen <= LFS_DIRBLKSIZ);
 	assert(dir->curr % LFS_DIRBLKSIZ == 0);
-	assert(((dir->prev % LFS_DIRBLKSIZ) + prev->dh_reclen) % LFS_DIRBLKSIZ == 0);
-	assert((prev->dh_reclen & 0x3) == 0);
+	assert(((dir->prev % LFS_DIRBLKSIZ) + reclen) % LFS_DIRBLKSIZ == 0);
+	assert((reclen & 0x3) == 0);
 }
 
 /*
@@ -489,6 +1031,7 @@ int write_empty_root_dir(struct fs *fs) {
 	int ret;
 
 	memset(&dir, 0, sizeof(struct directory));
+	dir.is64 = fs->is64;
 
 	ret = dir_add_entry(&dir, ".", ULFS_ROOTINO, LFS_DT_DIR);
 	if (ret != 0)
@@ -500,176 +1043,233 @@ int write_empty_root_dir(struct fs *fs) {
 
 	dir_done(&dir);
 
-	assert(fs->lfs.dlfs_offset == 3);
+	assert(fs->lfs.dlfs_offset ==
+	       LABEL_FSBLOCKS(fs) + SB_FSBLOCKS(fs) + SUM_FSBLOCKS(fs));
 	assert(dir.curr == LFS_DIRBLKSIZ);
 	return write_file(fs, &dir.data[0], dir.curr, ULFS_ROOTINO,
 			LFS_IFDIR | 0755, 2, 0);
 }
 
-void init_ifile(struct fs *fs) {
-	struct dlfs *lfs = &fs->lfs;
+/*
+ * Makes sure the inode map has an entry for (inumber). The map grows a
+ * block at a time, so its size on disk follows the highest inode number
+ * written. The buffer behind it doubles when full, so memory stays
+ * proportional to the inodes used.
+ */
+static int ifile_map_grow(struct fs *fs, uint64_t inumber) {
 	struct _ifile *ifile = &fs->ifile;
-	uint32_t i;
+	int is64 = fs->is64;
+	uint64_t nmap = inumber / fs->lfs.dlfs_ifpb + 1;
+	uint64_t i;
+
+	if (nmap <= ifile->nmap)
+		return 0;
+
+	/* The ifile can't be larger than any other file */
+	if (FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_cleansz + fs->lfs.dlfs_segtabsz +
+				     nmap) >= fs->lfs.dlfs_maxfilesize)
+		return EFBIG;
+
+	if (nmap > ifile->nmap_alloc) {
+		uint64_t nalloc = MAX(nmap, 2 * ifile->nmap_alloc);
+		char *ifiles = realloc(ifile->ifiles,
+				       FSBLOCK_TO_BYTES(fs, nalloc));
+		if (ifiles == NULL)
+			return ENOMEM;
+		ifile->ifiles = ifiles;
+		ifile->nmap_alloc = nalloc;
+	}
+
+	memset(&ifile->ifiles[FSBLOCK_TO_BYTES(fs, ifile->nmap)], 0,
+	       FSBLOCK_TO_BYTES(fs, nmap - ifile->nmap));
+	/* Entry 0 is never used, and stays all zeroes */
+	for (i = MAX(MAX_INODES(fs), 1); i < nmap * fs->lfs.dlfs_ifpb; i++) {
+		IFILE *ifile_i = IFILE_GET(fs, i);
+		assert(IFILE_OFF(fs, i) < FSBLOCK_TO_BYTES(fs, nmap));
+		U_SET(is64, ifile_i, if_version, 1);
+		U_SET(is64, ifile_i, if_daddr, LFS_UNUSED_DADDR);
+		U_SET(is64, ifile_i, if_nextfree, i + 1);
+	}
+	ifile->nmap = nmap;
+
+	return 0;
+}
+
+/* Returns ifile block (lbn): the cleanerinfo, the segusage table, or the
+ * inode map. */
+static char *ifile_block(struct fs *fs, uint64_t lbn) {
+	struct _ifile *ifile = &fs->ifile;
+	uint64_t nhdr = fs->lfs.dlfs_cleansz + fs->lfs.dlfs_segtabsz;
+
+	if (lbn < fs->lfs.dlfs_cleansz)
+		return ifile->data + FSBLOCK_TO_BYTES(fs, lbn);
+	if (lbn < nhdr) {
+		char *blk = ifile->segusage[lbn - fs->lfs.dlfs_cleansz];
+		return blk != NULL ? blk : ifile->segusage_empty;
+	}
+	assert(lbn - nhdr < ifile->nmap);
+	return ifile->ifiles + FSBLOCK_TO_BYTES(fs, lbn - nhdr);
+}
+
+/* A segment usage table block of clean segments, or NULL. */
+static char *segusage_empty_block(struct fs *fs) {
+	char *blk = calloc(1, fs->lfs.dlfs_bsize);
 	SEGUSE empty_segusage = {.su_nbytes = 0,
 				 .su_olastmod = 0,
 				 .su_nsums = 0,
 				 .su_ninos = 0,
 				 .su_flags = SEGUSE_EMPTY,
 				 .su_lastmod = 0};
+	uint32_t i;
+
+	if (blk == NULL)
+		return NULL;
+	for (i = 0; i < fs->lfs.dlfs_sepb; i++)
+		memcpy(&blk[SEGUSE_OFF(fs, i)], &empty_segusage,
+		       sizeof(empty_segusage));
+	return blk;
+}
 
-	/* XXX: Artifial limit on max inodes. */
-	assert(sizeof(ifile->ifiles) <= DFL_LFSBLOCK);
+void init_ifile(struct fs *fs) {
+	struct dlfs64 *lfs = &fs->lfs;
+	int is64 = fs->is64;
+	struct _ifile *ifile = &fs->ifile;
+	uint32_t bsize = lfs->dlfs_bsize;
 
-	uint32_t nblocks =
-	    lfs->dlfs_cleansz + lfs->dlfs_segtabsz + IFILE_MAP_SZ;
-	ifile->data = calloc(DFL_LFSBLOCK, nblocks);
+	ifile->data = calloc(bsize, lfs->dlfs_cleansz);
 	assert(ifile->data);
+	ifile->cleanerinfo = (CLEANERINFO *)ifile->data;
 
-	ifile->cleanerinfo = (struct _cleanerinfo32 *)ifile->data;
-	ifile->segusage =
-	    (char *)(ifile->data + (lfs->dlfs_cleansz * DFL_LFSBLOCK));
-	ifile->ifiles = (char *)((uint64_t)ifile->segusage +
-				    (lfs->dlfs_segtabsz * DFL_LFSBLOCK));
-
-	memset(&ifile->ifiles[0], 0, sizeof(IFILE32));
-
-	for (i = 1; i < MAX_INODES; i++) {
-		int off = IFILE_OFF(lfs->dlfs_ifpb, i);
-		IFILE32 *ifile_i = IFILE_GET(fs, i);
-		assert((IFILE32 *)&ifile->ifiles[off] == ifile_i);
-		assert(off < (IFILE_MAP_SZ * DFL_LFSBLOCK));
-		ifile_i->if_version = 1;
-		ifile_i->if_daddr = LFS_UNUSED_DADDR;
-		ifile_i->if_nextfree = i + 1;
-		ifile_i->if_atime_sec = 0;
-		ifile_i->if_atime_nsec = 0;
-	}
-	assert(IFILE_OFF(lfs->dlfs_ifpb, lfs->dlfs_ifpb) == DFL_LFSBLOCK);
-	assert(IFILE_OFF(lfs->dlfs_ifpb, lfs->dlfs_ifpb + 1) ==
-			DFL_LFSBLOCK + sizeof(IFILE32));
-	assert((IFILE32 *)&ifile->ifiles[DFL_LFSBLOCK] ==
-			IFILE_GET(fs, lfs->dlfs_ifpb));
-	assert(IFILE_OFF(lfs->dlfs_ifpb, 2 * lfs->dlfs_ifpb) == 2 * DFL_LFSBLOCK);
-	assert(IFILE_OFF(lfs->dlfs_ifpb, 3 * lfs->dlfs_ifpb) == 3 * DFL_LFSBLOCK);
-	assert(IFILE_OFF(lfs->dlfs_ifpb, 4 * lfs->dlfs_ifpb) == 4 * DFL_LFSBLOCK);
-	assert((IFILE32 *)&ifile->ifiles[4 * DFL_LFSBLOCK] ==
-			IFILE_GET(fs, 4 * lfs->dlfs_ifpb));
-	if (IFILE_MAP_SZ > 4)
-		assert(IFILE_GET(fs, 4 * lfs->dlfs_ifpb)->if_version == 1);
-
-	ifile->cleanerinfo->free_head = 1;
-	ifile->cleanerinfo->free_tail = MAX_INODES - 1;
+	ifile->segusage = calloc(lfs->dlfs_segtabsz, sizeof(char *));
+	assert(ifile->segusage);
+	ifile->segusage_empty = segusage_empty_block(fs);
+	assert(ifile->segusage_empty);
 
-	for (i = 0; i < fs->nsegs; i++) {
-		int off = SEGUSE_OFF(lfs->dlfs_sepb, i);
-		assert((SEGUSE *)&ifile->segusage[off] == SEGUSE_GET(fs, i));
-		memcpy(&ifile->segusage[off], &empty_segusage,
-		       sizeof(empty_segusage));
-	}
+	/* The inode map starts with one block and grows as inodes are used */
+	ifile->ifiles = NULL;
+	ifile->nmap = ifile->nmap_alloc = 0;
+	assert(ifile_map_grow(fs, ULFS_ROOTINO) == 0);
+	assert(IFILE_OFF(fs, lfs->dlfs_ifpb) == bsize);
+	assert(IFILE_OFF(fs, lfs->dlfs_ifpb + 1) == bsize + IFILE_SIZE(is64));
+
+	U_SET(is64, ifile->cleanerinfo, free_head, ULFS_ROOTINO + 1);
 }
 
 void init_sboffs(struct fs *fs, struct _ifile *ifile) {
-	struct dlfs *lfs = &fs->lfs;
-	uint32_t i, j;
-	uint32_t sb_interval; /* number of segs between super blocks */
+	struct dlfs64 *lfs = &fs->lfs;
+	uint64_t i, interval = sb_interval(fs->nsegs);
+	uint32_t j;
 	SEGUSE *segusage;
 
-	if ((sb_interval = fs->nsegs / LFS_MAXNUMSB) < LFS_MIN_SBINTERVAL)
-		sb_interval = LFS_MIN_SBINTERVAL;
-
-	for (i = j = 0; i < fs->nsegs; i++) {
-		if (i == 0) {
-			segusage = SEGUSE_GET(fs, i);
-			segusage->su_flags = SEGUSE_SUPERBLOCK;
-			lfs->dlfs_sboffs[j] = 1;
-			++j;
-		}
-		if (i > 0) {
-			if ((i % sb_interval) == 0 && j < LFS_MAXNUMSB) {
-				segusage = SEGUSE_GET(fs, i);
-				segusage->su_flags = SEGUSE_SUPERBLOCK;
-				lfs->dlfs_sboffs[j] = i * lfs->dlfs_fsbpseg;
-				++j;
-			}
-		}
-	}
-}
-
-void add_finfo_inode(struct fs *fs, uint64_t size, uint32_t inumber) {
-	struct segment *seg = &fs->seg;
-	uint32_t nblocks = (size + DFL_LFSBLOCK - 1) / DFL_LFSBLOCK;
-	struct finfo32 *finfo = (struct finfo32 *)seg->fip;
-	uint32_t i;
-
-	finfo->fi_nblocks = nblocks;
-	finfo->fi_version = 1;
-	finfo->fi_ino = inumber;
-	finfo->fi_lastlength = DFL_LFSBLOCK;
-	seg->fip = (FINFO *)((uint64_t)seg->fip + sizeof(struct finfo32));
-	IINFO32 *blocks = (IINFO32 *)seg->fip;
-	for (i = 0; i < finfo->fi_nblocks; i++) {
-
-		uint64_t tip = (uint64_t)seg->fip - (uint64_t)seg->segsum;
-		if (tip > fs->lfs.dlfs_sumsize) {
-			/*
-			 * TODO: we should write the remaining blocks into the
-			 * next segment.
-			 */
-			break;
-		}
-
-		blocks[i].ii_block = i;
-		seg->fip = (FINFO *)((uint64_t)seg->fip + sizeof(IINFO32));
+	for (i = j = 0; i < fs->nsegs && j < LFS_MAXNUMSB; i += interval, j++) {
+		segusage = SEGUSE_GET(fs, i);
+		segusage->su_flags = SEGUSE_SUPERBLOCK;
+		if (i == 0)
+			lfs->dlfs_sboffs[j] = LABEL_FSBLOCKS(fs);
+		else
+			lfs->dlfs_sboffs[j] = i * lfs->dlfs_fsbpseg;
 	}
-
-	((struct segsum32 *)seg->segsum)->ss_ninos++;
-	((struct segsum32 *)seg->segsum)->ss_nfinfo++;
 }
 
 /* Calculate the number of indirect blocks for a file of size (size) */
-uint32_t num_iblocks(int32_t nblocks) {
+uint32_t num_iblocks(struct fs *fs, int32_t nblocks) {
+	uint64_t nptr = NPTR(fs);
 	uint32_t res = 1;
 
 	/* this can be negative (it's fine) */
 	nblocks -= ULFS_NDADDR;
 
-	if (nblocks > (NPTR32 * NPTR32 * NPTR32))
-		res += DIV_UP(nblocks, NPTR32 * NPTR32 * NPTR32);
-	if (nblocks > (NPTR32 * NPTR32))
-		res += DIV_UP(nblocks, NPTR32 * NPTR32);
-	if (nblocks > (NPTR32))
-		res += DIV_UP(nblocks, NPTR32);
+	if (nblocks > (nptr * nptr * nptr))
+		res += DIV_UP(nblocks, nptr * nptr * nptr);
+	if (nblocks > (nptr * nptr))
+		res += DIV_UP(nblocks, nptr * nptr);
+	if (nblocks > (nptr))
+		res += DIV_UP(nblocks, nptr);
 	if (nblocks > 0)
 		res += 1;
 
 	return res;
 }
 
-/*
- * Writes the block pointers and return the offset of the parent.
- */
-int write_single_indirect(struct fs *fs, struct _ifile *ifile, int *blk_ptrs,
-			uint32_t nblocks, int32_t *off,
-			struct lfs32_dinode *inode) {
-	SEGUSE *segusage;
-	int ret;
-
-	*off = fs->lfs.dlfs_offset;
+/* Exact number of indirect blocks needed to map (nblocks) blocks. */
+static uint64_t iblocks_needed(uint64_t nptr, uint64_t nblocks) {
+	uint64_t res = 0, n;
 
-	assert(nblocks <= NPTR32);
+	if (nblocks <= ULFS_NDADDR)
+		return 0;
+	nblocks -= ULFS_NDADDR;
 
-	ret = write_log(fs, blk_ptrs, DFL_LFSBLOCK, FSBLOCK_TO_BYTES(fs->lfs.dlfs_offset), 0);
-	if (ret != 0)
+	n = MIN(nblocks, nptr);
+	res += 1;
+	nblocks -= n;
+	if (nblocks > 0) {
+		n = MIN(nblocks, nptr * nptr);
+		res += DIV_UP(n, nptr) + 1;
+		nblocks -= n;
+	}
+	if (nblocks > 0) {
+		n = MIN(nblocks, nptr * nptr * nptr);
+		res += DIV_UP(n, nptr) + DIV_UP(n, nptr * nptr) + 1;
+	}
+	return res;
+}
+
+/*
+ * Fills in an inode with no blocks. The block pointers are set as the
+ * blocks are written.
+ */
+static inline __attribute__((always_inline)) void
+init_dinode(union lfs_dinode *inode, int inumber, int mode, int nlink,
+	    uint64_t size, uint64_t nblocks, int flags, time_t now,
+	    const int is64) {
+	memset(inode, 0, sizeof(*inode));
+	U_SET(is64, inode, di_mode, mode);
+	U_SET(is64, inode, di_nlink, nlink);
+	U_SET(is64, inode, di_inumber, inumber);
+	U_SET(is64, inode, di_size, size);
+	U_SET(is64, inode, di_atime, now);
+	U_SET(is64, inode, di_mtime, now);
+	U_SET(is64, inode, di_ctime, now);
+	U_SET(is64, inode, di_flags, flags);
+	U_SET(is64, inode, di_blocks, nblocks);
+	U_SET(is64, inode, di_gen, 1);
+	if (is64)
+		inode->u_64.di_birthtime = now;
+}
+
+/*
+ * Writes the block pointers and return the offset of the parent. Indirect
+ * blocks have negative logical block numbers (lbn), as in ulfs_getlbns().
+ */
+int write_single_indirect(struct fs *fs, struct _ifile *ifile, char *blk_ptrs,
+			uint32_t nblocks, int64_t lbn, int64_t *off,
+			union lfs_dinode *inode) {
+	SEGUSE *segusage;
+	uint64_t fit;
+	int ret;
+
+	assert(nblocks <= NPTR(fs));
+
+	ret = reserve_blocks(fs, ifile, 1, &fit);
+	if (ret != 0)
+		return ret;
+	finfo_add_blocks(fs, lbn, 1);
+	*off = fs->lfs.dlfs_offset;
+
+	ret = write_log(fs, blk_ptrs, fs->lfs.dlfs_bsize,
+			FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_offset), 0);
+	if (ret != 0)
 		return ret;
 
-	segment_add_datasum(&fs->seg, (char *)blk_ptrs, DFL_LFSBLOCK);
+	segment_add_datasum(fs, blk_ptrs, fs->lfs.dlfs_bsize,
+			    fs->lfs.dlfs_bshift);
 	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-	segusage->su_nbytes += DFL_LFSBLOCK;
+	segusage->su_nbytes += fs->lfs.dlfs_bsize;
 	// XXX: take care of failing advance_log
 	ret = advance_log(fs, ifile, 1);
 	if (ret != 0)
 		return ret;
-	inode->di_blocks++;
+	U_SET(fs->is64, inode, di_blocks, U_GET(fs->is64, inode, di_blocks) + 1);
 
 	return 0;
 }
@@ -677,43 +1277,55 @@ int write_single_indirect(struct fs *fs, struct _ifile *ifile, int *blk_ptrs,
 /*
  * Writes the block pointers and return the offset of the parent.
  */
-int write_double_indirect(struct fs *fs, struct _ifile *ifile, int *blk_ptrs,
-			  uint32_t nblocks, int32_t *off,
-			  struct lfs32_dinode *inode) {
-	int iblks[NPTR32];
+int write_double_indirect(struct fs *fs, struct _ifile *ifile, char *blk_ptrs,
+			  uint32_t nblocks, int64_t lbn, int64_t *off,
+			  union lfs_dinode *inode) {
+	char *iblks;
 	uint32_t i;
-	assert(nblocks <= NPTR32 * NPTR32);
+	assert(nblocks <= NPTR(fs) * NPTR(fs));
 	SEGUSE *segusage;
+	int64_t iblk;
+	uint64_t fit;
 	int ret;
 
-	memset(iblks, 0, DFL_LFSBLOCK);
+	iblks = calloc(1, fs->lfs.dlfs_bsize);
+	assert(iblks);
 
 	for (i = 0; nblocks > 0; i++) {
-		uint32_t _nblocks = MIN(nblocks, NPTR32);
-		assert(i < NPTR32);
-		ret = write_single_indirect(fs, ifile, blk_ptrs, _nblocks, &iblks[i], inode);
+		uint32_t _nblocks = MIN(nblocks, NPTR(fs));
+		assert(i < NPTR(fs));
+		ret = write_single_indirect(fs, ifile, blk_ptrs, _nblocks,
+					    lbn + 1 - (int64_t)i * NPTR(fs),
+					    &iblk, inode);
 		if (ret != 0)
 			return ret;
+		DADDR_SET(fs->is64, iblks, i, iblk);
 		nblocks -= _nblocks;
-		blk_ptrs += _nblocks;
+		blk_ptrs += _nblocks * DADDR_SIZE(fs->is64);
 	}
 
 	assert(nblocks == 0);
 
+	ret = reserve_blocks(fs, ifile, 1, &fit);
+	if (ret != 0)
+		return ret;
+	finfo_add_blocks(fs, lbn, 1);
 	*off = fs->lfs.dlfs_offset;
 
-	ret = write_log(fs, iblks, DFL_LFSBLOCK,
-			FSBLOCK_TO_BYTES(fs->lfs.dlfs_offset), 0);
+	ret = write_log(fs, iblks, fs->lfs.dlfs_bsize,
+			FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_offset), 0);
 	if (ret != 0)
 		return ret;
-	segment_add_datasum(&fs->seg, (char *)iblks, DFL_LFSBLOCK);
+	segment_add_datasum(fs, iblks, fs->lfs.dlfs_bsize,
+			    fs->lfs.dlfs_bshift);
 	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-	segusage->su_nbytes += DFL_LFSBLOCK;
+	segusage->su_nbytes += fs->lfs.dlfs_bsize;
 	// XXX: take care of failing advance_log
 	ret = advance_log(fs, ifile, 1);
 	if (ret != 0)
 		return ret;
-	inode->di_blocks++;
+	U_SET(fs->is64, inode, di_blocks, U_GET(fs->is64, inode, di_blocks) + 1);
+	free(iblks);
 
 	return 0;
 }
@@ -721,124 +1333,377 @@ int write_double_indirect(struct fs *fs, struct _ifile *ifile, int *blk_ptrs,
 /*
  * Writes the block pointers and return the offset of the parent.
  */
-int write_triple_indirect(struct fs *fs, struct _ifile *ifile, int *blk_ptrs,
-			  uint32_t nblocks, int32_t *off,
-			  struct lfs32_dinode *inode) {
-	int iblks[NPTR32];
+int write_triple_indirect(struct fs *fs, struct _ifile *ifile, char *blk_ptrs,
+			  uint32_t nblocks, int64_t lbn, int64_t *off,
+			  union lfs_dinode *inode) {
+	char *iblks;
 	uint32_t i;
+	int64_t iblk;
+	uint64_t fit;
 	int ret;
 
-	assert(nblocks <= NPTR32 * NPTR32 * NPTR32);
+	assert(nblocks <= NPTR(fs) * NPTR(fs) * NPTR(fs));
 	SEGUSE *segusage;
 
-	memset(iblks, 0, DFL_LFSBLOCK);
+	iblks = calloc(1, fs->lfs.dlfs_bsize);
+	assert(iblks);
 
 	for (i = 0; nblocks > 0; i++) {
-		uint32_t _nblocks = MIN(nblocks, NPTR32 * NPTR32);
-		assert(i < NPTR32);
-		ret = write_double_indirect(fs, ifile, blk_ptrs, _nblocks, &iblks[i], inode);
+		uint32_t _nblocks = MIN(nblocks, NPTR(fs) * NPTR(fs));
+		assert(i < NPTR(fs));
+		ret = write_double_indirect(
+		    fs, ifile, blk_ptrs, _nblocks,
+		    lbn + 1 - (int64_t)i * NPTR(fs) * NPTR(fs), &iblk, inode);
 		if (ret != 0)
 			return ret;
+		DADDR_SET(fs->is64, iblks, i, iblk);
 		nblocks -= _nblocks;
-		blk_ptrs += _nblocks;
+		blk_ptrs += _nblocks * DADDR_SIZE(fs->is64);
 	}
 
 	assert(nblocks == 0);
 
+	ret = reserve_blocks(fs, ifile, 1, &fit);
+	if (ret != 0)
+		return ret;
+	finfo_add_blocks(fs, lbn, 1);
 	*off = fs->lfs.dlfs_offset;
 
-	ret = write_log(fs, iblks,
-			DFL_LFSBLOCK, FSBLOCK_TO_BYTES(fs->lfs.dlfs_offset), 0);
+	ret = write_log(fs, iblks, fs->lfs.dlfs_bsize,
+			FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_offset), 0);
 	if (ret != 0)
 		return ret;
-	segment_add_datasum(&fs->seg, (char *)iblks, DFL_LFSBLOCK);
+	segment_add_datasum(fs, iblks, fs->lfs.dlfs_bsize,
+			    fs->lfs.dlfs_bshift);
 	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-	segusage->su_nbytes += DFL_LFSBLOCK;
+	segusage->su_nbytes += fs->lfs.dlfs_bsize;
 	// XXX: take care of failing advance_log
 	ret = advance_log(fs, ifile, 1);
 	if (ret != 0)
 		return ret;
-	inode->di_blocks++;
+	U_SET(fs->is64, inode, di_blocks, U_GET(fs->is64, inode, di_blocks) + 1);
+	free(iblks);
 
 	return 0;
 }
 
-int write_file(struct fs *fs, char *data, uint64_t size, int inumber, int mode,
-		int nlink, int flags) {
+/*
+ * Writes the single, double and triple indirect blocks for the (nblocks)
+ * block pointers past the direct ones, and points (inode) at them.
+ */
+static int write_indirect_blocks(struct fs *fs, struct _ifile *ifile,
+				 char *blk_ptrs, uint64_t nblocks,
+				 union lfs_dinode *inode) {
+	uint64_t nptr = NPTR(fs);
+	int64_t iblk;
+	int ret;
+
+	if (nblocks > 0) {
+		uint32_t _nblocks = MIN(nblocks, nptr);
+		ret = write_single_indirect(fs, ifile, blk_ptrs, _nblocks,
+					    -ULFS_NDADDR, &iblk, inode);
+		if (ret != 0)
+			return ret;
+		U_SET(fs->is64, inode, di_ib[0], iblk);
+		nblocks -= _nblocks;
+		blk_ptrs += _nblocks * DADDR_SIZE(fs->is64);
+	}
+
+	if (nblocks > 0) {
+		uint32_t _nblocks = MIN(nblocks, nptr * nptr);
+		ret = write_double_indirect(fs, ifile, blk_ptrs, _nblocks,
+					    -(int64_t)(ULFS_NDADDR + nptr + 1),
+					    &iblk, inode);
+		if (ret != 0)
+			return ret;
+		U_SET(fs->is64, inode, di_ib[1], iblk);
+		nblocks -= _nblocks;
+		blk_ptrs += _nblocks * DADDR_SIZE(fs->is64);
+	}
+
+	if (nblocks > 0) {
+		uint32_t _nblocks = MIN(nblocks, nptr * nptr * nptr);
+		ret = write_triple_indirect(
+		    fs, ifile, blk_ptrs, _nblocks,
+		    -(int64_t)(ULFS_NDADDR + nptr + nptr * nptr + 2), &iblk,
+		    inode);
+		if (ret != 0)
+			return ret;
+		U_SET(fs->is64, inode, di_ib[2], iblk);
+		nblocks -= _nblocks;
+		blk_ptrs += _nblocks * DADDR_SIZE(fs->is64);
+	}
+
+	assert(nblocks == 0);
+	return 0;
+}
+
+/*
+ * Blocks in the log for an indirect block of (level) (0 for a single one)
+ * and the (m) data blocks under it, with the indirect blocks in between.
+ */
+static uint64_t subtree_blocks(uint64_t nptr, unsigned level, uint64_t m) {
+	uint64_t n = 1 + m, span = 1;
+	unsigned k;
+
+	for (k = 0; k < level; k++) {
+		span *= nptr;
+		n += DIV_UP(m, span);
+	}
+	return n;
+}
+
+/*
+ * Writes an indirect block of (level) at lbn (lbn), for the (m) data blocks
+ * after it, and the indirect blocks between them. It goes before them in
+ * the log, so the addresses it holds are the ones plan_blocks() says they
+ * will have; they are set in (blk_ptrs) too.
+ */
+static int write_indirect_first(struct fs *fs, unsigned level, uint64_t m,
+				int64_t lbn, char *blk_ptrs, int64_t *off,
+				union lfs_dinode *inode) {
+	uint64_t nptr = NPTR(fs), span = 1, child, n, c;
+	uint64_t nblocks = subtree_blocks(nptr, level, m);
+	int64_t *daddrs = malloc(nblocks * sizeof(*daddrs));
+	unsigned k;
+	int ret;
+
+	if (daddrs == NULL)
+		return ENOMEM;
+	for (k = 0; k < level; k++)
+		span *= nptr;
+	child = level == 0 ? 1 : subtree_blocks(nptr, level - 1, span);
+	n = DIV_UP(m, span);
+	memset(blk_ptrs, 0, fs->lfs.dlfs_bsize);
+
+	ret = plan_blocks(fs, nblocks, daddrs);
+	if (ret == 0) {
+		for (c = 0; c < n; c++)
+			DADDR_SET(fs->is64, blk_ptrs, c, daddrs[1 + c * child]);
+		ret = write_single_indirect(fs, &fs->ifile, blk_ptrs, n, lbn,
+					    off, inode);
+	}
+	assert(ret != 0 || *off == daddrs[0]);
+	free(daddrs);
+	return ret;
+}
+
+/*
+ * With fs->iblocks_first: writes the indirect blocks that go before the data
+ * blocks of the (g)th single indirect block, of the (nblocks) of the file.
+ * That single indirect block, with its pointers in (blk_ptrs), and the
+ * double and triple ones that start there. (upper) keeps the last double
+ * and triple ones written.
+ */
+static int write_iblocks_first(struct fs *fs, char *blk_ptrs,
+			       uint64_t nblocks, uint64_t g, char *upper,
+			       union lfs_dinode *inode) {
+	uint64_t nptr = NPTR(fs), bsize = fs->lfs.dlfs_bsize;
+	uint64_t left = nblocks - ULFS_NDADDR - g * nptr, j;
+	int64_t lbn2 = -(int64_t)(ULFS_NDADDR + nptr + 1);
+	int64_t lbn3 = -(int64_t)(ULFS_NDADDR + nptr + nptr * nptr + 2);
+	int is64 = fs->is64;
+	int64_t iblk;
+	int ret;
+
+	if (g == 1) {
+		ret = write_indirect_first(fs, 1, MIN(left, nptr * nptr),
+					   lbn2, upper, &iblk, inode);
+		if (ret != 0)
+			return ret;
+		U_SET(is64, inode, di_ib[1], iblk);
+	}
+	if (g == 1 + nptr) {
+		ret = write_indirect_first(fs, 2,
+					   MIN(left, nptr * nptr * nptr), lbn3,
+					   upper + bsize, &iblk, inode);
+		if (ret != 0)
+			return ret;
+		U_SET(is64, inode, di_ib[2], iblk);
+	}
+	if (g >= 1 + nptr && (g - 1 - nptr) % nptr == 0) {
+		j = (g - 1 - nptr) / nptr;
+		ret = write_indirect_first(fs, 1, MIN(left, nptr * nptr),
+					   lbn3 + 1 - (int64_t)(j * nptr * nptr),
+					   upper, &iblk, inode);
+		if (ret != 0)
+			return ret;
+		/* Where the triple indirect block says */
+		assert(iblk == DADDR_GET(is64, upper + bsize, j));
+	}
+
+	if (g == 0) {
+		ret = write_indirect_first(fs, 0, MIN(left, nptr),
+					   -ULFS_NDADDR, blk_ptrs, &iblk,
+					   inode);
+		if (ret == 0)
+			U_SET(is64, inode, di_ib[0], iblk);
+		return ret;
+	}
+	j = (g - 1) % nptr;
+	ret = write_indirect_first(
+	    fs, 0, MIN(left, nptr),
+	    (g <= nptr ? lbn2 : lbn3 + 1 - (int64_t)((g - 1 - nptr) / nptr *
+						      nptr * nptr)) +
+		1 - (int64_t)(j * nptr),
+	    blk_ptrs, &iblk, inode);
+	/* Where the double indirect block says */
+	assert(ret != 0 || iblk == DADDR_GET(is64, upper, j));
+	return ret;
+}
+
+/* Writes (inode) in an inode block of its own, at the head of the log. */
+static int write_inode(struct fs *fs, union lfs_dinode *inode) {
+	struct _ifile *ifile = &fs->ifile;
+	int is64 = fs->is64;
+	uint64_t inumber = U_GET(is64, inode, di_inumber);
+	SEGUSE *segusage;
+	int ret;
+
+	ret = reserve_inode(fs, ifile);
+	if (ret != 0)
+		return ret;
+	iinfo_add(fs);
+	ret = write_log(fs, inode, DINO_SIZE(is64),
+			FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_offset), 0);
+	if (ret == 0)
+		ret = zero_block_tail(fs,
+				      FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_offset),
+				      DINO_SIZE(is64));
+	if (ret != 0)
+		return ret;
+
+	IFILE *ifile_i = IFILE_GET(fs, inumber);
+	/* we should be writing this for the first time */
+	assert(U_GET(is64, ifile_i, if_daddr) == LFS_UNUSED_DADDR);
+	U_SET(is64, ifile_i, if_daddr, fs->lfs.dlfs_offset);
+	U_SET(is64, ifile_i, if_nextfree, 0);
+	segment_add_datasum(fs, (char *)inode, DINO_SIZE(is64),
+			    fs->lfs.dlfs_bshift);
+	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
+	segusage->su_ninos += 1;
+	segusage->su_nbytes += fs->lfs.dlfs_bsize;
+	return advance_log(fs, ifile, 1);
+}
+
+int write_inodes(struct fs *fs) {
+	uint64_t i;
+	int ret = 0;
+
+	for (i = 0; i < fs->ninodes && ret == 0; i++)
+		ret = write_inode(fs, &fs->inodes[i]);
+	fs->ninodes = 0;
+	return ret;
+}
+
+/*
+ * The data path of write_file(), for a block size of (1 << bshift) and the
+ * LFS32 or LFS64 format. It is always inlined so that write_file() can
+ * instantiate it with a constant bshift and is64 for the common cases.
+ */
+static inline __attribute__((always_inline)) int
+_write_file(struct fs *fs, char *data, uint64_t size, int inumber, int mode,
+	    int nlink, int flags, const unsigned bshift, const int is64) {
+	const uint64_t bsize = 1ULL << bshift;
 	struct _ifile *ifile = &fs->ifile;
-	int32_t nblocks = DIV_UP(size, DFL_LFSBLOCK);
+	int32_t nblocks;
 	uint32_t i, j;
-	int *blk_ptrs;
-	int *indirect_blks = calloc(DFL_LFSBLOCK, num_iblocks(nblocks));
+	char *indirect_blks;
+	int lazy = fs->out != NULL && fs->out->lazy && (mode & LFS_IFREG);
+	const uint64_t nptr = NPTR(fs);
+	char *upper = NULL;
+	union lfs_dinode inode;
 	int ret;
 
+	/* The block size is an option: the file may not fit in an inode */
+	if (DIV_UP(size, bsize) << bshift >= fs->lfs.dlfs_maxfilesize)
+		return EFBIG;
+	nblocks = DIV_UP(size, bsize);
+	indirect_blks = calloc(bsize, num_iblocks(fs, nblocks));
 	assert(indirect_blks);
+	if (fs->iblocks_first && nblocks > ULFS_NDADDR) {
+		upper = calloc(bsize, 2);
+		assert(upper);
+	}
 	SEGUSE *segusage;
 
 	/*
 	 * TODO: We can't enable this at the moment, because the segment size
 	 * is limited to 1 block, and that's not enough for large files.
 	 */
-	add_finfo_inode(fs, size, inumber);
+	ret = ifile_map_grow(fs, inumber);
+	if (ret != 0)
+		return ret;
+	fs->seg.ino = inumber;
 	assert(fs->lfs.dlfs_inopb == 1);
 	fs->lfs.dlfs_dmeta++;
 
-	assert(MAXFILESIZE32 > nblocks * DFL_LFSBLOCK);
-
 	/* Write file inode */
-	struct lfs32_dinode inode = {
-	    .di_mode = mode,
-	    .di_nlink = nlink,
-	    .di_inumber = inumber,
-	    .di_size = size,
-	    .di_atime = time(0),
-	    .di_atimensec = 0,
-	    .di_mtime = time(0),
-	    .di_mtimensec = 0,
-	    .di_ctime = time(0),
-	    .di_ctimensec = 0,
-	    .di_db = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-	    .di_ib = {0, 0, 0},
-	    .di_flags = flags,
-	    .di_blocks = nblocks,
-	    .di_gen = 1,
-	    .di_uid = 0,
-	    .di_gid = 0,
-	    .di_modrev = 0};
-
-	ifile->cleanerinfo->free_head++;
+	init_dinode(&inode, inumber, mode, nlink, size, nblocks, flags,
+		    fs_time(fs), is64);
 
 	off_t pending;
 	for (pending = size, i = 0; pending > 0;) {
 		assert(i < nblocks);
-		off_t avail_blocks, curr_nblocks, len;
+		off_t curr_nblocks, len;
+		uint64_t fit, end = nblocks;
+
+		if (upper != NULL && i < ULFS_NDADDR) {
+			end = ULFS_NDADDR;
+		} else if (upper != NULL) {
+			/* Each run of data blocks after their indirect block */
+			uint64_t g = (i - ULFS_NDADDR) / nptr;
+
+			end = MIN(ULFS_NDADDR + (g + 1) * nptr, nblocks);
+			if ((i - ULFS_NDADDR) % nptr == 0) {
+				ret = write_iblocks_first(
+				    fs, indirect_blks + g * bsize, nblocks, g,
+				    upper, &inode);
+				if (ret != 0)
+					return ret;
+			}
+		}
 
-		char *curr_blk = data + (DFL_LFSBLOCK * i);
-		avail_blocks = fs->lfs.dlfs_fsbpseg;
-		avail_blocks -= fs->lfs.dlfs_offset - fs->lfs.dlfs_curseg;
-		assert(avail_blocks > 0 && avail_blocks < fs->lfs.dlfs_fsbpseg);
+		/* As many blocks as the segment and its summary can take */
+		ret = reserve_blocks(fs, ifile, end - i, &fit);
+		if (ret != 0)
+			return ret;
+		assert(fit > 0 && fit < fs->lfs.dlfs_fsbpseg);
 
-		len = MIN(pending, avail_blocks * DFL_LFSBLOCK);
-		curr_nblocks = DIV_UP(len, DFL_LFSBLOCK);
-		assert(len <= avail_blocks * DFL_LFSBLOCK && len > 0);
-		assert(curr_nblocks <= avail_blocks && curr_nblocks > 0);
+		char *curr_blk = data + (i << bshift);
+		len = MIN(pending, (off_t)fit << bshift);
+		curr_nblocks = (len + bsize - 1) >> bshift;
+		assert(len <= ((off_t)fit << bshift) && len > 0);
+		assert(curr_nblocks <= fit && curr_nblocks > 0);
 
-		segment_add_datasum(&fs->seg, curr_blk, len);
+		finfo_add_blocks(fs, i, curr_nblocks);
+		segment_add_datasum(fs, lazy ? NULL : curr_blk, len, bshift);
 
 		write_log(fs, curr_blk, len,
-			FSBLOCK_TO_BYTES(fs->lfs.dlfs_offset),
+			(uint64_t)fs->lfs.dlfs_offset << bshift,
 			mode & LFS_IFREG ? 1 : 0);
+		ret = zero_block_tail(fs, (uint64_t)fs->lfs.dlfs_offset << bshift,
+				      len);
+		if (ret != 0)
+			return ret;
 
 		for (j = 0; j < curr_nblocks; j++, i++) {
 			if (i < ULFS_NDADDR) {
-				inode.di_db[i] = fs->lfs.dlfs_offset + j;
+				U_SET(is64, &inode, di_db[i],
+				      fs->lfs.dlfs_offset + j);
+			} else if (upper != NULL) {
+				/* Where write_iblocks_first() said */
+				assert(DADDR_GET(is64, indirect_blks,
+						 i - ULFS_NDADDR) ==
+				       fs->lfs.dlfs_offset + j);
 			} else {
-				indirect_blks[i - ULFS_NDADDR] = fs->lfs.dlfs_offset + j;
+				DADDR_SET(is64, indirect_blks, i - ULFS_NDADDR,
+					  fs->lfs.dlfs_offset + j);
 			}
 		}
 
 		segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-		segusage->su_nbytes += curr_nblocks * DFL_LFSBLOCK;
+		segusage->su_nbytes += curr_nblocks << bshift;
 		ret = advance_log(fs, ifile, curr_nblocks);
 		if (ret != 0)
 			return ret;
@@ -848,67 +1713,66 @@ int write_file(struct fs *fs, char *data, uint64_t size, int inumber, int mode,
 
 	nblocks -= MIN(nblocks, ULFS_NDADDR);
 	assert(nblocks >= 0);
-	blk_ptrs = indirect_blks;
+	/* With iblocks_first, they are all written already */
+	ret = upper != NULL ? 0
+			    : write_indirect_blocks(fs, ifile, indirect_blks,
+						    nblocks, &inode);
+	free(indirect_blks);
+	free(upper);
+	if (ret != 0)
+		return ret;
 
-	if (nblocks > 0) {
-		uint32_t _nblocks = MIN(nblocks, NPTR32);
-		ret = write_single_indirect(fs, ifile, blk_ptrs, _nblocks,
-					&inode.di_ib[0], &inode);
-		if (ret != 0)
-			return ret;
-		nblocks -= _nblocks;
-		blk_ptrs += _nblocks;
+	if (fs->defer_inodes) {
+		if (fs->ninodes == fs->inodes_cap) {
+			fs->inodes_cap = fs->inodes_cap ? fs->inodes_cap * 2
+							: 256;
+			fs->inodes = realloc(fs->inodes,
+					     fs->inodes_cap * sizeof(inode));
+			if (fs->inodes == NULL)
+				return ENOMEM;
+		}
+		fs->inodes[fs->ninodes++] = inode;
+		/* The next file's blocks go in a FINFO of their own */
+		finfo_close(fs);
+		return 0;
 	}
+	return write_inode(fs, &inode);
+}
 
-	if (nblocks > 0) {
-		uint32_t _nblocks = MIN(nblocks, NPTR32 * NPTR32);
-		ret = write_double_indirect(fs, ifile, blk_ptrs, _nblocks,
-					&inode.di_ib[1], &inode);
-		if (ret != 0)
-			return ret;
-		nblocks -= _nblocks;
-		blk_ptrs += _nblocks;
+int write_file(struct fs *fs, char *data, uint64_t size, int inumber, int mode,
+		int nlink, int flags) {
+	/*
+	 * The common block sizes get their own copy of the data path for
+	 * each format, with all the block math done with constant shifts and
+	 * masks, and no 32/64-bit checks.
+	 */
+#define _WRITE_FILE(_bshift, _is64)                                            \
+	_write_file(fs, data, size, inumber, mode, nlink, flags, (_bshift),    \
+		    (_is64))
+	if (fs->is64) {
+		switch (fs->lfs.dlfs_bshift) {
+		case SMALL_LFSBLOCK_SHIFT:
+			return _WRITE_FILE(SMALL_LFSBLOCK_SHIFT, 1);
+		case DFL_LFSBLOCK_SHIFT:
+			return _WRITE_FILE(DFL_LFSBLOCK_SHIFT, 1);
+		case LARGE_LFSBLOCK_SHIFT:
+			return _WRITE_FILE(LARGE_LFSBLOCK_SHIFT, 1);
+		default:
+			return _WRITE_FILE(fs->lfs.dlfs_bshift, 1);
+		}
 	}
 
-	if (nblocks > 0) {
-		uint32_t _nblocks = MIN(nblocks, NPTR32 * NPTR32 * NPTR32);
-		ret = write_triple_indirect(fs, ifile, blk_ptrs, _nblocks,
-					&inode.di_ib[2], &inode);
-		if (ret != 0)
-			return ret;
-		nblocks -= _nblocks;
-		blk_ptrs += _nblocks;
+	switch (fs->lfs.dlfs_bshift) {
+	case SMALL_LFSBLOCK_SHIFT:
+		return _WRITE_FILE(SMALL_LFSBLOCK_SHIFT, 0);
+	case DFL_LFSBLOCK_SHIFT:
+		return _WRITE_FILE(DFL_LFSBLOCK_SHIFT, 0);
+	case LARGE_LFSBLOCK_SHIFT:
+		return _WRITE_FILE(LARGE_LFSBLOCK_SHIFT, 0);
+	default:
+		return _WRITE_FILE(fs->lfs.dlfs_bshift, 0);
 	}
-
-	assert(nblocks == 0);
-
-	/* Write the inode */
-	ret = write_log(fs, &inode, sizeof(inode),
-			FSBLOCK_TO_BYTES(fs->lfs.dlfs_offset), 0);
-	if (ret != 0)
-		return ret;
-
-	assert(inumber < MAX_INODES);
-	
-	IFILE32 *ifile_i = IFILE_GET(fs, inumber);
-	/* we should be writing this for the first time */
-	assert(ifile_i->if_daddr == LFS_UNUSED_DADDR);
-	ifile_i->if_daddr = fs->lfs.dlfs_offset;
-	ifile_i->if_nextfree = 0;
-	segment_add_datasum(&fs->seg, (char *)&inode, DFL_LFSBLOCK);
-	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-	segusage->su_ninos += 1;
-	segusage->su_nbytes += DFL_LFSBLOCK;
-	ret = advance_log(fs, ifile, 1);
-	if (ret != 0)
-		return ret;
-
-	if (inumber > fs->lfs.dlfs_freehd)
-		fs->lfs.dlfs_freehd = inumber;
-
-	free(indirect_blks);
-
-	return 0;
+#undef _WRITE_FILE
 }
 
 /*
@@ -917,63 +1781,67 @@ int write_file(struct fs *fs, char *data, uint64_t size, int inumber, int mode,
  */
 int write_ifile_content(struct fs *fs, struct _ifile *ifile,
 			 uint32_t nblocks) {
+	uint32_t bsize = fs->lfs.dlfs_bsize;
+	int is64 = fs->is64;
 	uint32_t i;
 	off_t inode_lbn;
-	int indirect_blk[DFL_LFSBLOCK / sizeof(int)];
+	char *indirect_blks;
 	int inumber = LFS_IFILE_INUM;
+	union lfs_dinode inode;
+	uint64_t fit;
 	int ret;
 
-	add_finfo_inode(fs, nblocks * DFL_LFSBLOCK, inumber);
+	if (FSBLOCK_TO_BYTES(fs, nblocks) >= fs->lfs.dlfs_maxfilesize)
+		return EFBIG;
+	indirect_blks = calloc(bsize, num_iblocks(fs, nblocks));
+	assert(indirect_blks);
+
+	fs->seg.ino = inumber;
 	assert(fs->lfs.dlfs_inopb == 1);
 	fs->lfs.dlfs_dmeta++;
 
-	/* TODO: only have single indirect disk blocks */
-	assert(nblocks <= ULFS_NDADDR + NPTR32);
-	assert(MAXFILESIZE32 > nblocks * DFL_LFSBLOCK);
-
 	/* Write ifile inode */
-	struct lfs32_dinode inode = {
-	    .di_mode = LFS_IFREG | 0600,
-	    .di_nlink = 1,
-	    .di_inumber = LFS_IFILE_INUM,
-	    .di_size = nblocks * DFL_LFSBLOCK,
-	    .di_atime = time(0),
-	    .di_atimensec = 0,
-	    .di_mtime = time(0),
-	    .di_mtimensec = 0,
-	    .di_ctime = time(0),
-	    .di_ctimensec = 0,
-	    .di_db = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},
-	    .di_ib = {0, 0, 0},
-	    .di_flags = SF_IMMUTABLE,
-	    .di_blocks = nblocks,
-	    .di_gen = 1,
-	    .di_uid = 0,
-	    .di_gid = 0,
-	    .di_modrev = 0};
-
-	ifile->cleanerinfo->free_head++;
-
-	IFILE32 *ifile_i = IFILE_GET(fs, inumber);
-	ifile_i->if_daddr = fs->lfs.dlfs_offset;
-	ifile_i->if_nextfree = 0;
+	init_dinode(&inode, LFS_IFILE_INUM, LFS_IFREG | 0600, 1,
+		    FSBLOCK_TO_BYTES(fs, nblocks), nblocks, SF_IMMUTABLE,
+		    fs_time(fs), is64);
+
+	/* write_ifile() made room for it already */
+	ret = reserve_inode(fs, ifile);
+	if (ret != 0)
+		return ret;
+	assert(fs->lfs.dlfs_offset == fs->lfs.dlfs_idaddr);
+	iinfo_add(fs);
+
+	IFILE *ifile_i = IFILE_GET(fs, inumber);
+	U_SET(is64, ifile_i, if_daddr, fs->lfs.dlfs_offset);
+	U_SET(is64, ifile_i, if_nextfree, 0);
 	inode_lbn = fs->lfs.dlfs_offset;
-	segment_add_datasum(&fs->seg, (char *)&inode, DFL_LFSBLOCK);
+	segment_add_datasum(fs, (char *)&inode, DINO_SIZE(is64),
+			    fs->lfs.dlfs_bshift);
 
 	/* This block is accounted for the inode. */
 	ret = advance_log(fs, ifile, 1);
 	if (ret != 0)
 		return ret;
 
-	for (i = 0; i < nblocks; i++) {
-		char *curr_blk = ifile->data + (DFL_LFSBLOCK * i);
-		segment_add_datasum(&fs->seg, curr_blk, DFL_LFSBLOCK);
-		write_log(fs, curr_blk, DFL_LFSBLOCK, FSBLOCK_TO_BYTES(fs->lfs.dlfs_offset), 0);
+	for (i = 0, fit = 0; i < nblocks; i++, fit--) {
+		char *curr_blk = ifile_block(fs, i);
+
+		if (fit == 0) {
+			ret = reserve_blocks(fs, ifile, nblocks - i, &fit);
+			if (ret != 0)
+				return ret;
+			finfo_add_blocks(fs, i, fit);
+		}
+		segment_add_datasum(fs, curr_blk, bsize, fs->lfs.dlfs_bshift);
+		write_log(fs, curr_blk, bsize,
+			  FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_offset), 0);
 
 		if (i < ULFS_NDADDR) {
-			inode.di_db[i] = fs->lfs.dlfs_offset;
+			U_SET(is64, &inode, di_db[i], fs->lfs.dlfs_offset);
 		} else {
-			indirect_blk[i - ULFS_NDADDR] = fs->lfs.dlfs_offset;
+			DADDR_SET(is64, indirect_blks, i - ULFS_NDADDR,
+				  fs->lfs.dlfs_offset);
 		}
 		/* Adding segusage[fs->seg.seg_number].su_nbytes here has no
 		effect,
@@ -983,171 +1851,1322 @@ int write_ifile_content(struct fs *fs, struct _ifile *ifile,
 			return ret;
 	}
 
+	/*
+	 * Same for the indirect blocks: write_ifile() already counted them in
+	 * su_nbytes, and the segusage table is on disk by now.
+	 */
 	nblocks -= MIN(nblocks, ULFS_NDADDR);
-
-	if (nblocks > 0) {
-		uint32_t _nblocks = MIN(nblocks, NPTR32);
-		assert(_nblocks <= NPTR32);
-		inode.di_ib[0] = fs->lfs.dlfs_offset;
-		ret = write_log(fs, indirect_blk, DFL_LFSBLOCK,
-				FSBLOCK_TO_BYTES(fs->lfs.dlfs_offset), 0);
-		if (ret != 0)
-			return ret;
-		segment_add_datasum(&fs->seg, (char *)indirect_blk, DFL_LFSBLOCK);
-		ret = advance_log(fs, ifile, 1);
-		if (ret != 0)
-			return ret;
-		nblocks -= _nblocks;
-		inode.di_blocks++;
-	}
-	assert(nblocks == 0);
+	ret = write_indirect_blocks(fs, ifile, indirect_blks, nblocks, &inode);
+	if (ret != 0)
+		return ret;
+	free(indirect_blks);
 
 	/* Write the inode (and indirect block) */
-	ret = write_log(fs, &inode, sizeof(inode), FSBLOCK_TO_BYTES(inode_lbn), 0);
+	ret = write_log(fs, &inode, DINO_SIZE(is64),
+			FSBLOCK_TO_BYTES(fs, inode_lbn), 0);
+	if (ret == 0)
+		ret = zero_block_tail(fs, FSBLOCK_TO_BYTES(fs, inode_lbn),
+				      DINO_SIZE(is64));
 	if (ret != 0)
 		return ret;
 
 	return 0;
 }
 
-int write_ifile(struct fs *fs) {
-	int nblocks = fs->lfs.dlfs_cleansz + fs->lfs.dlfs_segtabsz + IFILE_MAP_SZ;
-	int all_blocks;
-	struct _ifile *ifile = &fs->ifile;
-	SEGUSE *segusage;
-	int avail_blocks;
-	int curr_seg;
-	int ret;
+/*
+ * Layout model used by estimate_lfs() and write_ifile(). It follows the
+ * same rules as advance_log(), start_segment(), reserve_blocks() and
+ * reserve_inode(), without writing anything.
+ */
+struct est_log {
+	struct fs	*fs;
+	uint64_t	seg;		/* current segment */
+	uint64_t	offset;		/* next free block */
+	uint64_t	nblocks;	/* blocks the log moved past */
+	uint64_t	sum_left;	/* bytes left in the segment summary */
+	uint32_t	nsums;		/* partial segments in the segment */
+	uint64_t	nstarted;	/* segments started */
+	uint64_t	first;		/* segment the model started in */
+	int		wrapped;	/* went past the last segment */
+	int		has_finfo;	/* the current file has a FINFO */
+	uint32_t	sb_interval;	/* 0: where the sboffs of fs say */
+	int		segusage;	/* account the blocks in the SEGUSE table */
+};
+
+/* The SEGUSE entry to account the current segment in, if any. */
+static SEGUSE *est_segusage(struct est_log *log) {
+	if (!log->segusage || log->seg >= log->fs->nsegs)
+		return NULL;
+	return SEGUSE_GET(log->fs, log->seg);
+}
 
-	avail_blocks = fs->lfs.dlfs_fsbpseg;
-	avail_blocks -= fs->lfs.dlfs_offset - fs->lfs.dlfs_curseg;
-	assert(avail_blocks > 0 && avail_blocks < fs->lfs.dlfs_fsbpseg);
+/* Whether the current segment starts with a superblock. */
+static int est_superblock(struct est_log *log) {
+	struct fs *fs = log->fs;
+	uint32_t i;
 
-	/* Having the ifile span two segments is kind of tricky. So,
-	 * if we can't fit it into the current segment, just advance
-	 * to the next one. */
-	if (nblocks > avail_blocks) {
-		uint32_t curr = fs->seg.seg_number;
-		while (fs->seg.seg_number == curr) {
-			ret = advance_log_by_one(fs, ifile);
-			if (ret != 0)
-				return ret;
-		}
+	if (log->sb_interval != 0)
+		return log->seg % log->sb_interval == 0 &&
+		       log->seg / log->sb_interval < LFS_MAXNUMSB;
+	for (i = 0; i < LFS_MAXNUMSB; i++) {
+		if (i > 0 && fs->lfs.dlfs_sboffs[i] == 0)
+			break;
+		if (fs->lfs.dlfs_sboffs[i] / fs->lfs.dlfs_fsbpseg == log->seg)
+			return 1;
 	}
+	return 0;
+}
 
-	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-	segusage->su_ninos += 1;
+static void est_start_segment(struct est_log *log) {
+	struct fs *fs = log->fs;
+	SEGUSE *segusage;
 
-	/* Every segment has a counter of used bytes (su_nbytes), which
-	 * is written as part of the ifile. The ifile itself uses some bytes,
-	 * so we have to update the counter before writing the ifile.
-	 */
-	all_blocks = nblocks + 1; /* + 1 for the inode */
-	all_blocks += nblocks > ULFS_NDADDR ? 1 : 0; /* indirect block */
-	for (curr_seg = fs->seg.seg_number; all_blocks > 0; curr_seg++) {
-		segusage = SEGUSE_GET(fs, curr_seg);
-		segusage->su_nbytes += DFL_LFSBLOCK * MIN(all_blocks,
-						  fs->lfs.dlfs_fsbpseg - 1);
-		all_blocks -= MIN(all_blocks, fs->lfs.dlfs_fsbpseg - 1);
+	log->offset = SEGS_TO_FSBLOCKS(fs, log->seg);
+	if (log->seg == 0)
+		log->offset += LABEL_FSBLOCKS(fs);
+	if (est_superblock(log))
+		log->offset += SB_FSBLOCKS(fs);
+	log->offset += SUM_FSBLOCKS(fs);
+	log->nblocks += log->offset - SEGS_TO_FSBLOCKS(fs, log->seg);
+	log->sum_left = fs->lfs.dlfs_sumsize - SEGSUM_HDR_SIZE(fs->is64);
+	log->nsums = 1;
+	log->has_finfo = 0;
+
+	/* What start_segment() will set */
+	if ((segusage = est_segusage(log)) != NULL) {
+		segusage->su_flags &= SEGUSE_SUPERBLOCK;
+		segusage->su_flags |= SEGUSE_ACTIVE | SEGUSE_DIRTY;
+		segusage->su_nsums = log->nsums;
 	}
+}
 
-	/* point to ifile inode */
-	fs->lfs.dlfs_idaddr = fs->lfs.dlfs_offset;
+/* Blocks left in the current segment. */
+static uint64_t est_avail(struct est_log *log) {
+	return SEGS_TO_FSBLOCKS(log->fs, log->seg + 1) - log->offset;
+}
 
-	IFILE32 *ifile_i = IFILE_GET(fs, LFS_IFILE_INUM);
-	ifile_i->if_daddr = fs->lfs.dlfs_idaddr;
-	ifile_i->if_nextfree = 0;
+/* Starts the model where the log of (fs) is now. */
+static void est_init(struct est_log *log, struct fs *fs) {
+	log->fs = fs;
+	log->seg = fs->seg.seg_number;
+	log->offset = fs->lfs.dlfs_offset;
+	log->nblocks = 0;
+	log->sum_left = fs->seg.sum_bytes_left;
+	log->nsums = fs->seg.nsums;
+	log->nstarted = 0;
+	log->first = log->seg;
+	log->wrapped = 0;
+	log->has_finfo = fs->seg.fi_nblocks > 0;
+	log->sb_interval = 0;
+	log->segusage = 0;
+}
 
-	/* IFILE/CLEANER INFO */
-	ifile->cleanerinfo->clean = fs->lfs.dlfs_nclean;
-	ifile->cleanerinfo->dirty = fs->lfs.dlfs_curseg + 1;
-	ifile->cleanerinfo->bfree = fs->lfs.dlfs_bfree;
-	ifile->cleanerinfo->avail = fs->lfs.dlfs_avail;
-	assert(ifile->cleanerinfo->free_tail == (MAX_INODES - 1));
-	assert(fs->lfs.dlfs_cleansz == 1);
+/*
+ * See start_segment(). The segments started by the model are not marked in
+ * use, so after wrapping around it stops short of the first one. The rest
+ * of the current segment is skipped, see advance_log_by_one().
+ */
+static void est_next_segment(struct est_log *log) {
+	uint64_t next = next_log_segment(log->fs, log->seg + 1);
+
+	log->nblocks += est_avail(log);
+
+	if (next <= log->seg)
+		log->wrapped = 1;
+	if (log->wrapped && next >= log->first && next < log->fs->nsegs)
+		next = log->fs->nsegs;
+	log->seg = next;
+	log->nstarted++;
+	est_start_segment(log);
+}
 
-	/* IFILE/SEGUSE */
-	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
-	assert(segusage->su_nsums == 1);
-	assert(segusage->su_lastmod == 0);
-	assert((fs->nsegs * sizeof(SEGUSE)) <
-	       (fs->lfs.dlfs_segtabsz * DFL_LFSBLOCK));
+/* See next_partial_segment(). */
+static void est_next_partial_segment(struct est_log *log) {
+	struct fs *fs = log->fs;
+	SEGUSE *segusage;
 
-	/* IFILE/INODE MAP */
-	return write_ifile_content(fs, ifile, nblocks);
+	log->has_finfo = 0;
+	if (est_avail(log) <= SUM_FSBLOCKS(fs)) {
+		est_next_segment(log);
+		return;
+	}
+	log->offset += SUM_FSBLOCKS(fs);
+	log->nblocks += SUM_FSBLOCKS(fs);
+	log->sum_left = fs->lfs.dlfs_sumsize - SEGSUM_HDR_SIZE(fs->is64);
+	log->nsums++;
+	if ((segusage = est_segusage(log)) != NULL)
+		segusage->su_nsums = log->nsums;
 }
 
-int init_lfs(struct fs *fs, uint64_t nbytes) {
-	uint64_t resvseg;
-	struct dlfs *lfs = &fs->lfs;
-	uint64_t nsegs;
-	int ret;
-
-	fs->lfs = dlfs32_default;
+/* Moves past (nr) blocks, all in the current segment. */
+static void est_step(struct est_log *log, uint64_t nr) {
+	assert(nr <= est_avail(log));
+	log->offset += nr;
+	log->nblocks += nr;
+	if (est_avail(log) == 0)
+		est_next_segment(log);
+}
 
-	fs->nbytes = nbytes;
-	fs->nsegs = nsegs = ((fs->nbytes / DFL_LFSSEG) - 1);
-	resvseg = (((nsegs / DFL_MIN_FREE_SEGS) / 2) + 1);
-
-	lfs->dlfs_size = nbytes / DFL_LFSBLOCK;
-	lfs->dlfs_dsize = ((uint64_t)(nsegs - nsegs / DFL_MIN_FREE_SEGS) *
-			       (uint64_t)DFL_LFSSEG -
-			   DFL_LFSBLOCK * (uint64_t)NSUPERBLOCKS) /
-			  DFL_LFSBLOCK;
-	lfs->dlfs_lastseg = (nbytes - 2 * (uint64_t)DFL_LFSSEG) / DFL_LFSBLOCK;
-	lfs->dlfs_bfree = ((nsegs - nsegs / DFL_MIN_FREE_SEGS) * DFL_LFSSEG -
-			   DFL_LFSBLOCK * NSUPERBLOCKS) /
-			  DFL_LFSBLOCK;
-	lfs->dlfs_avail =
-	    SEGS_TO_FSBLOCKS((nbytes / (uint64_t)DFL_LFSSEG) - resvseg) -
-	    NSUPERBLOCKS;
-	lfs->dlfs_nseg = nsegs;
-	lfs->dlfs_segtabsz = ((nsegs + DFL_LFSBLOCK / sizeof(SEGUSE) - 1) /
-			      (DFL_LFSBLOCK / sizeof(SEGUSE)));
+/*
+ * Logs the next (nr) blocks of a file, see reserve_blocks(). Returns the
+ * number of times they are not contiguous, because of a segment or partial
+ * segment boundary.
+ */
+static uint64_t est_blocks(struct est_log *log, uint64_t nr) {
+	struct fs *fs = log->fs;
+	uint64_t breaks = 0, end = 0;
+	SEGUSE *segusage;
 
-	/*
-	 * write_ifile() currently doesn't support writing an ifile that spans
-	 * more than one segment. Check that we won't get into that situation
-	 * The "1 + 2" are for the inode, a segment summary, and a potential
-	 * superblock.
-	 */
-	int nblocks = fs->lfs.dlfs_cleansz + fs->lfs.dlfs_segtabsz + 1 + 2;
-	assert(nblocks < fs->lfs.dlfs_fsbpseg);
+	while (nr > 0) {
+		uint64_t n = pseg_fit(nr, est_avail(log), log->sum_left,
+				      log->has_finfo, fs->is64);
+		if (n == 0) {
+			est_next_partial_segment(log);
+			continue;
+		}
+		if (end != 0 && log->offset != end)
+			breaks++;
+		if (!log->has_finfo)
+			log->sum_left -= FINFO_SIZE(fs->is64);
+		log->has_finfo = 1;
+		log->sum_left -= n * DADDR_SIZE(fs->is64);
+		if ((segusage = est_segusage(log)) != NULL)
+			segusage->su_nbytes += FSBLOCK_TO_BYTES(fs, n);
+		nr -= n;
+		end = log->offset + n;
+		est_step(log, n);
+	}
+	return breaks;
+}
 
-	if (lfs->dlfs_lastseg >= SEGS_TO_FSBLOCKS(nsegs))
-		return ENOSPC;
+/* See reserve_inode(). */
+static void est_reserve_inode(struct est_log *log) {
+	log->has_finfo = 0;
+	while (log->sum_left < IINFO_SIZE(log->fs->is64))
+		est_next_partial_segment(log);
+}
 
-	lfs->dlfs_nclean = nsegs;
-	lfs->dlfs_minfreeseg = (nsegs / DFL_MIN_FREE_SEGS);
-	lfs->dlfs_resvseg = resvseg;
+/* Logs an inode block. */
+static void est_inode(struct est_log *log) {
+	SEGUSE *segusage;
 
-	/* This mem is freed at exit time. */
-	assert(lfs->dlfs_sumsize >= DFL_LFSBLOCK);
-	assert(lfs->dlfs_sumsize % DFL_LFSBLOCK == 0);
-	fs->seg.segsum = calloc(1, lfs->dlfs_sumsize);
-	assert(fs->seg.segsum);
+	est_reserve_inode(log);
+	log->sum_left -= IINFO_SIZE(log->fs->is64);
+	if ((segusage = est_segusage(log)) != NULL) {
+		segusage->su_ninos += 1;
+		segusage->su_nbytes += log->fs->lfs.dlfs_bsize;
+	}
+	est_step(log, 1);
+}
 
-	/* XXX: These make things a lot simpler. */
-	assert(DFL_LFSFRAG == DFL_LFSBLOCK);
-	assert(fs->lfs.dlfs_fsbpseg > (2 + 6 + 2));
-	assert(fs->lfs.dlfs_fsbpseg < MAX_BLOCKS_PER_SEG);
-	assert(fs->lfs.dlfs_cleansz == 1);
+/*
+ * Links every unused entry of the inode map into the free list, in order.
+ * Like in a new map, the last one points past the end of the map, to the
+ * inodes it grows into.
+ */
+static void ifile_free_list(struct fs *fs) {
+	uint64_t i, head = MAX_INODES(fs), tail = LFS_UNUSED_INUM;
+	int is64 = fs->is64;
+
+	for (i = MAX_INODES(fs) - 1; i > LFS_UNUSED_INUM; i--) {
+		IFILE *ifile_i = IFILE_GET(fs, i);
+
+		if (U_GET(is64, ifile_i, if_daddr) != LFS_UNUSED_DADDR)
+			continue;
+		U_SET(is64, ifile_i, if_nextfree, head);
+		if (tail == LFS_UNUSED_INUM)
+			tail = i;
+		head = i;
+	}
+	U_SET(is64, fs->ifile.cleanerinfo, free_head, head);
+	U_SET(is64, fs->ifile.cleanerinfo, free_tail, tail);
+	fs->lfs.dlfs_freehd = head;
+}
 
-	struct _ifile *ifile = &fs->ifile;
+/*
+ * Grows the inode map until (fs->spare_inodes) of its entries are free, so
+ * that as many files can be created before the ifile has to grow.
+ */
+static int ifile_spare_inodes(struct fs *fs) {
+	uint64_t i, nfree = 0;
+
+	for (i = LFS_IFILE_INUM + 1; i < MAX_INODES(fs); i++)
+		if (U_GET(fs->is64, IFILE_GET(fs, i), if_daddr) ==
+		    LFS_UNUSED_DADDR)
+			nfree++;
+	if (nfree >= fs->spare_inodes)
+		return 0;
+	return ifile_map_grow(fs, MAX_INODES(fs) - 1 + fs->spare_inodes -
+				      nfree);
+}
+
+int write_ifile(struct fs *fs) {
+	uint64_t nblocks;
+	uint64_t all_blocks;
+	struct _ifile *ifile = &fs->ifile;
+	struct est_log log, next;
+	SEGUSE *segusage;
+	int64_t avail;
+	int ret;
+
+	ret = ifile_spare_inodes(fs);
+	if (ret != 0)
+		return ret;
+	nblocks = fs->lfs.dlfs_cleansz + fs->lfs.dlfs_segtabsz + ifile->nmap;
+
+	/* The ifile inode goes first */
+	fs->seg.ino = LFS_IFILE_INUM;
+	ret = reserve_inode(fs, ifile);
+	if (ret != 0)
+		return ret;
+
+	all_blocks = nblocks + 1; /* + 1 for the inode */
+	all_blocks += iblocks_needed(NPTR(fs), nblocks);
+
+	/*
+	 * Keep the ifile in one segment when it fits in one: if it doesn't
+	 * fit in what's left of this segment, but fits in an empty one, skip
+	 * to the next one. Larger ifiles span as many segments as needed,
+	 * starting here.
+	 */
+	est_init(&log, fs);
+	next = log;
+	est_next_segment(&next);
+	if (all_blocks > est_avail(&log) && all_blocks <= est_avail(&next)) {
+		uint32_t curr = fs->seg.seg_number;
+		while (fs->seg.seg_number == curr) {
+			ret = advance_log_by_one(fs, ifile);
+			if (ret != 0)
+				return ret;
+		}
+		est_init(&log, fs);
+	}
+
+	/*
+	 * Every segment has a counter of used bytes (su_nbytes), flags and
+	 * a number of partial segments, which are written as part of the
+	 * ifile. The ifile itself uses some bytes, and maybe some new
+	 * (partial) segments, so we have to update the table before writing
+	 * the ifile.
+	 */
+	log.segusage = 1;
+	est_inode(&log);
+	est_blocks(&log, all_blocks - 1);
+	if (log.seg >= fs->nsegs)
+		return ENOSPC;
+	if (log.nblocks >= (uint64_t)fs->lfs.dlfs_avail)
+		return ENOSPC;
+
+/* point to ifile inode */
+	fs->lfs.dlfs_idaddr = fs->lfs.dlfs_offset;
+
+	IFILE *ifile_i = IFILE_GET(fs, LFS_IFILE_INUM);
+	U_SET(fs->is64, ifile_i, if_daddr, fs->lfs.dlfs_idaddr);
+	U_SET(fs->is64, ifile_i, if_nextfree, 0);
+
+	/* IFILE/CLEANER INFO, as they will be after writing the ifile */
+	U_SET(fs->is64, ifile->cleanerinfo, clean,
+	      fs->lfs.dlfs_nclean - log.nstarted);
+	U_SET(fs->is64, ifile->cleanerinfo, dirty,
+	      fs->nsegs - (fs->lfs.dlfs_nclean - log.nstarted));
+	U_SET(fs->is64, ifile->cleanerinfo, bfree,
+	      fs->lfs.dlfs_bfree - log.nblocks);
+	U_SET(fs->is64, ifile->cleanerinfo, avail,
+	      fs->lfs.dlfs_avail - log.nblocks);
+	ifile_free_list(fs);
+	assert(fs->lfs.dlfs_cleansz == 1);
+
+	/* IFILE/SEGUSE */
+	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
+	assert(segusage->su_nsums >= 1);
+	assert((fs->nsegs * sizeof(SEGUSE)) <=
+	       FSBLOCK_TO_BYTES(fs, fs->lfs.dlfs_segtabsz));
+
+	/* IFILE/INODE MAP */
+	avail = fs->lfs.dlfs_avail;
+	ret = write_ifile_content(fs, ifile, nblocks);
+	if (ret != 0)
+		return ret;
+	assert(fs->lfs.dlfs_offset == log.offset);
+	assert(avail - fs->lfs.dlfs_avail == (int64_t)log.nblocks);
+	assert(fs->seg.seg_number == log.seg);
+
+	return 0;
+}
+
+int estimate_lfs(uint64_t nbytes, const struct lfs_params *params,
+		 const uint64_t *sizes, uint64_t nsizes,
+		 struct lfs_estimate *est) {
+	struct fs fs = {.lfs = dlfs_default, .is64 = params->is64};
+	struct est_log log = {.fs = &fs}, next;
+	uint64_t nsegs, segtabsz, nblocks, i;
+	int ret;
+
+	ret = set_geometry(&fs.lfs, params->bsize, params->ssize, fs.is64);
+	if (ret != 0)
+		return ret;
+	if (nbytes / params->ssize < 2)
+		return ENOSPC;
+
+	nsegs = nbytes / params->ssize - 1;
+	segtabsz = DIV_UP(nsegs, fs.lfs.dlfs_sepb);
+	if (!fs.is64 && nbytes / params->bsize > INT32_MAX)
+		return EFBIG;
+
+	log.sb_interval = sb_interval(nsegs);
+	est_start_segment(&log);
+
+	memset(est, 0, sizeof(*est));
+	for (i = 0; i < nsizes; i++) {
+		uint64_t data = DIV_UP(sizes[i], params->bsize);
+		uint64_t breaks;
+
+		/* See write_file() */
+		if (FSBLOCK_TO_BYTES(&fs, data) >= fs.lfs.dlfs_maxfilesize)
+			return EFBIG;
+		/* data, then indirect blocks, then the inode */
+		nblocks = data + iblocks_needed(fs.lfs.dlfs_nindir, data);
+		breaks = est_blocks(&log, nblocks);
+		est_inode(&log);
+
+		est->nreads += 1 + (data > 0 ? 1 + breaks : 0);
+		est->read_bytes += FSBLOCK_TO_BYTES(&fs, nblocks + 1);
+	}
+
+	/*
+	 * The ifile goes last, see write_ifile(). Inode numbers are used in
+	 * order starting from the root directory, so the inode map has an
+	 * entry up to the last one.
+	 */
+	est_reserve_inode(&log);
+	nblocks = fs.lfs.dlfs_cleansz + segtabsz +
+		  (ULFS_ROOTINO + MAX(nsizes, 1) - 1) / fs.lfs.dlfs_ifpb + 1;
+	if (FSBLOCK_TO_BYTES(&fs, nblocks) >= fs.lfs.dlfs_maxfilesize)
+		return EFBIG;
+	nblocks += iblocks_needed(fs.lfs.dlfs_nindir, nblocks);
+	next = log;
+	est_next_segment(&next);
+	if (nblocks + 1 > est_avail(&log) && nblocks + 1 <= est_avail(&next))
+		log = next;
+	est_inode(&log);
+	est_blocks(&log, nblocks);
+
+	est->nbytes = FSBLOCK_TO_BYTES(&fs, log.offset);
+	return 0;
+}
+
+/*
+ * Reading an existing FS, to add files to it. Only the layout genlfs writes
+ * is supported: blocks without fragments, and one inode per inode block.
+ */
+
+/* Reads (len) bytes of the image at (off), from fs->out if it can. */
+static int read_image(struct fs *fs, void *buf, uint64_t len, uint64_t off) {
+	if (fs->out != NULL && fs->out->read != NULL)
+		return fs->out->read(fs->out, buf, len, off);
+	if (pread64(fs->fd, buf, len, off) != (ssize_t)len)
+		return EIO;
+	return 0;
+}
+
+/* Reads block (daddr), or zeroes for a hole. */
+static int read_block(struct fs *fs, int64_t daddr, void *buf) {
+	uint32_t bsize = fs->lfs.dlfs_bsize;
+
+	if (daddr == LFS_UNUSED_DADDR) {
+		memset(buf, 0, bsize);
+		return 0;
+	}
+	return read_image(fs, buf, bsize, FSBLOCK_TO_BYTES(fs, daddr));
+}
+
+/* Reads the inode (inumber) from the inode block at (daddr). */
+static int read_dinode(struct fs *fs, int64_t daddr, uint64_t inumber,
+		       union lfs_dinode *dino) {
+	int ret;
+
+	ret = read_image(fs, dino, DINO_SIZE(fs->is64),
+			 FSBLOCK_TO_BYTES(fs, daddr));
+	if (ret != 0)
+		return ret;
+	if ((uint64_t)U_GET(fs->is64, dino, di_inumber) != inumber)
+		return EINVAL;
+	return 0;
+}
+
+/* Reads the inode (inumber), and returns in (daddr) where it is. */
+static int read_inode(struct fs *fs, uint64_t inumber, union lfs_dinode *dino,
+		      int64_t *daddr) {
+	if (inumber >= MAX_INODES(fs))
+		return ENOENT;
+	*daddr = U_GET(fs->is64, IFILE_GET(fs, inumber), if_daddr);
+	if (*daddr == LFS_UNUSED_DADDR)
+		return ENOENT;
+	return read_dinode(fs, *daddr, inumber, dino);
+}
+
+/* The disk addresses of the blocks of a file. */
+struct file_map {
+	int64_t		*daddrs;	/* data blocks by lbn, 0 for holes */
+	uint64_t	nblocks;
+	int64_t		*iblks;		/* indirect blocks */
+	uint64_t	niblks;
+};
+
+/*
+ * Adds the blocks under the indirect block (daddr) to (map), from (lbn) up
+ * to (end). (level) is 0 for a single indirect block.
+ */
+static int map_indirect(struct fs *fs, int64_t daddr, unsigned level,
+			uint64_t *lbn, uint64_t end, struct file_map *map) {
+	uint64_t span = NPTR(fs), i;
+	char *blk;
+	int ret;
+
+	for (i = 0; i < level; i++)
+		span *= NPTR(fs);
+	if (daddr == LFS_UNUSED_DADDR) {
+		*lbn = MIN(end, *lbn + span);
+		return 0;
+	}
+
+	blk = malloc(fs->lfs.dlfs_bsize);
+	if (blk == NULL)
+		return ENOMEM;
+	ret = read_block(fs, daddr, blk);
+	map->iblks[map->niblks++] = daddr;
+	for (i = 0; ret == 0 && i < NPTR(fs) && *lbn < end; i++) {
+		int64_t addr = DADDR_GET(fs->is64, blk, i);
+		if (level == 0)
+			map->daddrs[(*lbn)++] = addr;
+		else
+			ret = map_indirect(fs, addr, level - 1, lbn, end, map);
+	}
+	free(blk);
+	return ret;
+}
+
+static int file_map(struct fs *fs, union lfs_dinode *dino,
+		    struct file_map *map) {
+	uint64_t nblocks = DIV_UP((uint64_t)U_GET(fs->is64, dino, di_size),
+				  fs->lfs.dlfs_bsize);
+	uint64_t lbn, i;
+	int ret = 0;
+
+	map->nblocks = nblocks;
+	map->niblks = 0;
+	map->daddrs = calloc(MAX(nblocks, 1), sizeof(int64_t));
+	map->iblks = calloc(MAX(iblocks_needed(NPTR(fs), nblocks), 1),
+			    sizeof(int64_t));
+	if (map->daddrs == NULL || map->iblks == NULL)
+		return ENOMEM;
+
+	for (lbn = 0; lbn < MIN(nblocks, ULFS_NDADDR); lbn++)
+		map->daddrs[lbn] = U_GET(fs->is64, dino, di_db[lbn]);
+	for (i = 0; ret == 0 && i < ULFS_NIADDR && lbn < nblocks; i++)
+		ret = map_indirect(fs, U_GET(fs->is64, dino, di_ib[i]), i, &lbn,
+				   nblocks, map);
+	return ret;
+}
+
+static void file_map_free(struct file_map *map) {
+	free(map->daddrs);
+	free(map->iblks);
+}
+
+/*
+ * Marks the block at (daddr) dead: it doesn't count as live in its segment
+ * anymore, and is free space again (once cleaned).
+ */
+static void kill_block(struct fs *fs, int64_t daddr) {
+	SEGUSE *segusage;
+
+	if (daddr == LFS_UNUSED_DADDR)
+		return;
+	segusage = SEGUSE_GET(fs, daddr / fs->lfs.dlfs_fsbpseg);
+	segusage->su_nbytes -= MIN(segusage->su_nbytes, fs->lfs.dlfs_bsize);
+	fs->lfs.dlfs_bfree++;
+}
+
+/* Marks all the blocks of a file dead, and its inode block at (daddr). */
+static int kill_file(struct fs *fs, union lfs_dinode *dino, int64_t daddr) {
+	struct file_map map;
+	uint64_t i;
+	int ret;
+
+	ret = file_map(fs, dino, &map);
+	if (ret == 0) {
+		for (i = 0; i < map.nblocks; i++)
+			kill_block(fs, map.daddrs[i]);
+		for (i = 0; i < map.niblks; i++)
+			kill_block(fs, map.iblks[i]);
+		kill_block(fs, daddr);
+	}
+	file_map_free(&map);
+	return ret;
+}
+
+/*
+ * Removes file (inumber), so it can be written again with write_file(): its
+ * blocks are dead, and it has no inode in the inode map.
+ */
+int remove_file(struct fs *fs, uint64_t inumber) {
+	union lfs_dinode dino;
+	int64_t daddr;
+	int ret;
+
+	ret = read_inode(fs, inumber, &dino, &daddr);
+	if (ret != 0)
+		return ret;
+	ret = kill_file(fs, &dino, daddr);
+	if (ret != 0)
+		return ret;
+	U_SET(fs->is64, IFILE_GET(fs, inumber), if_daddr, LFS_UNUSED_DADDR);
+	return 0;
+}
+
+/*
+ * Deletes file (inumber): like remove_file(), and the inode number gets a
+ * new version, so its old blocks are not taken for the ones of the next
+ * file with that number.
+ */
+int delete_file(struct fs *fs, uint64_t inumber) {
+	IFILE *ifile_i;
+	int ret;
+
+	ret = remove_file(fs, inumber);
+	if (ret != 0)
+		return ret;
+	ifile_i = IFILE_GET(fs, inumber);
+	U_SET(fs->is64, ifile_i, if_version,
+	      U_GET(fs->is64, ifile_i, if_version) + 1);
+	return 0;
+}
+
+/* Reads the attributes of file (inumber). ENOENT if it is not in use. */
+int stat_file(struct fs *fs, uint64_t inumber, struct lfs_file_info *info) {
+	int is64 = fs->is64;
+	union lfs_dinode dino;
+	int ret;
+
+	ret = read_inode(fs, inumber, &dino, &info->daddr);
+	if (ret != 0)
+		return ret;
+	info->size = U_GET(is64, &dino, di_size);
+	info->mode = U_GET(is64, &dino, di_mode);
+	info->nlink = U_GET(is64, &dino, di_nlink);
+	info->flags = U_GET(is64, &dino, di_flags);
+	return 0;
+}
+
+/*
+ * Reads all of file (inumber) into (*data), which is malloc'ed, and its
+ * attributes into (info).
+ */
+int read_file(struct fs *fs, uint64_t inumber, char **data,
+	      struct lfs_file_info *info) {
+	union lfs_dinode dino;
+	struct file_map map;
+	uint64_t i;
+	int ret;
+
+	*data = NULL;
+	ret = stat_file(fs, inumber, info);
+	if (ret == 0)
+		ret = read_dinode(fs, info->daddr, inumber, &dino);
+	if (ret != 0)
+		return ret;
+
+	ret = file_map(fs, &dino, &map);
+	*data = malloc(MAX(FSBLOCK_TO_BYTES(fs, map.nblocks), 1));
+	if (ret == 0 && *data == NULL)
+		ret = ENOMEM;
+	for (i = 0; ret == 0 && i < map.nblocks; i++)
+		ret = read_block(fs, map.daddrs[i],
+				 *data + FSBLOCK_TO_BYTES(fs, i));
+	file_map_free(&map);
+	if (ret != 0) {
+		free(*data);
+		*data = NULL;
+	}
+	return ret;
+}
+
+/*
+ * Reads the entries of directory (inumber) into (dir), but for "." and "..",
+ * so that more can be added before writing it again.
+ */
+int read_dir(struct fs *fs, uint64_t inumber, struct directory *dir) {
+	int is64 = fs->is64;
+	union lfs_dinode dino;
+	struct file_map map;
+	uint64_t size, off;
+	char name[LFS_MAXNAMLEN + 1];
+	int64_t daddr;
+	char *data;
+	int ret;
+
+	ret = read_inode(fs, inumber, &dino, &daddr);
+	if (ret != 0)
+		return ret;
+	if ((U_GET(is64, &dino, di_mode) & LFS_IFMT) != LFS_IFDIR)
+		return ENOTDIR;
+	size = U_GET(is64, &dino, di_size);
+	if (size > DIRSIZE)
+		return ENFILE;
+
+	ret = file_map(fs, &dino, &map);
+	data = malloc(FSBLOCK_TO_BYTES(fs, map.nblocks) + 1);
+	if (ret == 0 && data == NULL)
+		ret = ENOMEM;
+	for (off = 0; ret == 0 && off < map.nblocks; off++)
+		ret = read_block(fs, map.daddrs[off],
+				 data + FSBLOCK_TO_BYTES(fs, off));
+	file_map_free(&map);
+
+	memset(dir, 0, sizeof(*dir));
+	dir->is64 = is64;
+	for (off = 0; ret == 0 && off < size;) {
+		LFS_DIRHEADER *hdr = (LFS_DIRHEADER *)&data[off];
+		uint16_t reclen = U_GET(is64, hdr, dh_reclen);
+		uint8_t namlen = U_GET(is64, hdr, dh_namlen);
+		uint64_t ino = is64 ? hdr->u_64.dh_inoA |
+					      (uint64_t)hdr->u_64.dh_inoB << 32
+				    : hdr->u_32.dh_ino;
+
+		if (reclen == 0 || off + reclen > size ||
+		    DIRHDR_SIZE(is64) + namlen > reclen) {
+			ret = EINVAL;
+			break;
+		}
+		memcpy(name, &data[off + DIRHDR_SIZE(is64)], namlen);
+		name[namlen] = '\0';
+		off += reclen;
+		if (ino == LFS_UNUSED_INUM || strcmp(name, ".") == 0 ||
+		    strcmp(name, "..") == 0)
+			continue;
+		ret = dir_add_entry(dir, name, ino, U_GET(is64, hdr, dh_type));
+	}
+	free(data);
+	return ret;
+}
+
+/*
+ * Reads the entry at (*off) of (dir) into (name), (inumber) and (type), and
+ * moves (*off) to the next one. Returns ENOENT past the last one.
+ */
+int dir_entry(struct directory *dir, int *off, char *name, uint64_t *inumber,
+	      int *type) {
+	LFS_DIRHEADER *hdr;
+	uint16_t reclen;
+	uint8_t namlen;
+
+	if (*off >= dir->curr)
+		return ENOENT;
+	hdr = DIRHDR(dir, *off);
+	reclen = U_GET(dir->is64, hdr, dh_reclen);
+	namlen = U_GET(dir->is64, hdr, dh_namlen);
+	if (reclen == 0)
+		return ENOENT;
+	memcpy(name, &dir->data[*off + DIRHDR_SIZE(dir->is64)], namlen);
+	name[namlen] = '\0';
+	*inumber = dir->is64 ? hdr->u_64.dh_inoA |
+				       (uint64_t)hdr->u_64.dh_inoB << 32
+			     : hdr->u_32.dh_ino;
+	*type = U_GET(dir->is64, hdr, dh_type);
+	*off += reclen;
+	return 0;
+}
+
+/*
+ * Looks for (name) in (dir). Returns its inode number and type, or 0 if it
+ * isn't there.
+ */
+uint64_t dir_lookup(struct directory *dir, const char *name, int *type) {
+	char entry[LFS_MAXNAMLEN + 1];
+	uint64_t inumber;
+	int off = 0;
+
+	while (dir_entry(dir, &off, entry, &inumber, type) == 0)
+		if (strcmp(entry, name) == 0)
+			return inumber;
+	return 0;
+}
+
+/*
+ * Removes (name) from (dir), which is built again from the other entries.
+ * Returns ENOENT if it isn't there.
+ */
+int dir_remove_entry(struct directory *dir, const char *name) {
+	struct directory *old = malloc(sizeof(*old));
+	char entry[LFS_MAXNAMLEN + 1];
+	uint64_t inumber;
+	int off = 0, type, ret = ENOENT;
+
+	if (old == NULL)
+		return ENOMEM;
+	memcpy(old, dir, sizeof(*old));
+	memset(dir, 0, sizeof(*dir));
+	dir->is64 = old->is64;
+	while (dir_entry(old, &off, entry, &inumber, &type) == 0) {
+		if (strcmp(entry, name) == 0)
+			ret = 0;
+		else
+			dir_add_entry(dir, entry, inumber, type);
+	}
+	free(old);
+	return ret;
+}
+
+/*
+ * Takes an inode number off the free list. Past its end, the inode map
+ * grows when the inode is written.
+ */
+uint64_t alloc_inode(struct fs *fs) {
+	CLEANERINFO *cleanerinfo = fs->ifile.cleanerinfo;
+	uint64_t inumber = U_GET(fs->is64, cleanerinfo, free_head), next;
+
+	if (inumber == LFS_UNUSED_INUM || inumber >= MAX_INODES(fs)) {
+		inumber = MAX(inumber, MAX_INODES(fs));
+		next = inumber + 1;
+	} else {
+		next = U_GET(fs->is64, IFILE_GET(fs, inumber), if_nextfree);
+	}
+	U_SET(fs->is64, cleanerinfo, free_head, next);
+	return inumber;
+}
+
+/*
+ * The data blocks of file (inumber) as runs of consecutive disk addresses,
+ * in lbn order. Holes are runs at LFS_UNUSED_DADDR. (*ext) is malloc'ed.
+ */
+/* Runs of consecutive addresses in (daddrs), holes (0) in runs of their own. */
+static int to_extents(const int64_t *daddrs, uint64_t n,
+		      struct lfs_extent **ext, uint64_t *next) {
+	uint64_t i;
+
+	*next = 0;
+	*ext = malloc(MAX(n, 1) * sizeof(struct lfs_extent));
+	if (*ext == NULL)
+		return ENOMEM;
+	for (i = 0; i < n; i++) {
+		struct lfs_extent *last = *next > 0 ? &(*ext)[*next - 1] : NULL;
+		int64_t next_daddr = LFS_UNUSED_DADDR;
+
+		if (last != NULL && last->daddr != LFS_UNUSED_DADDR)
+			next_daddr = last->daddr + last->len;
+		if (last != NULL && daddrs[i] == next_daddr) {
+			last->len++;
+			continue;
+		}
+		(*ext)[*next].daddr = daddrs[i];
+		(*ext)[*next].len = 1;
+		(*next)++;
+	}
+	return 0;
+}
+
+int file_extents(struct fs *fs, uint64_t inumber, struct lfs_extent **ext,
+		 uint64_t *next) {
+	union lfs_dinode dino;
+	struct file_map map;
+	int64_t daddr;
+	int ret;
+
+	*ext = NULL;
+	*next = 0;
+	ret = read_inode(fs, inumber, &dino, &daddr);
+	if (ret != 0)
+		return ret;
+	ret = file_map(fs, &dino, &map);
+	if (ret == 0)
+		ret = to_extents(map.daddrs, map.nblocks, ext, next);
+	file_map_free(&map);
+	return ret;
+}
+
+int file_iblocks(struct fs *fs, uint64_t inumber, struct lfs_extent **ext,
+		 uint64_t *next) {
+	union lfs_dinode dino;
+	struct file_map map;
+	int64_t daddr;
+	int ret;
+
+	*ext = NULL;
+	*next = 0;
+	ret = read_inode(fs, inumber, &dino, &daddr);
+	if (ret != 0)
+		return ret;
+	ret = file_map(fs, &dino, &map);
+	if (ret == 0)
+		ret = to_extents(map.iblks, map.niblks, ext, next);
+	file_map_free(&map);
+	return ret;
+}
+
+/*
+ * Reads the superblock at byte (off) of (fd) into (lfs), in the 64-bit
+ * layout whatever the format. EINVAL if it is not one, or its checksum is
+ * wrong.
+ */
+int read_superblock(int fd, uint64_t off, struct dlfs64 *lfs) {
+	union {
+		struct dlfs u_32;
+		struct dlfs64 u_64;
+	} sb;
+
+	if (pread64(fd, &sb, sizeof(sb), off) != sizeof(sb))
+		return EIO;
+	if (sb.u_32.dlfs_magic == LFS_MAGIC)
+		dlfs32_to_dlfs(&sb.u_32, lfs);
+	else if (sb.u_64.dlfs_magic == LFS64_MAGIC)
+		*lfs = sb.u_64;
+	else
+		return EINVAL;
+	/* The checksum covers the same bytes in both formats */
+	if (sb.u_32.dlfs_cksum != lfs_sb_cksum32(&sb.u_32) ||
+	    lfs->dlfs_version != LFS_VERSION)
+		return EINVAL;
+	return 0;
+}
+
+/*
+ * Loads the FS in (fs->fd) to add files to it: the superblock, and the
+ * ifile. The log goes on from the last checkpoint, in a new partial
+ * segment. The old ifile is dead from now on, finish_lfs() writes a new one
+ * and a new checkpoint.
+ */
+int load_lfs(struct fs *fs) {
+	struct dlfs64 *lfs = &fs->lfs;
+	struct _ifile *ifile = &fs->ifile;
+	union lfs_dinode dino;
+	struct file_map map;
+	uint64_t nhdr, i;
+	int fd = fs->fd;
+	SEGUSE *segusage;
+	int ret;
+
+	memset(fs, 0, sizeof(*fs));
+	fs->fd = fd;
+	ret = read_superblock(fd, LFS_LABELPAD, lfs);
+	if (ret != 0)
+		return ret;
+	fs->is64 = lfs->dlfs_magic == LFS64_MAGIC;
+	if (lfs->dlfs_fsize != lfs->dlfs_bsize ||
+	    lfs->dlfs_sumsize != lfs->dlfs_bsize ||
+	    lfs->dlfs_ibsize != lfs->dlfs_bsize || lfs->dlfs_inopb != 1 ||
+	    lfs->dlfs_cleansz != 1 || lfs->dlfs_curseg % lfs->dlfs_fsbpseg)
+		return EINVAL;
+
+	fs->nsegs = lfs->dlfs_nseg;
+	fs->nbytes = FSBLOCK_TO_BYTES(fs, lfs->dlfs_size);
+	fs->seg.segsum = calloc(1, lfs->dlfs_sumsize);
+	fs->seg.data_for_cksum = calloc(lfs->dlfs_fsbpseg, sizeof(int32_t));
+	if (fs->seg.segsum == NULL || fs->seg.data_for_cksum == NULL)
+		return ENOMEM;
+
+	/* The ifile: cleanerinfo, segment usage table, and inode map */
+	ret = read_dinode(fs, lfs->dlfs_idaddr, LFS_IFILE_INUM, &dino);
+	if (ret != 0)
+		return ret;
+	nhdr = lfs->dlfs_cleansz + lfs->dlfs_segtabsz;
+	ret = file_map(fs, &dino, &map);
+	if (ret == 0 && map.nblocks <= nhdr)
+		ret = EINVAL;
+	ifile->data = malloc(FSBLOCK_TO_BYTES(fs, lfs->dlfs_cleansz));
+	ifile->cleanerinfo = (CLEANERINFO *)ifile->data;
+	ifile->segusage = calloc(lfs->dlfs_segtabsz, sizeof(char *));
+	ifile->nmap = ifile->nmap_alloc = map.nblocks - nhdr;
+	ifile->ifiles = malloc(FSBLOCK_TO_BYTES(fs, ifile->nmap));
+	if (ret == 0 && (ifile->data == NULL || ifile->segusage == NULL ||
+			 ifile->ifiles == NULL))
+		ret = ENOMEM;
+	for (i = 0; ret == 0 && i < map.nblocks; i++) {
+		char *blk;
+		if (i < lfs->dlfs_cleansz) {
+			blk = ifile->data + FSBLOCK_TO_BYTES(fs, i);
+		} else if (i < nhdr) {
+			blk = malloc(lfs->dlfs_bsize);
+			ifile->segusage[i - lfs->dlfs_cleansz] = blk;
+			if (blk == NULL) {
+				ret = ENOMEM;
+				break;
+			}
+		} else {
+			blk = ifile->ifiles + FSBLOCK_TO_BYTES(fs, i - nhdr);
+		}
+		ret = read_block(fs, map.daddrs[i], blk);
+	}
+	file_map_free(&map);
+	if (ret != 0)
+		return ret;
+
+	/*
+	 * Segments with nothing live in them are clean again, as the cleaner
+	 * would leave them, except segment 0 (it has the label) and the one
+	 * the log is in. This is before the old ifile is dead: it is live
+	 * until the next checkpoint.
+	 */
+	fs->inuse = calloc(DIV_UP(fs->nsegs, 8), 1);
+	if (fs->inuse == NULL)
+		return ENOMEM;
+	for (i = 0; i < fs->nsegs; i++) {
+		segusage = SEGUSE_GET(fs, i);
+		if (!(segusage->su_flags & SEGUSE_DIRTY))
+			continue;
+		if (segusage->su_nbytes == 0 && i != 0 &&
+		    i != lfs->dlfs_curseg / lfs->dlfs_fsbpseg) {
+			segusage->su_flags &= SEGUSE_SUPERBLOCK;
+			segusage->su_flags |= SEGUSE_EMPTY;
+			segusage->su_nsums = 0;
+			segusage->su_ninos = 0;
+			lfs->dlfs_nclean++;
+			lfs->dlfs_avail += lfs->dlfs_fsbpseg;
+			continue;
+		}
+		fs->inuse[i / 8] |= 1 << i % 8;
+	}
+
+	/* The ifile is written again at the checkpoint */
+	ret = kill_file(fs, &dino, lfs->dlfs_idaddr);
+	if (ret != 0)
+		return ret;
+
+	/*
+	 * The log goes on right after the last partial segment, or in the
+	 * next segment if there is no room for another one in this one.
+	 */
+	fs->seg.seg_number = lfs->dlfs_curseg / lfs->dlfs_fsbpseg;
+	segusage = SEGUSE_GET(fs, fs->seg.seg_number);
+	fs->seg.nsums = segusage->su_nsums;
+	U_SET(fs->is64, (SEGSUM *)fs->seg.segsum, ss_serial, lfs->dlfs_serial);
+	if (seg_avail(fs) > SUM_FSBLOCKS(fs)) {
+		ret = start_partial_segment(fs);
+		if (ret != 0)
+			return ret;
+		fs->seg.nsums++;
+		segusage->su_nsums = fs->seg.nsums;
+		return 0;
+	}
+	lfs->dlfs_offset = lfs->dlfs_curseg + lfs->dlfs_fsbpseg;
+	return start_segment(fs, ifile);
+}
+
+/* Whether file (inumber) has a block in segment (segnum) or after it. */
+static int file_past(struct fs *fs, uint64_t inumber, uint64_t segnum,
+		     int *past) {
+	int64_t end = SEGS_TO_FSBLOCKS(fs, segnum);
+	union lfs_dinode dino;
+	struct file_map map;
+	int64_t daddr;
+	uint64_t i;
+	int ret;
+
+	ret = read_inode(fs, inumber, &dino, &daddr);
+	if (ret != 0)
+		return ret;
+	ret = file_map(fs, &dino, &map);
+	*past = daddr >= end;
+	for (i = 0; ret == 0 && i < map.nblocks; i++)
+		if (map.daddrs[i] >= end)
+			*past = 1;
+	for (i = 0; ret == 0 && i < map.niblks; i++)
+		if (map.iblks[i] >= end)
+			*past = 1;
+	file_map_free(&map);
+	return ret;
+}
+
+/* Writes file (inumber) again, at the end of the log. */
+static int move_file(struct fs *fs, uint64_t inumber) {
+	struct lfs_file_info info;
+	char *data;
+	int ret;
+
+	ret = read_file(fs, inumber, &data, &info);
+	if (ret != 0)
+		return ret;
+	ret = remove_file(fs, inumber);
+	if (ret == 0)
+		ret = write_file(fs, data, info.size, inumber, info.mode,
+				 info.nlink, info.flags);
+	free(data);
+	return ret;
+}
+
+/*
+ * Moves everything in the segments from (nsegs) on to the ones before it:
+ * the log, and the files with blocks there. They are taken out of the
+ * segments the log can go to first, so it wraps around to the clean ones
+ * before (nsegs).
+ */
+static int evacuate_segments(struct fs *fs, uint64_t nsegs) {
+	uint64_t curr = fs->seg.seg_number, i;
+	int past, ret;
+
+	for (i = nsegs; i < fs->nsegs; i++) {
+		if (!(fs->inuse[i / 8] & (1 << i % 8))) {
+			fs->lfs.dlfs_nclean--;
+			fs->lfs.dlfs_avail -= fs->lfs.dlfs_fsbpseg;
+		}
+		fs->inuse[i / 8] |= 1 << i % 8;
+	}
+
+	/* The summary of the partial segment we are in is empty yet */
+	while (fs->seg.seg_number == curr && curr >= nsegs) {
+		ret = advance_log_by_one(fs, &fs->ifile);
+		if (ret != 0)
+			return ret;
+	}
+
+	for (i = ULFS_ROOTINO; i < MAX_INODES(fs); i++) {
+		if (U_GET(fs->is64, IFILE_GET(fs, i), if_daddr) ==
+		    LFS_UNUSED_DADDR)
+			continue;
+		ret = file_past(fs, i, nsegs, &past);
+		if (ret == 0 && past)
+			ret = move_file(fs, i);
+		if (ret != 0)
+			return ret;
+	}
+
+	for (i = nsegs; i < fs->nsegs; i++)
+		if (SEGUSE_GET(fs, i)->su_nbytes != 0)
+			return EIO;
+	return 0;
+}
+
+/*
+ * Changes the FS to (nbytes), the size of the image: the segment usage
+ * table, the superblocks, and the space counts. For a loaded FS, before
+ * finish_lfs(); the image is not extended nor truncated here. Growing only
+ * changes metadata. Shrinking past segments in use moves what is in them
+ * to clean segments before the new end (ENOSPC if there are not enough).
+ */
+int resize_lfs(struct fs *fs, uint64_t nbytes) {
+	struct dlfs64 *lfs = &fs->lfs;
+	struct _ifile *ifile = &fs->ifile;
+	uint64_t nsegs, segtabsz, minfreeseg, resvseg, last, interval, i;
+	uint32_t nsb;
+	int ret;
+
+	if (fs->inuse == NULL)
+		return EINVAL;
+	if (nbytes / lfs->dlfs_ssize < 2)
+		return ENOSPC;
+	if (!fs->is64 && nbytes / lfs->dlfs_bsize > INT32_MAX)
+		return EFBIG;
+	nsegs = nbytes / lfs->dlfs_ssize - 1;
+	segtabsz = DIV_UP(nsegs, lfs->dlfs_sepb);
+	if (FSBLOCK_TO_BYTES(fs, lfs->dlfs_cleansz + segtabsz + ifile->nmap) >=
+	    lfs->dlfs_maxfilesize)
+		return EFBIG;
+
+	if (ifile->segusage_empty == NULL)
+		ifile->segusage_empty = segusage_empty_block(fs);
+	if (ifile->segusage_empty == NULL)
+		return ENOMEM;
+
+	if (nsegs < fs->nsegs) {
+		ret = evacuate_segments(fs, nsegs);
+		if (ret != 0)
+			return ret;
+		for (nsb = 1; nsb < LFS_MAXNUMSB; nsb++)
+			if (lfs->dlfs_sboffs[nsb] >= SEGS_TO_FSBLOCKS(fs, nsegs))
+				lfs->dlfs_sboffs[nsb] = 0;
+		for (i = segtabsz; i < lfs->dlfs_segtabsz; i++)
+			free(ifile->segusage[i]);
+		/* The entries past the end of the table are clean */
+		for (i = nsegs; i < segtabsz * lfs->dlfs_sepb; i++) {
+			char *blk = ifile->segusage[i / lfs->dlfs_sepb];
+			if (blk != NULL)
+				memcpy(&blk[SEGUSE_OFF(fs, i)],
+				       &ifile->segusage_empty[SEGUSE_OFF(fs, i)],
+				       sizeof(SEGUSE));
+		}
+	} else {
+		char **segusage = realloc(ifile->segusage,
+					  segtabsz * sizeof(char *));
+		uint8_t *inuse = realloc(fs->inuse, DIV_UP(nsegs, 8));
+
+		if (segusage != NULL)
+			ifile->segusage = segusage;
+		if (inuse != NULL)
+			fs->inuse = inuse;
+		if (segusage == NULL || inuse == NULL)
+			return ENOMEM;
+		for (i = lfs->dlfs_segtabsz; i < segtabsz; i++)
+			ifile->segusage[i] = NULL;
+		for (i = DIV_UP(fs->nsegs, 8); i < DIV_UP(nsegs, 8); i++)
+			fs->inuse[i] = 0;
+		lfs->dlfs_nclean += nsegs - fs->nsegs;
+		lfs->dlfs_avail += SEGS_TO_FSBLOCKS(fs, nsegs - fs->nsegs);
+	}
+
+	/* A read-only FS has no cleaner reserve, see init_lfs_params() */
+	minfreeseg = lfs->dlfs_minfreeseg ? nsegs / DFL_MIN_FREE_SEGS : 0;
+	resvseg = lfs->dlfs_resvseg ? minfreeseg / 2 + 1 : 0;
+	lfs->dlfs_avail -= SEGS_TO_FSBLOCKS(fs, resvseg) -
+			   SEGS_TO_FSBLOCKS(fs, lfs->dlfs_resvseg);
+	lfs->dlfs_bfree += data_fsblocks(fs, nsegs, minfreeseg) -
+			   data_fsblocks(fs, fs->nsegs, lfs->dlfs_minfreeseg);
+	lfs->dlfs_dsize = data_fsblocks(fs, nsegs, minfreeseg);
+	lfs->dlfs_size = nbytes / lfs->dlfs_bsize;
+	lfs->dlfs_lastseg = (nbytes - 2 * (uint64_t)lfs->dlfs_ssize) /
+			    lfs->dlfs_bsize;
+	lfs->dlfs_nseg = nsegs;
+	lfs->dlfs_segtabsz = segtabsz;
+	lfs->dlfs_minfreeseg = minfreeseg;
+	lfs->dlfs_resvseg = resvseg;
+	fs->nsegs = nsegs;
+	fs->nbytes = nbytes;
+	if (lfs->dlfs_bfree <= 0 || lfs->dlfs_avail <= 0)
+		return ENOSPC;
+
+	/*
+	 * More superblocks in the new segments, as far apart as the ones
+	 * there are, until there are LFS_MAXNUMSB.
+	 */
+	for (nsb = 1; nsb < LFS_MAXNUMSB && lfs->dlfs_sboffs[nsb] != 0; nsb++)
+		;
+	last = lfs->dlfs_sboffs[nsb - 1] / lfs->dlfs_fsbpseg;
+	interval = nsb > 1 ? lfs->dlfs_sboffs[1] / lfs->dlfs_fsbpseg :
+			     sb_interval(nsegs);
+	for (i = last + interval; i < nsegs && nsb < LFS_MAXNUMSB;
+	     i += interval) {
+		if (fs->inuse[i / 8] & (1 << i % 8))
+			continue;
+		SEGUSE_GET(fs, i)->su_flags |= SEGUSE_SUPERBLOCK;
+		lfs->dlfs_sboffs[nsb++] = SEGS_TO_FSBLOCKS(fs, i);
+	}
+
+	/* Where the log goes after this segment may have changed */
+	lfs->dlfs_nextseg =
+	    SEGS_TO_FSBLOCKS(fs, next_log_segment(fs, fs->seg.seg_number + 1));
+	U_SET(fs->is64, (SEGSUM *)fs->seg.segsum, ss_next, lfs->dlfs_nextseg);
+	return 0;
+}
+
+/* Frees what init_lfs or load_lfs allocated. The FS can be loaded again. */
+void free_lfs(struct fs *fs) {
+	struct _ifile *ifile = &fs->ifile;
+	uint64_t i;
+
+	if (ifile->segusage != NULL)
+		for (i = 0; i < fs->lfs.dlfs_segtabsz; i++)
+			free(ifile->segusage[i]);
+	free(ifile->segusage);
+	free(ifile->segusage_empty);
+	free(ifile->data);
+	free(ifile->ifiles);
+	free(fs->seg.segsum);
+	free(fs->seg.data_for_cksum);
+	free(fs->inuse);
+	free(fs->inodes);
+	memset(ifile, 0, sizeof(*ifile));
+	fs->seg.segsum = NULL;
+	fs->seg.data_for_cksum = NULL;
+	fs->inuse = NULL;
+	fs->inodes = NULL;
+	fs->ninodes = fs->inodes_cap = 0;
+}
+
+int init_lfs(struct fs *fs, uint64_t nbytes) {
+	return init_lfs_params(fs, nbytes, NULL);
+}
+
+int init_lfs_params(struct fs *fs, uint64_t nbytes,
+		    const struct lfs_params *params) {
+	uint32_t bsize = DFL_LFSBLOCK, ssize = DFL_LFSSEG;
+	uint64_t minfreeseg, resvseg;
+	struct dlfs64 *lfs = &fs->lfs;
+	uint64_t nsegs;
+	int ret;
+
+	if (params != NULL && params->bsize != 0)
+		bsize = params->bsize;
+	if (params != NULL && params->ssize != 0)
+		ssize = params->ssize;
+
+	fs->lfs = dlfs_default;
+	fs->inuse = NULL;
+	fs->is64 = params != NULL ? params->is64 : 0;
+	fs->tstamp = params != NULL ? params->tstamp : 0;
+	fs->seg.skip_to = 0;
+	fs->out = NULL;
+	fs->defer_inodes = 0;
+	fs->inodes = NULL;
+	fs->ninodes = fs->inodes_cap = 0;
+	fs->iblocks_first = 0;
+	fs->lastmod = 0;
+	fs->spare_inodes = 0;
+	ret = set_geometry(lfs, bsize, ssize, fs->is64);
+	if (ret != 0)
+		return ret;
+
+	/* We need at least one segment, plus the one left for the label */
+	if (nbytes / ssize < 2)
+		return ENOSPC;
+	/* LFS32 block addresses are signed 32-bit */
+	if (!fs->is64 && nbytes / bsize > INT32_MAX)
+		return EFBIG;
+
+	fs->nbytes = nbytes;
+	fs->nsegs = nsegs = ((fs->nbytes / ssize) - 1);
+	/* A read-only FS is never cleaned, nor written after this */
+	if (params != NULL && params->readonly) {
+		minfreeseg = 0;
+		resvseg = 0;
+	} else {
+		minfreeseg = nsegs / DFL_MIN_FREE_SEGS;
+		resvseg = minfreeseg / 2 + 1;
+	}
+
+	lfs->dlfs_size = nbytes / bsize;
+	lfs->dlfs_dsize = data_fsblocks(fs, nsegs, minfreeseg);
+	lfs->dlfs_lastseg = (nbytes - 2 * (uint64_t)ssize) / bsize;
+	lfs->dlfs_bfree = data_fsblocks(fs, nsegs, minfreeseg);
+	lfs->dlfs_avail =
+	    SEGS_TO_FSBLOCKS(fs, (nbytes / (uint64_t)ssize) - resvseg) -
+	    NSUPERBLOCKS;
+	lfs->dlfs_nseg = nsegs;
+	lfs->dlfs_segtabsz = DIV_UP(nsegs, lfs->dlfs_sepb);
+
+	if (lfs->dlfs_lastseg >= SEGS_TO_FSBLOCKS(fs, nsegs))
+		return ENOSPC;
+
+	lfs->dlfs_nclean = nsegs;
+	lfs->dlfs_minfreeseg = minfreeseg;
+	lfs->dlfs_resvseg = resvseg;
+
+	/* This mem is freed at exit time. */
+	assert(lfs->dlfs_sumsize >= lfs->dlfs_bsize);
+	assert(lfs->dlfs_sumsize % lfs->dlfs_bsize == 0);
+	fs->seg.segsum = calloc(1, lfs->dlfs_sumsize);
+	assert(fs->seg.segsum);
+	fs->seg.data_for_cksum = calloc(lfs->dlfs_fsbpseg, sizeof(int32_t));
+	assert(fs->seg.data_for_cksum);
+
+	/* XXX: These make things a lot simpler. */
+	assert(lfs->dlfs_fsize == lfs->dlfs_bsize);
+	assert(fs->lfs.dlfs_fsbpseg > (2 + 6 + 2));
+	assert(fs->lfs.dlfs_cleansz == 1);
+
+	struct _ifile *ifile = &fs->ifile;
 
 	init_ifile(fs);
 	init_sboffs(fs, ifile);
 
 	/* XXX: start_segment starts by advancing seg_number and dlfs_curseg */
-	fs->lfs.dlfs_curseg = (-1) * (DFL_LFSSEG / DFL_LFSBLOCK);
+	fs->lfs.dlfs_curseg = -(int32_t)fs->lfs.dlfs_fsbpseg;
 	fs->lfs.dlfs_nextseg = 0;
 	fs->seg.seg_number = -1;
-	/* The first block is left empty */
-	ret = _advance_log(fs, 1);
+	/* The label area at the start of the disk is left empty */
+	ret = _advance_log(fs, LABEL_FSBLOCKS(fs));
 	if (ret != 0)
 		return ret;
 
-	assert(fs->lfs.dlfs_offset == 1);
+	assert(fs->lfs.dlfs_offset == LABEL_FSBLOCKS(fs));
 	ret = start_segment(fs, ifile);
 	if (ret != 0)
 		return ret;
@@ -1159,17 +3178,16 @@ int finish_lfs(struct fs *fs)
 {
 	int ret;
 
-	ret = write_ifile(fs);
-	if (ret != 0)
-		return ret;
-
-	ret = write_superblock(fs);
+	ret = write_inodes(fs);
+	if (ret == 0)
+		ret = write_ifile(fs);
 	if (ret != 0)
 		return ret;
 
+	/* The superblock goes last: until then, the last checkpoint holds */
 	ret = write_segment_summary(fs);
 	if (ret != 0)
 		return ret;
 
-	return 0;
+	return write_superblock(fs);
 }
@@ -1145,9 +1145,13 @@ struct segment {
 	uint32_t seg_number;		/* number of this segment */
 	union lfs_blocks start_lbp;	/* beginning lbn for this set */
 
-	int32_t		data_for_cksum[MAX_BLOCKS_PER_SEG];/* for segment data checksums */
+	int32_t		*data_for_cksum;	/* for segment data checksums */
 	int32_t		cksum_idx;
-	int32_t		disk_bno;	/* expected location on disk */
+	int64_t		disk_bno;	/* expected location on disk */
+	uint32_t	nsums;		/* partial segments in this segment */
+	uint64_t	ino;		/* file whose blocks are being written */
+	uint32_t	fi_nblocks;	/* blocks of it in the FINFO at fip */
+	uint64_t	skip_to;	/* segment to start next, if later */
 
 #define SEGM_CKP	0x0001		/* doing a checkpoint */
 #define SEGM_CLEAN	0x0002		/* cleaner call; don't sort */
@@ -1292,26 +1296,118 @@ void lfs_itimes(struct inode *, const struct timespec *,
     const struct timespec *, const struct timespec *);
 __END_DECLS
 
+/*
+ * On-disk sizes of the structures that differ between LFS32 and LFS64. When
+ * (_is64) is a constant, these are constants too.
+ */
+#define DINO_SIZE(_is64)                                                       \
+	((_is64) ? sizeof(struct lfs64_dinode) : sizeof(struct lfs32_dinode))
+#define FINFO_SIZE(_is64) ((_is64) ? sizeof(FINFO64) : sizeof(FINFO32))
+#define IINFO_SIZE(_is64) ((_is64) ? sizeof(IINFO64) : sizeof(IINFO32))
+#define IFILE_SIZE(_is64) ((_is64) ? sizeof(IFILE64) : sizeof(IFILE32))
+#define SEGSUM_HDR_SIZE(_is64) ((_is64) ? sizeof(SEGSUM64) : sizeof(SEGSUM32))
+#define DADDR_SIZE(_is64) ((_is64) ? sizeof(int64_t) : sizeof(int32_t))
+
+/* Access a field of one of the 32/64-bit unions (dinode, ifile, etc.). */
+#define U_GET(_is64, _u, _f)                                                   \
+	((_is64) ? (int64_t)(_u)->u_64._f : (int64_t)(_u)->u_32._f)
+#define U_SET(_is64, _u, _f, _v)                                               \
+	do {                                                                   \
+		if (_is64)                                                     \
+			(_u)->u_64._f = (_v);                                  \
+		else                                                           \
+			(_u)->u_32._f = (_v);                                  \
+	} while (0)
+
+/* Get or set the (_i)th disk address of an indirect block. */
+#define DADDR_GET(_is64, _blk, _i)                                             \
+	((_is64) ? ((int64_t *)(_blk))[_i] : (int64_t)((int32_t *)(_blk))[_i])
+#define DADDR_SET(_is64, _blk, _i, _v)                                         \
+	do {                                                                   \
+		if (_is64)                                                     \
+			((int64_t *)(_blk))[_i] = (_v);                        \
+		else                                                           \
+			((int32_t *)(_blk))[_i] = (_v);                        \
+	} while (0)
+
+/* Size of the header of a directory entry, before its name. */
+#define DIRHDR_SIZE(_is64)                                                     \
+	((_is64) ? sizeof(struct lfs_dirheader64) :                            \
+		   sizeof(struct lfs_dirheader32))
+
 struct _ifile {
 	/*
-	 * data holds all the data and cleanerinfo. segusage, and ifiles just
-	 * point to it.
+	 * data holds the cleanerinfo blocks, and cleanerinfo just points to
+	 * it. The segment usage table (segusage) is one pointer per block,
+	 * NULL for the blocks never used. The inode map (ifiles) grows with
+	 * the inode numbers used.
 	 */
 	char		*data;
-	struct _cleanerinfo32 *cleanerinfo;
-	char		*segusage;
+	CLEANERINFO	*cleanerinfo;
+	char		**segusage;
+	char		*segusage_empty; /* a segusage block of empty entries */
 	char		*ifiles;
+	uint64_t	nmap;		/* inode map blocks in use */
+	uint64_t	nmap_alloc;	/* inode map blocks allocated */
+};
+
+/*
+ * Where a new FS goes, if not to its fd: write() gets what would be written
+ * to the image at byte (off), and done() the number of a segment the log
+ * left, which is not written again (if not NULL). The segments with a
+ * superblock, and the one with the ifile inode, are never done:
+ * finish_lfs() writes to them last.
+ *
+ * A (lazy) output is passed the data of regular files without it being
+ * read, so the data checksums of the summaries leave it out: summary() gets
+ * where each summary is written, and the (nblocks) blocks after it that
+ * segsum_set_datasum() needs the first words of.
+ *
+ * If read() is not NULL, what was written can be read back from the output
+ * (with read_dir(), stat_file(), ...) as if from an image.
+ */
+struct lfs_output {
+	int	(*write)(struct lfs_output *out, const void *data, uint64_t len,
+			 uint64_t off);
+	void	(*done)(struct lfs_output *out, uint64_t segnum);
+	int	lazy;
+	void	(*summary)(struct lfs_output *out, uint64_t off,
+			   uint64_t nblocks);
+	int	(*read)(struct lfs_output *out, void *buf, uint64_t len,
+			uint64_t off);
 };
 
-/* In memory representation of the LFS */
+/*
+ * In memory representation of the LFS. The superblock is kept in the 64-bit
+ * layout, as it can hold both formats; write_superblock() converts it when
+ * writing a 32-bit FS.
+ */
 struct fs {
-	struct dlfs 	lfs;
+	struct dlfs64 	lfs;
+	int		is64;
 	uint32_t	avail_segs;
 	struct 		segment seg;
 	int		fd;
 	uint64_t	nbytes;
 	uint64_t	nsegs;
 	struct _ifile	ifile;
+	uint8_t		*inuse;		/* bitmap of the segments with data
+					   when loaded or written since,
+					   NULL in a new FS */
+	time_t		tstamp;		/* of the inodes and summaries
+					   written, 0 for the current time */
+	struct lfs_output *out;		/* NULL to write to fd */
+	int		defer_inodes;	/* see write_inodes() */
+	union lfs_dinode *inodes;	/* kept by write_file() */
+	uint64_t	ninodes;
+	uint64_t	inodes_cap;
+	int		iblocks_first;	/* see write_file() */
+	time_t		lastmod;	/* of what is written next: the
+					   su_lastmod of a segment is the
+					   newest written to it, 0 to leave
+					   it alone */
+	uint64_t	spare_inodes;	/* free inodes finish_lfs() leaves
+					   in the ifile, at least */
 };
 
 #ifndef DIRSIZE
@@ -1321,23 +1417,122 @@ struct fs {
 struct directory {
 	char	data[DIRSIZE];
 	int 	curr, prev;
+	int	is64;		/* use 64-bit directory entries */
+};
+
+/*
+ * Geometry of the FS to create. A zero means "use the default" (DFL_LFSBLOCK
+ * and DFL_LFSSEG). init_lfs_params returns EINVAL for geometries we can't
+ * (or NetBSD won't) handle.
+ */
+struct lfs_params {
+	uint32_t	bsize;		/* block (and fragment) size */
+	uint32_t	ssize;		/* segment size */
+	int		is64;		/* write an LFS64 */
+	int		readonly;	/* no segments kept for the cleaner */
+	int64_t		tstamp;		/* fixed time of what is written,
+					   0 for the current time */
+};
+
+/* What estimate_lfs() expects an image to look like. */
+struct lfs_estimate {
+	uint64_t	nbytes;		/* bytes up to the end of the log */
+	uint64_t	nreads;		/* reads needed to read every file */
+	uint64_t	read_bytes;	/* bytes read by those reads */
 };
 
+/*
+ * Predicts the layout of an image of (nbytes) with the given geometry,
+ * holding files and directories of (sizes) written in that order (the
+ * order genlfs writes them). Returns EINVAL, ENOSPC or EFBIG if
+ * init_lfs_params or write_file would fail.
+ */
+int estimate_lfs(uint64_t nbytes, const struct lfs_params *params,
+		 const uint64_t *sizes, uint64_t nsizes,
+		 struct lfs_estimate *est);
+
 /*
  * If any of these operations fail, the FS can be considered corrupted.
  * init_lfs should be called again with a bigger size (most common 
  * cause of failure).
  */
 int init_lfs(struct fs *fs, uint64_t nbytes);
+int init_lfs_params(struct fs *fs, uint64_t nbytes,
+		    const struct lfs_params *params);
 int write_empty_root_dir(struct fs *fs);
 int write_ifile(struct fs *fs);
 int write_superblock(struct fs *fs);
 int write_segment_summary(struct fs *fs);
+void segsum_set_datasum(struct fs *fs, void *segsum, const int32_t *words,
+			uint64_t nwords);
+/*
+ * Writes the data blocks of a file, then its indirect blocks, then its
+ * inode. With (fs->iblocks_first) set, each indirect block goes right
+ * before the blocks it maps instead, so that the file can be read in one
+ * pass from the start, without going back. EFBIG if the file is larger than
+ * the block size allows (dlfs_maxfilesize).
+ */
 int write_file(struct fs *fs, char *data, uint64_t size, int inumber,
 		int mode, int nlink, int flags);
+int skip_to_segment(struct fs *fs, uint64_t segnum);
+/*
+ * While (fs->defer_inodes) is set, write_file() writes the data of a file
+ * but keeps its inode, and write_inodes() writes the ones kept, in a row.
+ * finish_lfs() writes any left.
+ */
+int write_inodes(struct fs *fs);
 
 int dir_add_entry(struct directory *dir, char *name, int inumber, int type);
 void dir_done(struct directory *dir);
 int finish_lfs(struct fs *fs);
 
+/*
+ * To add files to an existing FS: load_lfs reads the superblock and the
+ * ifile from (fs->fd), and the log goes on where it was left. Files can be
+ * replaced (remove_file, then write_file with the same inode number) or
+ * added (alloc_inode), or deleted (delete_file). finish_lfs writes the new
+ * checkpoint.
+ */
+int load_lfs(struct fs *fs);
+int read_superblock(int fd, uint64_t off, struct dlfs64 *lfs);
+void free_lfs(struct fs *fs);
+int remove_file(struct fs *fs, uint64_t inumber);
+int delete_file(struct fs *fs, uint64_t inumber);
+int read_dir(struct fs *fs, uint64_t inumber, struct directory *dir);
+int dir_entry(struct directory *dir, int *off, char *name, uint64_t *inumber,
+	      int *type);
+uint64_t dir_lookup(struct directory *dir, const char *name, int *type);
+int dir_remove_entry(struct directory *dir, const char *name);
+uint64_t alloc_inode(struct fs *fs);
+int resize_lfs(struct fs *fs, uint64_t nbytes);
+
+/* (len) blocks of a file, at consecutive disk addresses from (daddr) on. */
+struct lfs_extent {
+	int64_t		daddr;
+	uint64_t	len;
+};
+
+/*
+ * The data blocks of file (inumber) as (*next) extents in (*ext), by logical
+ * block, holes at daddr 0; file_iblocks() gives its indirect blocks, each
+ * one before the ones under it. (*ext) is for the caller to free.
+ */
+int file_extents(struct fs *fs, uint64_t inumber, struct lfs_extent **ext,
+		 uint64_t *next);
+int file_iblocks(struct fs *fs, uint64_t inumber, struct lfs_extent **ext,
+		 uint64_t *next);
+
+/* What stat_file and read_file tell about a file, besides its data. */
+struct lfs_file_info {
+	uint64_t	size;
+	uint32_t	mode;
+	uint32_t	nlink;
+	uint32_t	flags;
+	int64_t		daddr;		/* of its inode block */
+};
+
+int stat_file(struct fs *fs, uint64_t inumber, struct lfs_file_info *info);
+int read_file(struct fs *fs, uint64_t inumber, char **data,
+	      struct lfs_file_info *info);
+
 #endif /* !_UFS_LFS_LFS_H_ */
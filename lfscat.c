@@ -0,0 +1,70 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+#include "lfsr.h"
+
+#define BUF_SIZE	(1024 * 1024)
+
+/*
+ * lfscat reads a path of an image in process, with lfsr: a file is written
+ * to stdout, a directory is listed (the name, inode number and type of each
+ * entry, a line each). Tests and scripts can look into an image this way
+ * without booting a guest.
+ */
+
+static int print_entry(void *arg, const char *name, uint64_t ino, int type) {
+	printf("%s %lu %d\n", name, ino, type);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct lfsr r;
+	struct lfsr_stat st;
+	uint64_t ino, off, n;
+	char *buf;
+	int fd, ret;
+
+	if (argc != 3)
+		errx(1, "Usage: %s <image> <path>", argv[0]);
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0)
+		err(1, "Failed to open %s", argv[1]);
+	ret = lfsr_open(&r, fd);
+	if (ret != 0)
+		errx(1, "Failed to load %s: %s", argv[1], strerror(ret));
+	ret = lfsr_lookup(&r, argv[2], &ino);
+	if (ret == 0)
+		ret = lfsr_stat(&r, ino, &st);
+	if (ret != 0)
+		errx(1, "%s: %s", argv[2], strerror(ret));
+
+	if ((st.mode & LFS_IFMT) == LFS_IFDIR) {
+		ret = lfsr_readdir(&r, ino, print_entry, NULL);
+		if (ret != 0)
+			errx(1, "Failed to read %s: %s", argv[2], strerror(ret));
+	} else {
+		buf = malloc(BUF_SIZE);
+		assert(buf);
+		for (off = 0; off < st.size; off += n) {
+			ret = lfsr_pread(&r, ino, buf, BUF_SIZE, off, &n);
+			if (ret != 0)
+				errx(1, "Failed to read %s: %s", argv[2],
+				     strerror(ret));
+			if (fwrite(buf, 1, n, stdout) != n)
+				err(1, "Failed to write");
+		}
+		free(buf);
+	}
+	lfsr_close(&r);
+	close(fd);
+	return 0;
+}
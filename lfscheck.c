@@ -0,0 +1,784 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+#include "lfsz.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+#define DIV_UP(_x, _y) (((_x) + (_y) - 1) / (_y))
+
+/* Errors printed, the ones after that are only counted */
+#define MAX_ERRORS	1000
+
+u_int32_t cksum(void *str, size_t len);
+
+/*
+ * lfscheck checks the structure of an image of any geometry, LFS32 or
+ * LFS64: the superblocks, the ifile, every inode in use and its blocks,
+ * the directories, and every partial segment, its summary and checksums
+ * against the inodes and the segment usage table. The image is mapped and
+ * read only. The inodes are checked first, by all threads at once, which
+ * marks the blocks in use; then the segments, each by one thread, which
+ * checks every live block is where a summary says.
+ */
+
+struct check {
+	struct dlfs64	lfs;
+	int		is64;
+	const char	*img;
+	uint64_t	len;		/* of the image */
+	uint32_t	bsize;
+	uint64_t	fsbpseg;
+	uint64_t	nsegs;
+	uint64_t	nptr;		/* disk addresses per block */
+	char		*ifile;		/* its blocks, one after the other */
+	uint64_t	ninodes;	/* in the inode map */
+	uint8_t		*live;		/* bitmap of the blocks in use */
+	uint8_t		*listed;	/* of the live blocks in a summary */
+	uint32_t	*nrefs;		/* directory entries of each inode */
+	uint64_t	next;		/* first inode or segment not taken */
+	uint64_t	nfiles;
+	uint64_t	ndirs;
+	uint64_t	nblocks;	/* in use */
+	uint64_t	nsums;
+
+	pthread_mutex_t	lock;
+	uint64_t	nerrors;
+};
+
+typedef void (*block_fn)(struct check *c, uint64_t inum, int64_t lbn,
+			 int64_t daddr);
+
+static void bad(struct check *c, const char *fmt, ...) {
+	va_list ap;
+
+	pthread_mutex_lock(&c->lock);
+	if (c->nerrors++ < MAX_ERRORS) {
+		va_start(ap, fmt);
+		vprintf(fmt, ap);
+		va_end(ap);
+		putchar('\n');
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Block (daddr) in the image, NULL if it is out of the FS or the image. */
+static const char *block(struct check *c, int64_t daddr) {
+	if (daddr <= 0 || (uint64_t)daddr >= c->lfs.dlfs_size ||
+	    ((uint64_t)daddr + 1) * c->bsize > c->len)
+		return NULL;
+	return c->img + daddr * c->bsize;
+}
+
+static IFILE *ifile_entry(struct check *c, uint64_t inum) {
+	uint64_t ifpb = c->lfs.dlfs_ifpb;
+
+	return (IFILE *)(c->ifile +
+			 (c->lfs.dlfs_cleansz + c->lfs.dlfs_segtabsz +
+			  inum / ifpb) * c->bsize +
+			 inum % ifpb * IFILE_SIZE(c->is64));
+}
+
+static SEGUSE *seguse(struct check *c, uint64_t segnum) {
+	uint64_t sepb = c->lfs.dlfs_sepb;
+
+	return (SEGUSE *)(c->ifile + (c->lfs.dlfs_cleansz + segnum / sepb) *
+					     c->bsize) +
+	       segnum % sepb;
+}
+
+/* The inode (inum) if it is in use and where the inode map says, or NULL. */
+static const union lfs_dinode *inode(struct check *c, uint64_t inum) {
+	const union lfs_dinode *dino;
+
+	if (inum >= c->ninodes)
+		return NULL;
+	dino = (const union lfs_dinode *)block(
+		c, U_GET(c->is64, ifile_entry(c, inum), if_daddr));
+	if (dino == NULL || (uint64_t)U_GET(c->is64, dino, di_inumber) != inum)
+		return NULL;
+	return dino;
+}
+
+/* Sets bit (daddr) in (map), and returns what it was. */
+static int mark(uint8_t *map, int64_t daddr) {
+	uint8_t bit = 1 << daddr % 8;
+
+	return __atomic_fetch_or(&map[daddr / 8], bit, __ATOMIC_RELAXED) & bit;
+}
+
+static int is_set(const uint8_t *map, int64_t daddr) {
+	return map[daddr / 8] & 1 << daddr % 8;
+}
+
+/*
+ * Where block (lbn) of (dino) is, 0 if it is a hole, -1 if an indirect
+ * block on the way can't be read. Indirect blocks have negative lbns, as in
+ * ulfs_getlbns(): the one in di_ib[0] is -NDADDR, in di_ib[1] -(NDADDR +
+ * NPTR + 1), and so on; each one under it is NPTR^level lower.
+ */
+static int64_t bmap(struct check *c, const union lfs_dinode *dino,
+		    int64_t lbn) {
+	int64_t n = c->nptr, ib1 = -ULFS_NDADDR, ib2 = -(ULFS_NDADDR + n + 1);
+	int64_t ib3 = -(ULFS_NDADDR + n + n * n + 2), daddr, d;
+	uint64_t idx[3];
+	int depth, i, top;
+	const char *blk;
+
+	if (lbn >= 0 && lbn < ULFS_NDADDR)
+		return U_GET(c->is64, dino, di_db[lbn]);
+	if (lbn >= 0) {
+		d = lbn - ULFS_NDADDR;
+		if (d < n) {
+			top = 0;
+			depth = 1;
+			idx[0] = d;
+		} else if ((d -= n) < n * n) {
+			top = 1;
+			depth = 2;
+			idx[0] = d / n;
+			idx[1] = d % n;
+		} else if ((d -= n * n) < n * n * n) {
+			top = 2;
+			depth = 3;
+			idx[0] = d / (n * n);
+			idx[1] = d / n % n;
+			idx[2] = d % n;
+		} else {
+			return 0;
+		}
+	} else if (lbn == ib1 || lbn == ib2 || lbn == ib3) {
+		return U_GET(c->is64, dino,
+			     di_ib[lbn == ib1 ? 0 : lbn == ib2 ? 1 : 2]);
+	} else if (lbn > ib3 + 2) {
+		/* Under the double indirect block */
+		d = ib2 + 1 - lbn;
+		if (d < 0 || d % n != 0 || d / n >= n)
+			return 0;
+		top = 1;
+		depth = 1;
+		idx[0] = d / n;
+	} else if ((d = ib3 + 1 - lbn) % (n * n) == 0) {
+		/* Under the triple indirect block, a double one */
+		if (d / (n * n) >= n)
+			return 0;
+		top = 2;
+		depth = 1;
+		idx[0] = d / (n * n);
+	} else {
+		/* Under one of those */
+		d++;
+		if (d % (n * n) % n != 0 || d / (n * n) >= n)
+			return 0;
+		top = 2;
+		depth = 2;
+		idx[0] = d / (n * n);
+		idx[1] = d % (n * n) / n;
+	}
+
+	daddr = U_GET(c->is64, dino, di_ib[top]);
+	for (i = 0; i < depth && daddr != 0; i++) {
+		blk = block(c, daddr);
+		if (blk == NULL)
+			return -1;
+		daddr = DADDR_GET(c->is64, blk, idx[i]);
+	}
+	return daddr;
+}
+
+/*
+ * Calls (fn) on each block of the tree under indirect block (daddr), of
+ * (level) (0 for a single indirect block) and lbn (meta), and on it.
+ * (*lbn) is the first data block under it, up to (end).
+ */
+static void walk_indirect(struct check *c, uint64_t inum, int64_t daddr,
+			  int64_t meta, int level, uint64_t *lbn, uint64_t end,
+			  block_fn fn) {
+	uint64_t span = c->nptr, i;
+	const char *blk;
+	int j;
+
+	for (j = 0; j < level; j++)
+		span *= c->nptr;
+	if (daddr == 0) {
+		*lbn = MIN(end, *lbn + span);
+		return;
+	}
+	fn(c, inum, meta, daddr);
+	blk = block(c, daddr);
+	if (blk == NULL) {
+		*lbn = MIN(end, *lbn + span);
+		return;
+	}
+	for (i = 0; i < c->nptr && *lbn < end; i++) {
+		int64_t addr = DADDR_GET(c->is64, blk, i);
+
+		if (level > 0) {
+			walk_indirect(c, inum, addr,
+				      meta + 1 - (int64_t)(i * (span / c->nptr)),
+				      level - 1, lbn, end, fn);
+			continue;
+		}
+		if (addr != 0)
+			fn(c, inum, *lbn, addr);
+		(*lbn)++;
+	}
+}
+
+/* Calls (fn) on each block of (dino), data or indirect. */
+static void walk_blocks(struct check *c, uint64_t inum,
+			const union lfs_dinode *dino, block_fn fn) {
+	uint64_t end = DIV_UP(U_GET(c->is64, dino, di_size), c->bsize);
+	int64_t n = c->nptr;
+	int64_t metas[ULFS_NIADDR] = {-ULFS_NDADDR, -(ULFS_NDADDR + n + 1),
+				      -(ULFS_NDADDR + n + n * n + 2)};
+	uint64_t lbn;
+	int i;
+
+	for (lbn = 0; lbn < MIN(end, ULFS_NDADDR); lbn++)
+		if (U_GET(c->is64, dino, di_db[lbn]) != 0)
+			fn(c, inum, lbn, U_GET(c->is64, dino, di_db[lbn]));
+	for (i = 0; i < ULFS_NIADDR && lbn < end; i++)
+		walk_indirect(c, inum, U_GET(c->is64, dino, di_ib[i]), metas[i],
+			      i, &lbn, end, fn);
+}
+
+static void mark_live(struct check *c, uint64_t inum, int64_t lbn,
+		      int64_t daddr) {
+	if (block(c, daddr) == NULL) {
+		bad(c, "inode %lu: block %ld at %ld, out of the image", inum,
+		    lbn, daddr);
+		return;
+	}
+	if (mark(c->live, daddr))
+		bad(c, "inode %lu: block %ld at %ld, in use twice", inum, lbn,
+		    daddr);
+	else
+		__atomic_fetch_add(&c->nblocks, 1, __ATOMIC_RELAXED);
+}
+
+/* Checks directory entry (name) in (inum), to inode (ino) of (type). */
+static void check_entry(struct check *c, uint64_t inum, const char *name,
+			int namlen, uint64_t ino, int type) {
+	const union lfs_dinode *target = inode(c, ino);
+	int dot = namlen == 1 && name[0] == '.';
+	int dotdot = namlen == 2 && name[0] == '.' && name[1] == '.';
+
+	if (memchr(name, '/', namlen) != NULL ||
+	    memchr(name, '\0', namlen) != NULL) {
+		bad(c, "directory %lu: bad name %.*s", inum, namlen, name);
+		return;
+	}
+	if (target == NULL) {
+		bad(c, "directory %lu: %.*s is inode %lu, not in use", inum,
+		    namlen, name, ino);
+		return;
+	}
+	if (type != LFS_IFTODT(U_GET(c->is64, target, di_mode)))
+		bad(c, "directory %lu: %.*s has type %d, inode %lu mode %o",
+		    inum, namlen, name, type, ino,
+		    (int)U_GET(c->is64, target, di_mode));
+	if (dot && ino != inum)
+		bad(c, "directory %lu: . is inode %lu", inum, ino);
+	if (dotdot && type != LFS_DT_DIR)
+		bad(c, "directory %lu: .. is not a directory", inum);
+	if (!dot && !dotdot)
+		__atomic_fetch_add(&c->nrefs[ino], 1, __ATOMIC_RELAXED);
+}
+
+static void check_dir(struct check *c, uint64_t inum,
+		      const union lfs_dinode *dino) {
+	uint64_t size = U_GET(c->is64, dino, di_size), lbn, off;
+	size_t hdr = DIRHDR_SIZE(c->is64);
+	int ndots = 0, ndotdots = 0;
+
+	/* genlfs writes . and .. last, the kernel doesn't mind where */
+	for (lbn = 0; lbn < DIV_UP(size, c->bsize); lbn++) {
+		const char *blk = block(c, bmap(c, dino, lbn));
+		uint64_t len = MIN(c->bsize, size - lbn * c->bsize);
+
+		if (blk == NULL) {
+			bad(c, "directory %lu: block %lu missing", inum, lbn);
+			return;
+		}
+		for (off = 0; off < len;) {
+			const LFS_DIRHEADER *dh = (const LFS_DIRHEADER *)(blk +
+									 off);
+			uint64_t ino = c->is64 ? dh->u_64.dh_inoA |
+						 (uint64_t)dh->u_64.dh_inoB << 32
+					       : dh->u_32.dh_ino;
+			uint64_t reclen = U_GET(c->is64, dh, dh_reclen);
+			int namlen = U_GET(c->is64, dh, dh_namlen);
+
+			if (reclen < hdr || reclen % 4 != 0 ||
+			    hdr + namlen > reclen ||
+			    off / LFS_DIRBLKSIZ !=
+				    (off + reclen - 1) / LFS_DIRBLKSIZ ||
+			    off + reclen > len) {
+				bad(c, "directory %lu: bad entry at %lu", inum,
+				    lbn * c->bsize + off);
+				break;
+			}
+			if (ino != 0) {
+				const char *name = (const char *)dh + hdr;
+
+				if (namlen == 0)
+					bad(c, "directory %lu: empty name at "
+					       "%lu", inum, lbn * c->bsize + off);
+				else
+					check_entry(c, inum, name, namlen, ino,
+						    U_GET(c->is64, dh, dh_type));
+				if (namlen == 1 && name[0] == '.')
+					ndots++;
+				if (namlen == 2 && name[0] == '.' &&
+				    name[1] == '.')
+					ndotdots++;
+			}
+			off += reclen;
+		}
+	}
+	if (ndots != 1 || ndotdots != 1)
+		bad(c, "directory %lu: %d . and %d ..", inum, ndots, ndotdots);
+}
+
+static void check_inode(struct check *c, uint64_t inum) {
+	int64_t daddr = U_GET(c->is64, ifile_entry(c, inum), if_daddr);
+	const union lfs_dinode *dino;
+	uint64_t mode;
+
+	if (daddr == LFS_UNUSED_DADDR)
+		return;
+	dino = (const union lfs_dinode *)block(c, daddr);
+	if (dino == NULL) {
+		bad(c, "inode %lu: at %ld, out of the image", inum, daddr);
+		return;
+	}
+	if ((uint64_t)U_GET(c->is64, dino, di_inumber) != inum) {
+		bad(c, "inode %lu: block %ld has inode %lu", inum, daddr,
+		    (uint64_t)U_GET(c->is64, dino, di_inumber));
+		return;
+	}
+	if (mark(c->live, daddr))
+		bad(c, "inode %lu: at %ld, in use twice", inum, daddr);
+	else
+		__atomic_fetch_add(&c->nblocks, 1, __ATOMIC_RELAXED);
+
+	mode = U_GET(c->is64, dino, di_mode);
+	if ((mode & LFS_IFMT) == LFS_IFDIR) {
+		__atomic_fetch_add(&c->ndirs, 1, __ATOMIC_RELAXED);
+		check_dir(c, inum, dino);
+	} else {
+		__atomic_fetch_add(&c->nfiles, 1, __ATOMIC_RELAXED);
+	}
+	walk_blocks(c, inum, dino, mark_live);
+}
+
+/* Checks a data or indirect block a summary has, if it is live. */
+static void check_finfo_block(struct check *c, uint64_t segnum, uint64_t ino,
+			      uint32_t version, int64_t lbn, int64_t daddr) {
+	const union lfs_dinode *dino;
+
+	if (!is_set(c->live, daddr))
+		return;
+	dino = inode(c, ino);
+	if (dino == NULL) {
+		bad(c, "segment %lu: block %ld is in use, but of inode %lu, "
+		       "not in use", segnum, daddr, ino);
+		return;
+	}
+	if (U_GET(c->is64, ifile_entry(c, ino), if_version) != version)
+		bad(c, "segment %lu: block %ld of inode %lu version %u, not "
+		       "%u", segnum, daddr, ino, version,
+		    (uint32_t)U_GET(c->is64, ifile_entry(c, ino), if_version));
+	else if (bmap(c, dino, lbn) != daddr)
+		bad(c, "segment %lu: block %ld is in use, but inode %lu has "
+		       "block %ld at %ld", segnum, daddr, ino, lbn,
+		    bmap(c, dino, lbn));
+	else if (mark(c->listed, daddr))
+		bad(c, "segment %lu: block %ld listed twice", segnum, daddr);
+}
+
+/* Checks an inode block a summary has, if it is live. */
+static void check_iinfo_block(struct check *c, uint64_t segnum,
+			      int64_t daddr) {
+	const union lfs_dinode *dino = (const union lfs_dinode *)block(c,
+								       daddr);
+	uint64_t inum;
+
+	if (!is_set(c->live, daddr))
+		return;
+	inum = U_GET(c->is64, dino, di_inumber);
+	if (inum >= c->ninodes ||
+	    U_GET(c->is64, ifile_entry(c, inum), if_daddr) != daddr)
+		bad(c, "segment %lu: inode block %ld is in use by a file",
+		    segnum, daddr);
+	else if (mark(c->listed, daddr))
+		bad(c, "segment %lu: inode block %ld listed twice", segnum,
+		    daddr);
+}
+
+/*
+ * Checks the partial segment at (off) in (segnum): its summary and
+ * checksums, and its blocks. (words) has room for a segment of checksum
+ * words, (inos) is a bitmap of one. Returns its length in blocks, 0 if it
+ * is broken.
+ */
+static uint64_t check_pseg(struct check *c, uint64_t segnum, int64_t off,
+			   uint32_t *words, uint8_t *inos, uint64_t *ninos) {
+	const char *sum = block(c, off), *fip;
+	size_t sumsize = c->lfs.dlfs_sumsize, iinfo = IINFO_SIZE(c->is64);
+	size_t sumstart = offsetof(SEGSUM32, ss_datasum);
+	uint64_t first = segnum * c->fsbpseg, end = first + c->fsbpseg;
+	uint64_t nfinfo, nino, nblocks, i, j, pos;
+
+	if (sum == NULL ||
+	    U_GET(c->is64, (const SEGSUM *)sum, ss_magic) != SS_MAGIC) {
+		bad(c, "segment %lu: no summary at %ld", segnum, off);
+		return 0;
+	}
+	/* ss_sumsum and ss_datasum are at the same place in SEGSUM64 */
+	if (cksum((void *)(sum + sumstart), sumsize - sumstart) !=
+	    (uint32_t)U_GET(c->is64, (const SEGSUM *)sum, ss_sumsum)) {
+		bad(c, "segment %lu: bad summary checksum at %ld", segnum, off);
+		return 0;
+	}
+	nfinfo = U_GET(c->is64, (const SEGSUM *)sum, ss_nfinfo);
+	nino = U_GET(c->is64, (const SEGSUM *)sum, ss_ninos);
+
+	/* The FINFOs grow up from the header, the IINFOs down from the end */
+	fip = sum + SEGSUM_HDR_SIZE(c->is64);
+	for (i = 0, nblocks = nino; i < nfinfo; i++) {
+		const FINFO *fi = (const FINFO *)fip;
+
+		if (fip + FINFO_SIZE(c->is64) > sum + sumsize - nino * iinfo)
+			break;
+		nblocks += U_GET(c->is64, fi, fi_nblocks);
+		fip += FINFO_SIZE(c->is64) +
+		       U_GET(c->is64, fi, fi_nblocks) * DADDR_SIZE(c->is64);
+	}
+	if (i < nfinfo || fip > sum + sumsize - nino * iinfo ||
+	    off + 1 + nblocks > end) {
+		bad(c, "segment %lu: summary at %ld overflows", segnum, off);
+		return 0;
+	}
+
+	memset(inos, 0, DIV_UP(c->fsbpseg, 8));
+	for (i = 0; i < nino; i++) {
+		int64_t daddr = DADDR_GET(c->is64,
+					  sum + sumsize - (i + 1) * iinfo, 0);
+
+		if (daddr <= off || daddr > off + (int64_t)nblocks) {
+			bad(c, "segment %lu: inode block %ld out of the partial "
+			       "segment at %ld", segnum, daddr, off);
+			return 0;
+		}
+		mark(inos, daddr - first);
+	}
+	for (i = 0; i < nblocks; i++) {
+		if (block(c, off + 1 + i) == NULL) {
+			bad(c, "segment %lu: block %ld out of the image", segnum,
+			    off + 1 + i);
+			return 0;
+		}
+		memcpy(&words[i], block(c, off + 1 + i), sizeof(words[i]));
+	}
+	if (cksum(words, nblocks * sizeof(words[0])) !=
+	    (uint32_t)U_GET(c->is64, (const SEGSUM *)sum, ss_datasum)) {
+		bad(c, "segment %lu: bad data checksum at %ld", segnum, off);
+		return 0;
+	}
+
+	/* The data blocks fill the places the inode blocks don't take */
+	fip = sum + SEGSUM_HDR_SIZE(c->is64);
+	for (i = 0, pos = off + 1; i < nfinfo; i++) {
+		const FINFO *fi = (const FINFO *)fip;
+		uint64_t n = U_GET(c->is64, fi, fi_nblocks);
+
+		fip += FINFO_SIZE(c->is64);
+		for (j = 0; j < n; j++, pos++, fip += DADDR_SIZE(c->is64)) {
+			while (is_set(inos, pos - first))
+				pos++;
+			check_finfo_block(c, segnum, U_GET(c->is64, fi, fi_ino),
+					  U_GET(c->is64, fi, fi_version),
+					  DADDR_GET(c->is64, fip, 0), pos);
+		}
+	}
+	for (i = 0; i < nino; i++)
+		check_iinfo_block(
+			c, segnum,
+			DADDR_GET(c->is64, sum + sumsize - (i + 1) * iinfo, 0));
+	*ninos += nino;
+	return 1 + nblocks;
+}
+
+static void check_segment(struct check *c, uint64_t segnum, uint32_t *words,
+			  uint8_t *inos) {
+	SEGUSE *su = seguse(c, segnum);
+	uint64_t first = segnum * c->fsbpseg, end = first + c->fsbpseg;
+	uint64_t off = first, ninos = 0, nlive = 0, i, n, start;
+	int64_t daddr;
+	int broken = 0;
+
+	for (i = 0; i < LFS_MAXNUMSB && c->lfs.dlfs_sboffs[i] != 0; i++)
+		if ((uint64_t)c->lfs.dlfs_sboffs[i] / c->fsbpseg == segnum &&
+		    !(su->su_flags & SEGUSE_SUPERBLOCK))
+			bad(c, "segment %lu: superblock %lu, but no flag", segnum,
+			    i);
+	if (!(su->su_flags & SEGUSE_DIRTY)) {
+		for (daddr = first; (uint64_t)daddr < end; daddr++)
+			if (is_set(c->live, daddr))
+				bad(c, "segment %lu: clean, but block %ld is "
+				       "in use", segnum, daddr);
+		if (su->su_nbytes != 0)
+			bad(c, "segment %lu: clean, with %u bytes in use",
+			    segnum, su->su_nbytes);
+		return;
+	}
+
+	/* Read it ahead; madvise() wants whole pages */
+	start = first * c->bsize & ~(uint64_t)(getpagesize() - 1);
+	if (start < c->len)
+		madvise((char *)c->img + start,
+			MIN(end * c->bsize, c->len) - start, MADV_WILLNEED);
+	if (segnum == 0)
+		off += DIV_UP(LFS_LABELPAD, c->bsize);
+	if (su->su_flags & SEGUSE_SUPERBLOCK)
+		off += DIV_UP(LFS_SBPAD, c->bsize);
+	for (i = 0; i < su->su_nsums; i++, off += n) {
+		n = check_pseg(c, segnum, off, words, inos, &ninos);
+		if (n == 0) {
+			broken = 1;
+			break;
+		}
+	}
+	__atomic_fetch_add(&c->nsums, i, __ATOMIC_RELAXED);
+
+	for (daddr = first; (uint64_t)daddr < end; daddr++) {
+		if (!is_set(c->live, daddr))
+			continue;
+		nlive++;
+		if (!broken && !is_set(c->listed, daddr))
+			bad(c, "segment %lu: block %ld is in use, but in no "
+			       "summary", segnum, daddr);
+	}
+	if (su->su_nbytes != nlive * c->bsize)
+		bad(c, "segment %lu: %u bytes in use, not %lu", segnum,
+		    su->su_nbytes, nlive * c->bsize);
+	if (!broken && su->su_ninos != ninos)
+		bad(c, "segment %lu: %u inode blocks, not %lu", segnum,
+		    su->su_ninos, ninos);
+}
+
+struct job {
+	struct check	*c;
+	int		segments;	/* or the inodes */
+};
+
+static void *check_thread(void *arg) {
+	struct job *job = arg;
+	struct check *c = job->c;
+	uint64_t n = job->segments ? c->nsegs : c->ninodes, chunk, i;
+	uint32_t *words = NULL;
+	uint8_t *inos = NULL;
+
+	/* Inodes are small, segments not */
+	chunk = job->segments ? 1 : 1024;
+	if (job->segments) {
+		words = malloc(c->fsbpseg * sizeof(uint32_t));
+		inos = malloc(DIV_UP(c->fsbpseg, 8));
+		assert(words && inos);
+	}
+	for (;;) {
+		uint64_t start = __atomic_fetch_add(&c->next, chunk,
+						    __ATOMIC_RELAXED);
+
+		if (start >= n)
+			break;
+		for (i = start; i < MIN(n, start + chunk); i++) {
+			if (job->segments)
+				check_segment(c, i, words, inos);
+			else if (i != LFS_UNUSED_INUM)
+				check_inode(c, i);
+		}
+	}
+	free(words);
+	free(inos);
+	return NULL;
+}
+
+static void run(struct check *c, int segments, int nthreads) {
+	struct job job = {c, segments};
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	int i;
+
+	assert(threads);
+	c->next = 0;
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, check_thread, &job))
+			assert(0);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+/* The superblock at LFS_LABELPAD, and the geometry it has. */
+static void check_superblocks(struct check *c, int fd, const char *path) {
+	struct dlfs64 *lfs = &c->lfs, copy;
+	char magic[sizeof(LFSZ_MAGIC) - 1];
+	int ret, i;
+
+	ret = read_superblock(fd, LFS_LABELPAD, lfs);
+	if (ret != 0 && pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+	    memcmp(magic, LFSZ_MAGIC, sizeof(magic)) == 0)
+		errx(1, "%s is compressed, uncompress it with lfsunz first",
+		     path);
+	if (ret != 0)
+		errx(1, "%s: bad superblock", path);
+	c->is64 = lfs->dlfs_magic == LFS64_MAGIC;
+	c->bsize = lfs->dlfs_bsize;
+	c->fsbpseg = lfs->dlfs_fsbpseg;
+	c->nsegs = lfs->dlfs_nseg;
+	c->nptr = c->bsize / DADDR_SIZE(c->is64);
+	if (c->bsize < LFS_DIRBLKSIZ || (c->bsize & (c->bsize - 1)) != 0 ||
+	    lfs->dlfs_fsize != c->bsize || lfs->dlfs_ibsize != c->bsize ||
+	    lfs->dlfs_sumsize != c->bsize ||
+	    lfs->dlfs_ssize != c->fsbpseg * c->bsize ||
+	    lfs->dlfs_nindir != c->nptr || lfs->dlfs_inopb != 1 ||
+	    lfs->dlfs_sepb != c->bsize / sizeof(SEGUSE) ||
+	    lfs->dlfs_ifpb != c->bsize / IFILE_SIZE(c->is64) ||
+	    c->fsbpseg < 2 || c->nsegs * c->fsbpseg > lfs->dlfs_size ||
+	    lfs->dlfs_segtabsz < DIV_UP(c->nsegs, lfs->dlfs_sepb))
+		errx(1, "%s: bad geometry", path);
+
+	for (i = 0; i < LFS_MAXNUMSB; i++) {
+		uint64_t off = lfs->dlfs_sboffs[i] * c->bsize;
+
+		if (lfs->dlfs_sboffs[i] == 0)
+			break;
+		if (off + sizeof(struct dlfs64) > c->len) {
+			bad(c, "superblock %d: at %ld, out of the image", i,
+			    (int64_t)lfs->dlfs_sboffs[i]);
+			continue;
+		}
+		if (read_superblock(fd, off, &copy) != 0)
+			bad(c, "superblock %d: bad checksum or magic", i);
+		else if (copy.dlfs_size != lfs->dlfs_size ||
+			 copy.dlfs_bsize != c->bsize ||
+			 copy.dlfs_fsbpseg != c->fsbpseg ||
+			 copy.dlfs_nseg != c->nsegs)
+			bad(c, "superblock %d: other geometry", i);
+	}
+}
+
+/* Copies the blocks of the ifile, from its inode at dlfs_idaddr. */
+static void load_ifile(struct check *c, const char *path) {
+	const union lfs_dinode *dino;
+	uint64_t nblocks, meta, lbn;
+	int64_t daddr;
+
+	dino = (const union lfs_dinode *)block(c, c->lfs.dlfs_idaddr);
+	if (dino == NULL || U_GET(c->is64, dino, di_inumber) != LFS_IFILE_INUM)
+		errx(1, "%s: no ifile at %ld", path, c->lfs.dlfs_idaddr);
+	nblocks = DIV_UP(U_GET(c->is64, dino, di_size), c->bsize);
+	meta = c->lfs.dlfs_cleansz + c->lfs.dlfs_segtabsz;
+	if (nblocks <= meta)
+		errx(1, "%s: ifile of %lu blocks", path, nblocks);
+	c->ninodes = (nblocks - meta) * c->lfs.dlfs_ifpb;
+	c->ifile = malloc(nblocks * c->bsize);
+	assert(c->ifile);
+	for (lbn = 0; lbn < nblocks; lbn++) {
+		daddr = bmap(c, dino, lbn);
+		if (block(c, daddr) == NULL)
+			errx(1, "%s: ifile block %lu at %ld", path, lbn, daddr);
+		memcpy(c->ifile + lbn * c->bsize, block(c, daddr), c->bsize);
+	}
+	if (U_GET(c->is64, ifile_entry(c, LFS_IFILE_INUM), if_daddr) !=
+	    c->lfs.dlfs_idaddr)
+		bad(c, "ifile: inode map has it at %ld, not %ld",
+		    U_GET(c->is64, ifile_entry(c, LFS_IFILE_INUM), if_daddr),
+		    c->lfs.dlfs_idaddr);
+}
+
+int main(int argc, char **argv) {
+	struct check c = {0};
+	struct timespec t0, t1;
+	uint64_t inum;
+	double secs;
+	int fd, nthreads;
+	void *img;
+
+	if (argc != 2)
+		errx(1, "Usage: %s <image>", argv[0]);
+	fd = open(argv[1], O_RDONLY);
+	if (fd < 0)
+		err(1, "Failed to open %s", argv[1]);
+	/* lseek works for devices too */
+	c.len = lseek(fd, 0, SEEK_END);
+	if ((off_t)c.len <= LFS_LABELPAD + LFS_SBPAD)
+		errx(1, "%s: too small", argv[1]);
+	img = mmap(NULL, c.len, PROT_READ, MAP_SHARED, fd, 0);
+	if (img == MAP_FAILED)
+		err(1, "Failed to map %s", argv[1]);
+	c.img = img;
+	pthread_mutex_init(&c.lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	check_superblocks(&c, fd, argv[1]);
+	load_ifile(&c, argv[1]);
+	c.live = calloc(DIV_UP(c.lfs.dlfs_size, 8), 1);
+	c.listed = calloc(DIV_UP(c.lfs.dlfs_size, 8), 1);
+	c.nrefs = calloc(c.ninodes, sizeof(uint32_t));
+	assert(c.live && c.listed && c.nrefs);
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1)
+		nthreads = 1;
+	run(&c, 0, nthreads);
+	if (inode(&c, ULFS_ROOTINO) == NULL ||
+	    (U_GET(c.is64, inode(&c, ULFS_ROOTINO), di_mode) & LFS_IFMT) !=
+		    LFS_IFDIR)
+		bad(&c, "inode %lu: root, not a directory in use",
+		    (uint64_t)ULFS_ROOTINO);
+	for (inum = ULFS_ROOTINO; inum < c.ninodes; inum++) {
+		const union lfs_dinode *dino = inode(&c, inum);
+
+		if (dino == NULL)
+			continue;
+		/* genlfs leaves directories at 1 link, the kernel doesn't mind */
+		if (c.nrefs[inum] == 0 && inum != ULFS_ROOTINO)
+			bad(&c, "inode %lu: in use, but in no directory", inum);
+		else if ((U_GET(c.is64, dino, di_mode) & LFS_IFMT) !=
+				 LFS_IFDIR &&
+			 U_GET(c.is64, dino, di_nlink) != c.nrefs[inum])
+			bad(&c, "inode %lu: %d links, but %u entries", inum,
+			    (int)U_GET(c.is64, dino, di_nlink), c.nrefs[inum]);
+	}
+	run(&c, 1, nthreads);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (c.nerrors > MAX_ERRORS)
+		printf("... %lu more\n", c.nerrors - MAX_ERRORS);
+	printf("%s: %lu segments, %lu partial segments, %lu files, %lu "
+	       "directories, %lu blocks in use in %.1f s, %lu errors\n",
+	       argv[1], c.nsegs, c.nsums, c.nfiles, c.ndirs, c.nblocks, secs,
+	       c.nerrors);
+	munmap(img, c.len);
+	close(fd);
+	return c.nerrors != 0;
+}
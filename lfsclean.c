@@ -0,0 +1,255 @@
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+
+/*
+ * lfsclean rewrites the live files of an image into a new log, from the
+ * first segment on: every segment with dead blocks is clean afterwards.
+ * Inode numbers are kept, so directories are copied as they are.
+ */
+
+enum order {
+	ORDER_TREE,	/* the files of a directory, then the directory */
+	ORDER_INODE,	/* by inode number */
+};
+
+struct inode_list {
+	uint64_t	*inums;
+	uint64_t	n;
+	uint64_t	cap;
+};
+
+/*
+ * How many times reading every file in order has to seek: for each file,
+ * its inode block, then its data.
+ */
+struct locality {
+	uint64_t	nblocks;
+	uint64_t	nextents;
+	uint64_t	nseeks;
+};
+
+static void list_add(struct inode_list *list, uint64_t inum) {
+	if (list->n == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 1024;
+		list->inums = realloc(list->inums, list->cap * sizeof(uint64_t));
+		assert(list->inums);
+	}
+	list->inums[list->n++] = inum;
+}
+
+static uint64_t max_inodes(struct fs *fs) {
+	return fs->ifile.nmap * fs->lfs.dlfs_ifpb;
+}
+
+static int in_use(struct fs *fs, uint64_t inum) {
+	struct lfs_file_info info;
+
+	return stat_file(fs, inum, &info) == 0;
+}
+
+/* Adds the files under directory (inum) in the order genlfs writes them. */
+static void tree_order(struct fs *fs, uint64_t inum, uint8_t *seen,
+		       struct inode_list *list) {
+	struct directory *dir = malloc(sizeof(struct directory));
+	char name[LFS_MAXNAMLEN + 1];
+	uint64_t child;
+	int off = 0, type;
+
+	assert(dir);
+	seen[inum / 8] |= 1 << inum % 8;
+	if (read_dir(fs, inum, dir) != 0)
+		errx(1, "Failed to read directory %lu", inum);
+	while (dir_entry(dir, &off, name, &child, &type) == 0) {
+		if (child >= max_inodes(fs) || (seen[child / 8] & (1 << child % 8)))
+			continue;
+		if (type == LFS_DT_DIR) {
+			tree_order(fs, child, seen, list);
+		} else {
+			seen[child / 8] |= 1 << child % 8;
+			list_add(list, child);
+		}
+	}
+	list_add(list, inum);
+	free(dir);
+}
+
+/*
+ * The inodes in use, in (order). Inodes not in any directory go after the
+ * others in tree order, they are live as far as the ifile is concerned.
+ */
+static void live_inodes(struct fs *fs, enum order order,
+			struct inode_list *list) {
+	uint64_t n = max_inodes(fs), i;
+	uint8_t *seen = calloc(n / 8 + 1, 1);
+
+	assert(seen);
+	seen[LFS_IFILE_INUM / 8] |= 1 << LFS_IFILE_INUM % 8;
+	if (order == ORDER_TREE)
+		tree_order(fs, ULFS_ROOTINO, seen, list);
+	for (i = ULFS_ROOTINO; i < n; i++)
+		if (!(seen[i / 8] & (1 << i % 8)) && in_use(fs, i))
+			list_add(list, i);
+	free(seen);
+}
+
+static void measure(struct fs *fs, struct inode_list *list,
+		    struct locality *loc) {
+	int64_t last = -1;
+	uint64_t i, j, next;
+
+	memset(loc, 0, sizeof(*loc));
+	for (i = 0; i < list->n; i++) {
+		struct lfs_file_info info;
+		struct lfs_extent *ext;
+
+		if (stat_file(fs, list->inums[i], &info) != 0 ||
+		    file_extents(fs, list->inums[i], &ext, &next) != 0)
+			errx(1, "Failed to map inode %lu", list->inums[i]);
+		if (info.daddr != last)
+			loc->nseeks++;
+		last = info.daddr + 1;
+		for (j = 0; j < next; j++) {
+			if (ext[j].daddr != last)
+				loc->nseeks++;
+			last = ext[j].daddr + ext[j].len;
+			loc->nblocks += ext[j].len;
+		}
+		loc->nextents += next;
+		free(ext);
+	}
+}
+
+/* Segments not clean at the last checkpoint, see write_ifile() */
+static uint64_t dirty_segments(struct fs *fs) {
+	CLEANERINFO *ci = fs->ifile.cleanerinfo;
+
+	return fs->nsegs - (fs->is64 ? ci->u_64.clean : ci->u_32.clean);
+}
+
+static void usage(char *prog) {
+	errx(1, "Usage: %s [--order tree|inode] <image> [<output image>]",
+	     prog);
+}
+
+int main(int argc, char **argv) {
+	static struct option long_opts[] = {
+		{"order", required_argument, 0, 'o'},
+		{0, 0, 0, 0}};
+	struct fs src, dst;
+	struct lfs_params params = {0};
+	struct inode_list list = {0};
+	struct locality before, after;
+	enum order order = ORDER_TREE;
+	uint64_t nbytes, dirty_before, dirty_after, reclaimed, i;
+	char *image, *output, tmp[PATH_MAX];
+	struct stat sb;
+	int opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "o:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'o':
+			if (strcmp(optarg, "tree") == 0)
+				order = ORDER_TREE;
+			else if (strcmp(optarg, "inode") == 0)
+				order = ORDER_INODE;
+			else
+				usage(argv[0]);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 1 && argc - optind != 2)
+		usage(argv[0]);
+	image = argv[optind];
+	output = argc - optind == 2 ? argv[optind + 1] : NULL;
+
+	src.fd = open(image, O_RDONLY);
+	if (src.fd < 0)
+		err(1, "Failed to open %s", image);
+	ret = load_lfs(&src);
+	if (ret != 0)
+		errx(1, "Failed to load the FS: %s", strerror(ret));
+
+	/* Without an output, the image is replaced when we are done */
+	if (output == NULL) {
+		if (fstat(src.fd, &sb) != 0 || !S_ISREG(sb.st_mode))
+			errx(1, "%s is not a file, give an output image", image);
+		snprintf(tmp, sizeof(tmp), "%s.clean", image);
+		output = tmp;
+	}
+	dst.fd = open(output, O_CREAT | O_TRUNC | O_RDWR, DEFFILEMODE);
+	if (dst.fd < 0)
+		err(1, "Failed to create %s", output);
+
+	/* Same geometry and number of segments */
+	params.bsize = src.lfs.dlfs_bsize;
+	params.ssize = src.lfs.dlfs_ssize;
+	params.is64 = src.is64;
+	nbytes = (src.nsegs + 1) * src.lfs.dlfs_ssize;
+	ret = init_lfs_params(&dst, nbytes, &params);
+	if (ret != 0)
+		errx(1, "Failed to initialize the FS: %s", strerror(ret));
+	assert(dst.nsegs == src.nsegs);
+
+	live_inodes(&src, order, &list);
+	measure(&src, &list, &before);
+	dirty_before = dirty_segments(&src);
+
+	for (i = 0; i < list.n; i++) {
+		struct lfs_file_info info;
+		char *data;
+
+		ret = read_file(&src, list.inums[i], &data, &info);
+		if (ret != 0)
+			errx(1, "Failed to read inode %lu: %s", list.inums[i],
+			     strerror(ret));
+		ret = write_file(&dst, data, info.size, list.inums[i],
+				 info.mode, info.nlink, info.flags);
+		if (ret != 0)
+			errx(1, "Failed to write inode %lu: %s", list.inums[i],
+			     strerror(ret));
+		free(data);
+	}
+	ret = finish_lfs(&dst);
+	if (ret != 0)
+		errx(1, "Failed to write the ifile: %s", strerror(ret));
+
+	measure(&dst, &list, &after);
+	dirty_after = dirty_segments(&dst);
+	reclaimed = dirty_before > dirty_after ? dirty_before - dirty_after : 0;
+
+	if (fstat(dst.fd, &sb) == 0 && S_ISREG(sb.st_mode) &&
+	    (uint64_t)sb.st_size < nbytes && ftruncate(dst.fd, nbytes) != 0)
+		warn("Failed to extend the image");
+	if (fsync(dst.fd) != 0)
+		err(1, "Failed to write %s", output);
+	close(dst.fd);
+	close(src.fd);
+	if (output == tmp && rename(tmp, image) != 0)
+		err(1, "Failed to replace %s", image);
+
+	printf("%lu files, %lu blocks\n", list.n, after.nblocks);
+	printf("segments in use: %lu before, %lu after, %lu reclaimed "
+	       "(%lu bytes)\n", dirty_before, dirty_after, reclaimed,
+	       reclaimed * src.lfs.dlfs_ssize);
+	printf("reading every file in %s order: %lu data extents and %lu "
+	       "seeks before, %lu data extents and %lu seeks after\n",
+	       order == ORDER_TREE ? "tree" : "inode", before.nextents,
+	       before.nseeks, after.nextents, after.nseeks);
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+
+/*
+ * lfsdiff tells how much of an image changed from another one with the
+ * same geometry: the blocks (and segments) that differ at the same offset,
+ * out of the ones in use (not zero) in either, and the blocks of the second
+ * one that are nowhere in the first. A delta transfer with rolling
+ * checksums (rsync, zsync) only has to send those.
+ */
+
+struct hashes {
+	uint64_t	*h;
+	uint64_t	n;
+	uint64_t	cap;
+};
+
+struct image {
+	struct fs	fs;
+	off_t		size;
+	char		*buf;		/* one segment */
+};
+
+static void open_image(struct image *img, const char *path) {
+	struct stat sb;
+	int ret;
+
+	img->fs.fd = open(path, O_RDONLY);
+	if (img->fs.fd < 0)
+		err(1, "Failed to open %s", path);
+	ret = load_lfs(&img->fs);
+	if (ret != 0)
+		errx(1, "Failed to load %s: %s", path, strerror(ret));
+	if (fstat(img->fs.fd, &sb) != 0)
+		err(1, "Failed to stat %s", path);
+	img->size = S_ISREG(sb.st_mode) ? sb.st_size :
+					  lseek(img->fs.fd, 0, SEEK_END);
+	img->buf = malloc(img->fs.lfs.dlfs_ssize);
+	assert(img->buf);
+}
+
+/* Reads (len) bytes at (off), zeros past the end and in holes. */
+static void read_chunk(struct image *img, off_t off, size_t len) {
+	off_t data = lseek(img->fs.fd, off, SEEK_DATA);
+	ssize_t n = 0;
+
+	if (off < img->size && (data < 0 || data < off + (off_t)len)) {
+		n = pread(img->fs.fd, img->buf, len, off);
+		if (n < 0)
+			err(1, "Failed to read the image");
+	}
+	memset(img->buf + n, 0, len - n);
+}
+
+static int is_zero(const char *buf, size_t len) {
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+/* FNV-1a */
+static uint64_t hash_block(const char *buf, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (uint8_t)buf[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+static void hashes_add(struct hashes *hs, uint64_t h) {
+	if (hs->n == hs->cap) {
+		hs->cap = hs->cap ? hs->cap * 2 : 1024;
+		hs->h = realloc(hs->h, hs->cap * sizeof(uint64_t));
+		assert(hs->h);
+	}
+	hs->h[hs->n++] = h;
+}
+
+static int hash_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv) {
+	struct image a, b;
+	struct hashes old = {0}, new = {0};
+	uint64_t bsize, ssize, nblocks = 0, changed = 0, nsegs = 0;
+	uint64_t changed_segs = 0, diff_bytes = 0, missing = 0, i, j;
+	off_t off, end;
+
+	if (argc != 3)
+		errx(1, "Usage: %s <image> <other image>", argv[0]);
+	open_image(&a, argv[1]);
+	open_image(&b, argv[2]);
+	bsize = a.fs.lfs.dlfs_bsize;
+	ssize = a.fs.lfs.dlfs_ssize;
+	if (b.fs.lfs.dlfs_bsize != bsize || b.fs.lfs.dlfs_ssize != ssize)
+		errx(1, "The images have different block or segment sizes");
+
+	end = a.size > b.size ? a.size : b.size;
+	for (off = 0; off < end; off += ssize) {
+		uint64_t len = MIN(ssize, (uint64_t)(end - off));
+		int used = 0, seg_changed = 0;
+
+		read_chunk(&a, off, len);
+		read_chunk(&b, off, len);
+		for (i = 0; i < len; i += bsize) {
+			char *x = a.buf + i, *y = b.buf + i;
+			uint64_t n = MIN(bsize, len - i);
+
+			int zx = is_zero(x, n), zy = is_zero(y, n);
+
+			if (!zx)
+				hashes_add(&old, hash_block(x, n));
+			if (!zy)
+				hashes_add(&new, hash_block(y, n));
+			if (zx && zy)
+				continue;
+			nblocks++;
+			used = 1;
+			if (memcmp(x, y, n) == 0)
+				continue;
+			changed++;
+			seg_changed = 1;
+			for (j = 0; j < n; j++)
+				diff_bytes += x[j] != y[j];
+		}
+		nsegs += used;
+		changed_segs += seg_changed;
+	}
+
+	qsort(old.h, old.n, sizeof(uint64_t), hash_cmp);
+	for (i = 0; i < new.n; i++)
+		if (bsearch(&new.h[i], old.h, old.n, sizeof(uint64_t),
+			    hash_cmp) == NULL)
+			missing++;
+
+	printf("blocks: %lu of %lu in use changed (%.2f%%, %lu bytes)\n",
+	       changed, nblocks, nblocks ? 100.0 * changed / nblocks : 0.0,
+	       changed * bsize);
+	printf("segments: %lu of %lu in use changed\n", changed_segs, nsegs);
+	printf("bytes: %lu differ\n", diff_bytes);
+	printf("new: %lu of %lu blocks in use in %s are not in %s (%.2f%%, "
+	       "%lu bytes)\n", missing, new.n, argv[2], argv[1],
+	       new.n ? 100.0 * missing / new.n : 0.0, missing * bsize);
+
+	free(old.h);
+	free(new.h);
+	free(a.buf);
+	free(b.buf);
+	free_lfs(&a.fs);
+	free_lfs(&b.fs);
+	close(a.fs.fd);
+	close(b.fs.fd);
+	return 0;
+}
@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+#include "lfsr.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+#define DIV_UP(_x, _y) (((_x) + (_y) - 1) / (_y))
+
+/* Block (daddr) of the image, NULL if it is out of the FS or the image. */
+static const char *block(struct lfsr *r, int64_t daddr) {
+	if (daddr <= 0 || (uint64_t)daddr >= r->nblocks ||
+	    ((uint64_t)daddr + 1) * r->bsize > r->len)
+		return NULL;
+	return r->img + daddr * r->bsize;
+}
+
+/*
+ * The single indirect block with the addresses of data blocks NDADDR +
+ * (leaf) * nptr on, of (dino): the one in di_ib[0] is leaf 0, the ones under
+ * di_ib[1] the next nptr, then the ones under di_ib[2]. NULL if a hole.
+ */
+static int leaf_block(struct lfsr *r, uint64_t ino, const void *dino,
+		      uint64_t leaf, const char **blk) {
+	unsigned slot = (ino * 31 + leaf) % LFSR_CACHE_SLOTS;
+	uint64_t n = r->nptr, l = leaf, idx[2];
+	int depth, i;
+	int64_t daddr;
+
+	if (r->leaves[slot].ino == ino && r->leaves[slot].leaf == leaf) {
+		*blk = r->leaves[slot].blk;
+		return 0;
+	}
+	if (l == 0) {
+		daddr = U_GET(r->is64, (const union lfs_dinode *)dino, di_ib[0]);
+		depth = 0;
+	} else if (--l < n) {
+		daddr = U_GET(r->is64, (const union lfs_dinode *)dino, di_ib[1]);
+		depth = 1;
+		idx[0] = l;
+	} else if ((l -= n) < n * n) {
+		daddr = U_GET(r->is64, (const union lfs_dinode *)dino, di_ib[2]);
+		depth = 2;
+		idx[0] = l / n;
+		idx[1] = l % n;
+	} else {
+		return EFBIG;
+	}
+	for (i = 0; i < depth && daddr != 0; i++) {
+		const char *ind = block(r, daddr);
+
+		if (ind == NULL)
+			return EIO;
+		daddr = DADDR_GET(r->is64, ind, idx[i]);
+	}
+	*blk = NULL;
+	if (daddr != 0 && (*blk = block(r, daddr)) == NULL)
+		return EIO;
+
+	r->leaves[slot].ino = ino;
+	r->leaves[slot].leaf = leaf;
+	r->leaves[slot].blk = *blk;
+	return 0;
+}
+
+/* Where block (lbn) of (dino) is, 0 if a hole. */
+static int bmap(struct lfsr *r, uint64_t ino, const void *dino, uint64_t lbn,
+		int64_t *daddr) {
+	const char *blk;
+	int ret;
+
+	if (lbn < ULFS_NDADDR) {
+		*daddr = U_GET(r->is64, (const union lfs_dinode *)dino,
+			       di_db[lbn]);
+		return 0;
+	}
+	lbn -= ULFS_NDADDR;
+	ret = leaf_block(r, ino, dino, lbn / r->nptr, &blk);
+	if (ret != 0)
+		return ret;
+	*daddr = blk == NULL ? 0 : DADDR_GET(r->is64, blk, lbn % r->nptr);
+	return 0;
+}
+
+/* Inode (ino), where the inode map of the ifile says. */
+static int get_inode(struct lfsr *r, uint64_t ino, const void **dino) {
+	unsigned slot = ino % LFSR_CACHE_SLOTS;
+	const union lfs_dinode *d;
+	const char *blk;
+	int64_t daddr;
+	int ret;
+
+	if (ino == LFS_UNUSED_INUM || ino >= r->ninodes)
+		return ENOENT;
+	if (r->inodes[slot].ino == ino) {
+		*dino = r->inodes[slot].dino;
+		return 0;
+	}
+	ret = bmap(r, LFS_IFILE_INUM, r->ifile, r->imap + ino / r->ifpb,
+		   &daddr);
+	if (ret != 0)
+		return ret;
+	blk = block(r, daddr);
+	if (blk == NULL)
+		return EIO;
+	daddr = U_GET(r->is64,
+		      (const IFILE *)(blk + ino % r->ifpb * IFILE_SIZE(r->is64)),
+		      if_daddr);
+	if (daddr == LFS_UNUSED_DADDR)
+		return ENOENT;
+	d = (const union lfs_dinode *)block(r, daddr);
+	if (d == NULL || (uint64_t)U_GET(r->is64, d, di_inumber) != ino)
+		return EIO;
+
+	r->inodes[slot].ino = ino;
+	r->inodes[slot].dino = d;
+	*dino = d;
+	return 0;
+}
+
+int lfsr_open(struct lfsr *r, int fd) {
+	struct dlfs64 lfs;
+	uint64_t size;
+	off_t len;
+	void *img;
+	int ret;
+
+	memset(r, 0, sizeof(*r));
+	ret = read_superblock(fd, LFS_LABELPAD, &lfs);
+	if (ret != 0)
+		return ret;
+	/* lseek works for devices too */
+	len = lseek(fd, 0, SEEK_END);
+	if (len < 0)
+		return errno;
+	img = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (img == MAP_FAILED)
+		return errno;
+	r->img = img;
+	r->len = len;
+	r->is64 = lfs.dlfs_magic == LFS64_MAGIC;
+	r->bsize = lfs.dlfs_bsize;
+	r->nblocks = lfs.dlfs_size;
+	r->nptr = r->bsize / DADDR_SIZE(r->is64);
+	r->imap = lfs.dlfs_cleansz + lfs.dlfs_segtabsz;
+	r->ifpb = lfs.dlfs_ifpb;
+
+	r->ifile = block(r, lfs.dlfs_idaddr);
+	if (r->ifile == NULL ||
+	    U_GET(r->is64, (const union lfs_dinode *)r->ifile, di_inumber) !=
+		    LFS_IFILE_INUM) {
+		lfsr_close(r);
+		return EINVAL;
+	}
+	size = U_GET(r->is64, (const union lfs_dinode *)r->ifile, di_size);
+	if (DIV_UP(size, r->bsize) > r->imap)
+		r->ninodes = (DIV_UP(size, r->bsize) - r->imap) * r->ifpb;
+	return 0;
+}
+
+void lfsr_close(struct lfsr *r) {
+	munmap((void *)r->img, r->len);
+	r->img = NULL;
+}
+
+int lfsr_stat(struct lfsr *r, uint64_t ino, struct lfsr_stat *st) {
+	const union lfs_dinode *d;
+	int ret;
+
+	ret = get_inode(r, ino, (const void **)&d);
+	if (ret != 0)
+		return ret;
+	st->ino = ino;
+	st->mode = U_GET(r->is64, d, di_mode);
+	st->nlink = U_GET(r->is64, d, di_nlink);
+	st->uid = U_GET(r->is64, d, di_uid);
+	st->gid = U_GET(r->is64, d, di_gid);
+	st->size = U_GET(r->is64, d, di_size);
+	st->mtime = U_GET(r->is64, d, di_mtime);
+	st->blocks = U_GET(r->is64, d, di_blocks);
+	return 0;
+}
+
+int lfsr_readdir(struct lfsr *r, uint64_t ino, lfsr_dir_fn fn, void *arg) {
+	const union lfs_dinode *d;
+	char name[LFS_MAXNAMLEN + 1];
+	uint64_t size, lbn, off;
+	int64_t daddr;
+	int ret;
+
+	ret = get_inode(r, ino, (const void **)&d);
+	if (ret != 0)
+		return ret;
+	if ((U_GET(r->is64, d, di_mode) & LFS_IFMT) != LFS_IFDIR)
+		return ENOTDIR;
+	size = U_GET(r->is64, d, di_size);
+	for (lbn = 0; lbn < DIV_UP(size, r->bsize); lbn++) {
+		uint64_t len = MIN(r->bsize, size - lbn * r->bsize);
+		const char *blk;
+
+		ret = bmap(r, ino, d, lbn, &daddr);
+		if (ret != 0)
+			return ret;
+		blk = block(r, daddr);
+		if (blk == NULL)
+			return EIO;
+		for (off = 0; off < len;) {
+			const LFS_DIRHEADER *hdr = (const LFS_DIRHEADER *)(blk +
+									  off);
+			uint16_t reclen = U_GET(r->is64, hdr, dh_reclen);
+			uint8_t namlen = U_GET(r->is64, hdr, dh_namlen);
+			uint64_t entry = r->is64 ? hdr->u_64.dh_inoA |
+				(uint64_t)hdr->u_64.dh_inoB << 32
+						 : hdr->u_32.dh_ino;
+
+			if (reclen == 0 || off + reclen > len ||
+			    DIRHDR_SIZE(r->is64) + namlen > reclen)
+				return EIO;
+			off += reclen;
+			if (entry == LFS_UNUSED_INUM)
+				continue;
+			memcpy(name, (const char *)hdr + DIRHDR_SIZE(r->is64),
+			       namlen);
+			name[namlen] = '\0';
+			if (fn(arg, name, entry, U_GET(r->is64, hdr, dh_type)))
+				return 0;
+		}
+	}
+	return 0;
+}
+
+struct find {
+	const char	*name;
+	size_t		len;
+	uint64_t	ino;
+};
+
+static int find_entry(void *arg, const char *name, uint64_t ino, int type) {
+	struct find *f = arg;
+
+	if (strlen(name) != f->len || memcmp(name, f->name, f->len) != 0)
+		return 0;
+	f->ino = ino;
+	return 1;
+}
+
+int lfsr_lookup(struct lfsr *r, const char *path, uint64_t *ino) {
+	uint64_t cur = ULFS_ROOTINO;
+	int ret;
+
+	for (;;) {
+		struct find f = {.name = path + strspn(path, "/")};
+
+		f.len = strcspn(f.name, "/");
+		if (f.len == 0)
+			break;
+		path = f.name + f.len;
+		if (f.len > LFS_MAXNAMLEN)
+			return ENAMETOOLONG;
+		ret = lfsr_readdir(r, cur, find_entry, &f);
+		if (ret != 0)
+			return ret;
+		if (f.ino == 0)
+			return ENOENT;
+		cur = f.ino;
+	}
+	*ino = cur;
+	return 0;
+}
+
+int lfsr_pread(struct lfsr *r, uint64_t ino, void *buf, uint64_t len,
+	       uint64_t off, uint64_t *nread) {
+	const union lfs_dinode *d;
+	uint64_t size, done;
+	int64_t daddr;
+	int ret;
+
+	*nread = 0;
+	ret = get_inode(r, ino, (const void **)&d);
+	if (ret != 0)
+		return ret;
+	size = U_GET(r->is64, d, di_size);
+	if (off >= size)
+		return 0;
+	len = MIN(len, size - off);
+	for (done = 0; done < len;) {
+		uint64_t lbn = (off + done) / r->bsize;
+		uint64_t boff = (off + done) % r->bsize;
+		uint64_t n = MIN(r->bsize - boff, len - done);
+		const char *blk;
+
+		ret = bmap(r, ino, d, lbn, &daddr);
+		if (ret != 0)
+			return ret;
+		if (daddr == 0) {
+			memset((char *)buf + done, 0, n);
+		} else {
+			blk = block(r, daddr);
+			if (blk == NULL)
+				return EIO;
+			memcpy((char *)buf + done, blk + boff, n);
+		}
+		done += n;
+	}
+	*nread = len;
+	return 0;
+}
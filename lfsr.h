@@ -0,0 +1,74 @@
+#ifndef _LFSR_H_
+#define _LFSR_H_
+
+#include <stdint.h>
+
+/*
+ * A read-only view of an image, to read it in the same process (tests,
+ * tools) without loading it for writing (load_lfs()) or booting a guest.
+ * The image is mapped, and the inodes and the indirect blocks last used are
+ * cached. It is read as the kernel would, from the superblock and the ifile
+ * of the last checkpoint. A reader is for one thread at a time: open one
+ * for each.
+ */
+
+#define LFSR_CACHE_SLOTS	1024
+
+struct lfsr_stat {
+	uint64_t	ino;
+	uint16_t	mode;		/* LFS_IFMT and permissions */
+	int16_t		nlink;
+	uint32_t	uid;
+	uint32_t	gid;
+	uint64_t	size;
+	int64_t		mtime;
+	uint64_t	blocks;		/* data and indirect */
+};
+
+struct lfsr {
+	const char	*img;
+	uint64_t	len;		/* of the image */
+	int		is64;
+	uint32_t	bsize;
+	uint64_t	nblocks;	/* in the FS */
+	uint64_t	nptr;		/* disk addresses per block */
+	const void	*ifile;		/* its inode */
+	uint64_t	imap;		/* first block of the inode map */
+	uint64_t	ifpb;
+	uint64_t	ninodes;
+
+	/* Direct-mapped, by inode number and by (inode, leaf) */
+	struct {
+		uint64_t	ino;
+		const void	*dino;
+	} inodes[LFSR_CACHE_SLOTS];
+	struct {
+		uint64_t	ino;
+		uint64_t	leaf;	/* (lbn - NDADDR) / nptr */
+		const char	*blk;
+	} leaves[LFSR_CACHE_SLOTS];
+};
+
+/*
+ * Called by lfsr_readdir() on each entry (. and .. too), with its inode
+ * number and type (LFS_DT_*); nonzero stops there.
+ */
+typedef int (*lfsr_dir_fn)(void *arg, const char *name, uint64_t ino,
+			   int type);
+
+/* EINVAL if (fd) is not an image (a compressed one has to be uncompressed). */
+int lfsr_open(struct lfsr *r, int fd);
+void lfsr_close(struct lfsr *r);
+
+/* The inode of (path), from the root. ENOENT or ENOTDIR if not found. */
+int lfsr_lookup(struct lfsr *r, const char *path, uint64_t *ino);
+int lfsr_stat(struct lfsr *r, uint64_t ino, struct lfsr_stat *st);
+int lfsr_readdir(struct lfsr *r, uint64_t ino, lfsr_dir_fn fn, void *arg);
+/*
+ * Reads up to (len) bytes of file (ino) at (off) into (buf); (*nread) is
+ * fewer at the end of the file. Holes read as zeros.
+ */
+int lfsr_pread(struct lfsr *r, uint64_t ino, void *buf, uint64_t len,
+	       uint64_t off, uint64_t *nread);
+
+#endif /* !_LFSR_H_ */
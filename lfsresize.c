@@ -0,0 +1,117 @@
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+
+/*
+ * lfsresize grows or shrinks an image: it writes a new checkpoint with the
+ * new size, and extends or truncates the image file. Only metadata is
+ * written, unless shrinking past segments in use.
+ */
+
+static uint64_t parse_size(const char *str) {
+	unsigned shift = 0;
+	char *end;
+	uint64_t n;
+
+	errno = 0;
+	n = strtoull(str, &end, 0);
+	switch (*end) {
+	case 'k': case 'K':
+		shift = 10;
+		end++;
+		break;
+	case 'm': case 'M':
+		shift = 20;
+		end++;
+		break;
+	case 'g': case 'G':
+		shift = 30;
+		end++;
+		break;
+	case 't': case 'T':
+		shift = 40;
+		end++;
+		break;
+	}
+	/* Nor negative, nor past 64 bits, before or after the suffix */
+	if (*end != '\0' || end == str || strchr(str, '-') != NULL ||
+	    errno == ERANGE || n > UINT64_MAX >> shift)
+		return 0;
+	return n << shift;
+}
+
+static void usage(char *prog) {
+	errx(1, "Usage: %s <image> <size>", prog);
+}
+
+int main(int argc, char **argv) {
+	struct fs fs;
+	uint64_t nbytes, nsegs;
+	uint32_t nsb;
+	struct stat sb;
+	off_t devsize;
+	int ret;
+
+	if (argc != 3)
+		usage(argv[0]);
+	nbytes = parse_size(argv[2]);
+	if (nbytes == 0)
+		usage(argv[0]);
+
+	fs.fd = open(argv[1], O_RDWR);
+	if (fs.fd < 0)
+		err(1, "Failed to open %s", argv[1]);
+	if (fstat(fs.fd, &sb) != 0)
+		err(1, "Failed to stat %s", argv[1]);
+	ret = load_lfs(&fs);
+	if (ret != 0)
+		errx(1, "Failed to load the FS: %s", strerror(ret));
+	nsegs = fs.nsegs;
+
+	/* A device has to be large enough already */
+	if (!S_ISREG(sb.st_mode)) {
+		devsize = lseek(fs.fd, 0, SEEK_END);
+		if (devsize < 0 || (uint64_t)devsize < nbytes)
+			errx(1, "%s is smaller than %lu bytes", argv[1], nbytes);
+	}
+
+	ret = resize_lfs(&fs, nbytes);
+	if (ret == ENOSPC)
+		errx(1, "The files in %s don't fit in %lu bytes, or not in the "
+			"clean segments there (try lfsclean first)", argv[1],
+		     nbytes);
+	if (ret != 0)
+		errx(1, "Failed to resize the FS: %s", strerror(ret));
+
+	/* The new checkpoint only refers to blocks before the new end */
+	if (S_ISREG(sb.st_mode) && (uint64_t)sb.st_size < nbytes &&
+	    ftruncate(fs.fd, nbytes) != 0)
+		err(1, "Failed to extend %s", argv[1]);
+	ret = finish_lfs(&fs);
+	if (ret != 0)
+		errx(1, "Failed to write the ifile: %s", strerror(ret));
+	if (fsync(fs.fd) != 0)
+		err(1, "Failed to write %s", argv[1]);
+	if (S_ISREG(sb.st_mode) && (uint64_t)sb.st_size > nbytes &&
+	    ftruncate(fs.fd, nbytes) != 0)
+		err(1, "Failed to truncate %s", argv[1]);
+
+	for (nsb = 1; nsb < LFS_MAXNUMSB && fs.lfs.dlfs_sboffs[nsb] != 0; nsb++)
+		;
+	printf("segments: %lu before, %lu after; %u superblocks\n", nsegs,
+	       fs.nsegs, nsb);
+
+	free_lfs(&fs);
+	close(fs.fd);
+	return 0;
+}
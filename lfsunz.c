@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lfsz.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+
+/*
+ * lfsunz reads an image written by genlfs --compress: one segment (to
+ * stdout), without reading any other, or all of it into a raw image, where
+ * the segments that were left out are holes.
+ */
+
+static void usage(char *prog) {
+	errx(1, "Usage: %s [--segment N] <compressed image> [<image>]", prog);
+}
+
+static void write_all(int fd, const char *buf, uint64_t len, off_t off) {
+	ssize_t n;
+
+	while (len > 0) {
+		n = off < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, off);
+		if (n <= 0)
+			err(1, "Failed to write the segment");
+		buf += n;
+		len -= n;
+		if (off >= 0)
+			off += n;
+	}
+}
+
+/* Leaves a hole where a page is all zeros, like the raw image had. */
+static void write_sparse(int fd, const char *buf, uint64_t len, off_t off) {
+	uint64_t i, n, start = 0;
+
+	for (i = 0; i < len; i += n) {
+		n = MIN(4096, len - i);
+		if (buf[i] == 0 && memcmp(buf + i, buf + i + 1, n - 1) == 0) {
+			if (start < i)
+				write_all(fd, buf + start, i - start,
+					  off + start);
+			start = i + n;
+		}
+	}
+	if (start < len)
+		write_all(fd, buf + start, len - start, off + start);
+}
+
+int main(int argc, char **argv) {
+	static struct option long_opts[] = {
+		{"segment", required_argument, 0, 'n'},
+		{0, 0, 0, 0}};
+	struct lfsz z;
+	uint64_t segnum = 0, i, off;
+	int opt, ret, fd, out, one = 0;
+	char *buf, *end;
+
+	while ((opt = getopt_long(argc, argv, "n:", long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			segnum = strtoull(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+				errx(1, "Invalid segment: %s", optarg);
+			one = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != (one ? 1 : 2))
+		usage(argv[0]);
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0)
+		err(1, "Failed to open %s", argv[optind]);
+	ret = lfsz_open(&z, fd);
+	if (ret != 0)
+		errx(1, "Not a compressed image: %s", argv[optind]);
+	buf = malloc(z.h.ssize);
+	assert(buf);
+
+	if (one) {
+		ret = lfsz_read_segment(&z, segnum, buf);
+		if (ret != 0)
+			errx(1, "Failed to read segment %lu: %s", segnum,
+			     strerror(ret));
+		off = segnum * z.h.ssize;
+		write_all(STDOUT_FILENO, buf, MIN(z.h.ssize, z.h.nbytes - off),
+			  -1);
+	} else {
+		struct stat sb;
+
+		out = open(argv[optind + 1], O_CREAT | O_RDWR | O_TRUNC,
+			   DEFFILEMODE);
+		if (out < 0)
+			err(1, "Failed to create %s", argv[optind + 1]);
+		for (i = 0; i < z.h.nframes; i++) {
+			segnum = z.frames[i].segnum;
+			ret = lfsz_read_segment(&z, segnum, buf);
+			if (ret != 0)
+				errx(1, "Failed to read segment %lu: %s",
+				     segnum, strerror(ret));
+			off = segnum * z.h.ssize;
+			write_sparse(out, buf, MIN(z.h.ssize, z.h.nbytes - off),
+				     off);
+		}
+		if (fstat(out, &sb) == 0 && S_ISREG(sb.st_mode) &&
+		    ftruncate(out, z.h.nbytes) != 0)
+			err(1, "Failed to extend %s", argv[optind + 1]);
+		close(out);
+	}
+
+	free(buf);
+	lfsz_close(&z);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "config.h"
+#include "lfs.h"
+#include "lfsz.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+
+/*
+ * The log only goes forward, so a segment is written to memory until the
+ * log leaves it (see start_segment()), and then queued for the threads that
+ * compress it. The frames go to the image in the order they are done, the
+ * index tells where each one ended up. The segments with a superblock stay
+ * in memory until lfsz_finish(), as the last superblocks go there.
+ */
+
+struct zseg {
+	uint64_t	segnum;
+	char		*buf;
+	struct zseg	*next;
+};
+
+struct lfsz_writer {
+	struct lfs_output	out;
+	int			fd;
+	uint64_t		ssize;
+	uint64_t		nbytes;
+	struct zseg		*open;		/* being written */
+	int			failed;		/* error seen by the writer */
+
+	/* The rest is under the lock */
+	pthread_mutex_t		lock;
+	pthread_cond_t		more;
+	pthread_cond_t		room;
+	struct zseg		*queue;		/* to compress, in order */
+	struct zseg		**tail;
+	int			queued;
+	int			max_queued;
+	int			stop;
+	int			error;
+	uint64_t		end;		/* where the next frame goes */
+	struct lfsz_frame	*frames;
+	uint64_t		nframes;
+	uint64_t		cap;
+
+	pthread_t		*threads;
+	int			nthreads;
+};
+
+static int is_zero(const char *buf, size_t len) {
+	return buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0;
+}
+
+static void set_error(struct lfsz_writer *w, int error) {
+	if (w->error == 0)
+		w->error = error;
+}
+
+/* Compresses (seg) into (zbuf), and writes it after the last frame. */
+static void compress_segment(struct lfsz_writer *w, struct zseg *seg,
+			     char *zbuf, uLongf zlen) {
+	uint64_t off;
+	ssize_t ret;
+
+	if (is_zero(seg->buf, w->ssize))
+		return;
+	ret = compress2((Bytef *)zbuf, &zlen, (Bytef *)seg->buf, w->ssize,
+			Z_BEST_SPEED);
+
+	pthread_mutex_lock(&w->lock);
+	if (ret != Z_OK) {
+		set_error(w, ret == Z_MEM_ERROR ? ENOMEM : EIO);
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+	off = w->end;
+	w->end += zlen;
+	if (w->nframes == w->cap) {
+		w->cap = w->cap ? w->cap * 2 : 64;
+		w->frames = realloc(w->frames, w->cap * sizeof(*w->frames));
+		assert(w->frames);
+	}
+	w->frames[w->nframes++] =
+	    (struct lfsz_frame){.segnum = seg->segnum, .off = off, .len = zlen};
+	pthread_mutex_unlock(&w->lock);
+
+	ret = pwrite(w->fd, zbuf, zlen, off);
+	if (ret != (ssize_t)zlen) {
+		pthread_mutex_lock(&w->lock);
+		set_error(w, ret < 0 ? errno : EIO);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+static void *compress_thread(void *arg) {
+	struct lfsz_writer *w = arg;
+	uLongf zlen = compressBound(w->ssize);
+	char *zbuf = malloc(zlen);
+	struct zseg *seg;
+
+	assert(zbuf);
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->queue == NULL && !w->stop)
+			pthread_cond_wait(&w->more, &w->lock);
+		seg = w->queue;
+		if (seg == NULL)
+			break;
+		w->queue = seg->next;
+		if (w->queue == NULL)
+			w->tail = &w->queue;
+		w->queued--;
+		pthread_cond_signal(&w->room);
+		pthread_mutex_unlock(&w->lock);
+
+		compress_segment(w, seg, zbuf, zlen);
+		free(seg->buf);
+		free(seg);
+
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	free(zbuf);
+	return NULL;
+}
+
+/* Queues (seg) for the threads; waits for room if (wait). */
+static void queue_segment(struct lfsz_writer *w, struct zseg *seg, int wait) {
+	pthread_mutex_lock(&w->lock);
+	while (wait && w->queued >= w->max_queued)
+		pthread_cond_wait(&w->room, &w->lock);
+	seg->next = NULL;
+	*w->tail = seg;
+	w->tail = &seg->next;
+	w->queued++;
+	pthread_cond_signal(&w->more);
+	w->failed = w->error;
+	pthread_mutex_unlock(&w->lock);
+}
+
+static int lfsz_write(struct lfs_output *out, const void *data, uint64_t len,
+		      uint64_t off) {
+	struct lfsz_writer *w = (struct lfsz_writer *)out;
+	const char *p = data;
+
+	if (w->failed != 0)
+		return w->failed;
+	if (off + len > w->nbytes)
+		return ENOSPC;
+	while (len > 0) {
+		uint64_t segnum = off / w->ssize;
+		uint64_t segoff = off % w->ssize;
+		uint64_t n = MIN(len, w->ssize - segoff);
+		struct zseg *seg;
+
+		for (seg = w->open; seg != NULL; seg = seg->next)
+			if (seg->segnum == segnum)
+				break;
+		if (seg == NULL) {
+			seg = malloc(sizeof(*seg));
+			assert(seg);
+			seg->segnum = segnum;
+			seg->buf = calloc(1, w->ssize);
+			assert(seg->buf);
+			seg->next = w->open;
+			w->open = seg;
+		}
+		memcpy(seg->buf + segoff, p, n);
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void lfsz_done(struct lfs_output *out, uint64_t segnum) {
+	struct lfsz_writer *w = (struct lfsz_writer *)out;
+	struct zseg **prev, *seg;
+
+	for (prev = &w->open; (seg = *prev) != NULL; prev = &seg->next) {
+		if (seg->segnum == segnum) {
+			*prev = seg->next;
+			queue_segment(w, seg, 1);
+			return;
+		}
+	}
+}
+
+struct lfs_output *lfsz_create(int fd, uint64_t ssize, uint64_t nbytes,
+			       int nthreads) {
+	struct lfsz_writer *w = calloc(1, sizeof(*w));
+	int i;
+
+	assert(w);
+	w->out.write = lfsz_write;
+	w->out.done = lfsz_done;
+	w->fd = fd;
+	w->ssize = ssize;
+	w->nbytes = nbytes;
+	w->tail = &w->queue;
+	w->nthreads = nthreads > 0 ? nthreads : 1;
+	/* Enough to keep every thread busy while the log fills the next ones */
+	w->max_queued = 2 * w->nthreads;
+	w->end = sizeof(struct lfsz_header);
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->more, NULL);
+	pthread_cond_init(&w->room, NULL);
+	w->threads = malloc(w->nthreads * sizeof(pthread_t));
+	assert(w->threads);
+	for (i = 0; i < w->nthreads; i++)
+		if (pthread_create(&w->threads[i], NULL, compress_thread, w))
+			assert(0);
+	return &w->out;
+}
+
+static int write_all(int fd, const void *buf, uint64_t len, uint64_t off) {
+	ssize_t ret = pwrite(fd, buf, len, off);
+
+	if (ret == (ssize_t)len)
+		return 0;
+	if (ret >= 0)
+		errno = EIO;
+	return -1;
+}
+
+static int frame_cmp(const void *a, const void *b) {
+	const struct lfsz_frame *x = a, *y = b;
+
+	return x->segnum < y->segnum ? -1 : x->segnum > y->segnum;
+}
+
+int lfsz_finish(struct lfs_output *out) {
+	struct lfsz_writer *w = (struct lfsz_writer *)out;
+	struct lfsz_header h = {.magic = LFSZ_MAGIC, .version = LFSZ_VERSION};
+	uint64_t len;
+	int i, ret;
+
+	while (w->open != NULL) {
+		struct zseg *seg = w->open;
+
+		w->open = seg->next;
+		queue_segment(w, seg, 0);
+	}
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->more);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	ret = w->error;
+	if (ret == 0) {
+		qsort(w->frames, w->nframes, sizeof(*w->frames), frame_cmp);
+		h.ssize = w->ssize;
+		h.nbytes = w->nbytes;
+		h.nframes = w->nframes;
+		h.index = w->end;
+		len = w->nframes * sizeof(*w->frames);
+		if (write_all(w->fd, w->frames, len, h.index) != 0 ||
+		    write_all(w->fd, &h, sizeof(h), 0) != 0)
+			ret = errno;
+	}
+
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->more);
+	pthread_cond_destroy(&w->room);
+	free(w->threads);
+	free(w->frames);
+	free(w);
+	return ret;
+}
+
+int lfsz_open(struct lfsz *z, int fd) {
+	uint64_t len;
+
+	memset(z, 0, sizeof(*z));
+	z->fd = fd;
+	if (pread(fd, &z->h, sizeof(z->h), 0) != sizeof(z->h))
+		return EINVAL;
+	if (memcmp(z->h.magic, LFSZ_MAGIC, sizeof(z->h.magic)) != 0 ||
+	    z->h.version != LFSZ_VERSION || z->h.ssize == 0)
+		return EINVAL;
+	len = z->h.nframes * sizeof(*z->frames);
+	z->frames = malloc(len ? len : 1);
+	assert(z->frames);
+	if (pread(fd, z->frames, len, z->h.index) != (ssize_t)len) {
+		free(z->frames);
+		z->frames = NULL;
+		return EINVAL;
+	}
+	return 0;
+}
+
+int lfsz_read_segment(struct lfsz *z, uint64_t segnum, void *buf) {
+	struct lfsz_frame key = {.segnum = segnum}, *f;
+	uLongf len = z->h.ssize;
+	char *zbuf;
+	int ret = 0;
+
+	if (segnum >= (z->h.nbytes + z->h.ssize - 1) / z->h.ssize)
+		return EINVAL;
+	f = bsearch(&key, z->frames, z->h.nframes, sizeof(*f), frame_cmp);
+	if (f == NULL) {
+		memset(buf, 0, z->h.ssize);
+		return 0;
+	}
+	zbuf = malloc(f->len);
+	assert(zbuf);
+	if (pread(z->fd, zbuf, f->len, f->off) != (ssize_t)f->len)
+		ret = EIO;
+	else if (uncompress(buf, &len, (Bytef *)zbuf, f->len) != Z_OK ||
+		 len != z->h.ssize)
+		ret = EIO;
+	free(zbuf);
+	return ret;
+}
+
+void lfsz_close(struct lfsz *z) {
+	free(z->frames);
+	z->frames = NULL;
+}
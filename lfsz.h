@@ -0,0 +1,51 @@
+#ifndef _LFSZ_H_
+#define _LFSZ_H_
+
+#include <stdint.h>
+
+struct lfs_output;
+
+/*
+ * A compressed image: a header, the segments that are not all zeros, each
+ * one compressed on its own (a zlib stream), and an index of them sorted by
+ * segment number. Any segment can be read without the ones before it.
+ */
+#define LFSZ_MAGIC	"LFSZ"
+#define LFSZ_VERSION	1
+
+struct lfsz_header {
+	char		magic[4];
+	uint32_t	version;
+	uint64_t	ssize;		/* bytes in a segment */
+	uint64_t	nbytes;		/* of the image */
+	uint64_t	nframes;	/* segments in the index */
+	uint64_t	index;		/* byte where the index starts */
+};
+
+struct lfsz_frame {
+	uint64_t	segnum;
+	uint64_t	off;		/* of the compressed segment */
+	uint64_t	len;
+};
+
+struct lfsz {
+	int			fd;
+	struct lfsz_header	h;
+	struct lfsz_frame	*frames;
+};
+
+/*
+ * Writes the compressed image of an FS to (fd), for fs->out. The segments
+ * are compressed by (nthreads) threads as the log leaves them.
+ */
+struct lfs_output *lfsz_create(int fd, uint64_t ssize, uint64_t nbytes,
+			       int nthreads);
+/* Compresses the segments left, and writes the index. */
+int lfsz_finish(struct lfs_output *out);
+
+int lfsz_open(struct lfsz *z, int fd);
+/* Reads segment (segnum) into (buf), ssize bytes; zeros if not in the image. */
+int lfsz_read_segment(struct lfsz *z, uint64_t segnum, void *buf);
+void lfsz_close(struct lfsz *z);
+
+#endif /* !_LFSZ_H_ */
@@ -0,0 +1,574 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+#include "nbd.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+#define MAX(_x, _y) (((_x) > (_y)) ? (_x) : (_y))
+
+/*
+ * The image is never written: the log writer lays it out as usual, and
+ * every write is kept in memory as a piece of the image, except for the
+ * data of regular files, which is only where it comes from (a file and an
+ * offset in it). A read of the image puts together the pieces it covers,
+ * reading the files then. The data checksum of a summary needs the first
+ * word of every block of its partial segment, so a summary with file data
+ * after it is fixed the first time it is read.
+ */
+
+struct piece {
+	uint64_t	off;		/* in the image */
+	uint64_t	len;
+	uint64_t	seq;		/* of the write, later ones win */
+	char		*buf;		/* NULL if from a file */
+	uint64_t	src;		/* the file, in lazy->paths */
+	uint64_t	src_off;
+};
+
+struct summary {
+	uint64_t	off;
+	uint64_t	nblocks;
+	char		*buf;		/* of its piece */
+	int		lazy;		/* data checksum still to fix */
+};
+
+struct lazy {
+	struct lfs_output	out;
+	struct fs		*fs;
+	uint64_t		nbytes;
+	struct piece		*pieces;
+	uint64_t		npieces;
+	uint64_t		cap;
+	uint64_t		max_len;	/* of a piece */
+	struct summary		*sums;
+	uint64_t		nsums;
+	uint64_t		sumcap;
+	int			pending;	/* file data since the last
+						   summary */
+	char			**paths;
+	uint64_t		npaths;
+	uint64_t		pathcap;
+	char			*addr;		/* of the file being written */
+	uint64_t		size;
+	int			fd;		/* of paths[fd_src] */
+	uint64_t		fd_src;
+	int			sorted;		/* pieces and sums */
+};
+
+static int lazy_write(struct lfs_output *out, const void *data, uint64_t len,
+		      uint64_t off) {
+	struct lazy *lz = (struct lazy *)out;
+	const char *p = data;
+	struct piece *pc;
+
+	if (len == 0)
+		return 0;
+	if (off + len > lz->nbytes)
+		return ENOSPC;
+	if (lz->npieces == lz->cap) {
+		lz->cap = lz->cap ? lz->cap * 2 : 1024;
+		lz->pieces = realloc(lz->pieces, lz->cap * sizeof(*pc));
+		assert(lz->pieces);
+	}
+	pc = &lz->pieces[lz->npieces];
+	*pc = (struct piece){.off = off, .len = len, .seq = lz->npieces};
+	if (lz->addr != NULL && p >= lz->addr && p < lz->addr + lz->size) {
+		pc->src = lz->npaths - 1;
+		pc->src_off = p - lz->addr;
+		lz->pending = 1;
+	} else {
+		pc->buf = malloc(len);
+		assert(pc->buf);
+		memcpy(pc->buf, data, len);
+	}
+	lz->npieces++;
+	lz->max_len = MAX(lz->max_len, len);
+	lz->sorted = 0;
+	return 0;
+}
+
+static void lazy_summary(struct lfs_output *out, uint64_t off,
+			 uint64_t nblocks) {
+	struct lazy *lz = (struct lazy *)out;
+	struct piece *pc = &lz->pieces[lz->npieces - 1];
+
+	/* write_segment_summary() just wrote it */
+	assert(lz->npieces > 0 && pc->off == off && pc->buf != NULL);
+	if (lz->nsums == lz->sumcap) {
+		lz->sumcap = lz->sumcap ? lz->sumcap * 2 : 1024;
+		lz->sums = realloc(lz->sums, lz->sumcap * sizeof(*lz->sums));
+		assert(lz->sums);
+	}
+	lz->sums[lz->nsums++] = (struct summary){
+	    .off = off, .nblocks = nblocks, .buf = pc->buf,
+	    .lazy = lz->pending};
+	lz->pending = 0;
+}
+
+static int lazy_pread(struct lfs_output *out, void *buf, uint64_t len,
+		      uint64_t off);
+
+struct lfs_output *lazy_create(struct fs *fs, uint64_t nbytes) {
+	struct lazy *lz = calloc(1, sizeof(*lz));
+
+	assert(lz);
+	lz->out.write = lazy_write;
+	lz->out.lazy = 1;
+	lz->out.summary = lazy_summary;
+	lz->out.read = lazy_pread;
+	lz->fs = fs;
+	lz->nbytes = nbytes;
+	lz->fd = -1;
+	return &lz->out;
+}
+
+void *lazy_map(struct lfs_output *out, const char *path, uint64_t size) {
+	struct lazy *lz = (struct lazy *)out;
+
+	assert(lz->addr == NULL && size > 0);
+	if (lz->npaths == lz->pathcap) {
+		lz->pathcap = lz->pathcap ? lz->pathcap * 2 : 1024;
+		lz->paths = realloc(lz->paths, lz->pathcap * sizeof(char *));
+		assert(lz->paths);
+	}
+	lz->paths[lz->npaths] = strdup(path);
+	assert(lz->paths[lz->npaths]);
+	lz->npaths++;
+
+	/* Only the addresses are used, any access would fault */
+	lz->addr = mmap(NULL, size, PROT_NONE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	assert(lz->addr != MAP_FAILED);
+	lz->size = size;
+	return lz->addr;
+}
+
+void lazy_unmap(struct lfs_output *out) {
+	struct lazy *lz = (struct lazy *)out;
+
+	munmap(lz->addr, lz->size);
+	lz->addr = NULL;
+	lz->size = 0;
+}
+
+/* Reads (len) bytes of the file of (pc), from (off) in it on. */
+static int read_source(struct lazy *lz, struct piece *pc, char *buf,
+		       uint64_t len, uint64_t off) {
+	ssize_t n;
+
+	if (lz->fd < 0 || lz->fd_src != pc->src) {
+		if (lz->fd >= 0)
+			close(lz->fd);
+		lz->fd = open(lz->paths[pc->src], O_RDONLY);
+		if (lz->fd < 0)
+			return EIO;
+		lz->fd_src = pc->src;
+	}
+	/* A file that got shorter reads as zeros past its end */
+	n = pread(lz->fd, buf, len, pc->src_off + off);
+	return n < 0 ? EIO : 0;
+}
+
+static int piece_cmp(const void *a, const void *b) {
+	const struct piece *x = a, *y = b;
+
+	if (x->off != y->off)
+		return x->off < y->off ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int summary_cmp(const void *a, const void *b) {
+	const struct summary *x = a, *y = b;
+
+	return x->off < y->off ? -1 : x->off > y->off;
+}
+
+static int seq_cmp(const void *a, const void *b) {
+	const struct piece *x = *(struct piece **)a, *y = *(struct piece **)b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* The first piece that could end after (off). */
+static uint64_t first_piece(struct lazy *lz, uint64_t off) {
+	uint64_t lo = 0, hi = lz->npieces, from;
+
+	from = off > lz->max_len ? off - lz->max_len : 0;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (lz->pieces[mid].off < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Reads (len) bytes of the image at (off), with the pieces sorted. */
+static int lazy_read(struct lazy *lz, char *buf, uint64_t len, uint64_t off) {
+	struct piece **pcs = NULL;
+	uint64_t i, n = 0, cap = 0;
+	int ret = 0;
+
+	memset(buf, 0, len);
+	for (i = first_piece(lz, off);
+	     i < lz->npieces && lz->pieces[i].off < off + len; i++) {
+		struct piece *pc = &lz->pieces[i];
+
+		if (pc->off + pc->len <= off)
+			continue;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 16;
+			pcs = realloc(pcs, cap * sizeof(*pcs));
+			assert(pcs);
+		}
+		pcs[n++] = pc;
+	}
+	/* Pieces written again (superblocks) go in the order written */
+	qsort(pcs, n, sizeof(*pcs), seq_cmp);
+
+	for (i = 0; i < n && ret == 0; i++) {
+		struct piece *pc = pcs[i];
+		uint64_t start = MAX(pc->off, off);
+		uint64_t end = MIN(pc->off + pc->len, off + len);
+
+		if (pc->buf != NULL)
+			memcpy(buf + (start - off), pc->buf + (start - pc->off),
+			       end - start);
+		else
+			ret = read_source(lz, pc, buf + (start - off),
+					  end - start, start - pc->off);
+	}
+	free(pcs);
+	return ret;
+}
+
+/* Sets the data checksum of the summaries in [off, off + len). */
+static int fix_summaries(struct lazy *lz, uint64_t len, uint64_t off) {
+	struct fs *fs = lz->fs;
+	uint64_t bsize = fs->lfs.dlfs_bsize;
+	uint64_t lo = 0, hi = lz->nsums, i, j;
+	int ret;
+
+	/* The first one that could end after (off), see nbd_serve() */
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+
+		if (lz->sums[mid].off + fs->lfs.dlfs_sumsize <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = lo; i < lz->nsums && lz->sums[i].off < off + len; i++) {
+		struct summary *s = &lz->sums[i];
+		uint64_t first = s->off + ((fs->lfs.dlfs_sumsize + bsize - 1) &
+					   ~(bsize - 1));
+		int32_t *words;
+
+		if (!s->lazy)
+			continue;
+		words = calloc(s->nblocks + 1, sizeof(int32_t));
+		assert(words);
+		for (j = 0; j < s->nblocks; j++) {
+			ret = lazy_read(lz, (char *)&words[j], sizeof(int32_t),
+					first + j * bsize);
+			if (ret != 0) {
+				free(words);
+				return ret;
+			}
+		}
+		segsum_set_datasum(fs, s->buf, words, s->nblocks);
+		s->lazy = 0;
+		free(words);
+	}
+	return 0;
+}
+
+static void sort_pieces(struct lazy *lz) {
+	if (lz->sorted)
+		return;
+	qsort(lz->pieces, lz->npieces, sizeof(*lz->pieces), piece_cmp);
+	qsort(lz->sums, lz->nsums, sizeof(*lz->sums), summary_cmp);
+	lz->sorted = 1;
+}
+
+/* fs->out->read(), for the FS to read what it wrote so far */
+static int lazy_pread(struct lfs_output *out, void *buf, uint64_t len,
+		      uint64_t off) {
+	struct lazy *lz = (struct lazy *)out;
+	int ret;
+
+	if (off + len > lz->nbytes)
+		return EINVAL;
+	sort_pieces(lz);
+	ret = fix_summaries(lz, len, off);
+	if (ret == 0)
+		ret = lazy_read(lz, buf, len, off);
+	return ret;
+}
+
+#define NBD_MAGIC		0x4e42444d41474943ULL	/* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC		0x49484156454f5054ULL	/* "IHAVEOPT" */
+#define NBD_REP_MAGIC		0x3e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_REPLY_MAGIC		0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)
+#define NBD_FLAG_READ_ONLY	(1 << 1)
+#define NBD_FLAG_SEND_FLUSH	(1 << 2)
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_INFO_EXPORT		0
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+
+#define NBD_MAX_READ		(32 << 20)
+#define NBD_TFLAGS (NBD_FLAG_HAS_FLAGS | NBD_FLAG_READ_ONLY | NBD_FLAG_SEND_FLUSH)
+
+static int recv_all(int fd, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = recv(fd, p, len, 0);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int send_all(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Drops (len) bytes the client sent. */
+static int recv_skip(int fd, uint64_t len) {
+	char buf[4096];
+
+	while (len > 0) {
+		if (recv_all(fd, buf, MIN(len, sizeof(buf))) != 0)
+			return -1;
+		len -= MIN(len, sizeof(buf));
+	}
+	return 0;
+}
+
+static int send_option_reply(int fd, uint32_t opt, uint32_t type,
+			     const void *data, uint32_t len) {
+	struct __attribute__((packed)) {
+		uint64_t	magic;
+		uint32_t	opt;
+		uint32_t	type;
+		uint32_t	len;
+	} r = {htobe64(NBD_REP_MAGIC), htobe32(opt), htobe32(type),
+	       htobe32(len)};
+
+	if (send_all(fd, &r, sizeof(r)) != 0)
+		return -1;
+	return len ? send_all(fd, data, len) : 0;
+}
+
+/*
+ * The fixed newstyle negotiation, with a single export (any name will do).
+ * Returns 0 once the client is ready for requests.
+ */
+static int handshake(struct lazy *lz, int fd) {
+	struct __attribute__((packed)) {
+		uint64_t	magic;
+		uint64_t	opts_magic;
+		uint16_t	flags;
+	} hello = {htobe64(NBD_MAGIC), htobe64(NBD_OPTS_MAGIC),
+		   htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES)};
+	struct __attribute__((packed)) {
+		uint64_t	magic;
+		uint32_t	opt;
+		uint32_t	len;
+	} req;
+	struct __attribute__((packed)) {
+		uint16_t	type;
+		uint64_t	size;
+		uint16_t	flags;
+	} info = {htobe16(NBD_INFO_EXPORT), htobe64(lz->nbytes),
+		  htobe16(NBD_TFLAGS)};
+	uint32_t cflags, opt, nolen = 0;
+	char zeroes[124] = {0};
+
+	if (send_all(fd, &hello, sizeof(hello)) != 0 ||
+	    recv_all(fd, &cflags, sizeof(cflags)) != 0)
+		return -1;
+	cflags = be32toh(cflags);
+
+	for (;;) {
+		if (recv_all(fd, &req, sizeof(req)) != 0 ||
+		    be64toh(req.magic) != NBD_OPTS_MAGIC ||
+		    recv_skip(fd, be32toh(req.len)) != 0)
+			return -1;
+		opt = be32toh(req.opt);
+		switch (opt) {
+		case NBD_OPT_EXPORT_NAME:
+			if (send_all(fd, &info.size, sizeof(info.size) +
+						     sizeof(info.flags)) != 0)
+				return -1;
+			if (cflags & NBD_FLAG_NO_ZEROES)
+				return 0;
+			return send_all(fd, zeroes, sizeof(zeroes));
+		case NBD_OPT_ABORT:
+			send_option_reply(fd, opt, NBD_REP_ACK, NULL, 0);
+			return -1;
+		case NBD_OPT_LIST:
+			if (send_option_reply(fd, opt, NBD_REP_SERVER, &nolen,
+					      sizeof(nolen)) != 0 ||
+			    send_option_reply(fd, opt, NBD_REP_ACK, NULL, 0))
+				return -1;
+			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			if (send_option_reply(fd, opt, NBD_REP_INFO, &info,
+					      sizeof(info)) != 0 ||
+			    send_option_reply(fd, opt, NBD_REP_ACK, NULL, 0))
+				return -1;
+			if (opt == NBD_OPT_GO)
+				return 0;
+			break;
+		default:
+			if (send_option_reply(fd, opt, NBD_REP_ERR_UNSUP, NULL,
+					      0) != 0)
+				return -1;
+		}
+	}
+}
+
+/* Answers requests until the client disconnects. */
+static void transmission(struct lazy *lz, int fd) {
+	struct __attribute__((packed)) {
+		uint32_t	magic;
+		uint16_t	flags;
+		uint16_t	type;
+		uint64_t	handle;
+		uint64_t	off;
+		uint32_t	len;
+	} req;
+	struct __attribute__((packed)) {
+		uint32_t	magic;
+		uint32_t	error;
+		uint64_t	handle;
+	} reply = {htobe32(NBD_REPLY_MAGIC)};
+	char *buf = malloc(NBD_MAX_READ);
+	uint64_t off, len;
+	int error;
+
+	assert(buf);
+	while (recv_all(fd, &req, sizeof(req)) == 0 &&
+	       be32toh(req.magic) == NBD_REQUEST_MAGIC) {
+		off = be64toh(req.off);
+		len = be32toh(req.len);
+		reply.handle = req.handle;
+		error = 0;
+		switch (be16toh(req.type)) {
+		case NBD_CMD_READ:
+			if (len > NBD_MAX_READ || off + len > lz->nbytes)
+				error = EINVAL;
+			if (error == 0)
+				error = fix_summaries(lz, len, off);
+			if (error == 0)
+				error = lazy_read(lz, buf, len, off);
+			break;
+		case NBD_CMD_WRITE:
+			if (recv_skip(fd, len) != 0)
+				goto out;
+			error = EPERM;
+			break;
+		case NBD_CMD_DISC:
+			goto out;
+		case NBD_CMD_FLUSH:
+			break;
+		default:
+			error = EINVAL;
+		}
+		reply.error = htobe32(error);
+		if (send_all(fd, &reply, sizeof(reply)) != 0)
+			goto out;
+		if (be16toh(req.type) == NBD_CMD_READ && error == 0 &&
+		    send_all(fd, buf, len) != 0)
+			goto out;
+	}
+out:
+	free(buf);
+}
+
+int nbd_listen(const char *path) {
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0)
+		return -1;
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(sock, 1) != 0) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int nbd_serve(struct lfs_output *out, int sock) {
+	struct lazy *lz = (struct lazy *)out;
+	int fd;
+
+	sort_pieces(lz);
+	for (;;) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (handshake(lz, fd) == 0)
+			transmission(lz, fd);
+		close(fd);
+	}
+}
@@ -0,0 +1,29 @@
+#ifndef _NBD_H_
+#define _NBD_H_
+
+#include <stdint.h>
+
+struct fs;
+struct lfs_output;
+
+/*
+ * An output that keeps the image of (fs) in memory instead of writing it,
+ * but for the data of regular files, which is read from them on demand.
+ * lazy_map() gives the address to pass to write_file() for the file at
+ * (path), relative to the current directory when nbd_serve() is called.
+ * Nothing is mapped there: the data is never read while writing. The image
+ * can be read back through the output, like nbd_serve() does.
+ */
+struct lfs_output *lazy_create(struct fs *fs, uint64_t nbytes);
+void *lazy_map(struct lfs_output *out, const char *path, uint64_t size);
+void lazy_unmap(struct lfs_output *out);
+
+/*
+ * nbd_listen() makes a unix socket at (path), -1 with errno set on errors;
+ * nbd_serve() serves the image of a lazy output there, to one client at a
+ * time, until it fails.
+ */
+int nbd_listen(const char *path);
+int nbd_serve(struct lfs_output *out, int sock);
+
+#endif /* !_NBD_H_ */
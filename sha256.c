@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROR(_x, _n)	(((_x) >> (_n)) | ((_x) << (32 - (_n))))
+
+static uint32_t get_be32(const uint8_t *p) {
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t x) {
+	p[0] = x >> 24;
+	p[1] = x >> 16;
+	p[2] = x >> 8;
+	p[3] = x;
+}
+
+static void sha256_block(struct sha256 *c, const uint8_t *block) {
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = get_be32(block + 4 * i);
+	for (; i < 64; i++)
+		w[i] = w[i - 16] +
+		       (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ w[i - 15] >> 3) +
+		       w[i - 7] +
+		       (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ w[i - 2] >> 10);
+	memcpy(s, c->h, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+		t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		c->h[i] += s[i];
+}
+
+void sha256_init(struct sha256 *c) {
+	static const uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+				      0xa54ff53a, 0x510e527f, 0x9b05688c,
+				      0x1f83d9ab, 0x5be0cd19};
+
+	memcpy(c->h, h, sizeof(h));
+	c->len = 0;
+}
+
+void sha256_update(struct sha256 *c, const void *data, size_t len) {
+	const uint8_t *p = data;
+	size_t used = c->len % 64, n;
+
+	c->len += len;
+	if (used > 0) {
+		n = len < 64 - used ? len : 64 - used;
+		memcpy(c->buf + used, p, n);
+		p += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		sha256_block(c, c->buf);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(c, p);
+	memcpy(c->buf, p, len);
+}
+
+void sha256_final(struct sha256 *c, uint8_t digest[SHA256_DIGEST_LEN]) {
+	size_t used = c->len % 64;
+	uint64_t bits = c->len * 8;
+	int i;
+
+	c->buf[used++] = 0x80;
+	if (used > 56) {
+		memset(c->buf + used, 0, 64 - used);
+		sha256_block(c, c->buf);
+		used = 0;
+	}
+	memset(c->buf + used, 0, 56 - used);
+	put_be32(c->buf + 56, bits >> 32);
+	put_be32(c->buf + 60, bits);
+	sha256_block(c, c->buf);
+	for (i = 0; i < 8; i++)
+		put_be32(digest + 4 * i, c->h[i]);
+}
+
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_LEN]) {
+	struct sha256 c;
+
+	sha256_init(&c);
+	sha256_update(&c, data, len);
+	sha256_final(&c, digest);
+}
@@ -0,0 +1,23 @@
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_LEN	32
+
+/* SHA-256 (FIPS 180-4), fed any number of times before the digest. */
+struct sha256 {
+	uint32_t	h[8];
+	uint64_t	len;		/* bytes fed so far */
+	uint8_t		buf[64];	/* the part of a block fed */
+};
+
+void sha256_init(struct sha256 *c);
+void sha256_update(struct sha256 *c, const void *data, size_t len);
+void sha256_final(struct sha256 *c, uint8_t digest[SHA256_DIGEST_LEN]);
+
+/* The digest of (len) bytes at (data), at once. */
+void sha256(const void *data, size_t len, uint8_t digest[SHA256_DIGEST_LEN]);
+
+#endif /* !_SHA256_H_ */
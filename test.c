@@ -77,6 +77,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <err.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
@@ -84,10 +85,15 @@
 #include <unistd.h>
 
 #include "lfs.h"
+#include "lfsz.h"
+#include "lfsr.h"
+#include "verity.h"
 #include "config.h"
 
 #define FSIZE ((DFL_LFSBLOCK * 130))
 
+u_int32_t cksum(void *str, size_t len);
+
 void test_no_space(char *log)
 {
 	struct fs fs;
@@ -121,6 +127,938 @@ void test_no_space(char *log)
 	close(fs.fd);
 }
 
+void test_geometry(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 64 * 1024 * 1024ull;
+	struct lfs_params bad_bsize = {.bsize = 3000, .ssize = 0};
+	struct lfs_params bad_ssize = {.bsize = 0, .ssize = 32 * 1024};
+	struct lfs_params small = {.bsize = 1024, .ssize = 0};
+	struct lfs_params large = {.bsize = 65536, .ssize = 8 * 1024 * 1024};
+
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	assert(init_lfs_params(&fs, nbytes, &bad_bsize) == EINVAL);
+	assert(init_lfs_params(&fs, nbytes, &bad_ssize) == EINVAL);
+
+	assert(init_lfs_params(&fs, nbytes, &small) == 0);
+	assert(fs.lfs.dlfs_bsize == 1024 && fs.lfs.dlfs_bshift == 10);
+	assert(fs.lfs.dlfs_fsbpseg == 1024);
+	/* the superblock is right after the 8K label */
+	assert(fs.lfs.dlfs_sboffs[0] == LFS_LABELPAD / 1024);
+	/* Larger than the inode of a 1K-block FS maps */
+	assert(write_file(&fs, NULL, fs.lfs.dlfs_maxfilesize, 3,
+			  LFS_IFREG | 0777, 1, 0) == EFBIG);
+	assert(write_empty_root_dir(&fs) == 0);
+	assert(finish_lfs(&fs) == 0);
+
+	assert(init_lfs_params(&fs, nbytes, &large) == 0);
+	assert(fs.lfs.dlfs_bsize == 65536 && fs.lfs.dlfs_bshift == 16);
+	assert(fs.lfs.dlfs_fsbpseg == 128);
+	assert(fs.lfs.dlfs_nindir == 65536 / sizeof(int32_t));
+	assert(fs.lfs.dlfs_sboffs[0] == 1);
+	assert(write_empty_root_dir(&fs) == 0);
+	assert(finish_lfs(&fs) == 0);
+	close(fs.fd);
+}
+
+void test_estimate(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 64 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 1024, .ssize = 64 * 1024};
+	uint64_t sizes[] = {FSIZE, 20, 0, 20, LFS_DIRBLKSIZ};
+	uint64_t huge = 1ULL << 40;
+	struct lfs_estimate est;
+	uint32_t i;
+
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	/* More than an inode of 1K blocks maps */
+	assert(estimate_lfs(nbytes, &params, &huge, 1, &est) == EFBIG);
+	assert(estimate_lfs(nbytes, &params, sizes, 5, &est) == 0);
+
+	char *block = malloc(FSIZE);
+	assert(block);
+	memset(block, '.', FSIZE);
+
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	for (i = 0; i < 4; i++)
+		assert(write_file(&fs, block, sizes[i], 3 + i,
+				  LFS_IFREG | 0777, 1, 0) == 0);
+	assert(write_file(&fs, block, LFS_DIRBLKSIZ, ULFS_ROOTINO,
+			  LFS_IFDIR | 0755, 2, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	/* FSIZE spans more than one 64K segment */
+	assert(est.nbytes == (uint64_t)fs.lfs.dlfs_offset * params.bsize);
+	assert(est.nreads > 5 * 2);
+
+	free(block);
+	close(fs.fd);
+}
+
+void test_64bit(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 64 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 1024 * 1024,
+				    .is64 = 1};
+	uint64_t sizes[] = {FSIZE, 20, LFS_DIRBLKSIZ};
+	struct lfs_estimate est;
+	struct lfs64_dinode dino;
+
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	assert(estimate_lfs(nbytes, &params, sizes, 3, &est) == 0);
+
+	char *block = malloc(FSIZE);
+	assert(block);
+	memset(block, '.', FSIZE);
+
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(fs.is64);
+	assert(fs.lfs.dlfs_magic == LFS64_MAGIC);
+	assert(fs.lfs.dlfs_nindir == 4096 / sizeof(int64_t));
+	assert(write_file(&fs, block, FSIZE, 3, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(write_file(&fs, block, 20, 4, LFS_IFREG | 0777, 1, 0) == 0);
+
+	struct directory dir = {.is64 = 1};
+	dir_add_entry(&dir, ".", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&dir, "..", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&dir, "big", 3, LFS_DT_REG);
+	dir_add_entry(&dir, "small", 4, LFS_DT_REG);
+	dir_done(&dir);
+	assert(write_file(&fs, &dir.data[0], LFS_DIRBLKSIZ, ULFS_ROOTINO,
+			  LFS_IFDIR | 0755, 2, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	assert(est.nbytes == (uint64_t)fs.lfs.dlfs_offset * params.bsize);
+
+	/* The root inode is the last thing written before the ifile */
+	assert(pread(fs.fd, &dino, sizeof(dino),
+		     (fs.lfs.dlfs_idaddr - 1) * params.bsize) == sizeof(dino));
+	assert(dino.di_inumber == ULFS_ROOTINO);
+	assert(dino.di_size == LFS_DIRBLKSIZ);
+
+	free(block);
+	close(fs.fd);
+}
+
+void test_many_inodes(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 512 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 1024, .ssize = 1024 * 1024,
+				    .is64 = 1};
+	uint64_t nfiles = 5000, i;
+	uint64_t *sizes = calloc(nfiles + 1, sizeof(uint64_t));
+	struct lfs_estimate est;
+	struct lfs64_dinode dino;
+	char data[20] = "many inodes";
+
+	assert(sizes);
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	for (i = 0; i < nfiles; i++)
+		sizes[i] = sizeof(data);
+	sizes[nfiles] = sizeof(data);
+	assert(estimate_lfs(nbytes, &params, sizes, nfiles + 1, &est) == 0);
+
+	/* More inodes than the ifile direct and single indirect blocks map */
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	for (i = 0; i <= nfiles; i++)
+		assert(write_file(&fs, data, sizeof(data), ULFS_ROOTINO + i,
+				  LFS_IFREG | 0777, 1, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	assert(est.nbytes == (uint64_t)fs.lfs.dlfs_offset * params.bsize);
+
+	assert(pread(fs.fd, &dino, sizeof(dino),
+		     fs.lfs.dlfs_idaddr * params.bsize) == sizeof(dino));
+	assert(dino.di_inumber == LFS_IFILE_INUM);
+	assert(dino.di_ib[1] != 0);
+	assert(dino.di_size >= (nfiles / (1024 / sizeof(IFILE64))) * 1024);
+
+	free(sizes);
+	close(fs.fd);
+}
+
+void test_large_image(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 1024 * 1024 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 8192, .ssize = 1024 * 1024};
+	uint64_t sizes[] = {LFS_DIRBLKSIZ};
+	struct lfs_estimate est;
+	uint32_t first_seg;
+
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	assert(estimate_lfs(nbytes, &params, sizes, 1, &est) == 0);
+
+	/* The segment usage table alone is larger than a segment */
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(fs.lfs.dlfs_segtabsz > fs.lfs.dlfs_fsbpseg);
+	assert(write_empty_root_dir(&fs) == 0);
+	first_seg = fs.seg.seg_number;
+	assert(finish_lfs(&fs) == 0);
+	assert(fs.seg.seg_number - first_seg >=
+	       fs.lfs.dlfs_segtabsz / fs.lfs.dlfs_fsbpseg);
+	assert(est.nbytes == (uint64_t)fs.lfs.dlfs_offset * params.bsize);
+
+	close(fs.fd);
+	truncate(log, 0);
+}
+
+void test_partial_segments(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 256 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 1024, .ssize = 1024 * 1024};
+	uint64_t nfiles = 2000, i, j, npsegs, nblocks;
+	uint64_t *sizes = calloc(nfiles + 2, sizeof(uint64_t));
+	size_t sumstart = offsetof(SEGSUM32, ss_datasum);
+	struct lfs_estimate est;
+	char data[20] = "partial segments";
+	char *block = malloc(FSIZE);
+	SEGSUM32 *ssp = malloc(1024);
+	int64_t daddr;
+
+	assert(sizes && block && ssp);
+	memset(block, '.', FSIZE);
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	/* Many more files than a 1K summary can describe, and a large one */
+	for (i = 0; i < nfiles; i++)
+		sizes[i] = sizeof(data);
+	sizes[nfiles] = FSIZE;
+	sizes[nfiles + 1] = LFS_DIRBLKSIZ;
+	assert(estimate_lfs(nbytes, &params, sizes, nfiles + 2, &est) == 0);
+
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	for (i = 0; i < nfiles; i++)
+		assert(write_file(&fs, data, sizeof(data), 3 + i,
+				  LFS_IFREG | 0777, 1, 0) == 0);
+	assert(write_file(&fs, block, FSIZE, 3 + nfiles, LFS_IFREG | 0777, 1,
+			  0) == 0);
+	assert(write_file(&fs, block, LFS_DIRBLKSIZ, ULFS_ROOTINO,
+			  LFS_IFDIR | 0755, 2, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	assert(est.nbytes == (uint64_t)fs.lfs.dlfs_offset * params.bsize);
+
+	/*
+	 * Follow the partial segments of the first segment: each summary is
+	 * valid, and describes every block up to the next one. A partial
+	 * segment needs at least a summary and a block.
+	 */
+	daddr = fs.lfs.dlfs_sboffs[0] + LFS_SBPAD / params.bsize;
+	for (npsegs = 0; daddr + 1 < fs.lfs.dlfs_fsbpseg; npsegs++) {
+		FINFO32 *fip = (FINFO32 *)(ssp + 1);
+
+		assert(pread(fs.fd, ssp, 1024, daddr * 1024) == 1024);
+		assert(ssp->ss_magic == SS_MAGIC);
+		assert(ssp->ss_sumsum ==
+		       cksum((char *)ssp + sumstart, 1024 - sumstart));
+		assert(ssp->ss_nfinfo > 0 || ssp->ss_ninos > 0);
+		nblocks = 1 + ssp->ss_ninos;
+		for (j = 0; j < ssp->ss_nfinfo; j++) {
+			nblocks += fip->fi_nblocks;
+			fip = (FINFO32 *)((char *)(fip + 1) +
+					  fip->fi_nblocks * sizeof(int32_t));
+		}
+		assert((char *)fip <= (char *)ssp + 1024 -
+					      ssp->ss_ninos * sizeof(IINFO32));
+		daddr += nblocks;
+	}
+	assert(npsegs > 1);
+	assert(daddr <= fs.lfs.dlfs_fsbpseg);
+
+	free(ssp);
+	free(block);
+	free(sizes);
+	close(fs.fd);
+}
+
+void test_append(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 64 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 1024 * 1024};
+	struct directory dir = {0};
+	struct lfs32_dinode dino;
+	char data[20] = "appended";
+	char *block = malloc(FSIZE);
+	uint32_t nbytes_before, offset;
+	struct lfs_file_info info;
+	struct lfs_extent *ext;
+	char *copy;
+	uint64_t next, nblocks, i;
+	int type;
+
+	assert(block);
+	memset(block, '.', FSIZE);
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(write_file(&fs, block, FSIZE, 3, LFS_IFREG | 0777, 1, 0) == 0);
+	dir_add_entry(&dir, ".", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&dir, "..", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&dir, "big", 3, LFS_DT_REG);
+	dir_done(&dir);
+	assert(write_file(&fs, &dir.data[0], LFS_DIRBLKSIZ, ULFS_ROOTINO,
+			  LFS_IFDIR | 0755, 2, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	offset = fs.lfs.dlfs_offset;
+
+	/* Every data block is in a run, runs only break between segments */
+	assert(file_extents(&fs, 3, &ext, &next) == 0);
+	for (i = 0, nblocks = 0; i < next; i++) {
+		assert(ext[i].daddr != LFS_UNUSED_DADDR);
+		if (i > 0)
+			assert(ext[i].daddr / fs.lfs.dlfs_fsbpseg !=
+			       ext[i - 1].daddr / fs.lfs.dlfs_fsbpseg);
+		nblocks += ext[i].len;
+	}
+	assert(nblocks == FSIZE / params.bsize);
+	free(ext);
+
+	/* Replace "big" with a small file, and add "new" next to it */
+	memset(&fs, 0, sizeof(fs));
+	fs.fd = open(log, O_RDWR);
+	assert(load_lfs(&fs) == 0);
+	/* The log goes on in a new partial segment, after its summary */
+	assert(fs.lfs.dlfs_offset == offset + 1);
+	assert(fs.ifile.cleanerinfo->u_32.free_head == 4);
+	nbytes_before = ((SEGUSE *)fs.ifile.segusage[0])->su_nbytes;
+	assert(read_dir(&fs, ULFS_ROOTINO, &dir) == 0);
+	assert(dir_lookup(&dir, "big", &type) == 3 && type == LFS_DT_REG);
+	assert(dir_lookup(&dir, "new", &type) == 0);
+
+	assert(remove_file(&fs, 3) == 0);
+	assert(((SEGUSE *)fs.ifile.segusage[0])->su_nbytes <
+	       nbytes_before - FSIZE);
+	assert(write_file(&fs, data, sizeof(data), 3, LFS_IFREG | 0777, 1,
+			  0) == 0);
+	assert(alloc_inode(&fs) == 4);
+	assert(write_file(&fs, data, sizeof(data), 4, LFS_IFREG | 0777, 1,
+			  0) == 0);
+	dir_add_entry(&dir, "new", 4, LFS_DT_REG);
+	dir_add_entry(&dir, ".", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&dir, "..", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_done(&dir);
+	assert(remove_file(&fs, ULFS_ROOTINO) == 0);
+	assert(write_file(&fs, &dir.data[0], LFS_DIRBLKSIZ, ULFS_ROOTINO,
+			  LFS_IFDIR | 0755, 2, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+
+	/* Only the new files and the checkpoint were written */
+	assert(fs.lfs.dlfs_offset > offset);
+	assert(fs.lfs.dlfs_offset - offset < FSIZE / params.bsize);
+	close(fs.fd);
+
+	memset(&fs, 0, sizeof(fs));
+	fs.fd = open(log, O_RDWR);
+	assert(load_lfs(&fs) == 0);
+	assert(fs.ifile.cleanerinfo->u_32.free_head == 5);
+	assert(read_dir(&fs, ULFS_ROOTINO, &dir) == 0);
+	assert(dir_lookup(&dir, "big", &type) == 3);
+	assert(dir_lookup(&dir, "new", &type) == 4 && type == LFS_DT_REG);
+	assert(read_file(&fs, 3, &copy, &info) == 0);
+	assert(info.size == sizeof(data) && info.mode == (LFS_IFREG | 0777));
+	assert(memcmp(copy, data, sizeof(data)) == 0);
+	free(copy);
+
+	/* The root inode is still the last thing written before the ifile */
+	assert(pread(fs.fd, &dino, sizeof(dino),
+		     (fs.lfs.dlfs_idaddr - 1) * params.bsize) == sizeof(dino));
+	assert(dino.di_inumber == ULFS_ROOTINO);
+
+	/* Delete "new": its inode number is free again after the checkpoint */
+	assert(delete_file(&fs, 4) == 0);
+	assert(stat_file(&fs, 4, &info) == ENOENT);
+	assert(dir_remove_entry(&dir, "new") == 0);
+	assert(dir_remove_entry(&dir, "new") == ENOENT);
+	assert(dir_lookup(&dir, "big", &type) == 3);
+	dir_add_entry(&dir, ".", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&dir, "..", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_done(&dir);
+	assert(remove_file(&fs, ULFS_ROOTINO) == 0);
+	assert(write_file(&fs, &dir.data[0], LFS_DIRBLKSIZ, ULFS_ROOTINO,
+			  LFS_IFDIR | 0755, 2, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+	assert(load_lfs(&fs) == 0);
+	assert(alloc_inode(&fs) == 4);
+	free_lfs(&fs);
+
+	free(block);
+	close(fs.fd);
+}
+
+void test_resize(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 32 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 1024 * 1024};
+	struct lfs_file_info info;
+	char *block = malloc(FSIZE);
+	char *copy;
+	int i;
+
+	assert(block);
+	memset(block, '.', FSIZE);
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(write_empty_root_dir(&fs) == 0);
+	assert(write_file(&fs, block, FSIZE, 3, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+
+	/* Growing adds segments and superblocks, the files stay */
+	assert(load_lfs(&fs) == 0);
+	assert(fs.lfs.dlfs_sboffs[9] == 0);
+	assert(resize_lfs(&fs, 2 * nbytes) == 0);
+	assert(fs.nsegs == 63 && fs.lfs.dlfs_nseg == 63);
+	assert(fs.lfs.dlfs_sboffs[9] != 0);
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+
+	/* Replace the file until the log is well past the first 8MB */
+	for (i = 0; i < 10; i++) {
+		assert(load_lfs(&fs) == 0);
+		assert(remove_file(&fs, 3) == 0);
+		assert(write_file(&fs, block, FSIZE, 3, LFS_IFREG | 0777, 1,
+				  0) == 0);
+		assert(finish_lfs(&fs) == 0);
+		free_lfs(&fs);
+	}
+	assert(load_lfs(&fs) == 0);
+	assert(fs.lfs.dlfs_curseg >= 8 * fs.lfs.dlfs_fsbpseg);
+
+	/* Shrinking moves the log and the file before the new end */
+	assert(resize_lfs(&fs, 8 * 1024 * 1024) == 0);
+	assert(fs.nsegs == 7);
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+	assert(load_lfs(&fs) == 0);
+	assert(fs.lfs.dlfs_nseg == 7);
+	assert(fs.lfs.dlfs_curseg < 7 * fs.lfs.dlfs_fsbpseg);
+	assert(read_file(&fs, 3, &copy, &info) == 0);
+	assert(info.size == FSIZE && memcmp(copy, block, FSIZE) == 0);
+	free(copy);
+
+	/* Not with a file larger than the whole FS */
+	assert(resize_lfs(&fs, 2 * 1024 * 1024) == ENOSPC);
+	free_lfs(&fs);
+
+	free(block);
+	close(fs.fd);
+}
+
+void test_skip_segments(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 32 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 1024 * 1024};
+	uint64_t fsbpseg, next, size = 100 * 4096;
+	struct lfs_file_info info;
+	struct lfs_extent *ext;
+	char *block = malloc(size);
+	char *copy;
+
+	assert(block);
+	memset(block, '.', size);
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	fsbpseg = fs.lfs.dlfs_fsbpseg;
+
+	/* Nothing written yet: the log stays in segment 0 */
+	assert(skip_to_segment(&fs, 0) == 0);
+	assert(fs.lfs.dlfs_curseg == 0);
+	assert(write_empty_root_dir(&fs) == 0);
+
+	/* Segments 1 to 4 are left clean */
+	assert(skip_to_segment(&fs, 5) == 0);
+	assert(fs.lfs.dlfs_curseg == 5 * fsbpseg);
+	assert(fs.lfs.dlfs_nclean == fs.nsegs - 2);
+	assert(skip_to_segment(&fs, 5) == 0);
+	assert(fs.lfs.dlfs_curseg == 5 * fsbpseg);
+	assert(write_file(&fs, block, size, 3, LFS_IFREG | 0777, 1, 0) == 0);
+
+	/* Past it already, so the next one */
+	assert(skip_to_segment(&fs, 2) == 0);
+	assert(fs.lfs.dlfs_curseg == 6 * fsbpseg);
+	assert(skip_to_segment(&fs, fs.nsegs) == ENOSPC);
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+
+	assert(load_lfs(&fs) == 0);
+	assert(file_extents(&fs, 3, &ext, &next) == 0);
+	assert(next == 1 && ext[0].daddr / fsbpseg == 5);
+	free(ext);
+	assert(read_file(&fs, 3, &copy, &info) == 0);
+	assert(info.size == size && memcmp(copy, block, size) == 0);
+	free(copy);
+	free_lfs(&fs);
+
+	free(block);
+	close(fs.fd);
+}
+
+void test_read_only(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 256 * 1024 * 1024ull;
+	struct lfs_params params = {0};
+	struct lfs_params ro = {.readonly = 1};
+	uint64_t bfree, minfreeseg;
+
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(fs.lfs.dlfs_minfreeseg > 0 && fs.lfs.dlfs_resvseg > 0);
+	bfree = fs.lfs.dlfs_bfree;
+	minfreeseg = fs.lfs.dlfs_minfreeseg;
+	assert(write_empty_root_dir(&fs) == 0);
+	assert(finish_lfs(&fs) == 0);
+
+	/* Nothing is kept for the cleaner */
+	assert(init_lfs_params(&fs, nbytes, &ro) == 0);
+	assert(fs.lfs.dlfs_minfreeseg == 0 && fs.lfs.dlfs_resvseg == 0);
+	assert(fs.lfs.dlfs_bfree == bfree + minfreeseg * fs.lfs.dlfs_fsbpseg);
+	assert(write_empty_root_dir(&fs) == 0);
+	assert(finish_lfs(&fs) == 0);
+	close(fs.fd);
+}
+
+void test_iblocks_first(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 64 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 1024 * 1024};
+	/* Past the single indirect block, into the double one */
+	uint64_t size = (ULFS_NDADDR + 1024 + 100) * 4096ull, next, inext, lbn;
+	uint64_t i;
+	struct lfs_file_info info;
+	struct lfs_extent *ext, *iext;
+	char *block = malloc(size);
+	char *copy;
+
+	assert(block);
+	for (i = 0; i < size; i++)
+		block[i] = i % 251;
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	fs.iblocks_first = 1;
+	assert(write_empty_root_dir(&fs) == 0);
+	assert(write_file(&fs, block, size, 3, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+
+	assert(load_lfs(&fs) == 0);
+	assert(read_file(&fs, 3, &copy, &info) == 0);
+	assert(info.size == size && memcmp(copy, block, size) == 0);
+	free(copy);
+
+	/* The first indirect block is between the direct blocks and the next */
+	assert(file_extents(&fs, 3, &ext, &next) == 0);
+	assert(next > 1 && ext[0].len == ULFS_NDADDR);
+	assert(ext[1].daddr == ext[0].daddr + ULFS_NDADDR + 1);
+	for (i = 1; i < next; i++)
+		assert(ext[i].daddr > ext[i - 1].daddr);
+	assert(file_iblocks(&fs, 3, &iext, &inext) == 0);
+	assert(inext == 2 && iext[0].len == 1 && iext[1].len == 2);
+	assert(iext[0].daddr == ext[0].daddr + ULFS_NDADDR);
+	/* The double indirect block, and the first one under it, then data */
+	for (i = 0, lbn = 0; lbn + ext[i].len <= ULFS_NDADDR + 1024; i++)
+		lbn += ext[i].len;
+	assert(iext[1].daddr + 2 ==
+	       ext[i].daddr + (int64_t)(ULFS_NDADDR + 1024 - lbn));
+	free(iext);
+	free(ext);
+	free_lfs(&fs);
+
+	free(block);
+	close(fs.fd);
+}
+
+void test_lastmod(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 32 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 1024 * 1024};
+	uint64_t size = 100 * 4096;
+	char *block = calloc(1, size);
+	SEGUSE *su;
+
+	assert(block);
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(write_empty_root_dir(&fs) == 0);
+
+	/* The newest of what was written in a segment, once set */
+	assert(skip_to_segment(&fs, 2) == 0);
+	fs.lastmod = 1000;
+	assert(write_file(&fs, block, size, 3, LFS_IFREG | 0777, 1, 0) == 0);
+	fs.lastmod = 500;
+	assert(write_file(&fs, block, size, 4, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(skip_to_segment(&fs, 4) == 0);
+	fs.lastmod = 2000;
+	assert(write_file(&fs, block, size, 5, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+
+	assert(load_lfs(&fs) == 0);
+	su = (SEGUSE *)fs.ifile.segusage[0];
+	assert(su[0].su_lastmod == 0);
+	assert(su[1].su_lastmod == 0);
+	assert(su[2].su_lastmod == 1000);
+	assert(su[4].su_lastmod == 2000);
+	free_lfs(&fs);
+
+	free(block);
+	close(fs.fd);
+}
+
+void test_spare_inodes(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 32 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 1024 * 1024};
+	uint64_t nmap, prev, inum, i;
+
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(write_empty_root_dir(&fs) == 0);
+	fs.spare_inodes = 1000;
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+
+	/* That many files can be made without growing the ifile, in order */
+	assert(load_lfs(&fs) == 0);
+	nmap = fs.ifile.nmap;
+	prev = ULFS_ROOTINO;
+	for (i = 0; i < 1000; i++) {
+		inum = alloc_inode(&fs);
+		assert(inum == prev + 1);
+		prev = inum;
+	}
+	assert(fs.ifile.nmap == nmap);
+	free_lfs(&fs);
+
+	close(fs.fd);
+}
+
+void test_defer_inodes(char *log)
+{
+	struct fs fs;
+	uint64_t nbytes = 32 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 256 * 1024};
+	uint64_t size = 3 * 4096, i;
+	struct lfs_file_info info;
+	int64_t daddrs[8];
+	char *block = malloc(size);
+	char *copy;
+
+	assert(block);
+	fs.fd = open(log, O_CREAT | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	assert(write_empty_root_dir(&fs) == 0);
+
+	/* The data of each file, and then their inodes in a row */
+	fs.defer_inodes = 1;
+	for (i = 0; i < 8; i++) {
+		memset(block, 'a' + i, size);
+		assert(write_file(&fs, block, size, 3 + i, LFS_IFREG | 0777, 1,
+				  0) == 0);
+	}
+	fs.defer_inodes = 0;
+	assert(write_inodes(&fs) == 0);
+	/* And the last one, from finish_lfs() */
+	fs.defer_inodes = 1;
+	assert(write_file(&fs, block, size, 11, LFS_IFREG | 0777, 1, 0) == 0);
+	fs.defer_inodes = 0;
+	assert(finish_lfs(&fs) == 0);
+	free_lfs(&fs);
+
+	assert(load_lfs(&fs) == 0);
+	for (i = 0; i < 8; i++) {
+		assert(read_file(&fs, 3 + i, &copy, &info) == 0);
+		memset(block, 'a' + i, size);
+		assert(info.size == size && memcmp(copy, block, size) == 0);
+		free(copy);
+		daddrs[i] = info.daddr;
+		assert(i == 0 || daddrs[i] == daddrs[i - 1] + 1);
+	}
+	assert(read_file(&fs, 11, &copy, &info) == 0);
+	assert(info.size == size && info.daddr > daddrs[7]);
+	free(copy);
+	free_lfs(&fs);
+
+	free(block);
+	close(fs.fd);
+}
+
+/* Writes a small FS to (log), compressed if (compress). */
+static void write_compress_fs(struct fs *fs, char *log, int compress)
+{
+	uint64_t nbytes = 32 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 256 * 1024,
+				    .tstamp = 1};
+	uint64_t i, size = 1024 * 1024;
+	char *block = malloc(size);
+
+	assert(block);
+	for (i = 0; i < size; i++)
+		block[i] = i % 251;
+	fs->fd = open(log, O_CREAT | O_TRUNC | O_RDWR, DEFFILEMODE);
+	assert(fs->fd != 0);
+	assert(init_lfs_params(fs, nbytes, &params) == 0);
+	if (compress)
+		fs->out = lfsz_create(fs->fd, fs->lfs.dlfs_ssize, nbytes, 4);
+	assert(write_empty_root_dir(fs) == 0);
+	assert(write_file(fs, block, size, 3, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(skip_to_segment(fs, 20) == 0);
+	assert(write_file(fs, block, 100, 4, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(finish_lfs(fs) == 0);
+	if (compress)
+		assert(lfsz_finish(fs->out) == 0);
+	free(block);
+}
+
+void test_compress(char *log, char *zlog)
+{
+	struct fs fs, zfs;
+	struct lfsz z;
+	uint64_t ssize, i;
+	char *seg, *zseg;
+
+	write_compress_fs(&fs, log, 0);
+	write_compress_fs(&zfs, zlog, 1);
+	ssize = fs.lfs.dlfs_ssize;
+	seg = malloc(ssize);
+	zseg = malloc(ssize);
+	assert(seg && zseg);
+
+	/* Every segment reads the same, the empty ones are left out */
+	assert(lfsz_open(&z, zfs.fd) == 0);
+	assert(z.h.ssize == ssize && z.h.nframes < fs.nsegs);
+	for (i = 0; i < fs.nsegs; i++) {
+		ssize_t n = pread(fs.fd, seg, ssize, i * ssize);
+
+		assert(n >= 0);
+		memset(seg + n, 0, ssize - n);
+		assert(lfsz_read_segment(&z, i, zseg) == 0);
+		assert(memcmp(seg, zseg, ssize) == 0);
+	}
+	assert(lfsz_read_segment(&z, i + 1, zseg) == EINVAL);
+	lfsz_close(&z);
+
+	free(seg);
+	free(zseg);
+	free_lfs(&fs);
+	free_lfs(&zfs);
+	close(fs.fd);
+	close(zfs.fd);
+}
+
+void test_sha256(void)
+{
+	uint8_t digest[SHA256_DIGEST_LEN];
+	uint8_t abc[SHA256_DIGEST_LEN] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40,
+		0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17,
+		0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad};
+	uint8_t empty[SHA256_DIGEST_LEN] = {
+		0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4,
+		0xc8, 0x99, 0x6f, 0xb9, 0x24, 0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b,
+		0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55};
+	struct sha256 c;
+	int i;
+
+	sha256("abc", 3, digest);
+	assert(memcmp(digest, abc, sizeof(abc)) == 0);
+	sha256("", 0, digest);
+	assert(memcmp(digest, empty, sizeof(empty)) == 0);
+
+	/* Fed in pieces across the 64 byte blocks */
+	sha256_init(&c);
+	for (i = 0; i < 3; i++)
+		sha256_update(&c, "abc" + i, 1);
+	sha256_final(&c, digest);
+	assert(memcmp(digest, abc, sizeof(abc)) == 0);
+}
+
+void test_verity(char *log, char *tree)
+{
+	struct fs fs;
+	uint64_t nbytes = 32 * 1024 * 1024ull;
+	struct lfs_params params = {.bsize = 4096, .ssize = 256 * 1024};
+	uint32_t vbs = 4096, per_block = vbs / SHA256_DIGEST_LEN;
+	uint64_t n = nbytes / vbs, size = 1024 * 1024, len, i;
+	uint8_t root[SHA256_DIGEST_LEN], digest[SHA256_DIGEST_LEN];
+	char *block = malloc(size), *level, *up, *written;
+	int fd;
+
+	assert(block);
+	/* An older image where this one leaves holes, hashed as it is */
+	memset(block, 'x', size);
+	fs.fd = open(log, O_CREAT | O_TRUNC | O_RDWR, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(pwrite(fs.fd, block, size, 30 * size) == (ssize_t)size);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+	fs.out = verity_create(NULL, fs.fd, fs.lfs.dlfs_ssize, nbytes, vbs, 4);
+	assert(write_empty_root_dir(&fs) == 0);
+	for (i = 0; i < size; i++)
+		block[i] = i % 251;
+	assert(write_file(&fs, block, size, 3, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(skip_to_segment(&fs, 40) == 0);
+	assert(write_file(&fs, block, 100, 4, LFS_IFREG | 0777, 1, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+	fd = open(tree, O_CREAT | O_TRUNC | O_RDWR, DEFFILEMODE);
+	assert(fd != -1);
+	assert(verity_finish(fs.out, nbytes, fd, 0, root, &len) == 0);
+	fs.out = NULL;
+
+	/* The same tree, from what is in the image, from the top down */
+	level = calloc(n, SHA256_DIGEST_LEN);
+	assert(level);
+	for (i = 0; i < n; i++) {
+		/* Past the end of the file is zeros, as for the device */
+		memset(block, 0, vbs);
+		assert(pread(fs.fd, block, vbs, i * vbs) >= 0);
+		sha256(block, vbs, (uint8_t *)level + i * SHA256_DIGEST_LEN);
+	}
+	written = malloc(len);
+	assert(written);
+	assert(pread(fd, written, len, 0) == (ssize_t)len);
+	while (n > 1) {
+		uint64_t nup = (n + per_block - 1) / per_block;
+
+		up = calloc(nup, vbs);
+		assert(up);
+		memcpy(up, level, n * SHA256_DIGEST_LEN);
+		len -= nup * vbs;
+		assert(memcmp(written + len, up, nup * vbs) == 0);
+		free(level);
+		level = calloc(nup, SHA256_DIGEST_LEN);
+		assert(level);
+		for (i = 0; i < nup; i++)
+			sha256(up + i * vbs, vbs,
+			       (uint8_t *)level + i * SHA256_DIGEST_LEN);
+		free(up);
+		n = nup;
+	}
+	assert(len == 0);
+	memcpy(digest, level, SHA256_DIGEST_LEN);
+	assert(memcmp(digest, root, SHA256_DIGEST_LEN) == 0);
+
+	free(level);
+	free(written);
+	free(block);
+	free_lfs(&fs);
+	close(fs.fd);
+	close(fd);
+}
+
+static int count_entry(void *arg, const char *name, uint64_t ino, int type)
+{
+	(*(int *)arg)++;
+	return 0;
+}
+
+void test_reader(char *log, char *log64)
+{
+	struct fs fs;
+	uint64_t nbytes = 64 * 1024 * 1024ull;
+	/* 512-byte blocks: a 9 MB file goes down to the triple indirect */
+	struct lfs_params params = {.bsize = 512, .ssize = 64 * 1024};
+	uint64_t size = 9 * 1024 * 1024ull, ino, n, i;
+	struct lfsr_stat st;
+	struct lfsr r;
+	char *data, *buf;
+	int fd, count = 0;
+
+	fs.fd = open(log, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+	assert(fs.fd != 0);
+	assert(init_lfs_params(&fs, nbytes, &params) == 0);
+
+	data = malloc(size);
+	buf = malloc(size);
+	assert(data && buf);
+	for (i = 0; i < size; i++)
+		data[i] = i % 251;
+	assert(write_file(&fs, data, size, 3, LFS_IFREG | 0644, 1, 0) == 0);
+	assert(write_file(&fs, "small", 5, 5, LFS_IFREG | 0644, 1, 0) == 0);
+
+	struct directory dir = {{0}};
+	dir_add_entry(&dir, ".", 4, LFS_DT_DIR);
+	dir_add_entry(&dir, "..", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&dir, "small", 5, LFS_DT_REG);
+	dir_done(&dir);
+	assert(write_file(&fs, &dir.data[0], LFS_DIRBLKSIZ, 4,
+			  LFS_IFDIR | 0755, 2, 0) == 0);
+
+	struct directory root = {{0}};
+	dir_add_entry(&root, ".", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&root, "..", ULFS_ROOTINO, LFS_DT_DIR);
+	dir_add_entry(&root, "big", 3, LFS_DT_REG);
+	dir_add_entry(&root, "d", 4, LFS_DT_DIR);
+	dir_done(&root);
+	assert(write_file(&fs, &root.data[0], LFS_DIRBLKSIZ, ULFS_ROOTINO,
+			  LFS_IFDIR | 0755, 3, 0) == 0);
+	assert(finish_lfs(&fs) == 0);
+
+	assert(lfsr_open(&r, fs.fd) == 0);
+	assert(lfsr_lookup(&r, "/big", &ino) == 0 && ino == 3);
+	assert(lfsr_stat(&r, ino, &st) == 0);
+	assert((st.mode & LFS_IFMT) == LFS_IFREG && st.size == size);
+	assert(lfsr_pread(&r, ino, buf, size, 0, &n) == 0 && n == size);
+	assert(memcmp(buf, data, size) == 0);
+	/* Across blocks, at an odd offset, and past the end */
+	assert(lfsr_pread(&r, ino, buf, 1000, size - 700, &n) == 0);
+	assert(n == 700 && memcmp(buf, data + size - 700, n) == 0);
+	assert(lfsr_pread(&r, ino, buf, 10, size, &n) == 0 && n == 0);
+
+	assert(lfsr_lookup(&r, "d/../big", &ino) == 0 && ino == 3);
+	assert(lfsr_lookup(&r, "/d//small", &ino) == 0 && ino == 5);
+	assert(lfsr_pread(&r, ino, buf, 100, 0, &n) == 0);
+	assert(n == 5 && memcmp(buf, "small", 5) == 0);
+	assert(lfsr_lookup(&r, "/d/small/x", &ino) == ENOTDIR);
+	assert(lfsr_lookup(&r, "/nope", &ino) == ENOENT);
+	assert(lfsr_readdir(&r, ULFS_ROOTINO, count_entry, &count) == 0);
+	assert(count == 4);
+	lfsr_close(&r);
+	close(fs.fd);
+
+	/* And a 64-bit one, from test_64bit() */
+	fd = open(log64, O_RDONLY);
+	assert(fd >= 0);
+	assert(lfsr_open(&r, fd) == 0);
+	assert(lfsr_lookup(&r, "/big", &ino) == 0 && ino == 3);
+	assert(lfsr_stat(&r, ino, &st) == 0 && st.size == FSIZE);
+	assert(lfsr_pread(&r, ino, buf, FSIZE, 0, &n) == 0 && n == FSIZE);
+	memset(data, '.', FSIZE);
+	assert(memcmp(buf, data, FSIZE) == 0);
+	lfsr_close(&r);
+	close(fd);
+
+	free(data);
+	free(buf);
+}
+
 void test_create(char *log)
 {
 	struct fs fs;
@@ -138,8 +1076,8 @@ void test_create(char *log)
 	dir_add_entry(&dir, ".", ULFS_ROOTINO, LFS_DT_DIR);
 	dir_add_entry(&dir, "..", ULFS_ROOTINO, LFS_DT_DIR);
 	dir_add_entry(&dir, "aaaaaaaaaaaaaaax", 3, LFS_DT_REG);
-	dir_add_entry(&dir, "test2", 4, LFS_DT_REG);
-	dir_add_entry(&dir, "test3", 5, LFS_DT_REG);
+	dir_add_entry(&dir, "test2", 4, LFS_DT_DIR);
+	dir_add_entry(&dir, "test3", 5, LFS_DT_DIR);
 	dir_done(&dir);
 	write_file(&fs, &dir.data[0], LFS_DIRBLKSIZ, ULFS_ROOTINO,
 		LFS_IFDIR | 0755, 2, 0);
@@ -196,6 +1134,24 @@ int main(int argc, char **argv)
 	}
 
 	test_no_space("small.lfs");
+	test_geometry("geometry.lfs");
+	test_estimate("estimate.lfs");
+	test_64bit("64bit.lfs");
+	test_many_inodes("inodes.lfs");
+	test_large_image("large.lfs");
+	test_partial_segments("psegs.lfs");
+	test_append("append.lfs");
+	test_resize("resize.lfs");
+	test_read_only("readonly.lfs");
+	test_skip_segments("skip.lfs");
+	test_defer_inodes("defer.lfs");
+	test_iblocks_first("iblocks.lfs");
+	test_lastmod("lastmod.lfs");
+	test_spare_inodes("spare.lfs");
+	test_compress("raw.lfs", "compressed.lfs");
+	test_sha256();
+	test_verity("verity.lfs", "verity.tree");
+	test_reader("reader.lfs", "64bit.lfs");
 
 	/* XXX: should be last: some of our tests in tests.bats are using the
 	 * FS created by this test. */
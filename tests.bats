@@ -277,3 +277,680 @@ function create_tree() {
 	[[ "$output" == *"test2/data2 bla bla"* ]]
 	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
 }
+
+@test "genlfs: check tree with 1k and 64k blocks" {
+	create_tree
+
+	for geometry in "--block-size 1k" "--block-size 64k --segment-size 8m"; do
+		rm -f test.lfs
+		run ./genlfs $geometry test_dir test.lfs
+		echo "$output"
+		[ "$status" -eq 0 ]
+
+		export cksum=`./test_cksum test_dir/aaaaaaaaaaaaaaax`
+		run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/aaaaaaaaaaaaaaax","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+		echo "$output"
+		[[ "$output" == *"cksum: $cksum"* ]]
+		[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+
+		run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+		echo "$output"
+		[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+		[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	done
+}
+
+@test "genlfs: invalid geometry" {
+	mkdir -p test_dir
+	run ./genlfs --block-size 3000 test_dir test.lfs
+	[ "$status" -eq 1 ]
+	run ./genlfs --block-size 64k --segment-size 64k test_dir test.lfs
+	[ "$status" -eq 1 ]
+	# 4k + 4G: not 4k once truncated to 32 bits
+	run ./genlfs --block-size 4294971392 test_dir test.lfs
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Invalid block size"* ]]
+	run ./genlfs --size 16777216t test_dir test.lfs
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"Invalid image size"* ]]
+}
+
+@test "genlfs: tree larger than the image" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs --size 64m test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"try a larger --size"* ]]
+
+	# A failed append leaves the last checkpoint as it was
+	rm -f test.lfs
+	run ./genlfs --size 16m test_dir/test3 test.lfs
+	[ "$status" -eq 0 ]
+	run ./genlfs --append test.lfs test_dir
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"No space left"* ]]
+	run ./lfscheck test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	rm -f test.lfs
+}
+
+@test "genlfs: auto geometry" {
+	create_tree
+	run ./genlfs --auto-geometry test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" == *"chosen: bsize"* ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+
+	# No 512-byte LFS64 geometry can hold the 1G file
+	run ./genlfs --auto-geometry --64bit --block-size 512 test_dir test.lfs
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"No geometry can hold this tree"* ]]
+}
+
+@test "genlfs: 64-bit format" {
+	create_tree
+
+	for geometry in "" "--block-size 1k"; do
+		rm -f test.lfs
+		run ./genlfs --64bit $geometry test_dir test.lfs
+		echo "$output"
+		[ "$status" -eq 0 ]
+
+		export cksum=`./test_cksum test_dir/aaaaaaaaaaaaaaax`
+		run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/aaaaaaaaaaaaaaax","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+		echo "$output"
+		[[ "$output" == *"cksum: $cksum"* ]]
+		[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+
+		run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+		echo "$output"
+		[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+		[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	done
+
+	# An inode of 512-byte LFS64 blocks maps less than the 1G file
+	rm -f test.lfs
+	run ./genlfs --64bit --block-size 512 test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"file too large for this block size"* ]]
+}
+
+@test "genlfs: more inodes than the old inode map limit" {
+	rm -rf test_dir
+	mkdir -p test_dir
+	for d in `seq 1 20`; do
+		mkdir -p test_dir/d$d
+		(cd test_dir/d$d && for i in `seq 1 800`; do echo "d$d/$i" > f$i; done)
+	done
+
+	run ./genlfs test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/d20/f800","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"d20/800"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+}
+
+@test "genlfs: ifile spanning segments" {
+	create_tree
+
+	for format in "" "--64bit"; do
+		rm -f test.lfs
+		run ./genlfs $format --size 1t test_dir test.lfs
+		echo "$output"
+		[ "$status" -eq 0 ]
+
+		run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+		echo "$output"
+		[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+		[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	done
+	rm -f test.lfs
+}
+
+@test "genlfs: partial segments with small blocks" {
+	rm -rf test_dir
+	mkdir -p test_dir
+	for d in `seq 1 4`; do
+		mkdir -p test_dir/d$d
+		(cd test_dir/d$d && for i in `seq 1 800`; do echo "d$d/$i" > f$i; done)
+	done
+
+	run ./genlfs --block-size 1k --segment-size 4m test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/d4/f800","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"d4/800"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+}
+
+@test "genlfs: ifile spanning segments with small blocks" {
+	create_tree
+	rm -f test.lfs
+	# 512-byte blocks and 64k segments: the segment usage table alone
+	# spans many segments, and is written from inside them
+	run ./genlfs --block-size 512 --segment-size 64k test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	run ./lfscheck test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ ", 0 errors" ]]
+	rm -f test.lfs
+}
+
+@test "genlfs: append to an image" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	rm -rf append_dir
+	mkdir -p append_dir/test2 append_dir/test3/test5
+	echo "test2/data2 replaced" > append_dir/test2/data2
+	echo "test3/test5/data5 appended" > append_dir/test3/test5/data5
+	run ./genlfs --append test.lfs append_dir
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test5/data5","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test5/data5 appended"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test2/data2","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test2/data2 replaced"* ]]
+	rm -rf append_dir test.lfs
+}
+
+@test "genlfs: rebuild reusing an old image" {
+	create_tree
+	rm -f old.lfs* test.lfs*
+	run ./genlfs --manifest test_dir old.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[ -f old.lfs.manifest ]
+
+	echo "test2/data2 changed" > test_dir/test2/data2
+	run ./genlfs --manifest --reuse old.lfs test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" == *"data4 (reused)"* ]]
+	[[ "$output" != *"data2 (reused)"* ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test2/data2","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test2/data2 changed"* ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+
+	# A block of the old image written over is read from the tree
+	daddr=`grep ' /test3/data3$' old.lfs.manifest | cut -d' ' -f6 | cut -d+ -f1`
+	printf 'XXXXXXXX' | dd of=old.lfs bs=1 seek=$((daddr * 8192)) conv=notrunc
+	run ./genlfs --reuse old.lfs test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" == *"data4 (reused)"* ]]
+	[[ "$output" != *"data3 (reused)"* ]]
+	rm -f old.lfs* test.lfs*
+}
+
+@test "genlfs: keep an image in sync" {
+	create_tree
+	rm -f test.lfs watch.log
+	./genlfs --watch test_dir test.lfs > watch.log 2>&1 &
+	pid=$!
+	for i in `seq 1 50`; do
+		grep -q "watching for changes" watch.log && break
+		sleep 0.1
+	done
+
+	echo "test2/data2 changed" > test_dir/test2/data2
+	mkdir -p test_dir/test5
+	echo "test5/data5 new" > test_dir/test5/data5
+	rm -rf test_dir/test3
+	for i in `seq 1 50`; do
+		grep -q "checkpoint" watch.log && break
+		sleep 0.1
+	done
+	kill -INT $pid
+	wait $pid
+	cat watch.log
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test5/data5","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test5/data5 new"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test2/data2","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test2/data2 changed"* ]]
+	rm -f test.lfs watch.log
+}
+
+@test "lfsclean: compact an appended image" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs test_dir test.lfs
+	[ "$status" -eq 0 ]
+	echo "test2/data2 replaced" > test_dir/test2/data2
+	run ./genlfs --append test.lfs test_dir
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	run ./lfsclean test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" == *"reclaimed"* ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test2/data2","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test2/data2 replaced"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	rm -f test.lfs
+}
+
+@test "lfsresize: grow and shrink an image" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs --size 2g test_dir test.lfs
+	[ "$status" -eq 0 ]
+
+	run ./lfsresize test.lfs 8g
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[ "$(stat -c %s test.lfs)" -eq $((8 << 30)) ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+
+	run ./lfsresize test.lfs 1200m
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[ "$(stat -c %s test.lfs)" -eq $((1200 << 20)) ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test2/data2","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test2/data2 bla bla"* ]]
+
+	run ./lfsresize test.lfs 512m
+	[ "$status" -ne 0 ]
+	rm -f test.lfs
+}
+
+@test "genlfs: trimmed read-only image" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs --trim test_dir test.lfs
+	[ "$status" -ne 0 ]
+	run ./genlfs --read-only --trim --size 1g test_dir test.lfs
+	[ "$status" -ne 0 ]
+
+	run ./genlfs --read-only --trim test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" == *"trimmed to"* ]]
+	[ "$(stat -c %s test.lfs)" -lt $((1100 << 20)) ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs
+}
+
+@test "genlfs: stable layout keeps small changes small" {
+	create_tree
+	rm -f test.lfs test2.lfs
+	run ./genlfs --stable test_dir test.lfs
+	[ "$status" -eq 0 ]
+	echo "new file" > test_dir/test2/new
+	run ./genlfs --stable test_dir test2.lfs
+	[ "$status" -eq 0 ]
+
+	run ./lfsdiff test.lfs test2.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	pct=$(echo "$output" | sed -n 's/^blocks: .*(\([0-9]*\)\..*/\1/p')
+	[ "$pct" -lt 10 ]
+
+	run ./solo5-spt --disk=test2.lfs blk-rumprun.spt '{"cmdline":"blk /test/test2/new","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"new file"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs test2.lfs
+}
+
+@test "genlfs: compressed image" {
+	create_tree
+	rm -f test.lfs test.lfsz test2.lfs seg0
+	run ./genlfs --compress --manifest test_dir test.lfsz
+	[ "$status" -ne 0 ]
+
+	export SOURCE_DATE_EPOCH=1
+	run ./genlfs --stable test_dir test.lfs
+	[ "$status" -eq 0 ]
+	run ./genlfs --stable --compress test_dir test.lfsz
+	[ "$status" -eq 0 ]
+	[ "$(stat -c %s test.lfsz)" -lt $((8 << 20)) ]
+
+	run ./lfsunz test.lfsz test2.lfs
+	[ "$status" -eq 0 ]
+	cmp test.lfs test2.lfs
+	./lfsunz --segment 0 test.lfsz > seg0
+	cmp -n $((1 << 20)) test.lfs seg0
+
+	run ./solo5-spt --disk=test2.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs test.lfsz test2.lfs seg0
+}
+
+@test "genlfs: serve an image over NBD" {
+	command -v nbdcopy || skip "nbdcopy (libnbd) is needed"
+	create_tree
+	rm -f test.lfs test2.lfs test.sock
+	export SOURCE_DATE_EPOCH=1
+	run ./genlfs --stable test_dir test.lfs
+	[ "$status" -eq 0 ]
+
+	./genlfs --stable --serve-nbd test.sock test_dir > serve.log &
+	pid=$!
+	for i in $(seq 50); do [ -S test.sock ] && break; sleep 0.1; done
+	nbdcopy "nbd+unix:///?socket=test.sock" test2.lfs
+	kill $pid
+	cmp test.lfs test2.lfs
+	rm -f test.lfs test2.lfs test.sock serve.log
+}
+
+@test "genlfs: boot profile goes first" {
+	create_tree
+	rm -f test.lfs boot.prof
+	printf 'test3/test4/data4\n2048+4096 aaaaaaaaaaaaaaax\n/test2/data2\nmissing\n' > boot.prof
+	run ./genlfs --profile boot.prof test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" == *"left out of the profile: /missing"* ]]
+	[[ "$output" =~ "profile: 4 paths, "([0-9]+)" seeks to read them ("([0-9]+)" in the default" ]]
+	[ "${BASH_REMATCH[1]}" -le "${BASH_REMATCH[2]}" ]
+	[[ "$(echo "$output" | grep -m 1 '^directory')" == *": ." ]]
+	[[ "$(echo "$output" | grep -m 1 '^regular')" == *": ./test3/test4/data4" ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs boot.prof
+}
+
+@test "genlfs: extent map and read-ahead list" {
+	create_tree
+	rm -f test.lfs test.map boot.prof
+	printf 'test3/test4/data4\n2048+4096 aaaaaaaaaaaaaaax\n' > boot.prof
+	run ./genlfs --profile boot.prof --readahead .readahead --extent-map test.map test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ "readahead: "([0-9]+)" ranges" ]]
+	[ "${BASH_REMATCH[1]}" -ge 3 ]
+	read magic version bsize < test.map
+	[ "$magic $version" == "genlfs-extents 1" ]
+	grep -q ' /$' test.map
+	grep -q ' /.readahead$' test.map
+
+	# The data of a file is where the map says
+	read inum type size idaddr nruns run rest <<< "$(grep ' /test3/test4/data4$' test.map)"
+	[ "$type" == "f" ] && [ "$nruns" -eq 1 ]
+	cmp <(dd if=test.lfs bs="$bsize" skip="${run%+*}" count=1 2>/dev/null | head -c "$size") test_dir/test3/test4/data4
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs test.map
+
+	run ./genlfs --readahead .readahead test_dir test.lfs
+	[ "$status" -eq 1 ]
+	rm -f test.lfs boot.prof
+}
+
+@test "genlfs: directories next to their files" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs --locality test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ "ls -l: 4 directories, "[0-9]+" blocks in "([0-9]+)" segments ("([0-9]+)" in the default" ]]
+	[ "${BASH_REMATCH[1]}" -le "${BASH_REMATCH[2]}" ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs
+}
+
+@test "genlfs: indirect blocks first" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs --iblocks-first --block-size 4096 test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	export cksum=`./test_cksum test_dir/aaaaaaaaaaaaaaax`
+	echo "cksum: $cksum"
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/aaaaaaaaaaaaaaax","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"cksum: $cksum"* ]]
+	[[ "$output" == *"first100bytes"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs
+}
+
+@test "genlfs: hot files" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs --hot 'test3/*' test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ "hot: 2 files (46 bytes) in segments " ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs
+
+	run ./genlfs --read-only --hot 'test3/*' test_dir test.lfs
+	[ "$status" -eq 1 ]
+}
+
+@test "genlfs: reserved segments and spare inodes" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs --reserve-segments 100 --spare-inodes 10000 test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ "clean: " ]]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs
+
+	run ./genlfs --size 2g --reserve-segments 100000 test_dir test.lfs
+	[ "$status" -eq 1 ]
+	[ ! -e test.lfs ]
+
+	run ./genlfs --read-only --spare-inodes 10 test_dir test.lfs
+	[ "$status" -eq 1 ]
+}
+
+@test "genlfs: dm-verity hash tree" {
+	create_tree
+	rm -f test.lfs test.verity
+	run ./genlfs --stable --verity test.verity test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ "verity: root hash "([0-9a-f]{64})", "([0-9]+)" blocks of 4096 bytes, "([0-9]+)" bytes of tree" ]]
+	[ "$(stat -c %s test.verity)" -eq "${BASH_REMATCH[3]}" ]
+	[ "$(stat -c %s test.lfs)" -eq $((BASH_REMATCH[2] * 4096)) ]
+
+	run ./solo5-spt --disk=test.lfs blk-rumprun.spt '{"cmdline":"blk /test/test3/test4/data4","blk":{"source":"etfs","path":"/dev/ld0a","fstype":"blk","mountpoint":"/test"}}'
+	echo "$output"
+	[[ "$output" == *"test3/test4/data4 bla bla"* ]]
+	[[ "$output" == *"=== main() of \"blk\" returned 0 ==="* ]]
+	rm -f test.lfs
+
+	# The same tree after the image
+	run ./genlfs --stable --verity-append test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ "bytes of tree in test.lfs at "([0-9]+) ]]
+	cmp <(tail -c +$((BASH_REMATCH[1] + 1)) test.lfs) test.verity
+	rm -f test.lfs test.verity
+
+	run ./genlfs --compress --verity-append test_dir test.lfs
+	[ "$status" -eq 1 ]
+	run ./genlfs --verity-block-size 1000 --verity test.verity test_dir test.lfs
+	[ "$status" -eq 1 ]
+	rm -f test.lfs test.verity
+}
+
+@test "genlfs: verify an image" {
+	create_tree
+	rm -f test.lfs
+	run ./genlfs test_dir test.lfs
+	[ "$status" -eq 0 ]
+	run ./genlfs --verify test_dir test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ "verify: 4 directories, "([0-9]+)" files, ".*", 0 mismatches" ]]
+
+	# A changed file, a new one, and a missing one
+	cp -r test_dir test_dir2
+	printf 'X' | dd of=test_dir2/test3/test4/data4 bs=1 seek=3 conv=notrunc 2>/dev/null
+	touch test_dir2/new
+	rm test_dir2/test2/data2
+	run ./genlfs --verify test_dir2 test.lfs
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"mismatch: /test3/test4/data4: differs at byte 3"* ]]
+	[[ "$output" == *"mismatch: /new: not in the image"* ]]
+	[[ "$output" == *"mismatch: /test2/data2: not in the tree"* ]]
+	[[ "$output" == *", 3 mismatches"* ]]
+	rm -rf test_dir2 test.lfs
+
+	run ./genlfs --compress test_dir test.lfs
+	run ./genlfs --verify test_dir test.lfs
+	[ "$status" -eq 1 ]
+	rm -f test.lfs
+}
+
+@test "lfscheck: check the structure of an image" {
+	create_tree
+	rm -f test.lfs
+	run ./mkfs_small test.lfs
+	run ./lfscheck test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	run ./test test.lfs
+	run ./lfscheck test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	rm -f test.lfs
+	run ./genlfs --64bit --block-size 4096 test_dir test.lfs
+	[ "$status" -eq 0 ]
+	run ./lfscheck test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+	[[ "$output" =~ ", 0 errors" ]]
+
+	rm -f test.lfs
+	run ./genlfs test_dir test.lfs
+	echo "test2/data2 replaced" > test_dir/test2/data2
+	run ./genlfs --append test.lfs test_dir
+	[ "$status" -eq 0 ]
+	run ./lfscheck test.lfs
+	echo "$output"
+	[ "$status" -eq 0 ]
+
+	# The summary of segment 1 (128 blocks of 8k), then the first word of a
+	# block after it
+	cp test.lfs test2.lfs
+	printf 'X' | dd of=test2.lfs bs=1 seek=$((128 * 8192 + 100)) conv=notrunc 2>/dev/null
+	run ./lfscheck test2.lfs
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"segment 1: bad summary checksum"* ]]
+	cp test.lfs test2.lfs
+	printf 'X' | dd of=test2.lfs bs=1 seek=$((129 * 8192)) conv=notrunc 2>/dev/null
+	run ./lfscheck test2.lfs
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"segment 1: bad data checksum"* ]]
+
+	# Only a compressed image is sent to lfsunz
+	head -c 1M /dev/urandom > test2.lfs
+	run ./lfscheck test2.lfs
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"bad superblock" ]]
+	rm -f test2.lfs
+	run ./genlfs --compress test_dir test2.lfs
+	[ "$status" -eq 0 ]
+	run ./lfscheck test2.lfs
+	echo "$output"
+	[ "$status" -eq 1 ]
+	[[ "$output" == *"uncompress it with lfsunz first"* ]]
+	rm -f test.lfs test2.lfs
+}
+
+@test "lfscat: read files and directories" {
+	create_tree
+	for opts in "" "--64bit --block-size 1024"; do
+		rm -f test.lfs
+		run ./genlfs $opts test_dir test.lfs
+		[ "$status" -eq 0 ]
+		./lfscat test.lfs /test3/test4/data4 | cmp - test_dir/test3/test4/data4
+		./lfscat test.lfs aaaaaaaaaaaaaaax | cmp - test_dir/aaaaaaaaaaaaaaax
+		./lfscat test.lfs /huge | cmp - test_dir/huge
+		run ./lfscat test.lfs /test3
+		echo "$output"
+		[ "$status" -eq 0 ]
+		[ "${#lines[@]}" -eq 4 ]
+		[[ "$output" =~ "data3 " ]]
+		[[ "$output" =~ "test4 " ]]
+		run ./lfscat test.lfs /test2/data2/x
+		[ "$status" -eq 1 ]
+		[[ "$output" =~ "Not a directory" ]]
+		run ./lfscat test.lfs /nope
+		[ "$status" -eq 1 ]
+	done
+	rm -f test.lfs
+}
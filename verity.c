@@ -0,0 +1,347 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "lfs.h"
+#include "verity.h"
+
+#define MIN(_x, _y) (((_x) < (_y)) ? (_x) : (_y))
+#define DIV_UP(_x, _y) (((_x) + (_y) - 1) / (_y))
+
+/*
+ * Like with lfsz, a segment is copied to memory as the log writes it, and
+ * hashed by the threads once the log leaves it (see start_segment()). The
+ * segments with a superblock are only hashed in verity_finish(), as the
+ * last superblocks go there. Nothing the log writes is read back, only
+ * what an older image (or a device) had where the log doesn't write. The
+ * digests of the data blocks are kept by block number, the levels above
+ * them are hashed at the end, they are (bsize / 32) times smaller.
+ */
+
+struct vseg {
+	uint64_t	segnum;
+	char		*buf;
+	struct vseg	*next;
+};
+
+struct verity_writer {
+	struct lfs_output	out;
+	struct lfs_output	*next;
+	int			fd;
+	uint64_t		ssize;
+	uint64_t		nbytes;
+	uint32_t		bsize;
+	uint64_t		nblocks;
+	uint8_t			*digests;	/* of the data blocks */
+	uint8_t			*left;		/* segments the log left */
+	struct vseg		*open;		/* being written */
+
+	/* The rest is under the lock */
+	pthread_mutex_t		lock;
+	pthread_cond_t		more;
+	pthread_cond_t		room;
+	struct vseg		*queue;		/* to hash, in order */
+	struct vseg		**tail;
+	int			queued;
+	int			max_queued;
+	int			stop;
+
+	pthread_t		*threads;
+	int			nthreads;
+};
+
+/* The digests of the blocks of (seg), the ones in the image. */
+static void hash_segment(struct verity_writer *w, struct vseg *seg) {
+	uint64_t per_seg = w->ssize / w->bsize, i;
+	uint64_t first = seg->segnum * per_seg;
+
+	for (i = 0; i < per_seg && first + i < w->nblocks; i++)
+		sha256(seg->buf + i * w->bsize, w->bsize,
+		       w->digests + (first + i) * SHA256_DIGEST_LEN);
+}
+
+static void *hash_thread(void *arg) {
+	struct verity_writer *w = arg;
+	struct vseg *seg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (w->queue == NULL && !w->stop)
+			pthread_cond_wait(&w->more, &w->lock);
+		seg = w->queue;
+		if (seg == NULL)
+			break;
+		w->queue = seg->next;
+		if (w->queue == NULL)
+			w->tail = &w->queue;
+		w->queued--;
+		pthread_cond_signal(&w->room);
+		pthread_mutex_unlock(&w->lock);
+
+		hash_segment(w, seg);
+		free(seg->buf);
+		free(seg);
+
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+	return NULL;
+}
+
+/* Queues (seg) for the threads; waits for room if (wait). */
+static void queue_segment(struct verity_writer *w, struct vseg *seg,
+			  int wait) {
+	w->left[seg->segnum] = 1;
+	pthread_mutex_lock(&w->lock);
+	while (wait && w->queued >= w->max_queued)
+		pthread_cond_wait(&w->room, &w->lock);
+	seg->next = NULL;
+	*w->tail = seg;
+	w->tail = &seg->next;
+	w->queued++;
+	pthread_cond_signal(&w->more);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Whether (fd) has anything but a hole in segment (segnum). */
+static int has_data(struct verity_writer *w, uint64_t segnum) {
+	off_t off = segnum * w->ssize, data;
+
+	if (w->next != NULL)
+		return 0;
+	data = lseek(w->fd, off, SEEK_DATA);
+	return data >= 0 && (uint64_t)data < off + w->ssize;
+}
+
+/*
+ * A copy of segment (segnum) as it is in (fd) before the log writes it:
+ * zeros if it is a hole, but an image written over an older one (or a
+ * device) can have anything where the log doesn't write. NULL on errors.
+ */
+static struct vseg *new_segment(struct verity_writer *w, uint64_t segnum) {
+	uint64_t off = segnum * w->ssize, len = MIN(w->ssize, w->nbytes - off);
+	struct vseg *seg;
+
+	seg = malloc(sizeof(*seg));
+	assert(seg);
+	seg->segnum = segnum;
+	seg->buf = calloc(1, w->ssize);
+	assert(seg->buf);
+	if (has_data(w, segnum) && pread(w->fd, seg->buf, len, off) < 0) {
+		free(seg->buf);
+		free(seg);
+		return NULL;
+	}
+	return seg;
+}
+
+static int verity_write(struct lfs_output *out, const void *data, uint64_t len,
+			uint64_t off) {
+	struct verity_writer *w = (struct verity_writer *)out;
+	const char *p = data;
+	ssize_t ret;
+
+	if (off + len > w->nbytes)
+		return ENOSPC;
+	if (w->next != NULL) {
+		ret = w->next->write(w->next, data, len, off);
+		if (ret != 0)
+			return ret;
+	} else {
+		ret = pwrite64(w->fd, data, len, off);
+		if (ret == -1)
+			return errno;
+		if (ret != (ssize_t)len)
+			return -1;
+	}
+
+	while (len > 0) {
+		uint64_t segnum = off / w->ssize;
+		uint64_t segoff = off % w->ssize;
+		uint64_t n = MIN(len, w->ssize - segoff);
+		struct vseg *seg;
+
+		/* Hashed already, see start_segment() */
+		assert(!w->left[segnum]);
+		for (seg = w->open; seg != NULL; seg = seg->next)
+			if (seg->segnum == segnum)
+				break;
+		if (seg == NULL) {
+			seg = new_segment(w, segnum);
+			if (seg == NULL)
+				return errno;
+			seg->next = w->open;
+			w->open = seg;
+		}
+		memcpy(seg->buf + segoff, p, n);
+		p += n;
+		off += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void verity_done(struct lfs_output *out, uint64_t segnum) {
+	struct verity_writer *w = (struct verity_writer *)out;
+	struct vseg **prev, *seg;
+
+	if (w->next != NULL && w->next->done != NULL)
+		w->next->done(w->next, segnum);
+	for (prev = &w->open; (seg = *prev) != NULL; prev = &seg->next) {
+		if (seg->segnum == segnum) {
+			*prev = seg->next;
+			queue_segment(w, seg, 1);
+			return;
+		}
+	}
+}
+
+static void verity_summary(struct lfs_output *out, uint64_t off,
+			   uint64_t nblocks) {
+	struct verity_writer *w = (struct verity_writer *)out;
+
+	w->next->summary(w->next, off, nblocks);
+}
+
+static int verity_read(struct lfs_output *out, void *buf, uint64_t len,
+		       uint64_t off) {
+	struct verity_writer *w = (struct verity_writer *)out;
+
+	return w->next->read(w->next, buf, len, off);
+}
+
+struct lfs_output *verity_create(struct lfs_output *next, int fd,
+				 uint64_t ssize, uint64_t nbytes, uint32_t bsize,
+				 int nthreads) {
+	struct verity_writer *w = calloc(1, sizeof(*w));
+	int i;
+
+	assert(w);
+	assert(ssize % bsize == 0 && bsize >= 2 * SHA256_DIGEST_LEN);
+	w->out.write = verity_write;
+	w->out.done = verity_done;
+	if (next != NULL && next->summary != NULL)
+		w->out.summary = verity_summary;
+	if (next != NULL && next->read != NULL)
+		w->out.read = verity_read;
+	w->next = next;
+	w->fd = fd;
+	w->ssize = ssize;
+	w->nbytes = nbytes;
+	w->bsize = bsize;
+	w->nblocks = DIV_UP(nbytes, bsize);
+	w->digests = malloc(w->nblocks * SHA256_DIGEST_LEN);
+	w->left = calloc(DIV_UP(nbytes, ssize), 1);
+	assert(w->digests && w->left);
+	w->tail = &w->queue;
+	w->nthreads = nthreads > 0 ? nthreads : 1;
+	/* Enough to keep every thread busy while the log fills the next ones */
+	w->max_queued = 2 * w->nthreads;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->more, NULL);
+	pthread_cond_init(&w->room, NULL);
+	w->threads = malloc(w->nthreads * sizeof(pthread_t));
+	assert(w->threads);
+	for (i = 0; i < w->nthreads; i++)
+		if (pthread_create(&w->threads[i], NULL, hash_thread, w))
+			assert(0);
+	return &w->out;
+}
+
+int verity_finish(struct lfs_output *out, uint64_t nbytes, int fd,
+		  uint64_t off, uint8_t root[SHA256_DIGEST_LEN], uint64_t *len) {
+	struct verity_writer *w = (struct verity_writer *)out;
+	uint64_t per_block = w->bsize / SHA256_DIGEST_LEN;
+	uint64_t per_seg = w->ssize / w->bsize;
+	uint64_t n, nlevels = 0, i, j;
+	uint8_t *levels[64], *zero, digest[SHA256_DIGEST_LEN];
+	uint64_t nlevel[64];
+	int ret = 0;
+
+	assert(nbytes <= w->nbytes);
+	while (w->open != NULL) {
+		struct vseg *seg = w->open;
+
+		w->open = seg->next;
+		queue_segment(w, seg, 0);
+	}
+	for (i = 0; ret == 0 && i < DIV_UP(nbytes, w->ssize); i++) {
+		struct vseg *seg;
+
+		if (w->left[i] || !has_data(w, i))
+			continue;
+		seg = new_segment(w, i);
+		if (seg == NULL)
+			ret = errno;
+		else
+			queue_segment(w, seg, 1);
+	}
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->more);
+	pthread_mutex_unlock(&w->lock);
+	for (i = 0; i < (uint64_t)w->nthreads; i++)
+		pthread_join(w->threads[i], NULL);
+
+	/* The segments never written, and holes, are zeros */
+	zero = calloc(1, w->bsize);
+	assert(zero);
+	sha256(zero, w->bsize, digest);
+	for (i = 0; i < DIV_UP(w->nbytes, w->ssize); i++)
+		for (j = 0; !w->left[i] && j < per_seg &&
+			    i * per_seg + j < w->nblocks; j++)
+			memcpy(w->digests + (i * per_seg + j) * SHA256_DIGEST_LEN,
+			       digest, SHA256_DIGEST_LEN);
+
+	/* Each level in whole blocks of the digests of the one below */
+	n = DIV_UP(nbytes, w->bsize);
+	*len = 0;
+	if (n == 1)
+		memcpy(root, w->digests, SHA256_DIGEST_LEN);
+	for (i = 0; n > 1; i++) {
+		nlevel[i] = DIV_UP(n, per_block);
+		levels[i] = calloc(nlevel[i], w->bsize);
+		assert(levels[i]);
+		for (j = 0; j < n; j++) {
+			uint8_t *slot = levels[i] + j / per_block * w->bsize +
+					j % per_block * SHA256_DIGEST_LEN;
+
+			if (i == 0)
+				memcpy(slot, w->digests + j * SHA256_DIGEST_LEN,
+				       SHA256_DIGEST_LEN);
+			else
+				sha256(levels[i - 1] + j * w->bsize, w->bsize,
+				       slot);
+		}
+		*len += nlevel[i] * w->bsize;
+		nlevels++;
+		n = nlevel[i];
+	}
+	if (nlevels > 0)
+		sha256(levels[nlevels - 1], w->bsize, root);
+
+	/* From the top down */
+	for (i = nlevels; ret == 0 && i-- > 0; off += nlevel[i] * w->bsize) {
+		uint64_t size = nlevel[i] * w->bsize;
+
+		if (pwrite(fd, levels[i], size, off) != (ssize_t)size)
+			ret = errno ? errno : EIO;
+	}
+
+	for (i = 0; i < nlevels; i++)
+		free(levels[i]);
+	free(zero);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->more);
+	pthread_cond_destroy(&w->room);
+	free(w->threads);
+	free(w->digests);
+	free(w->left);
+	free(w);
+	return ret;
+}
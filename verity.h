@@ -0,0 +1,34 @@
+#ifndef _VERITY_H_
+#define _VERITY_H_
+
+#include <stdint.h>
+
+#include "sha256.h"
+
+struct lfs_output;
+
+/*
+ * A dm-verity hash tree of an image, made while the log writes it: the
+ * SHA-256 of each block of (bsize) bytes, of each block of those digests,
+ * and so on up to the root hash. The tree has no superblock and no salt,
+ * its levels go from the top down, each in whole blocks (what veritysetup
+ * --no-superblock expects, with format 1).
+ */
+
+/*
+ * An output that hashes the image of an FS of (nbytes) on (nthreads)
+ * threads, as the log leaves its segments, and writes it to (next), or to
+ * (fd) if NULL.
+ */
+struct lfs_output *verity_create(struct lfs_output *next, int fd,
+				 uint64_t ssize, uint64_t nbytes, uint32_t bsize,
+				 int nthreads);
+/*
+ * Hashes the segments left, and writes the tree of the first (nbytes) of
+ * the image (no more than it was created with) to (fd) at (off): (*len)
+ * bytes, and the root hash in (root). Frees (out), not (next).
+ */
+int verity_finish(struct lfs_output *out, uint64_t nbytes, int fd,
+		  uint64_t off, uint8_t root[SHA256_DIGEST_LEN], uint64_t *len);
+
+#endif /* !_VERITY_H_ */